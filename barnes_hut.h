@@ -0,0 +1,589 @@
+#ifndef barnes_hut_h
+#define barnes_hut_h
+
+#include "types.h"
+#include "math_stuff.h"
+#include "threading.h"
+
+// NOTE: long range forces in open space, where nothing is periodic and a mesh fits poorly.
+// Bodies are sorted along a Morton curve, so every node of the quadtree is a contiguous range of them,
+// and the nodes are laid out depth first, so the walk needs no stack: it either goes into a node
+// (the node right after it) or skips over it (node->next).
+//
+// Same units as the particle mesh: a unit source at distance r has potential -ln(r) and field 1/r,
+// softened by adding softening^2 to r^2.
+
+#define barnesHutMortonBits 16
+#define barnesHutLeafSize 8
+
+// NOTE: the top levels are put together serially, the 4^barnesHutSplitLevel subtrees below them are built in parallel
+#define barnesHutSplitLevel 3
+#define barnesHutSubtreeCount (1 << (2 * barnesHutSplitLevel))
+#define barnesHutTopNodeCount (((1 << (2 * barnesHutSplitLevel)) - 1) / 3)
+
+struct TreeNode {
+	// NOTE: the center is weighted by the size of the sources, so it stays inside the cell when they have mixed signs,
+	// and the dipole around it is what is left of them then (it is zero when they all have the same sign)
+	f64 centerX;
+	f64 centerY;
+	f64 source;
+	f64 weight;
+	f64 dipoleX;
+	f64 dipoleY;
+
+	// the node is opened closer than size / openingAngle + centerOffset
+	f64 size;
+	f64 centerOffset;
+
+	s32 next;
+	s32 firstBody;
+	s32 bodyCount;
+	bool isLeaf;
+};
+
+struct TreeNodeArray {
+	TreeNode* nodes;
+	int count;
+	int capacity;
+};
+
+struct BarnesHutTree {
+	f64 openingAngle;
+	f64 softening;
+	// NOTE: the logarithms take about half the walk, and the forces don't need them
+	bool isComputingPotentials;
+
+	// per body, filled in by the caller
+	int bodyCount;
+	int bodyCapacity;
+	V2* positions;
+	f64* sources;
+
+	// per body, in the order of the caller
+	f64* potentials;
+	f64* fieldX;
+	f64* fieldY;
+
+	// per body, in Morton order
+	u32* codes;
+	s32* order;
+	u32* scratchCodes;
+	s32* scratchOrder;
+	f64* bodyX;
+	f64* bodyY;
+	f64* bodySource;
+
+	// bounding square
+	f64 minX;
+	f64 minY;
+	f64 side;
+
+	TreeNodeArray subtrees[barnesHutSubtreeCount];
+	int subtreeFirstBodies[barnesHutSubtreeCount + 1];
+	int subtreeOffsets[barnesHutSubtreeCount];
+
+	TreeNode* nodes;
+	int nodeCount;
+	int nodeCapacity;
+};
+
+void
+setBarnesHutBodyCount(BarnesHutTree* tree, int bodyCount)
+{
+	tree->bodyCount = bodyCount;
+	if (tree->bodyCapacity < bodyCount)
+	{
+		tree->bodyCapacity = bodyCount;
+		tree->positions = (V2*) realloc(tree->positions, bodyCount * sizeof(V2));
+		tree->sources = (f64*) realloc(tree->sources, bodyCount * sizeof(f64));
+		tree->potentials = (f64*) realloc(tree->potentials, bodyCount * sizeof(f64));
+		tree->fieldX = (f64*) realloc(tree->fieldX, bodyCount * sizeof(f64));
+		tree->fieldY = (f64*) realloc(tree->fieldY, bodyCount * sizeof(f64));
+		tree->codes = (u32*) realloc(tree->codes, bodyCount * sizeof(u32));
+		tree->order = (s32*) realloc(tree->order, bodyCount * sizeof(s32));
+		tree->scratchCodes = (u32*) realloc(tree->scratchCodes, bodyCount * sizeof(u32));
+		tree->scratchOrder = (s32*) realloc(tree->scratchOrder, bodyCount * sizeof(s32));
+		tree->bodyX = (f64*) realloc(tree->bodyX, bodyCount * sizeof(f64));
+		tree->bodyY = (f64*) realloc(tree->bodyY, bodyCount * sizeof(f64));
+		tree->bodySource = (f64*) realloc(tree->bodySource, bodyCount * sizeof(f64));
+	}
+}
+
+//
+// Morton order
+//
+
+// NOTE: spreads the low 16 bits out to the even bits
+u32
+spreadBits(u32 x)
+{
+	x &= 0x0000ffff;
+	x = (x | (x << 8)) & 0x00ff00ff;
+	x = (x | (x << 4)) & 0x0f0f0f0f;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+void
+computeMortonCodes(void* data, int startIndex, int endIndex)
+{
+	BarnesHutTree* tree = (BarnesHutTree*) data;
+	f64 scale = (1 << barnesHutMortonBits) / tree->side;
+	u32 maxCoordinate = (1 << barnesHutMortonBits) - 1;
+	for (int bodyIndex = startIndex; bodyIndex < endIndex; ++bodyIndex)
+	{
+		V2 position = tree->positions[bodyIndex];
+		u32 x = min(maxCoordinate, (u32) ((position.x - tree->minX) * scale));
+		u32 y = min(maxCoordinate, (u32) ((position.y - tree->minY) * scale));
+		tree->codes[bodyIndex] = spreadBits(x) | (spreadBits(y) << 1);
+		tree->order[bodyIndex] = bodyIndex;
+	}
+}
+
+// NOTE: least significant digit first, a byte at a time
+void
+sortMortonCodes(BarnesHutTree* tree)
+{
+	u32* codes = tree->codes;
+	s32* order = tree->order;
+	u32* scratchCodes = tree->scratchCodes;
+	s32* scratchOrder = tree->scratchOrder;
+	for (int shift = 0; shift < 2 * barnesHutMortonBits; shift += 8)
+	{
+		int offsets[256] = {};
+		for (int bodyIndex = 0; bodyIndex < tree->bodyCount; ++bodyIndex)
+		{
+			offsets[(codes[bodyIndex] >> shift) & 0xff]++;
+		}
+		int total = 0;
+		for (int digit = 0; digit < 256; ++digit)
+		{
+			int count = offsets[digit];
+			offsets[digit] = total;
+			total += count;
+		}
+		for (int bodyIndex = 0; bodyIndex < tree->bodyCount; ++bodyIndex)
+		{
+			int destination = offsets[(codes[bodyIndex] >> shift) & 0xff]++;
+			scratchCodes[destination] = codes[bodyIndex];
+			scratchOrder[destination] = order[bodyIndex];
+		}
+
+		u32* tempCodes = codes;
+		codes = scratchCodes;
+		scratchCodes = tempCodes;
+		s32* tempOrder = order;
+		order = scratchOrder;
+		scratchOrder = tempOrder;
+	}
+	// NOTE: an even number of passes, so the result is back where it started
+	assert(codes == tree->codes);
+}
+
+void
+gatherSortedBodies(void* data, int startIndex, int endIndex)
+{
+	BarnesHutTree* tree = (BarnesHutTree*) data;
+	for (int bodyIndex = startIndex; bodyIndex < endIndex; ++bodyIndex)
+	{
+		int originalIndex = tree->order[bodyIndex];
+		tree->bodyX[bodyIndex] = tree->positions[originalIndex].x;
+		tree->bodyY[bodyIndex] = tree->positions[originalIndex].y;
+		tree->bodySource[bodyIndex] = tree->sources[originalIndex];
+	}
+}
+
+// NOTE: the first body in [first, end) whose code is at least code
+int
+lowerBoundCode(u32* codes, int first, int end, u32 code)
+{
+	while (first < end)
+	{
+		int middle = first + (end - first) / 2;
+		if (codes[middle] < code)
+		{
+			first = middle + 1;
+		}
+		else
+		{
+			end = middle;
+		}
+	}
+	return first;
+}
+
+//
+// Building
+//
+
+int
+pushTreeNode(TreeNodeArray* array)
+{
+	if (array->count == array->capacity)
+	{
+		array->capacity = atLeast(64, 2 * array->capacity);
+		array->nodes = (TreeNode*) realloc(array->nodes, array->capacity * sizeof(TreeNode));
+	}
+	return array->count++;
+}
+
+// NOTE: the center is divided out, and the dipole moved to it, by finishTreeNode
+void
+addBodyToTreeNode(TreeNode* node, f64 x, f64 y, f64 source)
+{
+	f64 weight = fabs(source);
+	node->centerX += weight * x;
+	node->centerY += weight * y;
+	node->source += source;
+	node->weight += weight;
+	node->dipoleX += source * x;
+	node->dipoleY += source * y;
+}
+
+void
+addChildToTreeNode(TreeNode* node, TreeNode* child)
+{
+	node->centerX += child->weight * child->centerX;
+	node->centerY += child->weight * child->centerY;
+	node->source += child->source;
+	node->weight += child->weight;
+	node->dipoleX += child->dipoleX + child->source * child->centerX;
+	node->dipoleY += child->dipoleY + child->source * child->centerY;
+}
+
+void
+finishTreeNode(TreeNode* node, f64 cellX, f64 cellY)
+{
+	f64 middleX = cellX + 0.5 * node->size;
+	f64 middleY = cellY + 0.5 * node->size;
+	if (node->weight > 0)
+	{
+		node->centerX /= node->weight;
+		node->centerY /= node->weight;
+	}
+	else
+	{
+		node->centerX = middleX;
+		node->centerY = middleY;
+	}
+	node->dipoleX -= node->source * node->centerX;
+	node->dipoleY -= node->source * node->centerY;
+	node->centerOffset = sqrt(square(node->centerX - middleX) + square(node->centerY - middleY));
+}
+
+// NOTE: appends the subtree over bodies [first, end) in depth first order and returns its root
+int
+buildTreeNode(BarnesHutTree* tree, TreeNodeArray* array, int first, int end, int level, f64 cellX, f64 cellY, f64 size)
+{
+	int nodeIndex = pushTreeNode(array);
+	TreeNode node = {};
+	node.size = size;
+	node.firstBody = first;
+	node.bodyCount = end - first;
+	node.isLeaf = (node.bodyCount <= barnesHutLeafSize) || (level == barnesHutMortonBits);
+
+	if (node.isLeaf)
+	{
+		for (int bodyIndex = first; bodyIndex < end; ++bodyIndex)
+		{
+			addBodyToTreeNode(&node, tree->bodyX[bodyIndex], tree->bodyY[bodyIndex], tree->bodySource[bodyIndex]);
+		}
+	}
+	else
+	{
+		// NOTE: the children are the bodies whose next two bits are 0, 1, 2 and 3, in that order
+		int shift = 2 * (barnesHutMortonBits - 1 - level);
+		u32 prefix = tree->codes[first] & ~((4u << shift) - 1);
+		f64 childSize = 0.5 * size;
+		int childFirst = first;
+		for (u32 quadrant = 0; quadrant < 4; ++quadrant)
+		{
+			int childEnd = (quadrant == 3) ? end : lowerBoundCode(tree->codes, childFirst, end, prefix | ((quadrant + 1) << shift));
+			if (childEnd > childFirst)
+			{
+				f64 childX = cellX + (quadrant & 1) * childSize;
+				f64 childY = cellY + (quadrant >> 1) * childSize;
+				int childIndex = buildTreeNode(tree, array, childFirst, childEnd, level + 1, childX, childY, childSize);
+				addChildToTreeNode(&node, array->nodes + childIndex);
+			}
+			childFirst = childEnd;
+		}
+	}
+
+	finishTreeNode(&node, cellX, cellY);
+	node.next = array->count;
+	array->nodes[nodeIndex] = node;
+	return nodeIndex;
+}
+
+void
+buildSubtrees(void* data, int startIndex, int endIndex)
+{
+	BarnesHutTree* tree = (BarnesHutTree*) data;
+	int cellsPerSide = 1 << barnesHutSplitLevel;
+	f64 size = tree->side / cellsPerSide;
+	for (int subtreeIndex = startIndex; subtreeIndex < endIndex; ++subtreeIndex)
+	{
+		TreeNodeArray* subtree = tree->subtrees + subtreeIndex;
+		subtree->count = 0;
+
+		int first = tree->subtreeFirstBodies[subtreeIndex];
+		int end = tree->subtreeFirstBodies[subtreeIndex + 1];
+		if (first < end)
+		{
+			// NOTE: the subtree's cell is where its first body is, rounded down to the split level
+			u32 code = tree->codes[first] >> (2 * (barnesHutMortonBits - barnesHutSplitLevel));
+			int col = 0;
+			int row = 0;
+			for (int bit = 0; bit < barnesHutSplitLevel; ++bit)
+			{
+				col |= ((code >> (2 * bit)) & 1) << bit;
+				row |= ((code >> (2 * bit + 1)) & 1) << bit;
+			}
+			buildTreeNode(tree, subtree, first, end, barnesHutSplitLevel, tree->minX + col * size, tree->minY + row * size, size);
+		}
+	}
+}
+
+// NOTE: lays out the top levels in depth first order, leaving room for the subtrees, and returns the node or -1 when empty
+int
+assembleTopNodes(BarnesHutTree* tree, int level, int prefix, f64 cellX, f64 cellY, f64 size)
+{
+	if (level == barnesHutSplitLevel)
+	{
+		TreeNodeArray* subtree = tree->subtrees + prefix;
+		if (subtree->count == 0) return -1;
+		int offset = tree->nodeCount;
+		tree->subtreeOffsets[prefix] = offset;
+		tree->nodeCount += subtree->count;
+		return offset;
+	}
+
+	int nodeIndex = tree->nodeCount++;
+	TreeNode node = {};
+	node.size = size;
+	node.firstBody = tree->subtreeFirstBodies[prefix << (2 * (barnesHutSplitLevel - level))];
+
+	f64 childSize = 0.5 * size;
+	for (int quadrant = 0; quadrant < 4; ++quadrant)
+	{
+		f64 childX = cellX + (quadrant & 1) * childSize;
+		f64 childY = cellY + (quadrant >> 1) * childSize;
+		int childPrefix = 4 * prefix + quadrant;
+		int childIndex = assembleTopNodes(tree, level + 1, childPrefix, childX, childY, childSize);
+		if (childIndex >= 0)
+		{
+			TreeNode* child = (level + 1 == barnesHutSplitLevel) ? tree->subtrees[childPrefix].nodes : tree->nodes + childIndex;
+			addChildToTreeNode(&node, child);
+			node.bodyCount += child->bodyCount;
+		}
+	}
+
+	if (node.bodyCount == 0)
+	{
+		tree->nodeCount = nodeIndex;
+		return -1;
+	}
+
+	finishTreeNode(&node, cellX, cellY);
+	node.next = tree->nodeCount;
+	tree->nodes[nodeIndex] = node;
+	return nodeIndex;
+}
+
+void
+copySubtrees(void* data, int startIndex, int endIndex)
+{
+	BarnesHutTree* tree = (BarnesHutTree*) data;
+	for (int subtreeIndex = startIndex; subtreeIndex < endIndex; ++subtreeIndex)
+	{
+		TreeNodeArray* subtree = tree->subtrees + subtreeIndex;
+		int offset = tree->subtreeOffsets[subtreeIndex];
+		TreeNode* destination = tree->nodes + offset;
+		for (int nodeIndex = 0; nodeIndex < subtree->count; ++nodeIndex)
+		{
+			destination[nodeIndex] = subtree->nodes[nodeIndex];
+			destination[nodeIndex].next += offset;
+		}
+	}
+}
+
+// NOTE: call after filling in the positions and sources
+void
+buildBarnesHutTree(BarnesHutTree* tree)
+{
+	tree->nodeCount = 0;
+	if (tree->bodyCount == 0) return;
+
+	// ! bounding square
+
+	f64 minX = tree->positions[0].x;
+	f64 minY = tree->positions[0].y;
+	f64 maxX = minX;
+	f64 maxY = minY;
+	for (int bodyIndex = 1; bodyIndex < tree->bodyCount; ++bodyIndex)
+	{
+		V2 position = tree->positions[bodyIndex];
+		minX = min(minX, position.x);
+		minY = min(minY, position.y);
+		maxX = max(maxX, position.x);
+		maxY = max(maxY, position.y);
+	}
+	// NOTE: a little bigger, so the bodies on the far edge still land inside
+	tree->side = atLeast(1e-6, 1.001 * max(maxX - minX, maxY - minY));
+	tree->minX = minX;
+	tree->minY = minY;
+
+	// ! sort
+
+	int chunkSize = 4096;
+	parallelFor(tree->bodyCount, chunkSize, computeMortonCodes, tree);
+	sortMortonCodes(tree);
+	parallelFor(tree->bodyCount, chunkSize, gatherSortedBodies, tree);
+
+	// ! subtrees
+
+	int subtreeShift = 2 * (barnesHutMortonBits - barnesHutSplitLevel);
+	for (int subtreeIndex = 0; subtreeIndex < barnesHutSubtreeCount; ++subtreeIndex)
+	{
+		tree->subtreeFirstBodies[subtreeIndex] = lowerBoundCode(tree->codes, 0, tree->bodyCount, (u32) subtreeIndex << subtreeShift);
+	}
+	tree->subtreeFirstBodies[barnesHutSubtreeCount] = tree->bodyCount;
+
+	parallelFor(barnesHutSubtreeCount, 1, buildSubtrees, tree);
+
+	// ! top levels
+
+	int nodeCount = barnesHutTopNodeCount;
+	for (int subtreeIndex = 0; subtreeIndex < barnesHutSubtreeCount; ++subtreeIndex)
+	{
+		nodeCount += tree->subtrees[subtreeIndex].count;
+	}
+	if (tree->nodeCapacity < nodeCount)
+	{
+		tree->nodeCapacity = nodeCount;
+		tree->nodes = (TreeNode*) realloc(tree->nodes, nodeCount * sizeof(TreeNode));
+	}
+
+	assembleTopNodes(tree, 0, 0, tree->minX, tree->minY, tree->side);
+	parallelFor(barnesHutSubtreeCount, 1, copySubtrees, tree);
+}
+
+//
+// Walking
+//
+
+template<bool isComputingPotentials>
+void
+walkBarnesHutBodies(void* data, int startIndex, int endIndex)
+{
+	BarnesHutTree* tree = (BarnesHutTree*) data;
+	f64 invOpeningAngle = 1 / tree->openingAngle;
+	f64 squaredSoftening = square(tree->softening);
+
+	for (int bodyIndex = startIndex; bodyIndex < endIndex; ++bodyIndex)
+	{
+		f64 x = tree->bodyX[bodyIndex];
+		f64 y = tree->bodyY[bodyIndex];
+		f64 potential = 0;
+		f64 fieldX = 0;
+		f64 fieldY = 0;
+
+		int nodeIndex = 0;
+		while (nodeIndex < tree->nodeCount)
+		{
+			TreeNode* node = tree->nodes + nodeIndex;
+			if (node->isLeaf)
+			{
+				int end = node->firstBody + node->bodyCount;
+				for (int otherIndex = node->firstBody; otherIndex < end; ++otherIndex)
+				{
+					if (otherIndex == bodyIndex) continue;
+					f64 dx = x - tree->bodyX[otherIndex];
+					f64 dy = y - tree->bodyY[otherIndex];
+					f64 quadrance = dx * dx + dy * dy + squaredSoftening;
+					f64 sourceOverQuadrance = tree->bodySource[otherIndex] / quadrance;
+					if (isComputingPotentials)
+					{
+						potential -= 0.5 * tree->bodySource[otherIndex] * log(quadrance);
+					}
+					fieldX += sourceOverQuadrance * dx;
+					fieldY += sourceOverQuadrance * dy;
+				}
+				nodeIndex = node->next;
+				continue;
+			}
+
+			f64 dx = x - node->centerX;
+			f64 dy = y - node->centerY;
+			f64 quadrance = dx * dx + dy * dy;
+			f64 openingRadius = node->size * invOpeningAngle + node->centerOffset;
+			if (quadrance > square(openingRadius))
+			{
+				// NOTE: the dipole adds (d . p) / d^2 to the potential
+				quadrance += squaredSoftening;
+				f64 invQuadrance = 1 / quadrance;
+				f64 dipoleTerm = (dx * node->dipoleX + dy * node->dipoleY) * invQuadrance;
+				f64 sourceTerm = node->source + 2 * dipoleTerm;
+				if (isComputingPotentials)
+				{
+					potential += dipoleTerm - 0.5 * node->source * log(quadrance);
+				}
+				fieldX += (sourceTerm * dx - node->dipoleX) * invQuadrance;
+				fieldY += (sourceTerm * dy - node->dipoleY) * invQuadrance;
+				nodeIndex = node->next;
+			}
+			else
+			{
+				nodeIndex++;
+			}
+		}
+
+		int originalIndex = tree->order[bodyIndex];
+		tree->potentials[originalIndex] = potential;
+		tree->fieldX[originalIndex] = fieldX;
+		tree->fieldY[originalIndex] = fieldY;
+	}
+}
+
+// NOTE: potential and field at every body from all the others, per unit charge and unit coupling.
+// Walks the bodies in Morton order, so neighboring bodies on a thread take mostly the same path.
+void
+walkBarnesHutTree(BarnesHutTree* tree)
+{
+	int chunkSize = 256;
+	if (tree->isComputingPotentials)
+	{
+		parallelFor(tree->bodyCount, chunkSize, walkBarnesHutBodies<true>, tree);
+	}
+	else
+	{
+		parallelFor(tree->bodyCount, chunkSize, walkBarnesHutBodies<false>, tree);
+	}
+}
+
+void
+freeBarnesHutTree(BarnesHutTree* tree)
+{
+	free(tree->positions);
+	free(tree->sources);
+	free(tree->potentials);
+	free(tree->fieldX);
+	free(tree->fieldY);
+	free(tree->codes);
+	free(tree->order);
+	free(tree->scratchCodes);
+	free(tree->scratchOrder);
+	free(tree->bodyX);
+	free(tree->bodyY);
+	free(tree->bodySource);
+	for (int subtreeIndex = 0; subtreeIndex < barnesHutSubtreeCount; ++subtreeIndex)
+	{
+		free(tree->subtrees[subtreeIndex].nodes);
+	}
+	free(tree->nodes);
+	*tree = {};
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef baseline_file_h
+#define baseline_file_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "math_stuff.h"
+
+// NOTE: the stored times the benchmarks compare themselves against. A line per case, the name and the time
+// separated by a tab, and lines starting with # are comments. The times only mean something on the machine
+// and build they came from.
+
+#define maxBaselineCount 128
+
+struct BaselineFile {
+	char names[maxBaselineCount][256];
+	f64 times[maxBaselineCount];
+	int count;
+};
+
+bool
+readBaselineFile(BaselineFile* baseline, const char* path)
+{
+	baseline->count = 0;
+	FILE* file = fopen(path, "r");
+	if (!file) return false;
+
+	char line[256];
+	while (fgets(line, sizeof(line), file) && (baseline->count < maxBaselineCount))
+	{
+		char* tab = strchr(line, '\t');
+		if (!tab || (line[0] == '#')) continue;
+		*tab = 0;
+		snprintf(baseline->names[baseline->count], sizeof(baseline->names[0]), "%s", line);
+		baseline->times[baseline->count] = atof(tab + 1);
+		baseline->count++;
+	}
+	fclose(file);
+	return true;
+}
+
+// NOTE: 0 for a case that isn't in the file
+f64
+findBaselineTime(BaselineFile* baseline, const char* name)
+{
+	for (int index = 0; index < baseline->count; ++index)
+	{
+		if (!strcmp(baseline->names[index], name)) return baseline->times[index];
+	}
+	return 0;
+}
+
+bool
+writeBaselineFile(const char* path, const char* comment, const char** names, f64* times, int count)
+{
+	FILE* file = fopen(path, "w");
+	if (!file) return false;
+
+	fprintf(file, "# %s\n", comment);
+	for (int index = 0; index < count; ++index)
+	{
+		fprintf(file, "%s\t%.4f\n", names[index], times[index]);
+	}
+	fclose(file);
+	return true;
+}
+
+// NOTE: how much slower than the baseline, in percent
+f64
+changeFromBaseline(f64 time, f64 baselineTime)
+{
+	return 100 * (time / baselineTime - 1);
+}
+
+#endif
@@ -0,0 +1,789 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "particle_simulation.h"
+#include "event_driven.h"
+#include "barnes_hut.h"
+#include "ensemble.h"
+#include "domain_decomposition.h"
+
+// NOTE: headless, so no SDL, just the simulation
+
+f64
+getTime()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+void
+benchmarkSetup(Simulation* simulation)
+{
+    *simulation = {};
+    srand(1);
+    initSimulation(simulation);
+    defaultParticles(simulation);
+    defaultWalls(simulation);
+    simulation->temperature = 1;
+    simulation->viscosity = 0.05;
+}
+
+// NOTE: returns nanoseconds per particle per step
+f64
+timeSteps(Simulation* simulation, int stepCount)
+{
+    u64 firstStep = simulation->stepCount;
+    f64 startTime = getTime();
+    advanceSimulation(simulation, (stepCount + 0.5) * simulation->dt);
+    f64 elapsedSeconds = getTime() - startTime;
+    u64 stepsTaken = simulation->stepCount - firstStep;
+    return 1e9 * elapsedSeconds / (stepsTaken * simulation->particleCount);
+}
+
+f64
+totalEnergy(Simulation* simulation)
+{
+    f64 energy = 0;
+    for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        energy += particle->kineticEnergy + particle->potentialEnergy;
+    }
+    return energy;
+}
+
+//
+// Cutoff
+//
+
+// NOTE: how many of the pairs the stencil visits are actually within the cutoff
+f64
+fractionOfStencilPairsInRange(Simulation* simulation)
+{
+    int gridRadius = ceil(simulation->interactionRange / min(simulation->gridCellWidth, simulation->gridCellHeight));
+    u64 pairCount = 0;
+    u64 inRangeCount = 0;
+    for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        for (int y = -gridRadius; y <= gridRadius; ++y)
+        {
+            int row = mod(particle->gridRow + y, simulation->gridRowCount);
+            for (int x = -gridRadius; x <= gridRadius; ++x)
+            {
+                int col = mod(particle->gridCol + x, simulation->gridColCount);
+                Particle* otherParticle = simulation->particleGrid[row * simulation->gridColCount + col];
+                if (otherParticle && (otherParticle < particle))
+                {
+                    Interaction* interaction = simulation->interactions + particle->species * maxSpeciesCount + otherParticle->species;
+                    V2 relativePosition = periodize(otherParticle->position - particle->position, simulation->boxWidth, simulation->boxHeight);
+                    pairCount++;
+                    inRangeCount += (square(relativePosition) < interaction->squaredCutoff);
+                }
+            }
+        }
+    }
+    return (f64) inRangeCount / pairCount;
+}
+
+void
+benchmarkCutoffShifts(int stepCount)
+{
+    printf("\n%-16s %12s %16s\n", "cutoff", "ns", "energy drift");
+
+    for (int shiftIndex = 0; shiftIndex < CutoffShift_Count; ++shiftIndex)
+    {
+        // NOTE: no thermostat, so energy should be conserved
+        Simulation simulation;
+        benchmarkSetup(&simulation);
+        simulation.viscosity = 0;
+        simulation.cutoffShift = (CutoffShift) shiftIndex;
+
+        timeSteps(&simulation, stepCount / 10);
+        f64 startEnergy = totalEnergy(&simulation);
+        f64 time = timeSteps(&simulation, stepCount);
+        f64 drift = (totalEnergy(&simulation) - startEnergy) / simulation.particleCount;
+
+        printf("%-16s %12.2f %16.4e\n", cutoffShiftNames[shiftIndex], time, drift);
+
+        if (shiftIndex == 0)
+        {
+            printf("(%.0f%% of the pairs in the stencil are within the cutoff)\n", 100 * fractionOfStencilPairsInRange(&simulation));
+        }
+    }
+}
+
+//
+// Precision
+//
+
+// NOTE: the force loop in each precision, without a thermostat and with the force shifted,
+// so the drift comes from the arithmetic and the integrator rather than the cutoff
+void
+benchmarkPrecision(int stepCount)
+{
+    printf("\n%-16s %12s %16s\n", "precision", "ns", "energy drift");
+
+    for (int precisionIndex = 0; precisionIndex < Precision_Count; ++precisionIndex)
+    {
+        Simulation simulation;
+        benchmarkSetup(&simulation);
+        simulation.viscosity = 0;
+        simulation.cutoffShift = CutoffShift_Force;
+        simulation.precision = (Precision) precisionIndex;
+
+        timeSteps(&simulation, stepCount / 10);
+        f64 startEnergy = totalEnergy(&simulation);
+        f64 time = timeSteps(&simulation, stepCount);
+        f64 drift = (totalEnergy(&simulation) - startEnergy) / simulation.particleCount;
+
+        printf("%-16s %12.2f %16.4e\n", precisionNames[precisionIndex], time, drift);
+        freeSimulation(&simulation);
+    }
+}
+
+//
+// Multiple time stepping
+//
+
+// NOTE: compares per unit of simulated time, since the point is taking longer outer steps
+void
+benchmarkMultipleTimeSteps(f64 simulatedTime)
+{
+    printf("\n%-24s %12s %16s\n", "time stepping", "seconds", "energy drift");
+
+    for (int innerStepCount = 1; innerStepCount <= 4; innerStepCount *= 2)
+    {
+        Simulation simulation;
+        benchmarkSetup(&simulation);
+        simulation.viscosity = 0;
+        simulation.cutoffShift = CutoffShift_Force;
+        simulation.isUsingMultipleTimeSteps = (innerStepCount > 1);
+        simulation.innerStepCount = innerStepCount;
+        simulation.dt *= innerStepCount;
+
+        advanceSimulation(&simulation, 10 * simulation.dt);
+        f64 startEnergy = totalEnergy(&simulation);
+        f64 startTime = getTime();
+        advanceSimulation(&simulation, simulatedTime);
+        f64 seconds = getTime() - startTime;
+        f64 drift = (totalEnergy(&simulation) - startEnergy) / simulation.particleCount;
+
+        char name[64];
+        snprintf(name, sizeof(name), "dt %.3f x %d inner", simulation.dt, innerStepCount);
+        printf("%-24s %12.4f %16.4e\n", name, seconds, drift);
+    }
+}
+
+//
+// Adaptive time step
+//
+
+// NOTE: in a steady liquid the adaptive step is about as long as the fixed one for the same accuracy,
+// since collisions are what limits both. Where it pays is a run whose violence changes: dragging a particle
+// hard through the default scene blows up any fixed dt above about 0.001, and a fixed dt that survives
+// the drag is paid for in the calm that follows too.
+void
+benchmarkAdaptiveTimeStep(f64 simulatedTime)
+{
+    printf("\n%-16s %12s %10s %12s %16s\n", "time step", "seconds", "steps", "final dt", "energy drift");
+
+    for (int isAdaptive = 0; isAdaptive <= 1; ++isAdaptive)
+    {
+        Simulation simulation;
+        benchmarkSetup(&simulation);
+        simulation.viscosity = 0;
+        simulation.cutoffShift = CutoffShift_Force;
+        simulation.isUsingAdaptiveTimeStep = isAdaptive;
+
+        advanceSimulation(&simulation, 10 * simulation.dt);
+        f64 startEnergy = totalEnergy(&simulation);
+        u64 firstStep = simulation.stepCount;
+        f64 startTime = getTime();
+        advanceSimulation(&simulation, simulatedTime);
+        f64 seconds = getTime() - startTime;
+        f64 drift = (totalEnergy(&simulation) - startEnergy) / simulation.particleCount;
+
+        printf("%-16s %12.4f %10llu %12.4f %16.4e\n", isAdaptive ? "adaptive" : "fixed", seconds,
+            (unsigned long long) (simulation.stepCount - firstStep), simulation.dt, drift);
+        freeSimulation(&simulation);
+    }
+
+    // NOTE: dragged for a sixth of the run, then left to calm down under a strong thermostat
+    printf("\n%-16s %12s %10s %12s %16s\n", "dragging", "seconds", "steps", "largest kT", "final kT");
+    f64 fixedDts[] = {0.005, 0.0015, 0.001};
+    for (int runIndex = 0; runIndex <= (int) arrayCount(fixedDts); ++runIndex)
+    {
+        bool isAdaptive = (runIndex == (int) arrayCount(fixedDts));
+        Simulation simulation;
+        benchmarkSetup(&simulation);
+        simulation.draggingStrength = 100;
+        simulation.viscosity = 0.5;
+        simulation.isUsingAdaptiveTimeStep = isAdaptive;
+        if (!isAdaptive) simulation.dt = fixedDts[runIndex];
+        advanceSimulation(&simulation, 5);
+
+        u64 firstStep = simulation.stepCount;
+        f64 startTime = getTime();
+        f64 largestTemperature = 0;
+        int frameCount = 60;
+        for (int frameIndex = 0; frameIndex < frameCount; ++frameIndex)
+        {
+            simulation.isDragging = (frameIndex < frameCount / 6);
+            simulation.draggedParticleIndex = 0;
+            simulation.mousePosition = v2(40, 40);
+            advanceSimulation(&simulation, 3 * simulatedTime / frameCount);
+            largestTemperature = max(largestTemperature, measureObservables(&simulation).measuredTemperature);
+        }
+        f64 seconds = getTime() - startTime;
+
+        char name[64];
+        if (isAdaptive) snprintf(name, sizeof(name), "adaptive");
+        else snprintf(name, sizeof(name), "fixed %g", fixedDts[runIndex]);
+        printf("%-16s %12.4f %10llu %12.4g %16.4g\n", name, seconds, (unsigned long long) (simulation.stepCount - firstStep),
+            largestTemperature, measureObservables(&simulation).measuredTemperature);
+        freeSimulation(&simulation);
+    }
+}
+
+//
+// Event-driven hard disks
+//
+
+bool
+benchmarkDiluteGas(f64 simulatedTime)
+{
+    int particleCount = 1000;
+    printf("\n%-16s %12s %16s\n", "dilute gas", "seconds", "energy drift");
+
+    // NOTE: WCA is the closest the stepped simulation gets to hard disks
+    Simulation simulation = {};
+    srand(1);
+    initSimulation(&simulation);
+    simulation.temperature = 1;
+    // NOTE: walls first, so the particles are placed clear of them
+    defaultWalls(&simulation);
+    diluteGasSetup(&simulation, particleCount);
+    simulation.viscosity = 0;
+    simulation.potentialType = PotentialType_WeeksChandlerAndersen;
+    advanceSimulation(&simulation, 1.5 * simulation.dt);
+    f64 startEnergy = totalEnergy(&simulation);
+    f64 startTime = getTime();
+    advanceSimulation(&simulation, simulatedTime);
+    f64 steppedSeconds = getTime() - startTime;
+    f64 steppedDrift = (totalEnergy(&simulation) - startEnergy) / particleCount;
+    printf("%-16s %12.4f %16.4e\n", "stepped", steppedSeconds, steppedDrift);
+    freeSimulation(&simulation);
+
+    simulation = {};
+    srand(1);
+    initSimulation(&simulation);
+    simulation.temperature = 1;
+    defaultWalls(&simulation);
+    diluteGasSetup(&simulation, particleCount);
+    EventDrivenEngine engine = {};
+    initEventDriven(&engine, &simulation);
+    advanceEventDriven(&engine, &simulation, 0);
+    startEnergy = totalEnergy(&simulation);
+    startTime = getTime();
+    advanceEventDriven(&engine, &simulation, simulatedTime);
+    f64 eventSeconds = getTime() - startTime;
+    f64 eventDrift = (totalEnergy(&simulation) - startEnergy) / particleCount;
+    printf("%-16s %12.4f %16.4e\n", "event-driven", eventSeconds, eventDrift);
+    u64 eventCount = engine.processedEventCount;
+
+    freeEventDriven(&engine);
+    freeSimulation(&simulation);
+
+    // NOTE: a run that blew up isn't a speed to compare against
+    if (!isfinite(steppedDrift) || !isfinite(eventDrift))
+    {
+        printf("FAILED: the energy of a run is not finite\n");
+        return false;
+    }
+    printf("(%llu events, %.1fx faster)\n", (unsigned long long) eventCount, steppedSeconds / eventSeconds);
+    return true;
+}
+
+//
+// Bonds
+//
+
+// NOTE: the default scene strung into chains, without a thermostat, with and without the pair potential
+// between bonded neighbors, and then the bonded pass alone on a million particles in chains
+void
+benchmarkBonds(int stepCount)
+{
+    printf("\n%-16s %12s %16s\n", "bonds", "ns", "energy drift");
+
+    const char* names[] = {"none", "chains", "chains, excluded"};
+    for (int variantIndex = 0; variantIndex < (int) arrayCount(names); ++variantIndex)
+    {
+        Simulation simulation;
+        benchmarkSetup(&simulation);
+        simulation.viscosity = 0;
+        simulation.cutoffShift = CutoffShift_Force;
+        if (variantIndex > 0)
+        {
+            polymerChainsSetup(&simulation, 20);
+            simulation.isExcludingBondedPairs = (variantIndex == 2);
+        }
+
+        timeSteps(&simulation, stepCount / 10);
+        f64 startEnergy = totalEnergy(&simulation);
+        f64 time = timeSteps(&simulation, stepCount);
+        f64 drift = (totalEnergy(&simulation) - startEnergy) / simulation.particleCount;
+
+        printf("%-16s %12.2f %16.4e\n", names[variantIndex], time, drift);
+        freeSimulation(&simulation);
+    }
+
+    int side = 1024;
+    Simulation simulation = {};
+    initSimulation(&simulation);
+    simulation.boxWidth = side * simulation.separation;
+    simulation.boxHeight = side * simulation.separation;
+    updateGrid(&simulation);
+    setParticleCount(&simulation, side * side);
+    for (int particleIndex = 0; particleIndex < simulation.particleCount; ++particleIndex)
+    {
+        // NOTE: rows that turn back at the ends, so the chains run on from one row into the next
+        int row = particleIndex / side;
+        int col = (row % 2) ? side - 1 - particleIndex % side : particleIndex % side;
+        simulation.particles[particleIndex].position = simulation.separation * v2(col - 0.5 * side, row - 0.5 * side);
+    }
+    polymerChainsSetup(&simulation, 100);
+
+    BondTopology* topology = &simulation.topology;
+    f64 startTime = getTime();
+    updateBondRows(topology, simulation.particleCount);
+    f64 rowSeconds = getTime() - startTime;
+    startTime = getTime();
+    int passCount = 10;
+    for (int passIndex = 0; passIndex < passCount; ++passIndex)
+    {
+        calculateBondedForces(&simulation, 0, simulation.particleCount);
+    }
+    f64 passSeconds = (getTime() - startTime) / passCount;
+    printf("(%d bonds and %d angles: %.1f ms to build the rows, %.1f ms per pass, %.1f ns per bond or angle)\n",
+        topology->bondCount, topology->angleCount, 1000 * rowSeconds, 1000 * passSeconds,
+        1e9 * passSeconds / (topology->bondCount + topology->angleCount));
+    freeSimulation(&simulation);
+}
+
+//
+// Potential tables
+//
+
+struct TableAccuracy {
+    f64 maxForceError;
+    f64 maxEnergyError;
+};
+
+// NOTE: errors are relative to the largest force and energy in the sampled range,
+// which starts a bit inside the separation since particles rarely get closer than that
+TableAccuracy
+measureTableAccuracy(PotentialType potentialType, Interaction* interaction)
+{
+    PotentialTable* table = allocArray(PotentialTable, 1);
+    buildPotentialTable(table, potentialType, interaction);
+
+    int sampleCount = 100000;
+    f64 minQuadrance = square(0.85) * interaction->squaredSeparation;
+    f64 step = (interaction->squaredCutoff - minQuadrance) / sampleCount;
+
+    f64 maxForce = 0;
+    f64 maxEnergy = 0;
+    TableAccuracy result = {};
+    for (int sampleIndex = 0; sampleIndex < sampleCount; ++sampleIndex)
+    {
+        f64 quadrance = minQuadrance + sampleIndex * step;
+        PairForce exact = evaluatePotential(potentialType, interaction, quadrance);
+        PairForce tabulated = lookUpPotentialTable(table, quadrance);
+
+        f64 distance = sqrt(quadrance);
+        maxForce = max(maxForce, fabs(exact.forceFactor * distance));
+        maxEnergy = max(maxEnergy, fabs(exact.potentialEnergy));
+        result.maxForceError = max(result.maxForceError, fabs((tabulated.forceFactor - exact.forceFactor) * distance));
+        result.maxEnergyError = max(result.maxEnergyError, fabs(tabulated.potentialEnergy - exact.potentialEnergy));
+    }
+    result.maxForceError /= maxForce;
+    result.maxEnergyError /= maxEnergy;
+
+    free(table);
+    return result;
+}
+
+// NOTE: a speedup near 1 is what to expect for the cheap potentials, see potential_table.h.
+// The point of the table is potentials that cost more than its lookup.
+void
+benchmarkPotentialTables(int stepCount)
+{
+    printf("\n%-38s %12s %12s %9s %12s %12s\n", "potential", "exact ns", "table ns", "speedup", "force err", "energy err");
+
+    for (int potentialIndex = 0; potentialIndex < PotentialType_Count; ++potentialIndex)
+    {
+        PotentialType potentialType = (PotentialType) potentialIndex;
+
+        Simulation simulation;
+        benchmarkSetup(&simulation);
+        simulation.potentialType = potentialType;
+        timeSteps(&simulation, stepCount / 10);
+        f64 exactTime = timeSteps(&simulation, stepCount);
+
+        benchmarkSetup(&simulation);
+        simulation.potentialType = potentialType;
+        simulation.isUsingPotentialTables = true;
+        timeSteps(&simulation, stepCount / 10);
+        f64 tableTime = timeSteps(&simulation, stepCount);
+
+        TableAccuracy accuracy = measureTableAccuracy(potentialType, simulation.interactions);
+
+        printf("%-38s %12.2f %12.2f %8.2fx %12.2e %12.2e\n",
+            potentialNames[potentialIndex], exactTime, tableTime, exactTime / tableTime,
+            accuracy.maxForceError, accuracy.maxEnergyError);
+    }
+}
+
+//
+// Long range
+//
+
+// NOTE: the force between two opposite unit charges should be 1 / r and their energy ln(r), up to the
+// periodic images which are small when r is much smaller than the box
+void
+benchmarkLongRange(int stepCount)
+{
+    printf("\n%-16s %12s %12s %12s %12s\n", "long range", "force", "error", "energy", "error");
+
+    Simulation simulation;
+    benchmarkSetup(&simulation);
+    simulation.boxWidth = 400;
+    simulation.boxHeight = 400;
+    electrolyteSetup(&simulation);
+    setParticleCount(&simulation, 2);
+    simulation.longRangeStrength = 1;
+
+    f64 distances[] = {1, 2, 4, 8, 16};
+    for (int distanceIndex = 0; distanceIndex < (int) arrayCount(distances); ++distanceIndex)
+    {
+        f64 distance = distances[distanceIndex];
+        Particle* particles = simulation.particles;
+        setParticleSpecies(&simulation, particles + 0, 0);
+        setParticleSpecies(&simulation, particles + 1, 1);
+        particles[0].position = v2(0.3, 0.1);
+        particles[1].position = v2(0.3 + distance, 0.1);
+
+        clearGrid(&simulation);
+        for (int particleIndex = 0; particleIndex < 2; ++particleIndex)
+        {
+            particles[particleIndex].acceleration = v2(0, 0);
+            particles[particleIndex].potentialEnergy = 0;
+            putParticleInGrid(&simulation, particles + particleIndex);
+        }
+        calculateLongRangeForces(&simulation, PairRange_All);
+
+        char name[64];
+        snprintf(name, sizeof(name), "r = %.0f", distance);
+        f64 force = particles[0].acceleration.x * particles[0].mass;
+        f64 energy = particles[0].potentialEnergy + particles[1].potentialEnergy;
+        printf("%-16s %12.5f %11.2f%% %12.5f %12.5f\n", name, force, 100 * (force * distance - 1), energy, energy - log(distance));
+    }
+
+    benchmarkSetup(&simulation);
+    electrolyteSetup(&simulation);
+    timeSteps(&simulation, stepCount / 10);
+    f64 meshTime = timeSteps(&simulation, stepCount);
+    simulation.longRangeType = LongRangeType_None;
+    f64 shortRangeTime = timeSteps(&simulation, stepCount);
+    printf("(%.2f ns with the mesh, %.2f ns without)\n", meshTime, shortRangeTime);
+}
+
+//
+// Barnes-Hut
+//
+
+// NOTE: a self-gravitating disk with a dense core, errors are against the direct sum for a sample of bodies
+void
+benchmarkBarnesHut(int bodyCount)
+{
+    printf("\n%-16s %12s %12s %12s %12s %12s\n", "Barnes-Hut", "build s", "walk s", "forces s", "mean err", "max err");
+
+    BarnesHutTree tree = {};
+    tree.softening = 0.01;
+    setBarnesHutBodyCount(&tree, bodyCount);
+    srand(1);
+    for (int bodyIndex = 0; bodyIndex < bodyCount; ++bodyIndex)
+    {
+        f64 radius = 50 * sqrt(randomF32());
+        if ((bodyIndex % 3) == 0)
+        {
+            radius *= 0.1;
+        }
+        tree.positions[bodyIndex] = radius * v2FromAngle(tau * randomF32());
+        tree.sources[bodyIndex] = 1;
+    }
+
+    int sampleCount = 100;
+    f64* exactFieldX = allocArray(f64, sampleCount);
+    f64* exactFieldY = allocArray(f64, sampleCount);
+    for (int sampleIndex = 0; sampleIndex < sampleCount; ++sampleIndex)
+    {
+        int bodyIndex = (int) ((u64) sampleIndex * bodyCount / sampleCount);
+        V2 position = tree.positions[bodyIndex];
+        exactFieldX[sampleIndex] = 0;
+        exactFieldY[sampleIndex] = 0;
+        for (int otherIndex = 0; otherIndex < bodyCount; ++otherIndex)
+        {
+            if (otherIndex == bodyIndex) continue;
+            f64 dx = position.x - tree.positions[otherIndex].x;
+            f64 dy = position.y - tree.positions[otherIndex].y;
+            f64 quadrance = dx * dx + dy * dy + square(tree.softening);
+            exactFieldX[sampleIndex] += tree.sources[otherIndex] * dx / quadrance;
+            exactFieldY[sampleIndex] += tree.sources[otherIndex] * dy / quadrance;
+        }
+    }
+
+    f64 openingAngles[] = {0.3, 0.5, 0.7, 1.0};
+    for (int angleIndex = 0; angleIndex < (int) arrayCount(openingAngles); ++angleIndex)
+    {
+        tree.openingAngle = openingAngles[angleIndex];
+
+        f64 startTime = getTime();
+        buildBarnesHutTree(&tree);
+        f64 buildSeconds = getTime() - startTime;
+
+        startTime = getTime();
+        tree.isComputingPotentials = true;
+        walkBarnesHutTree(&tree);
+        f64 walkSeconds = getTime() - startTime;
+
+        startTime = getTime();
+        tree.isComputingPotentials = false;
+        walkBarnesHutTree(&tree);
+        f64 forcesSeconds = getTime() - startTime;
+
+        f64 meanError = 0;
+        f64 maxError = 0;
+        for (int sampleIndex = 0; sampleIndex < sampleCount; ++sampleIndex)
+        {
+            int bodyIndex = (int) ((u64) sampleIndex * bodyCount / sampleCount);
+            f64 error = sqrt(square(tree.fieldX[bodyIndex] - exactFieldX[sampleIndex]) + square(tree.fieldY[bodyIndex] - exactFieldY[sampleIndex]))
+                / sqrt(square(exactFieldX[sampleIndex]) + square(exactFieldY[sampleIndex]));
+            meanError += error / sampleCount;
+            maxError = max(maxError, error);
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "angle %.1f", tree.openingAngle);
+        printf("%-16s %12.4f %12.4f %12.4f %12.2e %12.2e\n", name, buildSeconds, walkSeconds, forcesSeconds, meanError, maxError);
+    }
+    printf("(%d bodies on %d threads)\n", bodyCount, getThreadCount());
+
+    free(exactFieldX);
+    free(exactFieldY);
+    freeBarnesHutTree(&tree);
+}
+
+//
+// Ensemble
+//
+
+// NOTE: the default scene, moving at the member's temperature from the start
+void
+thermalEnsembleSetup(Simulation* simulation, void* data)
+{
+    defaultParticles(simulation);
+    defaultWalls(simulation);
+    for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        f32 thermalVelocity = sqrt(simulation->temperature / particle->mass);
+        particle->velocity = thermalVelocity * v2(randomGaussian(&simulation->random), randomGaussian(&simulation->random));
+    }
+}
+
+// NOTE: the measured temperature should follow the thermostat's in every member. The lattice settling
+// heats the members up, and at a viscosity of 0.05 that heat takes 1 / 0.05 = 20 time units to go, so the
+// members are first burned in with a strong thermostat. Its equilibrium is the same at any viscosity, so
+// they stay at their temperature once their own viscosity is back.
+bool
+benchmarkEnsemble(f64 simulatedTime)
+{
+    f32 temperatures[] = {0.5, 1, 2, 4};
+    f32 viscosities[] = {0.05, 0.5};
+    EnsembleSweep sweep = {};
+    sweep.temperatures = temperatures;
+    sweep.temperatureCount = arrayCount(temperatures);
+    sweep.viscosities = viscosities;
+    sweep.viscosityCount = arrayCount(viscosities);
+    sweep.replicaCount = 2;
+
+    Ensemble ensemble;
+    initEnsemble(&ensemble, &sweep, thermalEnsembleSetup, 0, 1);
+
+    f32 burnInViscosity = 2;
+    f64 burnInTime = 10 / burnInViscosity;
+    f32 memberViscosities[arrayCount(temperatures) * arrayCount(viscosities) * 2];
+    assert(ensemble.memberCount == (int) arrayCount(memberViscosities));
+    for (int memberIndex = 0; memberIndex < ensemble.memberCount; ++memberIndex)
+    {
+        Simulation* simulation = &ensemble.members[memberIndex].simulation;
+        memberViscosities[memberIndex] = simulation->viscosity;
+        simulation->viscosity = burnInViscosity;
+    }
+    runEnsemble(&ensemble, burnInTime, burnInTime);
+    for (int memberIndex = 0; memberIndex < ensemble.memberCount; ++memberIndex)
+    {
+        ensemble.members[memberIndex].simulation.viscosity = memberViscosities[memberIndex];
+    }
+
+    u64 burnInStepCount = 0;
+    for (int memberIndex = 0; memberIndex < ensemble.memberCount; ++memberIndex)
+    {
+        burnInStepCount += ensemble.members[memberIndex].simulation.stepCount;
+    }
+
+    f64 startTime = getTime();
+    runEnsemble(&ensemble, simulatedTime, simulatedTime / 10);
+    f64 seconds = getTime() - startTime;
+
+    // NOTE: each average is over the samples of both replicas, which leaves a few percent of noise
+    f64 tolerance = 0.1;
+    bool isPassing = true;
+    printf("\n%-16s %12s %12s %12s\n", "ensemble", "viscosity", "set", "measured");
+    for (int temperatureIndex = 0; temperatureIndex < sweep.temperatureCount; ++temperatureIndex)
+    {
+        for (int viscosityIndex = 0; viscosityIndex < sweep.viscosityCount; ++viscosityIndex)
+        {
+            f64 measured = 0;
+            int count = 0;
+            for (int sampleIndex = 0; sampleIndex < ensemble.sampleCount; ++sampleIndex)
+            {
+                EnsembleSample* sample = ensemble.samples + sampleIndex;
+                if ((sample->temperature == temperatures[temperatureIndex]) && (sample->viscosity == viscosities[viscosityIndex]))
+                {
+                    measured += sample->measuredTemperature;
+                    count++;
+                }
+            }
+            measured /= atLeast(1, count);
+
+            f64 temperature = temperatures[temperatureIndex];
+            bool isMatching = fabs(measured - temperature) <= tolerance * temperature;
+            isPassing &= isMatching;
+            printf("%-16s %12.2f %12.2f %12.2f%s\n", "temperature", viscosities[viscosityIndex], temperature, measured,
+                isMatching ? "" : "  FAILED");
+        }
+    }
+
+    u64 stepCount = 0;
+    u64 particleStepCount = 0;
+    for (int memberIndex = 0; memberIndex < ensemble.memberCount; ++memberIndex)
+    {
+        Simulation* simulation = &ensemble.members[memberIndex].simulation;
+        stepCount += simulation->stepCount;
+        particleStepCount += simulation->stepCount * simulation->particleCount;
+    }
+    stepCount -= burnInStepCount;
+    particleStepCount -= burnInStepCount * ensemble.members[0].simulation.particleCount;
+    printf("(%d members, %llu steps in %.3f seconds on %d threads, %.2f ns per particle step)\n",
+        ensemble.memberCount, (unsigned long long) stepCount, seconds, getThreadCount(), 1e9 * seconds / particleStepCount);
+
+    freeEnsemble(&ensemble);
+    return isPassing;
+}
+
+//
+// Domain decomposition
+//
+
+#if HAS_SOCKET_TRANSPORT
+// NOTE: the decomposed runs should follow the single process run exactly, so the difference should be zero
+void
+benchmarkDomainDecomposition(int stepCount)
+{
+    printf("\n%-16s %12s %12s\n", "domains", "seconds", "difference");
+
+    Simulation reference;
+    benchmarkSetup(&reference);
+    reference.isUsingFullStencil = true;
+    f64 startTime = getTime();
+    advanceSimulation(&reference, (stepCount + 0.5) * reference.dt);
+    printf("%-16s %12.4f\n", "single process", getTime() - startTime);
+
+    int rankCounts[] = {1, 2, 4};
+    for (int rankCountIndex = 0; rankCountIndex < (int) arrayCount(rankCounts); ++rankCountIndex)
+    {
+        int rankCount = rankCounts[rankCountIndex];
+        Simulation simulation;
+        benchmarkSetup(&simulation);
+        int particleCount = simulation.particleCount;
+
+        startTime = getTime();
+        DomainTransport transport;
+        if (!forkSocketTransport(&transport, rankCount)) return;
+
+        Domain domain;
+        initDomain(&domain, &simulation, &transport);
+        advanceDomain(&domain, (stepCount + 0.5) * domain.simulation.dt);
+
+        Simulation gathered = {};
+        if (transport.rank == 0)
+        {
+            gathered.particleCount = particleCount;
+            gathered.particles = allocArray(Particle, particleCount);
+        }
+        gatherDomains(&domain, &gathered);
+        freeDomain(&domain);
+        transport.close(&transport);
+        f64 seconds = getTime() - startTime;
+
+        f64 maxDifference = 0;
+        for (int particleIndex = 0; particleIndex < particleCount; ++particleIndex)
+        {
+            V2 difference = gathered.particles[particleIndex].position - reference.particles[particleIndex].position;
+            maxDifference = max(maxDifference, sqrt(square(difference)));
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "%d ranks", rankCount);
+        printf("%-16s %12.4f %12.3g\n", name, seconds, maxDifference);
+        free(gathered.particles);
+    }
+    printf("(%d particles, one process per rank over Unix sockets)\n", reference.particleCount);
+    freeSimulation(&reference);
+}
+#endif
+
+int
+main(int argumentCount, char** arguments)
+{
+    int stepCount = 1000;
+    if (argumentCount > 1)
+    {
+        stepCount = atoi(arguments[1]);
+    }
+    printf("%s vectors, %d threads\n", simdName, getThreadCount());
+
+    bool isPassing = true;
+    benchmarkCutoffShifts(stepCount);
+    benchmarkPrecision(stepCount);
+    benchmarkMultipleTimeSteps(stepCount * 0.005);
+    benchmarkAdaptiveTimeStep(stepCount * 0.005);
+    isPassing &= benchmarkDiluteGas(stepCount * 0.005);
+    benchmarkBonds(stepCount);
+    benchmarkPotentialTables(stepCount);
+    benchmarkLongRange(stepCount);
+    benchmarkBarnesHut(100 * stepCount);
+    isPassing &= benchmarkEnsemble(stepCount * 0.005);
+#if HAS_SOCKET_TRANSPORT
+    benchmarkDomainDecomposition(stepCount);
+#endif
+
+    return isPassing ? 0 : 1;
+}
@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+warnings="-Wall -Wno-unused-function"
+flags="-O3"
+c++ benchmark.cpp -o benchmark $warnings $flags
@@ -0,0 +1,18 @@
+#!/usr/bin/env bash
+# NOTE: the benchmark as WebAssembly under node, once like the default browser build (scalar, one thread)
+# and once like the simd one (SIMD128 and a worker per core), to measure the browser speedup without a browser.
+# Stops at the first build that fails, so it never runs a stale build from before.
+set -e
+if ! command -v em++ > /dev/null || ! command -v node > /dev/null; then
+    echo "benchmark_node.sh needs em++ (emsdk_env.sh) and node on the PATH" >&2
+    exit 1
+fi
+warnings="-Wall -Wno-unused-function"
+flags="-O3"
+emscripten_settings="-s ENVIRONMENT=node -s ALLOW_MEMORY_GROWTH=1"
+threads_settings="-pthread -s PTHREAD_POOL_SIZE=require('os').cpus().length"
+mkdir -p benchmark_node
+em++ benchmark.cpp -o benchmark_node/scalar.js $warnings $flags $emscripten_settings
+em++ benchmark.cpp -o benchmark_node/simd.js $warnings $flags -msimd128 $emscripten_settings $threads_settings
+node benchmark_node/scalar.js "$@"
+node benchmark_node/simd.js "$@"
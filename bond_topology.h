@@ -0,0 +1,408 @@
+#ifndef bond_topology_h
+#define bond_topology_h
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "math_stuff.h"
+
+// NOTE: bonds and angles between particles, for molecules and polymer chains, by particle index.
+// They are kept as plain lists, which is what gets added to and remapped when particles move in the array,
+// and whenever the lists change they are turned into compressed sparse rows, one row per particle.
+// A particle's row has all of its bonds and all the angles it is in, so the bonded forces are gathered
+// one particle at a time, on any number of threads, like the full stencil does for the pair forces.
+// Every bond is visited from both of its ends and every angle from all three, which costs more arithmetic
+// but needs no atomics, and comes out the same however the particles are split up.
+
+#define maxBondStyleCount 8
+
+enum BondType {
+	BondType_Harmonic,
+	// finitely extensible nonlinear elastic, the bond can't be stretched to its length
+	BondType_Fene,
+	BondType_Count
+};
+
+// NOTE: length is the rest length of a harmonic bond and the maximum length of a FENE bond
+struct BondStyle {
+	BondType type;
+	f64 stiffness;
+	f64 length;
+};
+
+// NOTE: harmonic in the cosine, 0.5 stiffness (cos(angle) - cos(restAngle))^2, which needs no inverse trig
+struct AngleStyle {
+	f64 stiffness;
+	f64 restAngle;
+	f64 restCosine;
+};
+
+struct Bond {
+	int a;
+	int b;
+	int style;
+};
+
+// NOTE: the angle at vertex, between the bonds to a and to c
+struct Angle {
+	int a;
+	int vertex;
+	int c;
+	int style;
+};
+
+struct BondTopology {
+	BondStyle bondStyles[maxBondStyleCount];
+	int bondStyleCount;
+	AngleStyle angleStyles[maxBondStyleCount];
+	int angleStyleCount;
+
+	Bond* bonds;
+	int bondCount;
+	int bondCapacity;
+
+	Angle* angles;
+	int angleCount;
+	int angleCapacity;
+
+	// ! rows, rebuilt from the lists by updateBondRows
+
+	bool isDirty;
+	int rowCount;
+	int rowCapacity;
+	// NOTE: the bonds of particle p are bondPartners[bondStarts[p]] up to bondPartners[bondStarts[p + 1]],
+	// with their styles in bondRowStyles, and its angles are the ones listed in angleRows from angleStarts[p]
+	int* bondStarts;
+	int* bondPartners;
+	int* bondRowStyles;
+	int bondEntryCapacity;
+	int* angleStarts;
+	int* angleRows;
+	int angleEntryCapacity;
+
+	// NOTE: how many times a bond was found stretched past feneMaxStretch, over all the force passes
+	// since this was last cleared. A run that is set up well never gets there, so anything but zero means
+	// the time step or the start is too rough for its FENE bonds.
+	volatile s32 overStretchedBondCount;
+};
+
+int
+addBondStyle(BondTopology* topology, BondType type, f64 stiffness, f64 length)
+{
+	assert(topology->bondStyleCount < maxBondStyleCount);
+	int styleIndex = topology->bondStyleCount++;
+	BondStyle* style = topology->bondStyles + styleIndex;
+	style->type = type;
+	style->stiffness = stiffness;
+	style->length = length;
+	return styleIndex;
+}
+
+int
+addAngleStyle(BondTopology* topology, f64 stiffness, f64 restAngle)
+{
+	assert(topology->angleStyleCount < maxBondStyleCount);
+	int styleIndex = topology->angleStyleCount++;
+	AngleStyle* style = topology->angleStyles + styleIndex;
+	style->stiffness = stiffness;
+	style->restAngle = restAngle;
+	style->restCosine = cos(restAngle);
+	return styleIndex;
+}
+
+void
+addBond(BondTopology* topology, int a, int b, int style)
+{
+	assert((a != b) && (a >= 0) && (b >= 0));
+	assert((style >= 0) && (style < topology->bondStyleCount));
+
+	if (topology->bondCount == topology->bondCapacity)
+	{
+		topology->bondCapacity = atLeast(64, 2 * topology->bondCapacity);
+		topology->bonds = (Bond*) realloc(topology->bonds, topology->bondCapacity * sizeof(Bond));
+	}
+	topology->bonds[topology->bondCount++] = {a, b, style};
+	topology->isDirty = true;
+}
+
+void
+addAngle(BondTopology* topology, int a, int vertex, int c, int style)
+{
+	assert((a != vertex) && (c != vertex) && (a != c));
+	assert((style >= 0) && (style < topology->angleStyleCount));
+
+	if (topology->angleCount == topology->angleCapacity)
+	{
+		topology->angleCapacity = atLeast(64, 2 * topology->angleCapacity);
+		topology->angles = (Angle*) realloc(topology->angles, topology->angleCapacity * sizeof(Angle));
+	}
+	topology->angles[topology->angleCount++] = {a, vertex, c, style};
+	topology->isDirty = true;
+}
+
+inline bool
+hasBondedTerms(BondTopology* topology)
+{
+	return (topology->bondCount > 0) || (topology->angleCount > 0);
+}
+
+// NOTE: newFromOld has the new index of every old one, or -1 for a particle that is gone,
+// and the bonds and angles of the particles that are gone go with them
+void
+remapBondTopology(BondTopology* topology, const int* newFromOld)
+{
+	int keptBondCount = 0;
+	for (int bondIndex = 0; bondIndex < topology->bondCount; ++bondIndex)
+	{
+		Bond bond = topology->bonds[bondIndex];
+		bond.a = newFromOld[bond.a];
+		bond.b = newFromOld[bond.b];
+		if ((bond.a >= 0) && (bond.b >= 0))
+		{
+			topology->bonds[keptBondCount++] = bond;
+		}
+	}
+	topology->bondCount = keptBondCount;
+
+	int keptAngleCount = 0;
+	for (int angleIndex = 0; angleIndex < topology->angleCount; ++angleIndex)
+	{
+		Angle angle = topology->angles[angleIndex];
+		angle.a = newFromOld[angle.a];
+		angle.vertex = newFromOld[angle.vertex];
+		angle.c = newFromOld[angle.c];
+		if ((angle.a >= 0) && (angle.vertex >= 0) && (angle.c >= 0))
+		{
+			topology->angles[keptAngleCount++] = angle;
+		}
+	}
+	topology->angleCount = keptAngleCount;
+	topology->isDirty = true;
+}
+
+// NOTE: drops the bonds and angles of the particles from particleCount on, for when the array shrinks
+void
+trimBondTopology(BondTopology* topology, int particleCount)
+{
+	int keptBondCount = 0;
+	for (int bondIndex = 0; bondIndex < topology->bondCount; ++bondIndex)
+	{
+		Bond bond = topology->bonds[bondIndex];
+		if ((bond.a < particleCount) && (bond.b < particleCount))
+		{
+			topology->bonds[keptBondCount++] = bond;
+		}
+	}
+
+	int keptAngleCount = 0;
+	for (int angleIndex = 0; angleIndex < topology->angleCount; ++angleIndex)
+	{
+		Angle angle = topology->angles[angleIndex];
+		if ((angle.a < particleCount) && (angle.vertex < particleCount) && (angle.c < particleCount))
+		{
+			topology->angles[keptAngleCount++] = angle;
+		}
+	}
+
+	topology->isDirty |= (keptBondCount != topology->bondCount) || (keptAngleCount != topology->angleCount);
+	topology->bondCount = keptBondCount;
+	topology->angleCount = keptAngleCount;
+}
+
+// NOTE: counts the entries per row into starts[p + 1], and turns that into where each row starts
+void
+prefixSumRowStarts(int* starts, int rowCount)
+{
+	starts[0] = 0;
+	for (int row = 0; row < rowCount; ++row)
+	{
+		starts[row + 1] += starts[row];
+	}
+}
+
+// NOTE: a counting sort of the lists into the rows, in list order within each row,
+// only when the lists or the particle count changed
+void
+updateBondRows(BondTopology* topology, int particleCount)
+{
+	if (!topology->isDirty && (topology->rowCount == particleCount)) return;
+
+	if (!topology->bondStarts || (particleCount > topology->rowCapacity))
+	{
+		topology->rowCapacity = atLeast(64, 2 * particleCount);
+		topology->bondStarts = (int*) realloc(topology->bondStarts, (topology->rowCapacity + 1) * sizeof(int));
+		topology->angleStarts = (int*) realloc(topology->angleStarts, (topology->rowCapacity + 1) * sizeof(int));
+	}
+	if (2 * topology->bondCount > topology->bondEntryCapacity)
+	{
+		topology->bondEntryCapacity = 4 * topology->bondCount;
+		topology->bondPartners = (int*) realloc(topology->bondPartners, topology->bondEntryCapacity * sizeof(int));
+		topology->bondRowStyles = (int*) realloc(topology->bondRowStyles, topology->bondEntryCapacity * sizeof(int));
+	}
+	if (3 * topology->angleCount > topology->angleEntryCapacity)
+	{
+		topology->angleEntryCapacity = 6 * topology->angleCount;
+		topology->angleRows = (int*) realloc(topology->angleRows, topology->angleEntryCapacity * sizeof(int));
+	}
+	topology->rowCount = particleCount;
+	topology->isDirty = false;
+
+	int* bondStarts = topology->bondStarts;
+	memset(bondStarts, 0, (particleCount + 1) * sizeof(int));
+	for (int bondIndex = 0; bondIndex < topology->bondCount; ++bondIndex)
+	{
+		Bond* bond = topology->bonds + bondIndex;
+		assert((bond->a < particleCount) && (bond->b < particleCount));
+		bondStarts[bond->a + 1]++;
+		bondStarts[bond->b + 1]++;
+	}
+	prefixSumRowStarts(bondStarts, particleCount);
+
+	// NOTE: fills each row from its start, which leaves the starts shifted by one row, so shift them back
+	for (int bondIndex = 0; bondIndex < topology->bondCount; ++bondIndex)
+	{
+		Bond* bond = topology->bonds + bondIndex;
+		int entryA = bondStarts[bond->a]++;
+		topology->bondPartners[entryA] = bond->b;
+		topology->bondRowStyles[entryA] = bond->style;
+		int entryB = bondStarts[bond->b]++;
+		topology->bondPartners[entryB] = bond->a;
+		topology->bondRowStyles[entryB] = bond->style;
+	}
+	memmove(bondStarts + 1, bondStarts, particleCount * sizeof(int));
+	bondStarts[0] = 0;
+
+	int* angleStarts = topology->angleStarts;
+	memset(angleStarts, 0, (particleCount + 1) * sizeof(int));
+	for (int angleIndex = 0; angleIndex < topology->angleCount; ++angleIndex)
+	{
+		Angle* angle = topology->angles + angleIndex;
+		assert((angle->a < particleCount) && (angle->vertex < particleCount) && (angle->c < particleCount));
+		angleStarts[angle->a + 1]++;
+		angleStarts[angle->vertex + 1]++;
+		angleStarts[angle->c + 1]++;
+	}
+	prefixSumRowStarts(angleStarts, particleCount);
+
+	for (int angleIndex = 0; angleIndex < topology->angleCount; ++angleIndex)
+	{
+		Angle* angle = topology->angles + angleIndex;
+		topology->angleRows[angleStarts[angle->a]++] = angleIndex;
+		topology->angleRows[angleStarts[angle->vertex]++] = angleIndex;
+		topology->angleRows[angleStarts[angle->c]++] = angleIndex;
+	}
+	memmove(angleStarts + 1, angleStarts, particleCount * sizeof(int));
+	angleStarts[0] = 0;
+}
+
+inline bool
+isInBondRow(int* partnersBegin, int* partnersEnd, int particleIndex)
+{
+	for (int* partner = partnersBegin; partner < partnersEnd; ++partner)
+	{
+		if (*partner == particleIndex) return true;
+	}
+	return false;
+}
+
+//
+// Bonded forces
+//
+
+// NOTE: past this stretch (in r^2 / length^2) a FENE bond goes on along its tangent in r^2 rather than
+// breaking the step, so the force stops growing faster and the energy still matches it
+#define feneMaxStretch 0.98
+
+// NOTE: the force on a is forceFactor * (b - a)
+struct BondForce {
+	f64 energy;
+	f64 forceFactor;
+	bool isOverStretched;
+};
+
+inline BondForce
+evaluateBond(BondStyle* style, f64 quadrance)
+{
+	BondForce result = {};
+	switch (style->type)
+	{
+		case BondType_Harmonic:
+		{
+			f64 distance = sqrt(quadrance);
+			f64 stretch = distance - style->length;
+			result.energy = 0.5 * style->stiffness * square(stretch);
+			result.forceFactor = (distance > 0) ? style->stiffness * stretch / distance : 0;
+		} break;
+		case BondType_Fene:
+		{
+			f64 squaredLength = square(style->length);
+			f64 stretch = quadrance / squaredLength;
+			result.isOverStretched = (stretch > feneMaxStretch);
+			if (result.isOverStretched)
+			{
+				// NOTE: forceFactor is twice the slope of the energy in r^2, so it stays constant from here on
+				f64 maxQuadrance = feneMaxStretch * squaredLength;
+				result.forceFactor = style->stiffness / (1 - feneMaxStretch);
+				result.energy = -0.5 * style->stiffness * squaredLength * log(1 - feneMaxStretch) +
+					0.5 * result.forceFactor * (quadrance - maxQuadrance);
+			}
+			else
+			{
+				result.energy = -0.5 * style->stiffness * squaredLength * log(1 - stretch);
+				result.forceFactor = style->stiffness / (1 - stretch);
+			}
+		} break;
+		default: invalidCodePath;
+	}
+	return result;
+}
+
+// NOTE: the forces on the ends of an angle, from the vectors from the vertex to them,
+// the force on the vertex being minus their sum
+struct AngleForce {
+	f64 energy;
+	f64 forceAX;
+	f64 forceAY;
+	f64 forceCX;
+	f64 forceCY;
+};
+
+inline AngleForce
+evaluateAngle(AngleStyle* style, f64 fromVertexAX, f64 fromVertexAY, f64 fromVertexCX, f64 fromVertexCY)
+{
+	AngleForce result = {};
+	f64 quadranceA = square(fromVertexAX) + square(fromVertexAY);
+	f64 quadranceC = square(fromVertexCX) + square(fromVertexCY);
+	if ((quadranceA == 0) || (quadranceC == 0)) return result;
+
+	f64 invLengths = 1 / sqrt(quadranceA * quadranceC);
+	f64 cosine = (fromVertexAX * fromVertexCX + fromVertexAY * fromVertexCY) * invLengths;
+	f64 deviation = cosine - style->restCosine;
+	result.energy = 0.5 * style->stiffness * square(deviation);
+
+	// NOTE: minus the derivative of the energy by the cosine, times that of the cosine by each end
+	f64 slope = -style->stiffness * deviation;
+	f64 cosineOverA = cosine / quadranceA;
+	f64 cosineOverC = cosine / quadranceC;
+	result.forceAX = slope * (fromVertexCX * invLengths - fromVertexAX * cosineOverA);
+	result.forceAY = slope * (fromVertexCY * invLengths - fromVertexAY * cosineOverA);
+	result.forceCX = slope * (fromVertexAX * invLengths - fromVertexCX * cosineOverC);
+	result.forceCY = slope * (fromVertexAY * invLengths - fromVertexCY * cosineOverC);
+	return result;
+}
+
+void
+freeBondTopology(BondTopology* topology)
+{
+	free(topology->bonds);
+	free(topology->angles);
+	free(topology->bondStarts);
+	free(topology->bondPartners);
+	free(topology->bondRowStyles);
+	free(topology->angleStarts);
+	free(topology->angleRows);
+	*topology = {};
+}
+
+#endif
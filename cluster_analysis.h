@@ -0,0 +1,237 @@
+#ifndef cluster_analysis_h
+#define cluster_analysis_h
+
+#include "particle_simulation.h"
+#include "threading.h"
+
+// NOTE: two particles are in the same cluster if they are connected by a chain of
+// particles that are all closer than bondDistance to the next one
+
+struct ClusterAnalysis {
+	f64 bondDistance;
+
+	// per particle
+	int* labels;
+	volatile s32* parents;
+	int particleCapacity;
+
+	// per cluster, indexed by label
+	int* clusterSizes;
+	int clusterCount;
+	int largestClusterLabel;
+};
+
+//
+// Concurrent union-find
+//
+
+// NOTE: links only ever go from a larger index to a smaller one, so the root of a set
+// is its smallest index and concurrent unions can't create cycles
+
+s32
+findRoot(volatile s32* parents, s32 index)
+{
+	while (true)
+	{
+		s32 parent = parents[index];
+		if (parent == index)
+		{
+			return index;
+		}
+		s32 grandparent = parents[parent];
+		if (parent != grandparent)
+		{
+			// path halving, if someone else got here first that is fine too
+			atomicCompareExchange(parents + index, parent, grandparent);
+		}
+		index = grandparent;
+	}
+}
+
+void
+unite(volatile s32* parents, s32 a, s32 b)
+{
+	while (true)
+	{
+		a = findRoot(parents, a);
+		b = findRoot(parents, b);
+		if (a == b)
+		{
+			return;
+		}
+		if (a < b)
+		{
+			s32 temp = a;
+			a = b;
+			b = temp;
+		}
+		// NOTE: only link a if it is still a root, otherwise retry from the new roots
+		if (atomicCompareExchange(parents + a, a, b) == a)
+		{
+			return;
+		}
+	}
+}
+
+//
+// Cluster analysis
+//
+
+struct ClusterJob {
+	Simulation* simulation;
+	ClusterAnalysis* analysis;
+};
+
+void
+resetClusterParents(void* data, int startIndex, int endIndex)
+{
+	ClusterJob* job = (ClusterJob*)data;
+	for (int particleIndex = startIndex; particleIndex < endIndex; ++particleIndex)
+	{
+		job->analysis->parents[particleIndex] = particleIndex;
+	}
+}
+
+void
+uniteNearbyParticles(void* data, int startIndex, int endIndex)
+{
+	ClusterJob* job = (ClusterJob*)data;
+	Simulation* simulation = job->simulation;
+	ClusterAnalysis* analysis = job->analysis;
+
+	f64 squaredBondDistance = square(analysis->bondDistance);
+	int gridRadius = ceil(analysis->bondDistance / min(simulation->gridCellWidth, simulation->gridCellHeight));
+
+	for (int particleIndex = startIndex; particleIndex < endIndex; ++particleIndex)
+	{
+		Particle* particle = simulation->particles + particleIndex;
+
+		for (int y = -gridRadius; y <= gridRadius; ++y)
+		{
+			int row = mod(particle->gridRow + y, simulation->gridRowCount);
+			int rowIndex = row * simulation->gridColCount;
+			for (int x = -gridRadius; x <= gridRadius; ++x)
+			{
+				int col = mod(particle->gridCol + x, simulation->gridColCount);
+				Particle* otherParticle = simulation->particleGrid[rowIndex + col];
+				if (otherParticle && (otherParticle < particle))
+				{
+					V2 relativePosition = otherParticle->position - particle->position;
+					relativePosition = periodize(relativePosition, simulation->boxWidth, simulation->boxHeight);
+					if (square(relativePosition) < squaredBondDistance)
+					{
+						unite(analysis->parents, particleIndex, otherParticle - simulation->particles);
+					}
+				}
+			}
+		}
+	}
+}
+
+void
+flattenClusterParents(void* data, int startIndex, int endIndex)
+{
+	ClusterJob* job = (ClusterJob*)data;
+	for (int particleIndex = startIndex; particleIndex < endIndex; ++particleIndex)
+	{
+		job->analysis->parents[particleIndex] = findRoot(job->analysis->parents, particleIndex);
+	}
+}
+
+// NOTE: bins the particles into the grid itself, since the grid from the last step is out of date after the
+// event-driven engine moved them, and points at freed particles after any were added or removed
+void
+analyzeClusters(Simulation* simulation, ClusterAnalysis* analysis)
+{
+	int particleCount = simulation->particleCount;
+	clearGrid(simulation);
+	for (int particleIndex = 0; particleIndex < particleCount; ++particleIndex)
+	{
+		putParticleInGrid(simulation, simulation->particles + particleIndex);
+	}
+
+	if (analysis->particleCapacity < particleCount)
+	{
+		analysis->particleCapacity = particleCount;
+		analysis->labels = (int*) realloc(analysis->labels, particleCount * sizeof(int));
+		analysis->clusterSizes = (int*) realloc(analysis->clusterSizes, particleCount * sizeof(int));
+		analysis->parents = (volatile s32*) realloc((void*) analysis->parents, particleCount * sizeof(s32));
+	}
+
+	if (analysis->bondDistance <= 0)
+	{
+		// NOTE: a bit beyond the potential minimum, so vibrating neighbors stay connected
+		analysis->bondDistance = 1.5 * simulation->separation;
+	}
+
+	ClusterJob job = {simulation, analysis};
+	int chunkSize = 256;
+	parallelFor(particleCount, chunkSize, resetClusterParents, &job);
+	parallelFor(particleCount, chunkSize, uniteNearbyParticles, &job);
+	parallelFor(particleCount, chunkSize, flattenClusterParents, &job);
+
+	// NOTE: roots come before the rest of their cluster, so one serial pass can hand out
+	// labels in order of each cluster's first particle
+	analysis->clusterCount = 0;
+	analysis->largestClusterLabel = -1;
+	for (int particleIndex = 0; particleIndex < particleCount; ++particleIndex)
+	{
+		int root = analysis->parents[particleIndex];
+		int label;
+		if (root == particleIndex)
+		{
+			label = analysis->clusterCount++;
+			analysis->clusterSizes[label] = 0;
+		}
+		else
+		{
+			label = analysis->labels[root];
+		}
+		analysis->labels[particleIndex] = label;
+		analysis->clusterSizes[label]++;
+	}
+
+	int largestClusterSize = 0;
+	for (int label = 0; label < analysis->clusterCount; ++label)
+	{
+		if (analysis->clusterSizes[label] > largestClusterSize)
+		{
+			largestClusterSize = analysis->clusterSizes[label];
+			analysis->largestClusterLabel = label;
+		}
+	}
+}
+
+Color4
+clusterColor(ClusterAnalysis* analysis, int particleIndex)
+{
+	int label = analysis->labels[particleIndex];
+	if (label == analysis->largestClusterLabel)
+	{
+		return c4(0.8, 0.3, 0, 1);
+	}
+	if (analysis->clusterSizes[label] == 1)
+	{
+		// lonely particles are gas
+		return c4(0.7, 0.7, 0.7, 1);
+	}
+
+	// scatter the other clusters around the color wheel
+	f32 hue = (label * 0.618034f) - floor(label * 0.618034f);
+	f32 angle = hue * tau;
+	f32 r = 0.5 + 0.4 * cos(angle);
+	f32 g = 0.5 + 0.4 * cos(angle - tau / 3);
+	f32 b = 0.5 + 0.4 * cos(angle + tau / 3);
+	return c4(r, g, b, 1);
+}
+
+void
+freeClusterAnalysis(ClusterAnalysis* analysis)
+{
+	free(analysis->labels);
+	free(analysis->clusterSizes);
+	free((void*) analysis->parents);
+	*analysis = {};
+}
+
+#endif
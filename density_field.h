@@ -0,0 +1,220 @@
+#ifndef density_field_h
+#define density_field_h
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "math_stuff.h"
+#include "threading.h"
+
+// NOTE: what the drawing needs, copied out before the simulation moves on,
+// so the frame can be built while the next step runs
+struct FrameParticle {
+	V2 position;
+	f64 radius;
+	Color4 color;
+};
+
+// NOTE: with more particles in view than the window has pixels, a disc per particle is mostly wasted work.
+// Instead the particles are binned into an image of the view, one texel per pixel, where every texel gets
+// the mean color of its particles and an opacity from how much of it their discs would cover.
+// Binning the particles by row is a counting sort over chunks of them, and the rows are then filled in parallel,
+// so the cost is the particle count once plus the pixel count, however many discs overlap.
+struct DensityField {
+	int width;
+	int height;
+
+	// NOTE: the world rectangle the image covers, its first row is the bottom one
+	V2 lowerLeft;
+	f32 texelsPerUnitX;
+	f32 texelsPerUnitY;
+
+	FrameParticle* particles;
+	// NOTE: the particles of row r are rowParticles[rowStarts[r]] up to rowParticles[rowStarts[r + 1]]
+	int* rowStarts;
+	int* rowParticles;
+	int* particleRows;
+	int particleCapacity;
+	int particleCount;
+
+	// NOTE: per chunk of particles, how many of them are in each row, and then where the chunk's part of
+	// each row starts, chunkRowCounts[chunk * height + row]
+	int* chunkRowCounts;
+	int chunkCount;
+	int chunkRowCapacity;
+
+	// RGBA, straight alpha
+	u8* texels;
+};
+
+void
+resizeDensityField(DensityField* field, int width, int height)
+{
+	if ((field->width == width) && (field->height == height)) return;
+
+	field->width = width;
+	field->height = height;
+	field->rowStarts = (int*) realloc(field->rowStarts, (height + 1) * sizeof(int));
+	field->texels = (u8*) realloc(field->texels, 4 * width * height);
+}
+
+#define densityBinChunkSize 16384
+
+inline void
+densityBinChunkRange(DensityField* field, int chunkIndex, int* startIndex, int* endIndex)
+{
+	*startIndex = (int) ((s64) field->particleCount * chunkIndex / field->chunkCount);
+	*endIndex = (int) ((s64) field->particleCount * (chunkIndex + 1) / field->chunkCount);
+}
+
+void
+countDensityRowsChunk(void* data, int startChunk, int endChunk)
+{
+	DensityField* field = (DensityField*)data;
+	for (int chunkIndex = startChunk; chunkIndex < endChunk; ++chunkIndex)
+	{
+		int* rowCounts = field->chunkRowCounts + chunkIndex * field->height;
+		memset(rowCounts, 0, field->height * sizeof(int));
+
+		int startIndex, endIndex;
+		densityBinChunkRange(field, chunkIndex, &startIndex, &endIndex);
+		for (int particleIndex = startIndex; particleIndex < endIndex; ++particleIndex)
+		{
+			V2 position = field->particles[particleIndex].position;
+			f32 u = (position.x - field->lowerLeft.x) * field->texelsPerUnitX;
+			f32 v = (position.y - field->lowerLeft.y) * field->texelsPerUnitY;
+			bool isInView = (u >= 0) && (u < field->width) && (v >= 0) && (v < field->height);
+
+			int row = isInView ? atMost(field->height - 1, (int) v) : -1;
+			field->particleRows[particleIndex] = row;
+			if (isInView) rowCounts[row]++;
+		}
+	}
+}
+
+// NOTE: every chunk goes over its particles in order, so the rows come out the same as sorting serially
+void
+scatterDensityRowsChunk(void* data, int startChunk, int endChunk)
+{
+	DensityField* field = (DensityField*)data;
+	for (int chunkIndex = startChunk; chunkIndex < endChunk; ++chunkIndex)
+	{
+		int* rowStarts = field->chunkRowCounts + chunkIndex * field->height;
+
+		int startIndex, endIndex;
+		densityBinChunkRange(field, chunkIndex, &startIndex, &endIndex);
+		for (int particleIndex = startIndex; particleIndex < endIndex; ++particleIndex)
+		{
+			int row = field->particleRows[particleIndex];
+			if (row >= 0) field->rowParticles[rowStarts[row]++] = particleIndex;
+		}
+	}
+}
+
+// NOTE: sorts the particles in the rectangle by row, the ones outside are left out.
+// The chunks count their rows in parallel, a prefix sum turns the counts into where each chunk's part
+// of each row starts, and then the chunks put their particles there in parallel.
+void
+binDensityField(DensityField* field, FrameParticle* particles, int particleCount, V2 lowerLeft, V2 upperRight)
+{
+	field->particles = particles;
+	field->particleCount = particleCount;
+	field->lowerLeft = lowerLeft;
+	field->texelsPerUnitX = field->width / (upperRight.x - lowerLeft.x);
+	field->texelsPerUnitY = field->height / (upperRight.y - lowerLeft.y);
+
+	if (particleCount > field->particleCapacity)
+	{
+		field->particleCapacity = 2 * particleCount;
+		field->rowParticles = (int*) realloc(field->rowParticles, field->particleCapacity * sizeof(int));
+		field->particleRows = (int*) realloc(field->particleRows, field->particleCapacity * sizeof(int));
+	}
+
+	field->chunkCount = atLeast(1, atMost(maxThreadCount, (particleCount + densityBinChunkSize - 1) / densityBinChunkSize));
+	int chunkRowCount = field->chunkCount * field->height;
+	if (chunkRowCount > field->chunkRowCapacity)
+	{
+		field->chunkRowCapacity = chunkRowCount;
+		field->chunkRowCounts = (int*) realloc(field->chunkRowCounts, chunkRowCount * sizeof(int));
+	}
+
+	parallelFor(field->chunkCount, 1, countDensityRowsChunk, field);
+
+	int start = 0;
+	for (int row = 0; row < field->height; ++row)
+	{
+		field->rowStarts[row] = start;
+		for (int chunkIndex = 0; chunkIndex < field->chunkCount; ++chunkIndex)
+		{
+			int* chunkRowCount = field->chunkRowCounts + chunkIndex * field->height + row;
+			int count = *chunkRowCount;
+			*chunkRowCount = start;
+			start += count;
+		}
+	}
+	field->rowStarts[field->height] = start;
+
+	parallelFor(field->chunkCount, 1, scatterDensityRowsChunk, field);
+}
+
+// NOTE: a ParallelForCallback over the rows, each row only writes its own texels
+void
+densityFieldRowChunk(void* data, int startRow, int endRow)
+{
+	DensityField* field = (DensityField*)data;
+	int width = field->width;
+	f32 texelArea = field->texelsPerUnitX * field->texelsPerUnitY;
+
+	// coverage, then coverage weighted red, green and blue
+	f32* sums = allocArray(f32, 4 * width);
+
+	for (int row = startRow; row < endRow; ++row)
+	{
+		memset(sums, 0, 4 * width * sizeof(f32));
+
+		for (int orderIndex = field->rowStarts[row]; orderIndex < field->rowStarts[row + 1]; ++orderIndex)
+		{
+			FrameParticle* particle = field->particles + field->rowParticles[orderIndex];
+			int col = atMost(width - 1, (int) ((particle->position.x - field->lowerLeft.x) * field->texelsPerUnitX));
+
+			// NOTE: the share of the texel the disc would cover, more than one when it is bigger than the texel
+			f32 coverage = (f32) (0.5 * tau * square(particle->radius)) * texelArea * particle->color.a;
+			f32* texelSums = sums + 4 * col;
+			texelSums[0] += coverage;
+			texelSums[1] += coverage * particle->color.r;
+			texelSums[2] += coverage * particle->color.g;
+			texelSums[3] += coverage * particle->color.b;
+		}
+
+		u8* texel = field->texels + 4 * width * row;
+		for (int col = 0; col < width; ++col)
+		{
+			f32* texelSums = sums + 4 * col;
+			f32 coverage = texelSums[0];
+			f32 invCoverage = (coverage > 0) ? 1 / coverage : 0;
+
+			// NOTE: randomly placed discs leave exp(-coverage) of the texel uncovered
+			texel[0] = (u8) (255 * texelSums[1] * invCoverage + 0.5f);
+			texel[1] = (u8) (255 * texelSums[2] * invCoverage + 0.5f);
+			texel[2] = (u8) (255 * texelSums[3] * invCoverage + 0.5f);
+			texel[3] = (u8) (255 * (1 - expf(-coverage)) + 0.5f);
+			texel += 4;
+		}
+	}
+
+	free(sums);
+}
+
+void
+freeDensityField(DensityField* field)
+{
+	free(field->rowStarts);
+	free(field->rowParticles);
+	free(field->particleRows);
+	free(field->chunkRowCounts);
+	free(field->texels);
+	*field = {};
+}
+
+#endif
@@ -0,0 +1,674 @@
+#ifndef domain_decomposition_h
+#define domain_decomposition_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "particle_simulation.h"
+#include "threading.h"
+
+// NOTE: the periodic box cut into vertical slabs, one per process (a rank). Each rank only steps the
+// particles it owns, and sees the particles near its edges as ghosts copied from its neighbors.
+// Every step, particles that drifted out of a slab move to the neighbor, and the ghosts are sent again.
+//
+// Positions stay in box coordinates everywhere, so a ghost from across the periodic edge is found by the
+// same periodize as in a single process, and the grid has the same cells on every rank. The forces are
+// summed per particle in stencil order (the full stencil), and the noise comes from per particle streams,
+// so the trajectories are the same as a single process run with isUsingFullStencil.
+//
+// Walls work, since they only touch the particle that hits them. Dragging, long range forces and
+// multiple or adaptive time steps don't: they would need all ranks to agree on something every step.
+
+//
+// Transport
+//
+
+// NOTE: a growable byte buffer, what the transport sends and receives
+struct DomainBuffer {
+	u8* bytes;
+	int byteCount;
+	int capacity;
+};
+
+struct DomainTransport;
+
+// NOTE: sends outgoing to the other rank and receives what the other rank sends us in the same call,
+// so two ranks that exchange with each other at the same time can't block each other
+typedef bool DomainExchange(DomainTransport* transport, int otherRank, DomainBuffer* outgoing, DomainBuffer* incoming);
+typedef void DomainTransportClose(DomainTransport* transport);
+
+struct DomainTransport {
+	int rank;
+	int rankCount;
+
+	DomainExchange* exchange;
+	DomainTransportClose* close;
+	void* data;
+};
+
+void
+reserveDomainBuffer(DomainBuffer* buffer, int capacity)
+{
+	if (capacity > buffer->capacity)
+	{
+		buffer->capacity = atLeast(2 * buffer->capacity, capacity);
+		buffer->bytes = (u8*) realloc(buffer->bytes, buffer->capacity);
+	}
+}
+
+void
+appendToDomainBuffer(DomainBuffer* buffer, void* bytes, int byteCount)
+{
+	reserveDomainBuffer(buffer, buffer->byteCount + byteCount);
+	memcpy(buffer->bytes + buffer->byteCount, bytes, byteCount);
+	buffer->byteCount += byteCount;
+}
+
+void
+freeDomainBuffer(DomainBuffer* buffer)
+{
+	free(buffer->bytes);
+	*buffer = {};
+}
+
+//
+// Unix socket transport
+//
+
+// NOTE: one process per rank on this machine, forked from the calling one, with a socket pair
+// between every two ranks. Rank 0 is the calling process.
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define HAS_SOCKET_TRANSPORT 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define maxDomainRankCount 64
+
+struct SocketTransport {
+	// per other rank, -1 for our own
+	int sockets[maxDomainRankCount];
+	pid_t children[maxDomainRankCount];
+};
+
+// NOTE: writes the byte count and the bytes while reading the other side's, whichever can make progress
+bool
+exchangeOverSocket(DomainTransport* transport, int otherRank, DomainBuffer* outgoing, DomainBuffer* incoming)
+{
+	SocketTransport* sockets = (SocketTransport*)transport->data;
+	int socket = sockets->sockets[otherRank];
+
+	s32 outgoingCount = outgoing->byteCount;
+	s32 incomingCount = -1;
+	int written = 0;
+	int read = 0;
+	int headerSize = sizeof(s32);
+
+	while ((written < headerSize + outgoingCount) || (incomingCount < 0) || (read < headerSize + incomingCount))
+	{
+		pollfd poller = {};
+		poller.fd = socket;
+		if (written < headerSize + outgoingCount) poller.events |= POLLOUT;
+		if ((incomingCount < 0) || (read < headerSize + incomingCount)) poller.events |= POLLIN;
+		if (poll(&poller, 1, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			perror("poll");
+			return false;
+		}
+
+		if (poller.revents & POLLOUT)
+		{
+			ssize_t result;
+			if (written < headerSize)
+			{
+				result = write(socket, (u8*)&outgoingCount + written, headerSize - written);
+			}
+			else
+			{
+				result = write(socket, outgoing->bytes + written - headerSize, outgoingCount - (written - headerSize));
+			}
+			if ((result < 0) && (errno != EAGAIN) && (errno != EINTR))
+			{
+				perror("write");
+				return false;
+			}
+			written += atLeast(0, (int) result);
+		}
+
+		if (poller.revents & POLLIN)
+		{
+			ssize_t result;
+			if (read < headerSize)
+			{
+				result = ::read(socket, (u8*)&incomingCount + read, headerSize - read);
+			}
+			else
+			{
+				result = ::read(socket, incoming->bytes + read - headerSize, incomingCount - (read - headerSize));
+			}
+			if (result == 0)
+			{
+				fprintf(stderr, "Rank %d hung up on rank %d.\n", otherRank, transport->rank);
+				return false;
+			}
+			if ((result < 0) && (errno != EAGAIN) && (errno != EINTR))
+			{
+				perror("read");
+				return false;
+			}
+			read += atLeast(0, (int) result);
+
+			if (read == headerSize)
+			{
+				reserveDomainBuffer(incoming, incomingCount);
+				incoming->byteCount = incomingCount;
+			}
+		}
+		else if (poller.revents & (POLLERR | POLLHUP))
+		{
+			fprintf(stderr, "Lost the connection between rank %d and rank %d.\n", transport->rank, otherRank);
+			return false;
+		}
+	}
+	return true;
+}
+
+void
+closeSocketTransport(DomainTransport* transport)
+{
+	SocketTransport* sockets = (SocketTransport*)transport->data;
+	for (int rank = 0; rank < transport->rankCount; ++rank)
+	{
+		if (sockets->sockets[rank] >= 0)
+		{
+			close(sockets->sockets[rank]);
+		}
+	}
+
+	if (transport->rank == 0)
+	{
+		for (int rank = 1; rank < transport->rankCount; ++rank)
+		{
+			waitpid(sockets->children[rank], 0, 0);
+		}
+		free(sockets);
+		*transport = {};
+	}
+	else
+	{
+		// NOTE: the child is a copy of the caller, which mustn't go on running the caller's code
+		fflush(0);
+		_exit(0);
+	}
+}
+
+// NOTE: returns in every rank's process with transport->rank set, rank 0 being the caller.
+// The children start out as copies of the caller, simulation and all.
+bool
+forkSocketTransport(DomainTransport* transport, int rankCount)
+{
+	*transport = {};
+	rankCount = atLeast(1, atMost(maxDomainRankCount, rankCount));
+
+	SocketTransport* sockets = allocArray(SocketTransport, 1);
+	*sockets = {};
+	int pairs[maxDomainRankCount][maxDomainRankCount][2];
+	for (int rank = 0; rank < rankCount; ++rank)
+	{
+		for (int otherRank = rank + 1; otherRank < rankCount; ++otherRank)
+		{
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[rank][otherRank]) != 0)
+			{
+				perror("socketpair");
+				free(sockets);
+				return false;
+			}
+		}
+	}
+
+	// NOTE: or the children print whatever the caller hasn't flushed yet, again
+	fflush(0);
+
+	int ownRank = 0;
+	for (int rank = 1; rank < rankCount; ++rank)
+	{
+		pid_t pid = fork();
+		if (pid < 0)
+		{
+			perror("fork");
+			return false;
+		}
+		if (pid == 0)
+		{
+			ownRank = rank;
+			// NOTE: the pool's threads stayed behind in the parent, so this process starts its own when needed
+			globalThreadPool = {};
+			break;
+		}
+		sockets->children[rank] = pid;
+	}
+
+	for (int rank = 0; rank < rankCount; ++rank)
+	{
+		sockets->sockets[rank] = -1;
+	}
+	for (int rank = 0; rank < rankCount; ++rank)
+	{
+		for (int otherRank = rank + 1; otherRank < rankCount; ++otherRank)
+		{
+			if (rank == ownRank)
+			{
+				sockets->sockets[otherRank] = pairs[rank][otherRank][0];
+				close(pairs[rank][otherRank][1]);
+			}
+			else if (otherRank == ownRank)
+			{
+				sockets->sockets[rank] = pairs[rank][otherRank][1];
+				close(pairs[rank][otherRank][0]);
+			}
+			else
+			{
+				close(pairs[rank][otherRank][0]);
+				close(pairs[rank][otherRank][1]);
+			}
+		}
+	}
+	for (int rank = 0; rank < rankCount; ++rank)
+	{
+		if (sockets->sockets[rank] >= 0)
+		{
+			fcntl(sockets->sockets[rank], F_SETFL, fcntl(sockets->sockets[rank], F_GETFL) | O_NONBLOCK);
+		}
+	}
+
+	transport->rank = ownRank;
+	transport->rankCount = rankCount;
+	transport->exchange = exchangeOverSocket;
+	transport->close = closeSocketTransport;
+	transport->data = sockets;
+	return true;
+}
+
+#else
+#define HAS_SOCKET_TRANSPORT 0
+#endif
+
+//
+// Domains
+//
+
+// NOTE: what goes over the wire for a particle, the id being its index in the whole system
+struct DomainRecord {
+	int id;
+	Particle particle;
+};
+
+struct Domain {
+	DomainTransport* transport;
+
+	// NOTE: the owned particles come first, the ghosts after them
+	Simulation simulation;
+	int ownedCount;
+	int* ids;
+	int idCapacity;
+
+	// owned x range
+	f64 left;
+	f64 slabWidth;
+	f64 haloWidth;
+
+	int leftRank;
+	int rightRank;
+
+	DomainBuffer outgoing;
+	DomainBuffer incoming;
+	int* binningOrder;
+};
+
+int
+domainRankOfPosition(Domain* domain, V2 position)
+{
+	f64 x = position.x + 0.5 * domain->simulation.boxWidth;
+	return atLeast(0, atMost(domain->transport->rankCount - 1, (int) floor(x / domain->slabWidth)));
+}
+
+void
+setDomainParticleCount(Domain* domain, int particleCount)
+{
+	if (particleCount > domain->idCapacity)
+	{
+		domain->idCapacity = atLeast(2 * domain->idCapacity, particleCount);
+		domain->ids = (int*) realloc(domain->ids, domain->idCapacity * sizeof(int));
+		domain->binningOrder = (int*) realloc(domain->binningOrder, domain->idCapacity * sizeof(int));
+		domain->simulation.particles = (Particle*) realloc(domain->simulation.particles, domain->idCapacity * sizeof(Particle));
+	}
+	domain->simulation.particleCount = particleCount;
+}
+
+// NOTE: takes over the simulation, which has to be the same on every rank, and keeps the particles in this rank's slab
+void
+initDomain(Domain* domain, Simulation* simulation, DomainTransport* transport)
+{
+	*domain = {};
+	domain->transport = transport;
+	domain->simulation = *simulation;
+	*simulation = {};
+
+	assert(domain->simulation.longRangeType == LongRangeType_None);
+	assert(!domain->simulation.isUsingMultipleTimeSteps && !domain->simulation.isUsingAdaptiveTimeStep);
+
+	updateInteractions(&domain->simulation);
+	if (domain->simulation.isUsingPotentialTables)
+	{
+		updatePotentialTables(&domain->simulation);
+	}
+
+	int rankCount = transport->rankCount;
+	domain->slabWidth = domain->simulation.boxWidth / rankCount;
+	domain->left = -0.5 * domain->simulation.boxWidth + transport->rank * domain->slabWidth;
+	domain->leftRank = mod(transport->rank - 1, rankCount);
+	domain->rightRank = mod(transport->rank + 1, rankCount);
+
+	// NOTE: everything in the cells the stencil looks at, plus a cell for particles that sit on a cell's edge
+	Simulation* local = &domain->simulation;
+	int gridRadius = ceil(local->interactionRange / min(local->gridCellWidth, local->gridCellHeight));
+	domain->haloWidth = (gridRadius + 2) * local->gridCellWidth;
+	assert((rankCount == 1) || (2 * domain->haloWidth <= domain->slabWidth));
+
+	int particleCount = local->particleCount;
+	setDomainParticleCount(domain, particleCount);
+	for (int particleIndex = 0; particleIndex < particleCount; ++particleIndex)
+	{
+		Particle* particle = local->particles + particleIndex;
+		if (domainRankOfPosition(domain, particle->position) == transport->rank)
+		{
+			local->particles[domain->ownedCount] = *particle;
+			domain->ids[domain->ownedCount] = particleIndex;
+			domain->ownedCount++;
+		}
+	}
+	local->particleCount = domain->ownedCount;
+}
+
+void
+appendDomainRecord(Domain* domain, DomainBuffer* buffer, int particleIndex)
+{
+	DomainRecord record;
+	record.id = domain->ids[particleIndex];
+	record.particle = domain->simulation.particles[particleIndex];
+	appendToDomainBuffer(buffer, &record, sizeof(record));
+}
+
+void
+addDomainRecords(Domain* domain, DomainBuffer* buffer)
+{
+	DomainRecord* records = (DomainRecord*) buffer->bytes;
+	int recordCount = buffer->byteCount / sizeof(DomainRecord);
+	int firstIndex = domain->simulation.particleCount;
+	setDomainParticleCount(domain, firstIndex + recordCount);
+	for (int recordIndex = 0; recordIndex < recordCount; ++recordIndex)
+	{
+		domain->simulation.particles[firstIndex + recordIndex] = records[recordIndex].particle;
+		domain->ids[firstIndex + recordIndex] = records[recordIndex].id;
+	}
+}
+
+// NOTE: the neighbors, each only once, since with two ranks the left one is also the right one.
+// Everyone goes through their neighbors from the lowest rank up, otherwise a ring of ranks that
+// each wait for their left neighbor would wait forever.
+int
+distinctDomainNeighbors(Domain* domain, int* neighbors)
+{
+	if (domain->transport->rankCount == 1) return 0;
+
+	int neighborCount = 0;
+	neighbors[neighborCount++] = min(domain->leftRank, domain->rightRank);
+	if (domain->rightRank != domain->leftRank)
+	{
+		neighbors[neighborCount++] = max(domain->leftRank, domain->rightRank);
+	}
+	return neighborCount;
+}
+
+// NOTE: owned particles that left the slab go to whoever owns them now, which is always a neighbor
+// since nothing gets anywhere near a slab's width in a step
+bool
+migrateDomainParticles(Domain* domain)
+{
+	int neighbors[2];
+	int neighborCount = distinctDomainNeighbors(domain, neighbors);
+	Simulation* simulation = &domain->simulation;
+
+	for (int neighborIndex = 0; neighborIndex < neighborCount; ++neighborIndex)
+	{
+		int neighbor = neighbors[neighborIndex];
+		domain->outgoing.byteCount = 0;
+
+		int keptCount = 0;
+		for (int particleIndex = 0; particleIndex < domain->ownedCount; ++particleIndex)
+		{
+			int rank = domainRankOfPosition(domain, simulation->particles[particleIndex].position);
+			if (rank == neighbor)
+			{
+				appendDomainRecord(domain, &domain->outgoing, particleIndex);
+			}
+			else
+			{
+				assert((rank == domain->transport->rank) || (neighborCount == 2));
+				simulation->particles[keptCount] = simulation->particles[particleIndex];
+				domain->ids[keptCount] = domain->ids[particleIndex];
+				keptCount++;
+			}
+		}
+		simulation->particleCount = keptCount;
+
+		if (!domain->transport->exchange(domain->transport, neighbor, &domain->outgoing, &domain->incoming))
+		{
+			return false;
+		}
+		addDomainRecords(domain, &domain->incoming);
+		domain->ownedCount = simulation->particleCount;
+	}
+	return true;
+}
+
+// NOTE: the owned particles near an edge are ghosts for the neighbor on that side.
+// Positions are periodic, so the left edge of rank 0 is next to the right edge of the last rank.
+bool
+exchangeDomainGhosts(Domain* domain)
+{
+	int neighbors[2];
+	int neighborCount = distinctDomainNeighbors(domain, neighbors);
+	Simulation* simulation = &domain->simulation;
+
+	for (int neighborIndex = 0; neighborIndex < neighborCount; ++neighborIndex)
+	{
+		int neighbor = neighbors[neighborIndex];
+		domain->outgoing.byteCount = 0;
+
+		for (int particleIndex = 0; particleIndex < domain->ownedCount; ++particleIndex)
+		{
+			f64 x = simulation->particles[particleIndex].position.x;
+			bool isNearLeft = (x - domain->left < domain->haloWidth);
+			bool isNearRight = (domain->left + domain->slabWidth - x < domain->haloWidth);
+			if ((isNearLeft && (neighbor == domain->leftRank)) || (isNearRight && (neighbor == domain->rightRank)))
+			{
+				appendDomainRecord(domain, &domain->outgoing, particleIndex);
+			}
+		}
+
+		if (!domain->transport->exchange(domain->transport, neighbor, &domain->outgoing, &domain->incoming))
+		{
+			return false;
+		}
+		addDomainRecords(domain, &domain->incoming);
+	}
+	return true;
+}
+
+global_variable int* sortingDomainIds;
+
+int
+compareDomainIds(const void* a, const void* b)
+{
+	return sortingDomainIds[*(int*)a] - sortingDomainIds[*(int*)b];
+}
+
+// NOTE: owned and ghosts in the order of their ids, which is the order a single process puts them in,
+// so when two particles land in the same cell, the same one wins. The cells were picked before the walls moved anyone.
+void
+binDomainParticles(Domain* domain)
+{
+	Simulation* simulation = &domain->simulation;
+	for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+	{
+		domain->binningOrder[particleIndex] = particleIndex;
+	}
+	sortingDomainIds = domain->ids;
+	qsort(domain->binningOrder, simulation->particleCount, sizeof(int), compareDomainIds);
+
+	clearGrid(simulation);
+	for (int orderIndex = 0; orderIndex < simulation->particleCount; ++orderIndex)
+	{
+		Particle* particle = simulation->particles + domain->binningOrder[orderIndex];
+		simulation->particleGrid[particle->gridRow * simulation->gridColCount + particle->gridCol] = particle;
+	}
+}
+
+// NOTE: singleTimeStep for the owned particles, with the exchanges in between
+bool
+domainTimeStep(Domain* domain, f32 viscosityFactor, f32 gaussianFactor, u64 noiseSeed)
+{
+	Simulation* simulation = &domain->simulation;
+	f64 dt = simulation->dt;
+
+	// ! first half
+
+	simulation->particleCount = domain->ownedCount;
+	clearGrid(simulation);
+	for (int particleIndex = 0; particleIndex < domain->ownedCount; ++particleIndex)
+	{
+		Particle* particle = simulation->particles + particleIndex;
+		int id = domain->ids[particleIndex];
+
+		RandomSeries random = randomSeries(noiseSeed, 2 * id);
+		applyLangevinNoise(&random, particle, simulation->temperature, viscosityFactor, gaussianFactor);
+		particle->velocity += 0.5 * dt * particle->acceleration;
+		particle->position += particle->velocity * dt;
+		particle->position = periodize(particle->position, simulation->boxWidth, simulation->boxHeight);
+
+		particle->acceleration = v2(0, -simulation->gravityStrength);
+		particle->potentialEnergy = 0;
+
+		putParticleInGrid(simulation, particle);
+	}
+
+	applyWallCollisions(simulation);
+
+	// ! exchange
+
+	if (!migrateDomainParticles(domain)) return false;
+	if (!exchangeDomainGhosts(domain)) return false;
+	binDomainParticles(domain);
+
+	// ! forces
+
+	PairLoop loop = {PairRange_All, 0, domain->ownedCount, true};
+	calculatePairForces(simulation, loop);
+
+	// ! second half
+
+	for (int particleIndex = 0; particleIndex < domain->ownedCount; ++particleIndex)
+	{
+		Particle* particle = simulation->particles + particleIndex;
+		int id = domain->ids[particleIndex];
+
+		particle->velocity += 0.5 * dt * particle->acceleration;
+		RandomSeries random = randomSeries(noiseSeed, 2 * id + 1);
+		applyLangevinNoise(&random, particle, simulation->temperature, viscosityFactor, gaussianFactor);
+
+		particle->kineticEnergy = 0.5 * particle->mass * square(particle->velocity);
+	}
+	return true;
+}
+
+// NOTE: like advanceSimulation, every rank has to call it with the same time
+bool
+advanceDomain(Domain* domain, f64 timeToSimulate)
+{
+	Simulation* simulation = &domain->simulation;
+	simulation->timeLeftToSimulate += timeToSimulate;
+
+	while (simulation->timeLeftToSimulate > simulation->dt) {
+		f64 dt = simulation->dt;
+		simulation->timeLeftToSimulate -= dt;
+		simulation->stepCount++;
+
+		f32 viscosityFactor = exp(-0.5 * simulation->viscosity * dt);
+		f32 gaussianFactor = sqrt(1 - square(viscosityFactor));
+
+		// NOTE: every rank draws the same seeds, since they all started from the same series
+		u64 noiseSeed = nextNoiseSeed(simulation);
+		if (!domainTimeStep(domain, viscosityFactor, gaussianFactor, noiseSeed)) return false;
+	}
+	simulation->particleCount = domain->ownedCount;
+	return true;
+}
+
+// NOTE: collects every rank's particles on rank 0, in their original order, into a simulation that
+// already has the right particle count. The other ranks leave it alone.
+bool
+gatherDomains(Domain* domain, Simulation* simulation)
+{
+	DomainTransport* transport = domain->transport;
+	domain->outgoing.byteCount = 0;
+	for (int particleIndex = 0; particleIndex < domain->ownedCount; ++particleIndex)
+	{
+		appendDomainRecord(domain, &domain->outgoing, particleIndex);
+	}
+
+	if (transport->rank != 0)
+	{
+		return transport->exchange(transport, 0, &domain->outgoing, &domain->incoming);
+	}
+
+	for (int rank = 0; rank < transport->rankCount; ++rank)
+	{
+		DomainBuffer* buffer = &domain->outgoing;
+		if (rank > 0)
+		{
+			DomainBuffer nothing = {};
+			if (!transport->exchange(transport, rank, &nothing, &domain->incoming)) return false;
+			buffer = &domain->incoming;
+		}
+
+		DomainRecord* records = (DomainRecord*) buffer->bytes;
+		int recordCount = buffer->byteCount / sizeof(DomainRecord);
+		for (int recordIndex = 0; recordIndex < recordCount; ++recordIndex)
+		{
+			assert(records[recordIndex].id < simulation->particleCount);
+			simulation->particles[records[recordIndex].id] = records[recordIndex].particle;
+		}
+	}
+	return true;
+}
+
+void
+freeDomain(Domain* domain)
+{
+	freeSimulation(&domain->simulation);
+	free(domain->ids);
+	free(domain->binningOrder);
+	freeDomainBuffer(&domain->outgoing);
+	freeDomainBuffer(&domain->incoming);
+	*domain = {};
+}
+
+#endif
@@ -4,7 +4,14 @@ set warnings=-Wall -Wno-c++11-compat-deprecated-writable-strings
 set flags=-O3
 set emscripten_settings=-s AGGRESSIVE_VARIABLE_ELIMINATION=1 -s NO_FILESYSTEM=1 -s FULL_ES2=1
 set emscripten_extra_settings=-s EXPORTED_RUNTIME_METHODS=[]
-em++ many_tiny_things.cpp -o emscripten_output/index.html -s USE_SDL=2 %warnings% %flags% %emscripten_settings%
+:: NOTE: emscripten.bat simd builds the wasm SIMD128 and worker per core variant, see emscripten.sh
+set output=emscripten_output
+if "%1"=="simd" (
+	set flags=%flags% -msimd128 -pthread
+	set emscripten_settings=%emscripten_settings% -s PTHREAD_POOL_SIZE=navigator.hardwareConcurrency -s ALLOW_MEMORY_GROWTH=1
+	set output=emscripten_output_simd
+)
+em++ many_tiny_things.cpp -o %output%/index.html -s USE_SDL=2 %warnings% %flags% %emscripten_settings%
 
 
 :: Build as a js library
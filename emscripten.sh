@@ -1,5 +1,15 @@
 #!/usr/bin/env bash
+# NOTE: ./emscripten.sh simd builds the variant with wasm SIMD128 and a worker per core into emscripten_output_simd.
+# The workers share memory through SharedArrayBuffer, so that page has to be served cross origin isolated
+# (Cross-Origin-Opener-Policy: same-origin and Cross-Origin-Embedder-Policy: require-corp).
 warnings="-Wall -Wno-c++11-compat-deprecated-writable-strings"
 flags="-O3"
 emscripten_settings="-s AGGRESSIVE_VARIABLE_ELIMINATION=1 -s NO_FILESYSTEM=1 -s USE_SDL=2"
-em++ many_tiny_things.cpp -o emscripten_output/index.html $warnings $flags $emscripten_settings
\ No newline at end of file
+output=emscripten_output
+if [ "$1" == "simd" ]; then
+    flags="$flags -msimd128 -pthread"
+    emscripten_settings="$emscripten_settings -s PTHREAD_POOL_SIZE=navigator.hardwareConcurrency -s ALLOW_MEMORY_GROWTH=1"
+    output=emscripten_output_simd
+fi
+mkdir -p $output
+em++ many_tiny_things.cpp -o $output/index.html $warnings $flags $emscripten_settings
@@ -0,0 +1,206 @@
+#ifndef ensemble_h
+#define ensemble_h
+
+#include <stdio.h>
+
+#include "particle_simulation.h"
+#include "threading.h"
+
+// NOTE: many independent copies of one scenario in one process, swept over temperature,
+// viscosity and gravity. Each copy has its own random stream, and advancing a copy to its next
+// sample is one task on the work stealing pool, so the slow copies don't hold up the fast ones.
+
+struct EnsembleSweep {
+	f32* temperatures;
+	int temperatureCount;
+	f32* viscosities;
+	int viscosityCount;
+	f64* gravityStrengths;
+	int gravityStrengthCount;
+
+	// copies per combination, with different random streams
+	int replicaCount;
+};
+
+// NOTE: one row of the table, per particle where it makes sense
+struct EnsembleSample {
+	int memberIndex;
+	int replicaIndex;
+	f64 time;
+
+	f32 temperature;
+	f32 viscosity;
+	f64 gravityStrength;
+
+	f64 kineticEnergy;
+	f64 potentialEnergy;
+	f64 measuredTemperature;
+	V2 momentum;
+};
+
+// NOTE: builds the particles, called after the parameters and the random stream are set
+typedef void EnsembleSetup(Simulation* simulation, void* data);
+
+struct Ensemble;
+
+struct EnsembleMember {
+	Ensemble* ensemble;
+	int memberIndex;
+	int replicaIndex;
+	Simulation simulation;
+
+	int sampleCount;
+};
+
+struct Ensemble {
+	int memberCount;
+	EnsembleMember* members;
+
+	f64 sampleInterval;
+	int samplesPerMember;
+
+	// NOTE: member by member, so every member writes its own rows without locking
+	EnsembleSample* samples;
+	int sampleCount;
+
+	TaskGroup tasks;
+};
+
+// NOTE: every combination of the sweep's values gets replicaCount members, seeded from seed
+void
+initEnsemble(Ensemble* ensemble, EnsembleSweep* sweep, EnsembleSetup* setup, void* setupData, u64 seed)
+{
+	*ensemble = {};
+
+	int replicaCount = atLeast(1, sweep->replicaCount);
+	int temperatureCount = atLeast(1, sweep->temperatureCount);
+	int viscosityCount = atLeast(1, sweep->viscosityCount);
+	int gravityStrengthCount = atLeast(1, sweep->gravityStrengthCount);
+	ensemble->memberCount = temperatureCount * viscosityCount * gravityStrengthCount * replicaCount;
+	ensemble->members = allocArray(EnsembleMember, ensemble->memberCount);
+
+	for (int memberIndex = 0; memberIndex < ensemble->memberCount; ++memberIndex)
+	{
+		EnsembleMember* member = ensemble->members + memberIndex;
+		*member = {};
+		member->ensemble = ensemble;
+		member->memberIndex = memberIndex;
+
+		int index = memberIndex;
+		member->replicaIndex = index % replicaCount;
+		index /= replicaCount;
+		int gravityStrengthIndex = index % gravityStrengthCount;
+		index /= gravityStrengthCount;
+		int viscosityIndex = index % viscosityCount;
+		index /= viscosityCount;
+		int temperatureIndex = index;
+
+		Simulation* simulation = &member->simulation;
+		initSimulation(simulation);
+		simulation->random = randomSeries(seed, memberIndex);
+		if (sweep->temperatureCount > 0) simulation->temperature = sweep->temperatures[temperatureIndex];
+		if (sweep->viscosityCount > 0) simulation->viscosity = sweep->viscosities[viscosityIndex];
+
+		if (setup)
+		{
+			setup(simulation, setupData);
+		}
+		else
+		{
+			defaultParticles(simulation);
+			defaultWalls(simulation);
+		}
+
+		// NOTE: after the setup, since some setups pick their own gravity
+		if (sweep->gravityStrengthCount > 0) simulation->gravityStrength = sweep->gravityStrengths[gravityStrengthIndex];
+	}
+}
+
+EnsembleSample
+measureEnsembleMember(EnsembleMember* member)
+{
+	Simulation* simulation = &member->simulation;
+
+	EnsembleSample sample = {};
+	sample.memberIndex = member->memberIndex;
+	sample.replicaIndex = member->replicaIndex;
+	sample.time = member->sampleCount * member->ensemble->sampleInterval;
+	sample.temperature = simulation->temperature;
+	sample.viscosity = simulation->viscosity;
+	sample.gravityStrength = simulation->gravityStrength;
+
+	SimulationObservables observables = measureObservables(simulation);
+	sample.kineticEnergy = observables.kineticEnergy;
+	sample.potentialEnergy = observables.potentialEnergy;
+	sample.measuredTemperature = observables.measuredTemperature;
+	sample.momentum = observables.momentum;
+	return sample;
+}
+
+void
+advanceEnsembleMember(void* data)
+{
+	EnsembleMember* member = (EnsembleMember*)data;
+	Ensemble* ensemble = member->ensemble;
+
+	advanceSimulation(&member->simulation, ensemble->sampleInterval);
+	member->sampleCount++;
+
+	int sampleIndex = member->memberIndex * ensemble->samplesPerMember + member->sampleCount - 1;
+	ensemble->samples[sampleIndex] = measureEnsembleMember(member);
+
+	// NOTE: back on this thread's queue, where another thread can steal it if this one is busy
+	if (member->sampleCount < ensemble->samplesPerMember)
+	{
+		spawnTask(&ensemble->tasks, advanceEnsembleMember, member);
+	}
+}
+
+// NOTE: advances every member by duration, with a sample every sampleInterval, and returns when they are all done.
+// The table holds the samples of the last run.
+void
+runEnsemble(Ensemble* ensemble, f64 duration, f64 sampleInterval)
+{
+	ensemble->sampleInterval = sampleInterval;
+	ensemble->samplesPerMember = atLeast(1, (int) (duration / sampleInterval + 0.5));
+	ensemble->sampleCount = ensemble->memberCount * ensemble->samplesPerMember;
+	ensemble->samples = (EnsembleSample*) realloc(ensemble->samples, ensemble->sampleCount * sizeof(EnsembleSample));
+
+	for (int memberIndex = 0; memberIndex < ensemble->memberCount; ++memberIndex)
+	{
+		EnsembleMember* member = ensemble->members + memberIndex;
+		member->sampleCount = 0;
+		spawnTask(&ensemble->tasks, advanceEnsembleMember, member);
+	}
+	waitForTasks(&ensemble->tasks);
+}
+
+// NOTE: tab separated, one line per sample, with a header
+void
+writeEnsembleTable(Ensemble* ensemble, FILE* file)
+{
+	fprintf(file, "member\treplica\ttime\ttemperature\tviscosity\tgravity\tkinetic\tpotential\tmeasured_temperature\tmomentum_x\tmomentum_y\n");
+	for (int sampleIndex = 0; sampleIndex < ensemble->sampleCount; ++sampleIndex)
+	{
+		EnsembleSample* sample = ensemble->samples + sampleIndex;
+		fprintf(file, "%d\t%d\t%g\t%g\t%g\t%g\t%.6g\t%.6g\t%.6g\t%.6g\t%.6g\n",
+			sample->memberIndex, sample->replicaIndex, sample->time,
+			sample->temperature, sample->viscosity, sample->gravityStrength,
+			sample->kineticEnergy, sample->potentialEnergy, sample->measuredTemperature,
+			sample->momentum.x, sample->momentum.y);
+	}
+}
+
+void
+freeEnsemble(Ensemble* ensemble)
+{
+	for (int memberIndex = 0; memberIndex < ensemble->memberCount; ++memberIndex)
+	{
+		freeSimulation(&ensemble->members[memberIndex].simulation);
+	}
+	free(ensemble->members);
+	free(ensemble->samples);
+	*ensemble = {};
+}
+
+#endif
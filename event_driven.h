@@ -0,0 +1,567 @@
+#ifndef event_driven_h
+#define event_driven_h
+
+#include "particle_simulation.h"
+
+// NOTE: event-driven dynamics for hard disks. Between collisions the disks fly freely,
+// so instead of stepping we jump from one predicted collision to the next.
+// Pair potentials, gravity, the thermostat and dragging don't apply here, only radius, mass and walls.
+//
+// Each particle keeps the time its state was last updated, and is only moved forward when it takes part in an event.
+// Predicted events go in a heap and are never removed from it, instead each particle counts its events,
+// and an event is stale if a participant has had another event since it was predicted.
+
+enum EventType {
+	EventType_Collision,
+	EventType_Wall,
+	EventType_CellCrossing,
+};
+
+struct Event {
+	f64 time;
+	EventType type;
+	int particleIndex;
+	int otherIndex; // particle for collisions, wall for walls, new cell for crossings
+	u32 eventCount;
+	u32 otherEventCount;
+};
+
+struct HardDisk {
+	f64 x, y;
+	f64 vx, vy;
+	f64 time;
+	u32 eventCount;
+
+	int cellIndex;
+	int nextInCell;
+	int previousInCell;
+};
+
+struct EventDrivenEngine {
+	f64 time;
+	int particleCount;
+	u32 particleGeneration;
+	u32 wallGeneration;
+	HardDisk* disks;
+
+	// NOTE: cells are at least a diameter wide, so only neighboring cells can collide
+	int* cellHeads;
+	int cellColCount;
+	int cellRowCount;
+	f64 cellWidth;
+	f64 cellHeight;
+
+	Event* events;
+	int eventCount;
+	int eventCapacity;
+
+	u64 processedEventCount;
+	u64 staleEventCount;
+};
+
+//
+// Event heap
+//
+
+bool
+isEarlier(Event* a, Event* b)
+{
+	return a->time < b->time;
+}
+
+void
+pushEvent(EventDrivenEngine* engine, Event event)
+{
+	if (engine->eventCount == engine->eventCapacity)
+	{
+		engine->eventCapacity = atLeast(1024, 2 * engine->eventCapacity);
+		engine->events = (Event*) realloc(engine->events, engine->eventCapacity * sizeof(Event));
+	}
+
+	Event* events = engine->events;
+	int index = engine->eventCount++;
+	events[index] = event;
+	while (index > 0)
+	{
+		int parentIndex = (index - 1) / 2;
+		if (!isEarlier(events + index, events + parentIndex)) break;
+
+		Event temp = events[index];
+		events[index] = events[parentIndex];
+		events[parentIndex] = temp;
+		index = parentIndex;
+	}
+}
+
+Event
+popEvent(EventDrivenEngine* engine)
+{
+	Event* events = engine->events;
+	Event result = events[0];
+	events[0] = events[--engine->eventCount];
+
+	int index = 0;
+	while (true)
+	{
+		int earliestIndex = index;
+		int leftIndex = 2 * index + 1;
+		int rightIndex = leftIndex + 1;
+		if ((leftIndex < engine->eventCount) && isEarlier(events + leftIndex, events + earliestIndex))
+		{
+			earliestIndex = leftIndex;
+		}
+		if ((rightIndex < engine->eventCount) && isEarlier(events + rightIndex, events + earliestIndex))
+		{
+			earliestIndex = rightIndex;
+		}
+		if (earliestIndex == index) break;
+
+		Event temp = events[index];
+		events[index] = events[earliestIndex];
+		events[earliestIndex] = temp;
+		index = earliestIndex;
+	}
+	return result;
+}
+
+//
+// Cells
+//
+
+void
+removeFromCell(EventDrivenEngine* engine, int diskIndex)
+{
+	HardDisk* disk = engine->disks + diskIndex;
+	if (disk->previousInCell >= 0)
+	{
+		engine->disks[disk->previousInCell].nextInCell = disk->nextInCell;
+	}
+	else
+	{
+		engine->cellHeads[disk->cellIndex] = disk->nextInCell;
+	}
+	if (disk->nextInCell >= 0)
+	{
+		engine->disks[disk->nextInCell].previousInCell = disk->previousInCell;
+	}
+}
+
+void
+insertIntoCell(EventDrivenEngine* engine, int diskIndex, int cellIndex)
+{
+	HardDisk* disk = engine->disks + diskIndex;
+	disk->cellIndex = cellIndex;
+	disk->previousInCell = -1;
+	disk->nextInCell = engine->cellHeads[cellIndex];
+	if (disk->nextInCell >= 0)
+	{
+		engine->disks[disk->nextInCell].previousInCell = diskIndex;
+	}
+	engine->cellHeads[cellIndex] = diskIndex;
+}
+
+//
+// Prediction
+//
+
+// NOTE: when a point at relative position (dx, dy) moving at (dvx, dvy) first gets within distance,
+// or now if it is already overlapping and approaching, or -1 if never
+f64
+contactTime(f64 dx, f64 dy, f64 dvx, f64 dvy, f64 distance)
+{
+	f64 approach = dx * dvx + dy * dvy;
+	if (approach >= 0) return -1;
+
+	f64 squaredDistance = dx * dx + dy * dy;
+	f64 overlap = squaredDistance - distance * distance;
+	if (overlap <= 0) return 0;
+
+	f64 squaredSpeed = dvx * dvx + dvy * dvy;
+	f64 discriminant = approach * approach - squaredSpeed * overlap;
+	if (discriminant < 0) return -1;
+
+	return overlap / (-approach + sqrt(discriminant));
+}
+
+void
+advanceDisk(HardDisk* disk, f64 time)
+{
+	f64 dt = time - disk->time;
+	disk->x += disk->vx * dt;
+	disk->y += disk->vy * dt;
+	disk->time = time;
+}
+
+void
+predictCollision(EventDrivenEngine* engine, Simulation* simulation, int diskIndex, int otherIndex)
+{
+	HardDisk* disk = engine->disks + diskIndex;
+	HardDisk* other = engine->disks + otherIndex;
+
+	// NOTE: compare both at the later of their times
+	f64 time = max(disk->time, other->time);
+	f64 dx = (other->x + other->vx * (time - other->time)) - (disk->x + disk->vx * (time - disk->time));
+	f64 dy = (other->y + other->vy * (time - other->time)) - (disk->y + disk->vy * (time - disk->time));
+	dx -= simulation->boxWidth * round(dx / simulation->boxWidth);
+	dy -= simulation->boxHeight * round(dy / simulation->boxHeight);
+
+	f64 distance = simulation->particles[diskIndex].radius + simulation->particles[otherIndex].radius;
+	f64 t = contactTime(dx, dy, other->vx - disk->vx, other->vy - disk->vy, distance);
+	if (t >= 0)
+	{
+		Event event = {time + t, EventType_Collision, diskIndex, otherIndex, disk->eventCount, other->eventCount};
+		pushEvent(engine, event);
+	}
+}
+
+// NOTE: the direction from the nearest point of the wall to the disk, in f64 like the event times,
+// so the reflection happens about the same normal that predicted the hit
+void
+wallNormal(Wall* wall, f64 x, f64 y, f64* normalX, f64* normalY)
+{
+	f64 wallX = wall->end.x - wall->start.x;
+	f64 wallY = wall->end.y - wall->start.y;
+	f64 relativeX = x - wall->start.x;
+	f64 relativeY = y - wall->start.y;
+	f64 t = atLeast(0, atMost(1, (relativeX * wallX + relativeY * wallY) / (wallX * wallX + wallY * wallY)));
+	f64 fromWallX = relativeX - t * wallX;
+	f64 fromWallY = relativeY - t * wallY;
+	f64 distance = sqrt(fromWallX * fromWallX + fromWallY * fromWallY);
+	*normalX = fromWallX / distance;
+	*normalY = fromWallY / distance;
+}
+
+void
+predictWallHit(EventDrivenEngine* engine, Simulation* simulation, int diskIndex, int wallIndex)
+{
+	HardDisk* disk = engine->disks + diskIndex;
+	Wall* wall = simulation->walls + wallIndex;
+	f64 radius = simulation->particles[diskIndex].radius;
+
+	f64 wallX = wall->end.x - wall->start.x;
+	f64 wallY = wall->end.y - wall->start.y;
+	f64 wallLength = sqrt(wallX * wallX + wallY * wallY);
+	wallX /= wallLength;
+	wallY /= wallLength;
+
+	f64 relativeX = disk->x - wall->start.x;
+	f64 relativeY = disk->y - wall->start.y;
+
+	// the side of the wall, with the normal pointing towards the disk
+	f64 normalX = -wallY;
+	f64 normalY = wallX;
+	f64 distance = relativeX * normalX + relativeY * normalY;
+	if (distance < 0)
+	{
+		normalX = -normalX;
+		normalY = -normalY;
+		distance = -distance;
+	}
+
+	f64 bestTime = -1;
+	f64 normalSpeed = disk->vx * normalX + disk->vy * normalY;
+	if (normalSpeed < 0)
+	{
+		f64 t = atLeast(0, (distance - radius) / -normalSpeed);
+		f64 along = (relativeX + disk->vx * t) * wallX + (relativeY + disk->vy * t) * wallY;
+		if ((along >= 0) && (along <= wallLength))
+		{
+			bestTime = t;
+		}
+	}
+
+	// the ends of the wall
+	V2 ends[] = {wall->start, wall->end};
+	for (int endIndex = 0; endIndex < 2; ++endIndex)
+	{
+		f64 dx = ends[endIndex].x - disk->x;
+		f64 dy = ends[endIndex].y - disk->y;
+		f64 t = contactTime(dx, dy, -disk->vx, -disk->vy, radius);
+		if ((t >= 0) && ((bestTime < 0) || (t < bestTime)))
+		{
+			bestTime = t;
+		}
+	}
+
+	if (bestTime >= 0)
+	{
+		Event event = {disk->time + bestTime, EventType_Wall, diskIndex, wallIndex, disk->eventCount, 0};
+		pushEvent(engine, event);
+	}
+}
+
+void
+predictCellCrossing(EventDrivenEngine* engine, Simulation* simulation, int diskIndex)
+{
+	HardDisk* disk = engine->disks + diskIndex;
+	int col = disk->cellIndex % engine->cellColCount;
+	int row = disk->cellIndex / engine->cellColCount;
+	f64 left = -0.5 * simulation->boxWidth + col * engine->cellWidth;
+	f64 bottom = -0.5 * simulation->boxHeight + row * engine->cellHeight;
+
+	f64 timeX = 1e300;
+	int newCol = col;
+	if (disk->vx > 0)
+	{
+		timeX = (left + engine->cellWidth - disk->x) / disk->vx;
+		newCol = col + 1;
+	}
+	else if (disk->vx < 0)
+	{
+		timeX = (left - disk->x) / disk->vx;
+		newCol = col - 1;
+	}
+
+	f64 timeY = 1e300;
+	int newRow = row;
+	if (disk->vy > 0)
+	{
+		timeY = (bottom + engine->cellHeight - disk->y) / disk->vy;
+		newRow = row + 1;
+	}
+	else if (disk->vy < 0)
+	{
+		timeY = (bottom - disk->y) / disk->vy;
+		newRow = row - 1;
+	}
+
+	if ((timeX == 1e300) && (timeY == 1e300)) return;
+
+	f64 t;
+	if (timeX < timeY)
+	{
+		t = timeX;
+		newRow = row;
+	}
+	else
+	{
+		t = timeY;
+		newCol = col;
+	}
+	newCol = mod(newCol, engine->cellColCount);
+	newRow = mod(newRow, engine->cellRowCount);
+
+	Event event = {disk->time + atLeast(0, t), EventType_CellCrossing, diskIndex, newRow * engine->cellColCount + newCol, disk->eventCount, 0};
+	pushEvent(engine, event);
+}
+
+void
+predictEvents(EventDrivenEngine* engine, Simulation* simulation, int diskIndex)
+{
+	HardDisk* disk = engine->disks + diskIndex;
+	int col = disk->cellIndex % engine->cellColCount;
+	int row = disk->cellIndex / engine->cellColCount;
+	for (int y = -1; y <= 1; ++y)
+	{
+		int rowIndex = mod(row + y, engine->cellRowCount) * engine->cellColCount;
+		for (int x = -1; x <= 1; ++x)
+		{
+			int cellIndex = rowIndex + mod(col + x, engine->cellColCount);
+			for (int otherIndex = engine->cellHeads[cellIndex]; otherIndex >= 0; otherIndex = engine->disks[otherIndex].nextInCell)
+			{
+				if (otherIndex != diskIndex)
+				{
+					predictCollision(engine, simulation, diskIndex, otherIndex);
+				}
+			}
+		}
+	}
+
+	for (int wallIndex = 0; wallIndex < simulation->wallCount; ++wallIndex)
+	{
+		predictWallHit(engine, simulation, diskIndex, wallIndex);
+	}
+
+	predictCellCrossing(engine, simulation, diskIndex);
+}
+
+//
+// Engine
+//
+
+void
+initEventDriven(EventDrivenEngine* engine, Simulation* simulation)
+{
+	engine->time = 0;
+	engine->eventCount = 0;
+	engine->particleCount = simulation->particleCount;
+	engine->particleGeneration = simulation->particleGeneration;
+	engine->wallGeneration = simulation->wallGeneration;
+	engine->disks = (HardDisk*) realloc(engine->disks, simulation->particleCount * sizeof(HardDisk));
+
+	f64 maxRadius = 0;
+	for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+	{
+		maxRadius = max(maxRadius, simulation->particles[particleIndex].radius);
+	}
+
+	// NOTE: at least 3 cells along each side, so the 3x3 neighborhood doesn't wrap onto itself
+	engine->cellColCount = atLeast(3, (int) floor(simulation->boxWidth / (2 * maxRadius)));
+	engine->cellRowCount = atLeast(3, (int) floor(simulation->boxHeight / (2 * maxRadius)));
+	engine->cellWidth = simulation->boxWidth / engine->cellColCount;
+	engine->cellHeight = simulation->boxHeight / engine->cellRowCount;
+	int cellCount = engine->cellColCount * engine->cellRowCount;
+	engine->cellHeads = (int*) realloc(engine->cellHeads, cellCount * sizeof(int));
+	for (int cellIndex = 0; cellIndex < cellCount; ++cellIndex)
+	{
+		engine->cellHeads[cellIndex] = -1;
+	}
+
+	for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+	{
+		Particle* particle = simulation->particles + particleIndex;
+		V2 position = periodize(particle->position, simulation->boxWidth, simulation->boxHeight);
+
+		HardDisk* disk = engine->disks + particleIndex;
+		disk->x = position.x;
+		disk->y = position.y;
+		disk->vx = particle->velocity.x;
+		disk->vy = particle->velocity.y;
+		disk->time = 0;
+		disk->eventCount = 0;
+
+		int col = mod(floor((disk->x / simulation->boxWidth + 0.5) * engine->cellColCount), engine->cellColCount);
+		int row = mod(floor((disk->y / simulation->boxHeight + 0.5) * engine->cellRowCount), engine->cellRowCount);
+		insertIntoCell(engine, particleIndex, row * engine->cellColCount + col);
+	}
+
+	for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+	{
+		predictEvents(engine, simulation, particleIndex);
+	}
+}
+
+void
+processEvent(EventDrivenEngine* engine, Simulation* simulation, Event* event)
+{
+	HardDisk* disk = engine->disks + event->particleIndex;
+	advanceDisk(disk, event->time);
+	disk->eventCount++;
+
+	if (event->type == EventType_Collision)
+	{
+		HardDisk* other = engine->disks + event->otherIndex;
+		advanceDisk(other, event->time);
+		other->eventCount++;
+
+		f64 dx = other->x - disk->x;
+		f64 dy = other->y - disk->y;
+		dx -= simulation->boxWidth * round(dx / simulation->boxWidth);
+		dy -= simulation->boxHeight * round(dy / simulation->boxHeight);
+		f64 distance = sqrt(dx * dx + dy * dy);
+		f64 normalX = dx / distance;
+		f64 normalY = dy / distance;
+
+		f64 mass = simulation->particles[event->particleIndex].mass;
+		f64 otherMass = simulation->particles[event->otherIndex].mass;
+		f64 normalSpeed = (other->vx - disk->vx) * normalX + (other->vy - disk->vy) * normalY;
+		f64 impulse = 2 * mass * otherMass / (mass + otherMass) * normalSpeed;
+
+		disk->vx += impulse / mass * normalX;
+		disk->vy += impulse / mass * normalY;
+		other->vx -= impulse / otherMass * normalX;
+		other->vy -= impulse / otherMass * normalY;
+
+		predictEvents(engine, simulation, event->particleIndex);
+		predictEvents(engine, simulation, event->otherIndex);
+	}
+	else if (event->type == EventType_Wall)
+	{
+		f64 normalX;
+		f64 normalY;
+		wallNormal(simulation->walls + event->otherIndex, disk->x, disk->y, &normalX, &normalY);
+
+		f64 normalSpeed = disk->vx * normalX + disk->vy * normalY;
+		if (normalSpeed < 0)
+		{
+			disk->vx -= 2 * normalSpeed * normalX;
+			disk->vy -= 2 * normalSpeed * normalY;
+		}
+
+		predictEvents(engine, simulation, event->particleIndex);
+	}
+	else if (event->type == EventType_CellCrossing)
+	{
+		// NOTE: wrap around when crossing the edge of the box
+		int oldCol = disk->cellIndex % engine->cellColCount;
+		int newCol = event->otherIndex % engine->cellColCount;
+		int oldRow = disk->cellIndex / engine->cellColCount;
+		int newRow = event->otherIndex / engine->cellColCount;
+		if ((oldCol == engine->cellColCount - 1) && (newCol == 0)) disk->x -= simulation->boxWidth;
+		if ((oldCol == 0) && (newCol == engine->cellColCount - 1)) disk->x += simulation->boxWidth;
+		if ((oldRow == engine->cellRowCount - 1) && (newRow == 0)) disk->y -= simulation->boxHeight;
+		if ((oldRow == 0) && (newRow == engine->cellRowCount - 1)) disk->y += simulation->boxHeight;
+
+		removeFromCell(engine, event->particleIndex);
+		insertIntoCell(engine, event->particleIndex, event->otherIndex);
+
+		predictEvents(engine, simulation, event->particleIndex);
+	}
+}
+
+void
+advanceEventDriven(EventDrivenEngine* engine, Simulation* simulation, f64 timeToSimulate)
+{
+	if ((engine->particleGeneration != simulation->particleGeneration) || (engine->wallGeneration != simulation->wallGeneration))
+	{
+		// NOTE: particles were reset, added or removed, or the walls changed, start over from the current state
+		initEventDriven(engine, simulation);
+	}
+
+	// NOTE: stale events far in the future pile up, so every now and then start the heap over
+	if (engine->eventCount > 32 * engine->particleCount + 1024)
+	{
+		engine->eventCount = 0;
+		for (int particleIndex = 0; particleIndex < engine->particleCount; ++particleIndex)
+		{
+			predictEvents(engine, simulation, particleIndex);
+		}
+	}
+
+	f64 endTime = engine->time + timeToSimulate;
+	while ((engine->eventCount > 0) && (engine->events[0].time <= endTime))
+	{
+		Event event = popEvent(engine);
+
+		bool isStale = (engine->disks[event.particleIndex].eventCount != event.eventCount);
+		if (event.type == EventType_Collision)
+		{
+			isStale = isStale || (engine->disks[event.otherIndex].eventCount != event.otherEventCount);
+		}
+		if (isStale)
+		{
+			engine->staleEventCount++;
+			continue;
+		}
+
+		processEvent(engine, simulation, &event);
+		engine->processedEventCount++;
+	}
+	engine->time = endTime;
+
+	// ! write back, so the simulation can be drawn as usual
+
+	for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+	{
+		HardDisk* disk = engine->disks + particleIndex;
+		Particle* particle = simulation->particles + particleIndex;
+		f64 dt = endTime - disk->time;
+
+		particle->position = periodize(v2(disk->x + disk->vx * dt, disk->y + disk->vy * dt), simulation->boxWidth, simulation->boxHeight);
+		particle->velocity = v2(disk->vx, disk->vy);
+		particle->acceleration = v2(0, 0);
+		particle->potentialEnergy = 0;
+		particle->kineticEnergy = 0.5 * particle->mass * (square(disk->vx) + square(disk->vy));
+	}
+}
+
+void
+freeEventDriven(EventDrivenEngine* engine)
+{
+	free(engine->disks);
+	free(engine->cellHeads);
+	free(engine->events);
+	*engine = {};
+}
+
+#endif
@@ -0,0 +1,315 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "particle_simulation.h"
+#include "threading.h"
+#include "software_rasterizer.h"
+#include "live_state_publisher.h"
+#include "scenario.h"
+#include "perf_counters.h"
+
+// NOTE: runs the simulation without a window and writes every frame as an image, for machines without a GPU.
+//
+//     headless [frame count] [particle count or scenario file] [directory] [png|ppm|none] [width] [height] [shared memory name]
+//              [profile file] [write]
+//
+// A particle count of 0 is the scene many_tiny_things starts with, anything else is a dilute gas in a box
+// big enough for it. A path ending in .scenario is loaded instead, see scenario.h. The frames go to directory/frame_00000.png and on, which has to exist.
+// ffmpeg -i directory/frame_%05d.png makes a movie of them.
+//
+// With a shared memory name (like /many_tiny_things), every frame is also published there for
+// live_state_viewer and other readers of live_state.h, and none skips the images. - publishes nothing.
+//
+// With a profile file, the phases of every step are counted with perf_counters.h and reported per particle
+// step at the end, compared to the counts in the file, or written to it with write. - only prints them.
+
+f64
+getTime()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+struct HeadlessRun {
+    Simulation simulation;
+    // NOTE: like many_tiny_things at 60 frames per second
+    f64 simulatedTimePerFrame;
+    int frameIndex;
+
+    int frameParticleCapacity;
+    int frameParticleCount;
+    FrameParticle* frameParticles;
+    bool isDragging;
+    V2 dragStart;
+    V2 dragEnd;
+
+    SoftwareRasterizer rasterizer;
+    const char* directory;
+    bool isWritingPpm;
+    bool isDrawing;
+
+    LiveStatePublisher publisher;
+    bool isPublishing;
+
+    StepProfiler profiler;
+    PerfPhaseProfile* profile;
+    f64 renderSeconds;
+    f64 writeSeconds;
+};
+
+//
+// Frame graph
+//
+
+// NOTE: as in loop, the particles are copied out, and then the next frame is simulated
+// while this one is drawn and written
+
+void
+snapshotHeadlessTask(void* data)
+{
+    HeadlessRun* run = (HeadlessRun*)data;
+    Simulation* simulation = &run->simulation;
+
+    int particleCount = simulation->particleCount;
+    if (particleCount > run->frameParticleCapacity)
+    {
+        run->frameParticleCapacity = 2 * particleCount;
+        run->frameParticles = (FrameParticle*) realloc(run->frameParticles, run->frameParticleCapacity * sizeof(FrameParticle));
+    }
+    run->frameParticleCount = particleCount;
+
+    for (int particleIndex = 0; particleIndex < particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        FrameParticle* frameParticle = run->frameParticles + particleIndex;
+        frameParticle->position = particle->position;
+        frameParticle->radius = particle->radius;
+        frameParticle->color = particle->color;
+    }
+
+    if (run->isPublishing)
+    {
+        publishLiveState(&run->publisher, simulation, run->frameIndex, run->frameIndex * run->simulatedTimePerFrame);
+    }
+    if (!run->isDrawing) return;
+
+    run->isDragging = simulation->isDragging;
+    if (simulation->isDragging)
+    {
+        run->dragStart = simulation->particles[simulation->draggedParticleIndex].position;
+        run->dragEnd = simulation->mousePosition;
+    }
+
+    // NOTE: the whole box, as large as it fits
+    SoftwareRasterizer* rasterizer = &run->rasterizer;
+    f32 pixelsPerUnit = min(rasterizer->width / simulation->boxWidth, rasterizer->height / simulation->boxHeight);
+    beginRasterFrame(rasterizer, v2(0, 0), pixelsPerUnit, c4(1, 1, 1, 1));
+
+    Color4 black = c4(0, 0, 0, 1);
+    for (int wallIndex = 0; wallIndex < simulation->wallCount; ++wallIndex)
+    {
+        Wall* wall = simulation->walls + wallIndex;
+        addRasterLine(rasterizer, wall->start, wall->end, 3, black);
+    }
+}
+
+void
+advanceHeadlessTask(void* data)
+{
+    HeadlessRun* run = (HeadlessRun*)data;
+    advanceSimulation(&run->simulation, run->simulatedTimePerFrame);
+}
+
+void
+drawHeadlessTask(void* data)
+{
+    HeadlessRun* run = (HeadlessRun*)data;
+    SoftwareRasterizer* rasterizer = &run->rasterizer;
+    if (!run->isDrawing) return;
+
+    f64 startTime = getTime();
+    if (run->isDragging)
+    {
+        addRasterLine(rasterizer, run->dragStart, run->dragEnd, 2, c4(0, 0, 0, 1));
+    }
+    rasterizeFrame(rasterizer, run->frameParticles, run->frameParticleCount);
+    f64 drawnTime = getTime();
+    run->renderSeconds += drawnTime - startTime;
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/frame_%05d.%s", run->directory, run->frameIndex, run->isWritingPpm ? "ppm" : "png");
+    bool isWritten = run->isWritingPpm ? writePpm(rasterizer, path) : writePng(rasterizer, path);
+    if (!isWritten)
+    {
+        printf("Could not write %s.\n", path);
+    }
+    run->writeSeconds += getTime() - drawnTime;
+}
+
+//
+// Profiling
+//
+
+void
+beginProfiledPhase(void* data, StepPhase phase, int particleCount)
+{
+    beginPerfPhase((PerfPhaseProfile*)data, phase);
+}
+
+void
+endProfiledPhase(void* data, StepPhase phase, int particleCount)
+{
+    endPerfPhase((PerfPhaseProfile*)data, phase, particleCount);
+}
+
+// NOTE: every step runs the first half of the integration, or the multiple time step in its place,
+// over all the particles once
+bool
+reportProfile(PerfPhaseProfile* profile, const char* path, bool isWritingBaseline)
+{
+    u64 totals[PerfCounter_Count];
+    u64 firstHalfCount;
+    u64 multipleTimeStepCount;
+    sumPerfPhase(profile, StepPhase_FirstHalf, totals, &firstHalfCount);
+    sumPerfPhase(profile, StepPhase_MultipleTimeStep, totals, &multipleTimeStepCount);
+    u64 particleSteps = firstHalfCount + multipleTimeStepCount;
+
+    bool isPrintingOnly = !strcmp(path, "-");
+    BaselineFile* baseline = allocArray(BaselineFile, 1);
+    *baseline = {};
+    if (!isPrintingOnly && !isWritingBaseline && !readBaselineFile(baseline, path))
+    {
+        printf("Could not read the profile %s.\n", path);
+    }
+    printPerfPhaseReport(profile, particleSteps, "particle step", baseline);
+    free(baseline);
+
+    if (!isPrintingOnly && isWritingBaseline)
+    {
+        if (!writePerfPhaseBaseline(profile, particleSteps, path, "counts per particle step, from headless with " simdName " vectors"))
+        {
+            printf("Could not write the profile %s.\n", path);
+            return false;
+        }
+        printf("\nWrote the profile %s.\n", path);
+    }
+    return true;
+}
+
+int
+main(int argumentCount, char** arguments)
+{
+    int frameCount = (argumentCount > 1) ? atoi(arguments[1]) : 100;
+    int particleCount = (argumentCount > 2) ? atoi(arguments[2]) : 0;
+    const char* scenarioPath = 0;
+    if ((argumentCount > 2) && (strlen(arguments[2]) > strlen(".scenario")))
+    {
+        const char* extension = arguments[2] + strlen(arguments[2]) - strlen(".scenario");
+        if (!strcmp(extension, ".scenario")) scenarioPath = arguments[2];
+    }
+    const char* directory = (argumentCount > 3) ? arguments[3] : ".";
+    bool isWritingPpm = (argumentCount > 4) && !strcmp(arguments[4], "ppm");
+    int width = (argumentCount > 5) ? atoi(arguments[5]) : 1920;
+    int height = (argumentCount > 6) ? atoi(arguments[6]) : 1080;
+    const char* liveStateName = ((argumentCount > 7) && strcmp(arguments[7], "-")) ? arguments[7] : 0;
+    const char* profilePath = (argumentCount > 8) ? arguments[8] : 0;
+    bool isWritingProfile = (argumentCount > 9) && !strcmp(arguments[9], "write");
+
+    HeadlessRun* run = allocArray(HeadlessRun, 1);
+    *run = {};
+    run->simulatedTimePerFrame = 5.0 / 60.0;
+    run->directory = directory;
+    run->isWritingPpm = isWritingPpm;
+    run->isDrawing = !((argumentCount > 4) && !strcmp(arguments[4], "none"));
+    if (liveStateName)
+    {
+        initLiveStatePublisher(&run->publisher, liveStateName);
+        run->isPublishing = true;
+        printf("Publishing the live state as %s.\n", liveStateName);
+    }
+    initRasterizer(&run->rasterizer, width, height);
+
+    Simulation* simulation = &run->simulation;
+    initSimulation(simulation);
+    simulation->temperature = 1;
+    simulation->viscosity = 0.05;
+    if (scenarioPath)
+    {
+        if (!loadScenario(simulation, scenarioPath)) return 1;
+    }
+    else if (particleCount > 0)
+    {
+        // NOTE: about a fifth of the box covered
+        f64 boxSide = 4 * sqrt((f64) particleCount);
+        simulation->boxWidth = boxSide;
+        simulation->boxHeight = boxSide;
+
+        Scenario* scenario = allocArray(Scenario, 1);
+        *scenario = {};
+        scenario->hasBoxWalls = true;
+        ScenarioRegion* gas = scenario->regions + scenario->regionCount++;
+        *gas = {};
+        gas->fill = ScenarioFill_Random;
+        gas->min = -0.5 * v2(boxSide, boxSide);
+        gas->max = 0.5 * v2(boxSide, boxSide);
+        gas->count = particleCount;
+        gas->isThermal = true;
+        bool isBuilt = buildScenario(simulation, scenario);
+        free(scenario);
+        if (!isBuilt) return 1;
+    }
+    else
+    {
+        defaultParticles(simulation);
+        defaultWalls(simulation);
+    }
+
+    if (profilePath)
+    {
+        run->profile = allocArray(PerfPhaseProfile, 1);
+        initPerfPhaseProfile(run->profile, StepPhase_Count, stepPhaseNames);
+        run->profiler.beginPhase = beginProfiledPhase;
+        run->profiler.endPhase = endProfiledPhase;
+        run->profiler.data = run->profile;
+        simulation->profiler = &run->profiler;
+    }
+
+    f64 startTime = getTime();
+    for (run->frameIndex = 0; run->frameIndex < frameCount; ++run->frameIndex)
+    {
+        TaskGraph graph;
+        graph.nodeCount = 0;
+        graph.group = {};
+        TaskNode* snapshot = addTask(&graph, snapshotHeadlessTask, run);
+        TaskNode* advance = addTask(&graph, advanceHeadlessTask, run);
+        TaskNode* draw = addTask(&graph, drawHeadlessTask, run);
+        addDependency(snapshot, advance);
+        addDependency(snapshot, draw);
+        runTaskGraph(&graph);
+    }
+    f64 seconds = getTime() - startTime;
+
+    printf("%d frames of %dx%d in %.2f seconds on %d threads, %.1f ms per frame drawing and %.1f ms writing\n",
+        frameCount, width, height, seconds, getThreadCount(),
+        1000 * run->renderSeconds / atLeast(1, frameCount), 1000 * run->writeSeconds / atLeast(1, frameCount));
+
+    bool isProfileReported = true;
+    if (run->profile)
+    {
+        isProfileReported = reportProfile(run->profile, profilePath, isWritingProfile);
+        free(run->profile);
+    }
+    if (run->isPublishing)
+    {
+        closeLiveStatePublisher(&run->publisher);
+    }
+    freeRasterizer(&run->rasterizer);
+    freeSimulation(simulation);
+    free(run->frameParticles);
+    free(run);
+    return isProfileReported ? 0 : 1;
+}
@@ -0,0 +1,5 @@
+#!/usr/bin/env bash
+warnings="-Wall -Wno-unused-function"
+flags="-O3"
+c++ headless.cpp -o headless $warnings $flags -lpthread
+c++ live_state_viewer.cpp -o live_state_viewer $warnings $flags
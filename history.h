@@ -0,0 +1,434 @@
+#ifndef history_h
+#define history_h
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "particle_simulation.h"
+
+// NOTE: the recent past of a simulation, so it can be rewound, replayed, and picked up again from any frame.
+// Every recorded frame is the particles as they are, byte for byte, plus whatever else the step reads that
+// can change, so going on from a frame of the history steps exactly as the simulation did the first time.
+//
+// The frames live in a ring buffer of a fixed size. Every keyframeInterval frames there is a keyframe,
+// which is the particles as is, and the frames in between are deltas against the frame before them.
+// A delta is the xor of the particles' bytes with the previous frame's, one 32 bit word at a time,
+// with the leading zero bytes left out (the masses, colors and so on don't change, so most words are zero,
+// and positions and velocities only change in their lower bytes), and two bits per word to say how many
+// bytes are left. When the buffer is full the oldest keyframe goes, together with the deltas after it.
+
+#define historyKeyframeInterval 60
+
+// NOTE: what the step reads, besides the particles, that can change while the simulation runs
+struct HistoryState {
+	f64 dt;
+	f64 timeLeftToSimulate;
+	u64 stepCount;
+	bool hasSplitForces;
+	RandomSeries random;
+
+	f32 temperature;
+	f32 viscosity;
+	f64 gravityStrength;
+	PotentialType potentialType;
+	bool isUsingPotentialTables;
+
+	bool isDragging;
+	V2 mousePosition;
+	int draggedParticleIndex;
+};
+
+struct HistoryEntry {
+	// NOTE: the whole entry with the particles after it, 0 marks the end of the used part of the buffer
+	u32 byteCount;
+	u32 isKeyframe;
+	u64 frameIndex;
+	int particleCount;
+	HistoryState state;
+};
+
+struct History {
+	u8* buffer;
+	u64 capacity;
+
+	// NOTE: where the oldest entry is and where the next one goes
+	u64 head;
+	u64 tail;
+	int entryCount;
+	int keyframeCount;
+	u64 firstFrame;
+
+	int framesSinceKeyframe;
+
+	// NOTE: the last recorded frame, which the next delta is against
+	Particle* recordedParticles;
+	int recordedParticleCount;
+	int recordedCapacity;
+
+	// NOTE: the frame that was last sought, which the next seek can go on from
+	bool isCursorValid;
+	u64 cursorFrame;
+	u64 cursorOffset;
+	Particle* cursorParticles;
+	int cursorParticleCount;
+	int cursorCapacity;
+
+	u8* scratch;
+	u64 scratchCapacity;
+};
+
+#define particleWordCount (sizeof(Particle) / sizeof(u32))
+
+void
+initHistory(History* history, u64 byteCount)
+{
+	*history = {};
+	history->capacity = byteCount;
+	history->buffer = allocArray(u8, byteCount);
+}
+
+inline u64
+lastHistoryFrame(History* history)
+{
+	return history->firstFrame + history->entryCount - 1;
+}
+
+inline HistoryEntry
+readHistoryEntry(History* history, u64 offset)
+{
+	HistoryEntry entry;
+	memcpy(&entry, history->buffer + offset, sizeof(entry));
+	return entry;
+}
+
+// NOTE: there has to be an entry after the one at offset
+u64
+nextHistoryOffset(History* history, u64 offset)
+{
+	offset += readHistoryEntry(history, offset).byteCount;
+	if ((offset + sizeof(HistoryEntry) > history->capacity) || (readHistoryEntry(history, offset).byteCount == 0))
+	{
+		offset = 0;
+	}
+	return offset;
+}
+
+void
+reserveParticles(Particle** particles, int* capacity, int particleCount)
+{
+	if (particleCount > *capacity)
+	{
+		*capacity = 2 * particleCount;
+		*particles = (Particle*) realloc(*particles, *capacity * sizeof(Particle));
+	}
+}
+
+//
+// Deltas
+//
+
+// NOTE: how many of a word's low bytes are kept, for each two bit code
+global_variable int historyCodeByteCounts[] = {0, 2, 3, 4};
+
+u64
+maxDeltaByteCount(int particleCount)
+{
+	u64 wordCount = particleCount * particleWordCount;
+	return (wordCount + 3) / 4 + 4 * wordCount;
+}
+
+u64
+encodeDelta(Particle* previous, Particle* current, int particleCount, u8* destination)
+{
+	u32* previousWords = (u32*) previous;
+	u32* currentWords = (u32*) current;
+	u64 wordCount = particleCount * particleWordCount;
+
+	u8* cursor = destination;
+	for (u64 wordIndex = 0; wordIndex < wordCount; wordIndex += 4)
+	{
+		u8* codes = cursor++;
+		*codes = 0;
+		for (u64 laneIndex = 0; (laneIndex < 4) && (wordIndex + laneIndex < wordCount); ++laneIndex)
+		{
+			u32 difference = previousWords[wordIndex + laneIndex] ^ currentWords[wordIndex + laneIndex];
+			int code = (difference == 0) ? 0 : (difference <= 0xFFFF) ? 1 : (difference <= 0xFFFFFF) ? 2 : 3;
+			*codes |= code << (2 * laneIndex);
+
+			// NOTE: little endian, so the low bytes come first
+			memcpy(cursor, &difference, historyCodeByteCounts[code]);
+			cursor += historyCodeByteCounts[code];
+		}
+	}
+	return cursor - destination;
+}
+
+// NOTE: turns the previous frame's particles into this one's
+void
+decodeDelta(u8* source, Particle* particles, int particleCount)
+{
+	u32* words = (u32*) particles;
+	u64 wordCount = particleCount * particleWordCount;
+
+	u8* cursor = source;
+	for (u64 wordIndex = 0; wordIndex < wordCount; wordIndex += 4)
+	{
+		u8 codes = *cursor++;
+		for (u64 laneIndex = 0; (laneIndex < 4) && (wordIndex + laneIndex < wordCount); ++laneIndex)
+		{
+			int byteCount = historyCodeByteCounts[(codes >> (2 * laneIndex)) & 3];
+			u32 difference = 0;
+			memcpy(&difference, cursor, byteCount);
+			cursor += byteCount;
+			words[wordIndex + laneIndex] ^= difference;
+		}
+	}
+}
+
+//
+// Ring buffer
+//
+
+// NOTE: drops the oldest keyframe and the deltas that need it
+void
+dropOldestHistorySegment(History* history)
+{
+	do
+	{
+		HistoryEntry entry = readHistoryEntry(history, history->head);
+		history->keyframeCount -= entry.isKeyframe;
+		history->entryCount--;
+		history->firstFrame++;
+		if (history->entryCount > 0)
+		{
+			history->head = nextHistoryOffset(history, history->head);
+		}
+	} while ((history->entryCount > 0) && !readHistoryEntry(history, history->head).isKeyframe);
+
+	if (history->isCursorValid && (history->cursorFrame < history->firstFrame))
+	{
+		history->isCursorValid = false;
+	}
+}
+
+// NOTE: makes room for byteCount bytes at the tail, dropping the oldest frames as needed
+bool
+reserveHistoryBytes(History* history, u64 byteCount)
+{
+	if (byteCount > history->capacity) return false;
+
+	// NOTE: the used part is head up to tail, or when it wraps, head up to the end and the start up to tail
+	while (history->entryCount > 0)
+	{
+		bool isWrapped = history->tail <= history->head;
+		if (!isWrapped)
+		{
+			if (history->capacity - history->tail >= byteCount) return true;
+			if (history->capacity - history->tail >= sizeof(HistoryEntry))
+			{
+				u32 endMarker = 0;
+				memcpy(history->buffer + history->tail, &endMarker, sizeof(endMarker));
+			}
+			history->tail = 0;
+		}
+		else if (history->head - history->tail >= byteCount)
+		{
+			return true;
+		}
+		else
+		{
+			dropOldestHistorySegment(history);
+		}
+	}
+
+	history->head = 0;
+	history->tail = 0;
+	return true;
+}
+
+// NOTE: adds the simulation's current state as the frame after the last one
+void
+recordHistory(History* history, Simulation* simulation)
+{
+	int particleCount = simulation->particleCount;
+	bool isKeyframe = (history->entryCount == 0) || (history->keyframeCount == 0) ||
+		(history->framesSinceKeyframe + 1 >= historyKeyframeInterval) ||
+		(particleCount != history->recordedParticleCount);
+
+	u64 maxByteCount = sizeof(HistoryEntry) + atLeast((u64) particleCount * sizeof(Particle), maxDeltaByteCount(particleCount));
+	if (maxByteCount > history->scratchCapacity)
+	{
+		history->scratchCapacity = 2 * maxByteCount;
+		history->scratch = (u8*) realloc(history->scratch, history->scratchCapacity);
+	}
+
+	HistoryEntry entry = {};
+	entry.frameIndex = history->entryCount ? lastHistoryFrame(history) + 1 : history->firstFrame;
+	entry.particleCount = particleCount;
+	entry.state.dt = simulation->dt;
+	entry.state.timeLeftToSimulate = simulation->timeLeftToSimulate;
+	entry.state.stepCount = simulation->stepCount;
+	entry.state.hasSplitForces = simulation->hasSplitForces;
+	entry.state.random = simulation->random;
+	entry.state.temperature = simulation->temperature;
+	entry.state.viscosity = simulation->viscosity;
+	entry.state.gravityStrength = simulation->gravityStrength;
+	entry.state.potentialType = simulation->potentialType;
+	entry.state.isUsingPotentialTables = simulation->isUsingPotentialTables;
+	entry.state.isDragging = simulation->isDragging;
+	entry.state.mousePosition = simulation->mousePosition;
+	entry.state.draggedParticleIndex = simulation->draggedParticleIndex;
+
+	for (;;)
+	{
+		u8* payload = history->scratch + sizeof(HistoryEntry);
+		u64 payloadByteCount = particleCount * sizeof(Particle);
+		if (isKeyframe)
+		{
+			memcpy(payload, simulation->particles, payloadByteCount);
+		}
+		else
+		{
+			payloadByteCount = encodeDelta(history->recordedParticles, simulation->particles, particleCount, payload);
+		}
+		entry.isKeyframe = isKeyframe;
+		entry.byteCount = sizeof(HistoryEntry) + payloadByteCount;
+		memcpy(history->scratch, &entry, sizeof(entry));
+
+		if (!reserveHistoryBytes(history, entry.byteCount)) return;
+
+		// NOTE: a delta whose keyframe had to go to make room for it goes in as a keyframe instead
+		if (!isKeyframe && (history->keyframeCount == 0))
+		{
+			isKeyframe = true;
+			continue;
+		}
+		break;
+	}
+
+	if (history->entryCount == 0)
+	{
+		history->firstFrame = entry.frameIndex;
+	}
+	memcpy(history->buffer + history->tail, history->scratch, entry.byteCount);
+	history->tail += entry.byteCount;
+	history->entryCount++;
+	history->keyframeCount += isKeyframe;
+	history->framesSinceKeyframe = isKeyframe ? 0 : history->framesSinceKeyframe + 1;
+
+	reserveParticles(&history->recordedParticles, &history->recordedCapacity, particleCount);
+	memcpy(history->recordedParticles, simulation->particles, particleCount * sizeof(Particle));
+	history->recordedParticleCount = particleCount;
+}
+
+// NOTE: the cursor becomes the entry at offset, which comes right after the cursor or is a keyframe
+void
+decodeHistoryEntry(History* history, u64 offset)
+{
+	HistoryEntry entry = readHistoryEntry(history, offset);
+	u8* payload = history->buffer + offset + sizeof(HistoryEntry);
+	reserveParticles(&history->cursorParticles, &history->cursorCapacity, entry.particleCount);
+	if (entry.isKeyframe)
+	{
+		memcpy(history->cursorParticles, payload, entry.particleCount * sizeof(Particle));
+	}
+	else
+	{
+		assert(history->isCursorValid && (entry.frameIndex == history->cursorFrame + 1));
+		decodeDelta(payload, history->cursorParticles, entry.particleCount);
+	}
+	history->cursorParticleCount = entry.particleCount;
+	history->cursorFrame = entry.frameIndex;
+	history->cursorOffset = offset;
+	history->isCursorValid = true;
+}
+
+// NOTE: puts the simulation back the way it was at the frame, or the nearest one that is still there.
+// Going forward from the last sought frame only decodes the deltas in between, going back starts
+// over from the keyframe before the frame.
+u64
+seekHistory(History* history, Simulation* simulation, u64 frameIndex)
+{
+	if (history->entryCount == 0) return 0;
+	frameIndex = atLeast(history->firstFrame, atMost(lastHistoryFrame(history), frameIndex));
+
+	if (!history->isCursorValid || (history->cursorFrame > frameIndex))
+	{
+		u64 offset = history->head;
+		u64 keyframeOffset = offset;
+		for (u64 frame = history->firstFrame; frame < frameIndex; ++frame)
+		{
+			offset = nextHistoryOffset(history, offset);
+			if (readHistoryEntry(history, offset).isKeyframe) keyframeOffset = offset;
+		}
+		history->isCursorValid = false;
+		decodeHistoryEntry(history, keyframeOffset);
+	}
+	while (history->cursorFrame < frameIndex)
+	{
+		decodeHistoryEntry(history, nextHistoryOffset(history, history->cursorOffset));
+	}
+
+	HistoryEntry entry = readHistoryEntry(history, history->cursorOffset);
+	setParticleCount(simulation, entry.particleCount);
+	memcpy(simulation->particles, history->cursorParticles, entry.particleCount * sizeof(Particle));
+	simulation->dt = entry.state.dt;
+	simulation->timeLeftToSimulate = entry.state.timeLeftToSimulate;
+	simulation->stepCount = entry.state.stepCount;
+	simulation->hasSplitForces = entry.state.hasSplitForces;
+	simulation->random = entry.state.random;
+	simulation->temperature = entry.state.temperature;
+	simulation->viscosity = entry.state.viscosity;
+	simulation->gravityStrength = entry.state.gravityStrength;
+	simulation->potentialType = entry.state.potentialType;
+	simulation->isUsingPotentialTables = entry.state.isUsingPotentialTables;
+	simulation->isDragging = entry.state.isDragging;
+	simulation->mousePosition = entry.state.mousePosition;
+	simulation->draggedParticleIndex = entry.state.draggedParticleIndex;
+	return frameIndex;
+}
+
+// NOTE: forgets the frames after the last sought one, so recording goes on from there.
+// Call it before the simulation moves on from a frame it was rewound to.
+void
+truncateHistory(History* history)
+{
+	if (!history->isCursorValid) return;
+
+	history->tail = history->cursorOffset + readHistoryEntry(history, history->cursorOffset).byteCount;
+	history->entryCount = history->cursorFrame - history->firstFrame + 1;
+
+	history->keyframeCount = 0;
+	history->framesSinceKeyframe = 0;
+	u64 offset = history->head;
+	for (int entryIndex = 0; entryIndex < history->entryCount; ++entryIndex)
+	{
+		if (entryIndex > 0) offset = nextHistoryOffset(history, offset);
+		if (readHistoryEntry(history, offset).isKeyframe)
+		{
+			history->keyframeCount++;
+			history->framesSinceKeyframe = 0;
+		}
+		else
+		{
+			history->framesSinceKeyframe++;
+		}
+	}
+
+	reserveParticles(&history->recordedParticles, &history->recordedCapacity, history->cursorParticleCount);
+	memcpy(history->recordedParticles, history->cursorParticles, history->cursorParticleCount * sizeof(Particle));
+	history->recordedParticleCount = history->cursorParticleCount;
+}
+
+void
+freeHistory(History* history)
+{
+	free(history->buffer);
+	free(history->recordedParticles);
+	free(history->cursorParticles);
+	free(history->scratch);
+	*history = {};
+}
+
+#endif
@@ -0,0 +1,301 @@
+#ifndef live_state_h
+#define live_state_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "math_stuff.h"
+#include "threading.h"
+
+// NOTE: the layout of the shared memory segment a running simulation publishes its state into
+// (see live_state_publisher.h), and the reading side, which is all an outside tool needs to include.
+//
+// The segment holds two frames. The publisher always writes the one readers weren't sent to last,
+// and then points them at it, so a reader only ever races the publisher when it takes longer than
+// a whole frame to look at one. Each frame has a sequence number that is odd while the frame is
+// being written (a seqlock): a reader notes it, reads the frame in place, and checks it again
+// afterwards. If it changed, what was read may be torn and the reader tries again. The publisher
+// never waits for anyone, and nothing is copied on the way unless the reader wants a copy.
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define HAS_LIVE_STATE 1
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define liveStateMagic 0x4576694C // "Live"
+#define liveStateVersion 1
+#define defaultLiveStateName "/many_tiny_things"
+
+// NOTE: averages are per particle, in the simulation's units where k is 1
+struct LiveStateObservables {
+	f64 kineticEnergy;
+	f64 potentialEnergy;
+	f64 measuredTemperature;
+	V2 momentum;
+
+	// the thermostat and field the frame was simulated with
+	f32 temperature;
+	f32 viscosity;
+	f64 gravityStrength;
+};
+
+// NOTE: the start of each of the two frames, followed by its arrays at the offsets in LiveStateHeader
+struct LiveStateFrame {
+	// odd while the publisher writes the frame
+	volatile s32 sequence;
+	s32 particleCount;
+	s32 wallCount;
+
+	u64 frameIndex;
+	u64 stepCount;
+	f64 time;
+	f64 boxWidth;
+	f64 boxHeight;
+
+	LiveStateObservables observables;
+};
+
+struct LiveStateHeader {
+	// NOTE: written last, once the rest of the header is there
+	volatile s32 magic;
+	s32 version;
+	u64 byteCount;
+
+	s32 particleCapacity;
+	s32 wallCapacity;
+	u64 frameOffsets[2];
+
+	// NOTE: from the start of a frame; the walls are a start and an end point each
+	u64 positionsOffset;
+	u64 velocitiesOffset;
+	u64 speciesOffset;
+	u64 wallPointsOffset;
+
+	// the frame readers should look at, -1 before the first one
+	volatile s32 latestFrame;
+	// NOTE: set when the publisher leaves the segment, either for good or for a bigger one
+	// under the same name, which readers then open again
+	volatile s32 isAbandoned;
+	s32 publisherProcess;
+};
+
+// NOTE: every array starts on its own cache line
+inline u64
+alignLiveStateOffset(u64 offset)
+{
+	return (offset + 63) & ~(u64) 63;
+}
+
+// NOTE: fills in the sizes and offsets of a segment with room for the given counts
+void
+layOutLiveState(LiveStateHeader* header, int particleCapacity, int wallCapacity)
+{
+	header->version = liveStateVersion;
+	header->particleCapacity = particleCapacity;
+	header->wallCapacity = wallCapacity;
+
+	u64 frameByteCount = alignLiveStateOffset(sizeof(LiveStateFrame));
+	header->positionsOffset = frameByteCount;
+	frameByteCount = alignLiveStateOffset(frameByteCount + particleCapacity * sizeof(V2));
+	header->velocitiesOffset = frameByteCount;
+	frameByteCount = alignLiveStateOffset(frameByteCount + particleCapacity * sizeof(V2));
+	header->speciesOffset = frameByteCount;
+	frameByteCount = alignLiveStateOffset(frameByteCount + particleCapacity * sizeof(s32));
+	header->wallPointsOffset = frameByteCount;
+	frameByteCount = alignLiveStateOffset(frameByteCount + 2 * wallCapacity * sizeof(V2));
+
+	header->frameOffsets[0] = alignLiveStateOffset(sizeof(LiveStateHeader));
+	header->frameOffsets[1] = header->frameOffsets[0] + frameByteCount;
+	header->byteCount = header->frameOffsets[1] + frameByteCount;
+}
+
+//
+// Reading
+//
+
+struct LiveStateReader {
+	char name[256];
+	LiveStateHeader* header;
+	u64 byteCount;
+
+	// how often a frame changed under a reader, for the curious
+	u64 retryCount;
+};
+
+// NOTE: a frame in place in the segment, only to be trusted once isLiveStateViewIntact says so
+struct LiveStateView {
+	LiveStateFrame* frame;
+	s32 sequence;
+
+	// clamped to the capacity, since a torn count could be anything
+	int particleCount;
+	int wallCount;
+	V2* positions;
+	V2* velocities;
+	s32* species;
+	V2* wallPoints;
+};
+
+void
+closeLiveStateReader(LiveStateReader* reader)
+{
+	if (reader->header)
+	{
+		munmap(reader->header, reader->byteCount);
+	}
+	reader->header = 0;
+	reader->byteCount = 0;
+}
+
+// NOTE: false while nothing is published under the name
+bool
+openLiveStateReader(LiveStateReader* reader, const char* name)
+{
+	closeLiveStateReader(reader);
+	if (name != reader->name)
+	{
+		snprintf(reader->name, sizeof(reader->name), "%s", name);
+	}
+
+	int file = shm_open(reader->name, O_RDONLY, 0);
+	if (file < 0) return false;
+
+	// NOTE: the publisher sizes the segment before it fills in the header, so a fresh one can still be empty
+	struct stat status;
+	bool isValid = (fstat(file, &status) == 0) && ((u64) status.st_size >= sizeof(LiveStateHeader));
+	void* memory = isValid ? mmap(0, status.st_size, PROT_READ, MAP_SHARED, file, 0) : MAP_FAILED;
+	close(file);
+	if (memory == MAP_FAILED) return false;
+
+	LiveStateHeader* header = (LiveStateHeader*)memory;
+	if ((atomicLoad(&header->magic) != liveStateMagic) ||
+		(header->version != liveStateVersion) ||
+		(header->byteCount > (u64) status.st_size))
+	{
+		munmap(memory, status.st_size);
+		return false;
+	}
+
+	reader->header = header;
+	reader->byteCount = status.st_size;
+	return true;
+}
+
+// NOTE: follows the publisher to a bigger segment, false when there is no publisher (anymore)
+bool
+updateLiveStateReader(LiveStateReader* reader)
+{
+	if (reader->header && !atomicLoad(&reader->header->isAbandoned)) return true;
+	return openLiveStateReader(reader, reader->name);
+}
+
+// NOTE: false when there is no frame yet
+bool
+beginLiveStateView(LiveStateReader* reader, LiveStateView* view)
+{
+	LiveStateHeader* header = reader->header;
+	if (!header) return false;
+
+	while (true)
+	{
+		s32 frameIndex = atomicLoad(&header->latestFrame);
+		if ((frameIndex != 0) && (frameIndex != 1)) return false;
+
+		u8* frameBytes = (u8*)header + header->frameOffsets[frameIndex];
+		LiveStateFrame* frame = (LiveStateFrame*)frameBytes;
+		view->sequence = atomicLoad(&frame->sequence);
+		if (view->sequence & 1)
+		{
+			// NOTE: the publisher went around twice since we read latestFrame, so there is a newer one
+			reader->retryCount++;
+			continue;
+		}
+
+		view->frame = frame;
+		view->particleCount = atLeast(0, atMost(header->particleCapacity, frame->particleCount));
+		view->wallCount = atLeast(0, atMost(header->wallCapacity, frame->wallCount));
+		view->positions = (V2*) (frameBytes + header->positionsOffset);
+		view->velocities = (V2*) (frameBytes + header->velocitiesOffset);
+		view->species = (s32*) (frameBytes + header->speciesOffset);
+		view->wallPoints = (V2*) (frameBytes + header->wallPointsOffset);
+		return true;
+	}
+}
+
+// NOTE: whether everything read through view since beginLiveStateView belongs to one frame
+bool
+isLiveStateViewIntact(LiveStateView* view)
+{
+	acquireFence();
+	return view->frame->sequence == view->sequence;
+}
+
+struct LiveStateCopy {
+	LiveStateFrame frame;
+	int capacity;
+	V2* positions;
+	V2* velocities;
+	s32* species;
+	int wallCapacity;
+	V2* wallPoints;
+};
+
+// NOTE: for readers that want to keep a frame, copies the latest one out, retrying until the copy is whole
+bool
+copyLiveState(LiveStateReader* reader, LiveStateCopy* copy)
+{
+	LiveStateView view;
+	while (beginLiveStateView(reader, &view))
+	{
+		if (view.particleCount > copy->capacity)
+		{
+			copy->capacity = 2 * view.particleCount;
+			copy->positions = (V2*) realloc(copy->positions, copy->capacity * sizeof(V2));
+			copy->velocities = (V2*) realloc(copy->velocities, copy->capacity * sizeof(V2));
+			copy->species = (s32*) realloc(copy->species, copy->capacity * sizeof(s32));
+		}
+		if (view.wallCount > copy->wallCapacity)
+		{
+			copy->wallCapacity = 2 * view.wallCount;
+			copy->wallPoints = (V2*) realloc(copy->wallPoints, 2 * copy->wallCapacity * sizeof(V2));
+		}
+
+		memcpy(&copy->frame, view.frame, sizeof(LiveStateFrame));
+		memcpy(copy->positions, view.positions, view.particleCount * sizeof(V2));
+		memcpy(copy->velocities, view.velocities, view.particleCount * sizeof(V2));
+		memcpy(copy->species, view.species, view.particleCount * sizeof(s32));
+		memcpy(copy->wallPoints, view.wallPoints, 2 * view.wallCount * sizeof(V2));
+
+		if (isLiveStateViewIntact(&view))
+		{
+			copy->frame.particleCount = view.particleCount;
+			copy->frame.wallCount = view.wallCount;
+			return true;
+		}
+		reader->retryCount++;
+	}
+	return false;
+}
+
+void
+freeLiveStateCopy(LiveStateCopy* copy)
+{
+	free(copy->positions);
+	free(copy->velocities);
+	free(copy->species);
+	free(copy->wallPoints);
+	*copy = {};
+}
+
+#else
+#define HAS_LIVE_STATE 0
+#endif
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef live_state_publisher_h
+#define live_state_publisher_h
+
+#include "particle_simulation.h"
+#include "live_state.h"
+
+// NOTE: the writing side of live_state.h. Publishing is a pass over the particles that copies their
+// positions, velocities and species into the frame readers aren't looking at, and sums the observables
+// on the way; it never waits for a reader.
+
+#if HAS_LIVE_STATE
+
+struct LiveStatePublisher {
+	char name[256];
+	LiveStateHeader* header;
+	u64 publishedCount;
+};
+
+// NOTE: whatever was under the name before is unlinked first, most likely left over from a run that crashed.
+// Readers that still have it mapped keep it until they notice it is abandoned.
+LiveStateHeader*
+createLiveStateSegment(const char* name, int particleCapacity, int wallCapacity)
+{
+	LiveStateHeader layout = {};
+	layOutLiveState(&layout, particleCapacity, wallCapacity);
+
+	shm_unlink(name);
+	int file = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (file < 0)
+	{
+		perror("shm_open");
+		return 0;
+	}
+	if (ftruncate(file, layout.byteCount) != 0)
+	{
+		perror("ftruncate");
+		close(file);
+		shm_unlink(name);
+		return 0;
+	}
+	void* memory = mmap(0, layout.byteCount, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	close(file);
+	if (memory == MAP_FAILED)
+	{
+		perror("mmap");
+		shm_unlink(name);
+		return 0;
+	}
+
+	LiveStateHeader* header = (LiveStateHeader*)memory;
+	*header = layout;
+	header->latestFrame = -1;
+	header->publisherProcess = getpid();
+	atomicStore(&header->magic, liveStateMagic);
+	return header;
+}
+
+void
+initLiveStatePublisher(LiveStatePublisher* publisher, const char* name)
+{
+	*publisher = {};
+	snprintf(publisher->name, sizeof(publisher->name), "%s", name);
+}
+
+// NOTE: false when there is no segment to publish into
+bool
+publishLiveState(LiveStatePublisher* publisher, Simulation* simulation, u64 frameIndex, f64 time)
+{
+	LiveStateHeader* header = publisher->header;
+	int particleCount = simulation->particleCount;
+	int wallCount = simulation->wallCount;
+
+	if (!header || (particleCount > header->particleCapacity) || (wallCount > header->wallCapacity))
+	{
+		// NOTE: the layout is fixed once readers have it, so more particles means a new segment
+		LiveStateHeader* newHeader = createLiveStateSegment(publisher->name, atLeast(1024, 2 * particleCount), atLeast(16, 2 * wallCount));
+		if (header)
+		{
+			atomicStore(&header->isAbandoned, 1);
+			munmap(header, header->byteCount);
+		}
+		publisher->header = header = newHeader;
+		if (!header) return false;
+	}
+
+	s32 frameSlot = (header->latestFrame == 0) ? 1 : 0;
+	u8* frameBytes = (u8*)header + header->frameOffsets[frameSlot];
+	LiveStateFrame* frame = (LiveStateFrame*)frameBytes;
+
+	s32 sequence = frame->sequence + 1;
+	frame->sequence = sequence;
+	releaseFence();
+
+	V2* positions = (V2*) (frameBytes + header->positionsOffset);
+	V2* velocities = (V2*) (frameBytes + header->velocitiesOffset);
+	s32* species = (s32*) (frameBytes + header->speciesOffset);
+	V2* wallPoints = (V2*) (frameBytes + header->wallPointsOffset);
+
+	for (int particleIndex = 0; particleIndex < particleCount; ++particleIndex)
+	{
+		Particle* particle = simulation->particles + particleIndex;
+		positions[particleIndex] = particle->position;
+		velocities[particleIndex] = particle->velocity;
+		species[particleIndex] = particle->species;
+	}
+	for (int wallIndex = 0; wallIndex < wallCount; ++wallIndex)
+	{
+		wallPoints[2 * wallIndex + 0] = simulation->walls[wallIndex].start;
+		wallPoints[2 * wallIndex + 1] = simulation->walls[wallIndex].end;
+	}
+
+	SimulationObservables measured = measureObservables(simulation);
+	LiveStateObservables observables = {};
+	observables.kineticEnergy = measured.kineticEnergy;
+	observables.potentialEnergy = measured.potentialEnergy;
+	observables.measuredTemperature = measured.measuredTemperature;
+	observables.momentum = measured.momentum;
+	observables.temperature = simulation->temperature;
+	observables.viscosity = simulation->viscosity;
+	observables.gravityStrength = simulation->gravityStrength;
+
+	frame->particleCount = particleCount;
+	frame->wallCount = wallCount;
+	frame->frameIndex = frameIndex;
+	frame->stepCount = simulation->stepCount;
+	frame->time = time;
+	frame->boxWidth = simulation->boxWidth;
+	frame->boxHeight = simulation->boxHeight;
+	frame->observables = observables;
+
+	atomicStore(&frame->sequence, sequence + 1);
+	atomicStore(&header->latestFrame, frameSlot);
+	publisher->publishedCount++;
+	return true;
+}
+
+// NOTE: readers see the segment abandoned and fail to open it again
+void
+closeLiveStatePublisher(LiveStatePublisher* publisher)
+{
+	LiveStateHeader* header = publisher->header;
+	if (header)
+	{
+		atomicStore(&header->isAbandoned, 1);
+		munmap(header, header->byteCount);
+		shm_unlink(publisher->name);
+	}
+	publisher->header = 0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,85 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "live_state.h"
+
+// NOTE: an example reader of the state a running headless publishes, which prints its observables a few
+// times a second, along with a couple of things worked out from the particles in place.
+//
+//     live_state_viewer [shared memory name] [seconds between lines]
+//
+//     ./headless 100000 10000 . none 0 0 /many_tiny_things &
+//     ./live_state_viewer /many_tiny_things 0.5
+
+void
+sleepSeconds(f64 seconds)
+{
+	timespec duration;
+	duration.tv_sec = (time_t) seconds;
+	duration.tv_nsec = (long) (1e9 * (seconds - duration.tv_sec));
+	nanosleep(&duration, 0);
+}
+
+int
+main(int argumentCount, char** arguments)
+{
+	const char* name = (argumentCount > 1) ? arguments[1] : defaultLiveStateName;
+	f64 interval = (argumentCount > 2) ? atof(arguments[2]) : 0.5;
+
+	LiveStateReader reader = {};
+	printf("Waiting for %s.\n", name);
+	while (!openLiveStateReader(&reader, name))
+	{
+		sleepSeconds(0.1);
+	}
+	printf("frame\ttime\tparticles\ttemperature\tkinetic\tpotential\tmomentum_x\tmomentum_y\tcenter_x\tcenter_y\tmax_speed\tretries\n");
+
+	while (true)
+	{
+		if (!updateLiveStateReader(&reader))
+		{
+			printf("The publisher is gone.\n");
+			break;
+		}
+
+		// NOTE: straight from the segment, without a copy; if the frame changed meanwhile, look again
+		LiveStateView view;
+		bool isIntact = false;
+		V2 center = {};
+		f32 maxSpeedSquared = 0;
+		while (!isIntact && beginLiveStateView(&reader, &view))
+		{
+			center = {};
+			maxSpeedSquared = 0;
+			for (int particleIndex = 0; particleIndex < view.particleCount; ++particleIndex)
+			{
+				center += view.positions[particleIndex];
+				maxSpeedSquared = max(maxSpeedSquared, square(view.velocities[particleIndex]));
+			}
+			center = center / (f32) atLeast(1, view.particleCount);
+
+			LiveStateFrame frame = *view.frame;
+			isIntact = isLiveStateViewIntact(&view);
+			if (!isIntact)
+			{
+				reader.retryCount++;
+				continue;
+			}
+
+			LiveStateObservables* observables = &frame.observables;
+			printf("%llu\t%.2f\t%d\t%.4f\t%.4f\t%.4f\t%.4f\t%.4f\t%.3f\t%.3f\t%.3f\t%llu\n",
+				(unsigned long long) frame.frameIndex, frame.time, view.particleCount, observables->measuredTemperature,
+				observables->kineticEnergy, observables->potentialEnergy, observables->momentum.x, observables->momentum.y,
+				center.x, center.y, sqrtf(maxSpeedSquared), (unsigned long long) reader.retryCount);
+			fflush(stdout);
+		}
+
+		sleepSeconds(interval);
+	}
+
+	closeLiveStateReader(&reader);
+	return 0;
+}
@@ -27,6 +27,11 @@
 #include <math.h>
 
 #include "particle_simulation.h"
+#include "cluster_analysis.h"
+#include "event_driven.h"
+#include "threading.h"
+#include "density_field.h"
+#include "history.h"
 
 #define multilineString(src) #src
 
@@ -42,8 +47,31 @@ struct Renderer {
 
     GLuint positionAttribute;
     GLuint colorAttribute;
+
+    // ! density field
+
+    GLuint densityProgramObject;
+    GLuint densityQuadBuffer;
+    GLuint densityTexture;
+    GLuint densityPositionAttribute;
+    GLuint densityTextureUniform;
+};
+
+struct VertexColor {
+    V2 vertex;
+    Color4 color;
 };
 
+#define discVertexCount 20
+#define discTriangleCount (discVertexCount - 2)
+
+// NOTE: more particles in view than this per pixel and they are drawn as a density field instead of discs
+#define densityFieldParticlesPerPixel 0.25
+
+#define historyByteCount mebi(64)
+// NOTE: how many recorded frames go by per frame while rewinding or replaying
+#define replaySpeed 4
+
 struct LoopData
 {
     bool isInitialized;
@@ -51,8 +79,44 @@ struct LoopData
     f64 timestamp;
     Renderer renderer;
     Simulation simulation;
+    ClusterAnalysis clusterAnalysis;
+    // NOTE: the analysis is a frame old, so particles added since then have no cluster yet
+    int analyzedParticleCount;
+    EventDrivenEngine eventDrivenEngine;
     
     bool isCKeyDown;
+    bool isColoringClusters;
+    bool isEventDriven;
+    bool isForcingDensityField;
+
+    // ! history
+
+    History history;
+    // NOTE: while reviewing, the simulation is stopped at a frame of the history, until something resumes it
+    bool isReviewing;
+    u64 reviewedFrame;
+    // recorded frames per frame, negative is backwards
+    int reviewVelocity;
+
+    // ! view
+
+    // NOTE: 1 shows the whole box
+    f64 zoom;
+    V2 viewCenter;
+
+    // ! frame
+
+    f64 elapsedSimulationTime;
+    V2 discVertices[discVertexCount];
+
+    int frameParticleCount;
+    int frameParticleCapacity;
+    FrameParticle* frameParticles;
+    int particleVertexCapacity;
+    VertexColor* particleVertices;
+
+    bool isDrawingDensityField;
+    DensityField densityField;
 };
 
 GLuint
@@ -82,6 +146,37 @@ loadShader(GLenum type, const char* shaderSrc)
     return shader;
 }
 
+GLuint
+loadProgram(const char* vertexShaderSource, const char* fragmentShaderSource)
+{
+    GLuint vertexShader = loadShader(GL_VERTEX_SHADER, vertexShaderSource);
+    GLuint fragmentShader = loadShader(GL_FRAGMENT_SHADER, fragmentShaderSource);
+
+    GLuint programObject = glCreateProgram();
+    if (programObject == 0)
+        return 0;
+
+    glAttachShader(programObject, vertexShader);
+    glAttachShader(programObject, fragmentShader);
+
+
+    GLint isLinked;
+    glLinkProgram(programObject);
+    glGetProgramiv(programObject, GL_LINK_STATUS, &isLinked);
+    if (!isLinked) {
+        GLint infoLen = 0;
+        glGetProgramiv(programObject, GL_INFO_LOG_LENGTH, &infoLen);
+        if (infoLen > 1) {
+            char* infoLog = (char*)malloc(sizeof(char) * infoLen);
+            glGetProgramInfoLog(programObject, infoLen, NULL, infoLog);
+            printf("Error linking program:\n%s\n", infoLog);
+            free(infoLog);
+        }
+        glDeleteProgram(programObject);
+        return 0;
+    }
+    return programObject;
+}
 
 int
 initRenderer(Renderer* renderer)
@@ -117,36 +212,12 @@ initRenderer(Renderer* renderer)
     );
 
 
-    GLuint vertexShader = loadShader(GL_VERTEX_SHADER, vertexShaderSource);
-    GLuint fragmentShader = loadShader(GL_FRAGMENT_SHADER, fragmentShaderSource);
-
-    GLuint programObject = glCreateProgram();
+    GLuint programObject = loadProgram(vertexShaderSource, fragmentShaderSource);
     if (programObject == 0)
-        return 0;
+        return GL_FALSE;
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    glAttachShader(programObject, vertexShader);
-    glAttachShader(programObject, fragmentShader);
-
-
-    GLint isLinked;
-    glLinkProgram(programObject);
-    glGetProgramiv(programObject, GL_LINK_STATUS, &isLinked);
-    if (!isLinked) {
-        GLint infoLen = 0;
-        glGetProgramiv(programObject, GL_INFO_LOG_LENGTH, &infoLen);
-        if (infoLen > 1) {
-            char* infoLog = (char*)malloc(sizeof(char) * infoLen);
-            glGetProgramInfoLog(programObject, infoLen, NULL, infoLog);
-            printf("Error linking program:\n%s\n", infoLog);
-            free(infoLog);
-        }
-        glDeleteProgram(programObject);
-        return GL_FALSE;
-    }
-
-
     renderer->programObject = programObject;
 
     glUseProgram(programObject);
@@ -158,14 +229,77 @@ initRenderer(Renderer* renderer)
     renderer->translateUniform = glGetUniformLocation(programObject, "translate");
     renderer->scaleUniform = glGetUniformLocation(programObject, "scale");
 
+    // ! density field, a quad covering the window
+
+    const char* densityVertexShaderSource =
+    multilineString(
+
+         attribute vec2 position;
+
+         varying vec2 TextureCoordinate;
+
+         void main()
+         {
+             TextureCoordinate = 0.5 * position + 0.5;
+             gl_Position = vec4(position, 0.0, 1.0);
+         }
+    );
+
+    const char* densityFragmentShaderSource =
+    multilineString(
+		precision mediump float;
+        uniform sampler2D density;
+        varying vec2 TextureCoordinate;
+
+        void main() {
+			gl_FragColor = texture2D(density, TextureCoordinate);
+        }
+    );
+
+    GLuint densityProgramObject = loadProgram(densityVertexShaderSource, densityFragmentShaderSource);
+    if (densityProgramObject == 0)
+        return GL_FALSE;
+
+    renderer->densityProgramObject = densityProgramObject;
+    renderer->densityPositionAttribute = glGetAttribLocation(densityProgramObject, "position");
+    renderer->densityTextureUniform = glGetUniformLocation(densityProgramObject, "density");
+
+    f32 quadVertices[] = {-1, -1, 1, -1, -1, 1, 1, 1};
+    glGenBuffers(1, &renderer->densityQuadBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, renderer->densityQuadBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), quadVertices, GL_STATIC_DRAW);
+
+    // NOTE: one texel per pixel, so no filtering, and no mipmaps, which the window size wouldn't allow in WebGL 1
+    glGenTextures(1, &renderer->densityTexture);
+    glBindTexture(GL_TEXTURE_2D, renderer->densityTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
     return GL_TRUE;
 }
 
-struct VertexColor {
-    V2 vertex;
-    Color4 color;
-};
+void
+drawDensityField(Renderer* renderer, DensityField* field)
+{
+    glUseProgram(renderer->densityProgramObject);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, renderer->densityTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, field->width, field->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, field->texels);
+    glUniform1i(renderer->densityTextureUniform, 0);
 
+    GLuint positionAttribute = renderer->densityPositionAttribute;
+    glBindBuffer(GL_ARRAY_BUFFER, renderer->densityQuadBuffer);
+    glEnableVertexAttribArray(positionAttribute);
+    glVertexAttribPointer(positionAttribute, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glDisableVertexAttribArray(positionAttribute);
+
+    glUseProgram(renderer->programObject);
+}
 
 f64
 getTime()
@@ -178,14 +312,159 @@ getTime()
 }
 
 V2
-worldFromPixel(Simulation* simulation, int x, int y)
+worldFromPixel(LoopData* loopData, int x, int y)
 {
+    Simulation* simulation = &loopData->simulation;
     V2 result;
-    result.x = ((x / ((f64) windowPixelWidth)) - 0.5) * simulation->boxWidth;
-    result.y = -((y / ((f64) windowPixelHeight)) - 0.5) * simulation->boxHeight;
+    result.x = loopData->viewCenter.x + ((x / ((f64) windowPixelWidth)) - 0.5) * simulation->boxWidth / loopData->zoom;
+    result.y = loopData->viewCenter.y - ((y / ((f64) windowPixelHeight)) - 0.5) * simulation->boxHeight / loopData->zoom;
     return result;
 }
 
+// NOTE: zooms by factor, keeping the world point under the pixel where it is, and the view inside the box
+void
+zoomView(LoopData* loopData, f64 factor, int x, int y)
+{
+    Simulation* simulation = &loopData->simulation;
+    V2 anchor = worldFromPixel(loopData, x, y);
+    f64 zoom = atLeast(1.0, loopData->zoom * factor);
+    V2 center = anchor + (loopData->zoom / zoom) * (loopData->viewCenter - anchor);
+
+    f64 maxOffsetX = 0.5 * simulation->boxWidth * (1 - 1 / zoom);
+    f64 maxOffsetY = 0.5 * simulation->boxHeight * (1 - 1 / zoom);
+    loopData->viewCenter.x = atLeast(-maxOffsetX, atMost(maxOffsetX, (f64) center.x));
+    loopData->viewCenter.y = atLeast(-maxOffsetY, atMost(maxOffsetY, (f64) center.y));
+    loopData->zoom = zoom;
+}
+
+//
+// Frame graph
+//
+
+// NOTE: after the events are handled, the particles are copied out, and then stepping the simulation
+// and building the particle vertices (or the density field) from the copy run side by side on the task graph.
+// The drawing is one step behind the simulation, which nobody can see.
+
+void
+snapshotFrameTask(void* data)
+{
+    LoopData* loopData = (LoopData*)data;
+    Simulation* simulation = &loopData->simulation;
+
+    int particleCount = simulation->particleCount;
+    if (particleCount > loopData->frameParticleCapacity)
+    {
+        loopData->frameParticleCapacity = 2 * particleCount;
+        loopData->frameParticles = (FrameParticle*) realloc(loopData->frameParticles, loopData->frameParticleCapacity * sizeof(FrameParticle));
+    }
+    // NOTE: the discs take a kilobyte per particle, so they are only allocated once they are drawn
+    if (!loopData->isDrawingDensityField && (particleCount > loopData->particleVertexCapacity))
+    {
+        loopData->particleVertexCapacity = 2 * particleCount;
+        int vertexCount = 3 * discTriangleCount * loopData->particleVertexCapacity;
+        loopData->particleVertices = (VertexColor*) realloc(loopData->particleVertices, vertexCount * sizeof(VertexColor));
+    }
+    loopData->frameParticleCount = particleCount;
+
+    for (int particleIndex = 0; particleIndex < particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        FrameParticle* frameParticle = loopData->frameParticles + particleIndex;
+        frameParticle->position = particle->position;
+        frameParticle->radius = particle->radius;
+        frameParticle->color = particle->color;
+        if (loopData->isColoringClusters && (particleIndex < loopData->analyzedParticleCount))
+        {
+            frameParticle->color = clusterColor(&loopData->clusterAnalysis, particleIndex);
+        }
+    }
+
+    if (loopData->isDrawingDensityField)
+    {
+        V2 halfView = v2(0.5 * simulation->boxWidth / loopData->zoom, 0.5 * simulation->boxHeight / loopData->zoom);
+        binDensityField(&loopData->densityField, loopData->frameParticles, particleCount,
+                        loopData->viewCenter - halfView, loopData->viewCenter + halfView);
+    }
+}
+
+void
+advanceFrameTask(void* data)
+{
+    LoopData* loopData = (LoopData*)data;
+    Simulation* simulation = &loopData->simulation;
+
+    if (loopData->isReviewing) return;
+
+    if (loopData->isEventDriven)
+    {
+        advanceEventDriven(&loopData->eventDrivenEngine, simulation, loopData->elapsedSimulationTime);
+    }
+    else
+    {
+        advanceSimulation(simulation, loopData->elapsedSimulationTime);
+    }
+
+    if (loopData->isColoringClusters)
+    {
+        analyzeClusters(simulation, &loopData->clusterAnalysis);
+        loopData->analyzedParticleCount = simulation->particleCount;
+    }
+
+    recordHistory(&loopData->history, simulation);
+}
+
+// NOTE: goes on from the reviewed frame, which forgets the frames that came after it
+void
+resumeFromHistory(LoopData* loopData)
+{
+    if (!loopData->isReviewing) return;
+
+    seekHistory(&loopData->history, &loopData->simulation, loopData->reviewedFrame);
+    truncateHistory(&loopData->history);
+    loopData->isReviewing = false;
+    loopData->reviewVelocity = 0;
+    loopData->analyzedParticleCount = 0;
+    if (loopData->isEventDriven)
+    {
+        initEventDriven(&loopData->eventDrivenEngine, &loopData->simulation);
+    }
+    printf("Resumed from frame %llu.\n", (unsigned long long) loopData->reviewedFrame);
+}
+
+void
+particleVerticesFrameChunk(void* data, int startIndex, int endIndex)
+{
+    LoopData* loopData = (LoopData*)data;
+    V2* discVertices = loopData->discVertices;
+    VertexColor* bufferCursor = loopData->particleVertices + 3 * discTriangleCount * startIndex;
+
+    for (int particleIndex = startIndex; particleIndex < endIndex; ++particleIndex) {
+
+        FrameParticle* particle = loopData->frameParticles + particleIndex;
+        Color4 color = particle->color;
+
+        V2 firstVertex = particle->position + particle->radius * discVertices[0];
+        V2 secondVertex = particle->position + particle->radius * discVertices[1];
+
+        for (int triangleIndex = 0; triangleIndex < discTriangleCount; ++triangleIndex) {
+            bufferCursor->vertex = firstVertex;
+            bufferCursor->color = color;
+            ++bufferCursor;
+
+            bufferCursor->vertex = secondVertex;
+            bufferCursor->color = color;
+            ++bufferCursor;
+
+            V2 thirdVertex = particle->position + particle->radius * discVertices[triangleIndex + 2];
+
+            bufferCursor->vertex = thirdVertex;
+            bufferCursor->color = color;
+            ++bufferCursor;
+
+            secondVertex = thirdVertex;
+        }
+    }
+}
 
 void
 loop(void* argument)
@@ -205,7 +484,29 @@ loop(void* argument)
         defaultWalls(simulation);
         simulation->temperature = 1;
         simulation->viscosity = 0.05;
+        loopData->zoom = 1;
+        initHistory(&loopData->history, historyByteCount);
         //evaporationSetup(simulation);
+        //binaryMixtureSetup(simulation);
+        //electrolyteSetup(simulation);
+        //selfGravitySetup(simulation);
+        //polymerChainsSetup(simulation, 20);
+
+        f64 angle = tau / discVertexCount;
+        f64 c = cos(angle);
+        f64 s = sin(angle);
+
+        V2 spoke = v2(1, 0);
+        for (int vertexIndex = 0; vertexIndex < discVertexCount; vertexIndex++)
+        {
+            loopData->discVertices[vertexIndex] = spoke;
+
+            // rotate spoke
+            f64 x = spoke.x;
+            f64 y = spoke.y;
+            spoke.x = c * x - s * y;
+            spoke.y = s * x + c * y;
+        }
     }
 
     // ! Timekeeping
@@ -216,9 +517,7 @@ loop(void* argument)
     f64 maxFrameTime = 1.0 / 60.0;
     elapsedSeconds = atMost(maxFrameTime, elapsedSeconds);
     f64 simulatedTimePerSecond = 5;
-    f64 elapsedSimulationTime = elapsedSeconds * simulatedTimePerSecond;
-    
-    advanceSimulation(simulation, elapsedSimulationTime);
+    loopData->elapsedSimulationTime = elapsedSeconds * simulatedTimePerSecond;
 
     SDL_Event event;
     while (SDL_PollEvent(&event) != 0)
@@ -231,8 +530,9 @@ loop(void* argument)
 
         if (event.type == SDL_MOUSEBUTTONDOWN)
         {
+            resumeFromHistory(loopData);
             
-            V2 mousePosition = worldFromPixel(simulation, event.button.x, event.button.y);
+            V2 mousePosition = worldFromPixel(loopData, event.button.x, event.button.y);
             int pickedParticleIndex = pickParticle(simulation, mousePosition);
             
             if (pickedParticleIndex >= 0)
@@ -243,6 +543,13 @@ loop(void* argument)
             }
         }
 
+        if (event.type == SDL_MOUSEWHEEL)
+        {
+            int x, y;
+            SDL_GetMouseState(&x, &y);
+            zoomView(loopData, pow(1.25, event.wheel.y), x, y);
+        }
+
         if (event.type == SDL_MOUSEBUTTONUP)
         {
             if (simulation->isDragging)
@@ -253,7 +560,7 @@ loop(void* argument)
 
         if (event.type == SDL_MOUSEMOTION)
         {
-            simulation->mousePosition = worldFromPixel(simulation, event.motion.x, event.motion.y);
+            simulation->mousePosition = worldFromPixel(loopData, event.motion.x, event.motion.y);
             int pickedParticleIndex = pickParticle(simulation, simulation->mousePosition);
             if (loopData->isCKeyDown && (pickedParticleIndex < 0)) {
                 Particle* particle = addParticle(simulation);
@@ -269,11 +576,60 @@ loop(void* argument)
             SDL_Scancode scancode = event.key.keysym.scancode;
 			if (scancode == SDL_SCANCODE_R)
 			{
+                resumeFromHistory(loopData);
                 defaultParticles(simulation);
 			}
             else if (scancode == SDL_SCANCODE_C)
             {
+                resumeFromHistory(loopData);
                 loopData->isCKeyDown = true;
+            }
+            else if (scancode == SDL_SCANCODE_K)
+            {
+                loopData->isColoringClusters = !loopData->isColoringClusters;
+                loopData->analyzedParticleCount = 0;
+            }
+            else if (scancode == SDL_SCANCODE_P)
+            {
+                resumeFromHistory(loopData);
+                simulation->potentialType = (PotentialType) ((simulation->potentialType + 1) % PotentialType_Count);
+                printf("Using %s potential.\n", potentialNames[simulation->potentialType]);
+            }
+            else if (scancode == SDL_SCANCODE_E)
+            {
+                resumeFromHistory(loopData);
+                loopData->isEventDriven = !loopData->isEventDriven;
+                if (loopData->isEventDriven)
+                {
+                    initEventDriven(&loopData->eventDrivenEngine, simulation);
+                }
+                printf("Event-driven hard disks %s.\n", loopData->isEventDriven ? "on" : "off");
+            }
+            else if (scancode == SDL_SCANCODE_T)
+            {
+                resumeFromHistory(loopData);
+                simulation->isUsingPotentialTables = !simulation->isUsingPotentialTables;
+                printf("Potential tables %s.\n", simulation->isUsingPotentialTables ? "on" : "off");
+            }
+            else if (scancode == SDL_SCANCODE_D)
+            {
+                loopData->isForcingDensityField = !loopData->isForcingDensityField;
+                printf("Density field at any particle count %s.\n", loopData->isForcingDensityField ? "on" : "off");
+            }
+            else if ((scancode == SDL_SCANCODE_LEFT) || (scancode == SDL_SCANCODE_RIGHT))
+            {
+                // NOTE: held down, the arrows rewind and replay, and the simulation stays where they leave it
+                if (!loopData->isReviewing && (loopData->history.entryCount > 0))
+                {
+                    loopData->isReviewing = true;
+                    loopData->reviewedFrame = lastHistoryFrame(&loopData->history);
+                    printf("Reviewing history, space resumes from the frame shown.\n");
+                }
+                loopData->reviewVelocity = (scancode == SDL_SCANCODE_LEFT) ? -replaySpeed : replaySpeed;
+            }
+            else if (scancode == SDL_SCANCODE_SPACE)
+            {
+                resumeFromHistory(loopData);
             }
 		}
         
@@ -283,7 +639,46 @@ loop(void* argument)
             if (scancode == SDL_SCANCODE_C) {
                 loopData->isCKeyDown = false;
             }
+            else if ((scancode == SDL_SCANCODE_LEFT) || (scancode == SDL_SCANCODE_RIGHT)) {
+                loopData->reviewVelocity = 0;
+            }
+        }
+    }
+
+    if (loopData->isReviewing && loopData->reviewVelocity)
+    {
+        History* history = &loopData->history;
+        s64 frame = (s64) loopData->reviewedFrame + loopData->reviewVelocity;
+        frame = atLeast((s64) history->firstFrame, frame);
+        loopData->reviewedFrame = seekHistory(history, simulation, frame);
+    }
+
+    // ! simulating and building vertices
+
+    {
+        // NOTE: zoomed in, only about 1 / zoom^2 of the particles are in view
+        f64 viewedParticleCount = simulation->particleCount / square(loopData->zoom);
+        loopData->isDrawingDensityField = loopData->isForcingDensityField ||
+            (viewedParticleCount > densityFieldParticlesPerPixel * windowPixelWidth * windowPixelHeight);
+        resizeDensityField(&loopData->densityField, windowPixelWidth, windowPixelHeight);
+
+        TaskGraph graph;
+        graph.nodeCount = 0;
+        graph.group = {};
+        TaskNode* snapshot = addTask(&graph, snapshotFrameTask, loopData);
+        TaskNode* advance = addTask(&graph, advanceFrameTask, loopData);
+        addDependency(snapshot, advance);
+        if (loopData->isDrawingDensityField)
+        {
+            TaskNode* densityRows = addParallelTask(&graph, windowPixelHeight, 16, densityFieldRowChunk, &loopData->densityField);
+            addDependency(snapshot, densityRows);
+        }
+        else
+        {
+            TaskNode* particleVertices = addParallelTask(&graph, simulation->particleCount, 256, particleVerticesFrameChunk, loopData);
+            addDependency(snapshot, particleVertices);
         }
+        runTaskGraph(&graph);
     }
 
     // ! drawing
@@ -294,8 +689,13 @@ loop(void* argument)
     glClearColor(1, 1, 1, 0);
     glClear(GL_COLOR_BUFFER_BIT);
 
-    glUniform2f(renderer->scaleUniform, 2.0f / simulation->boxWidth, 2.0f / simulation->boxHeight);
-	glUniform2f(renderer->translateUniform, 0, 0);
+    if (loopData->isDrawingDensityField)
+    {
+        drawDensityField(renderer, &loopData->densityField);
+    }
+
+    glUniform2f(renderer->scaleUniform, 2.0f * loopData->zoom / simulation->boxWidth, 2.0f * loopData->zoom / simulation->boxHeight);
+	glUniform2f(renderer->translateUniform, -loopData->viewCenter.x, -loopData->viewCenter.y);
 
 
     glBindBuffer(GL_ARRAY_BUFFER, renderer->buffer);
@@ -317,70 +717,13 @@ loop(void* argument)
 
     // draw particles
 
+    if (!loopData->isDrawingDensityField)
     {
-        int discVertexCount = 20;
-        V2* discVertices = (V2*) malloc(discVertexCount * sizeof(V2));
-
-        f64 angle = tau / discVertexCount;
-        f64 c = cos(angle);
-        f64 s = sin(angle);
-
-        V2 spoke = v2(1, 0);
-        for (int vertexIndex = 0; vertexIndex < discVertexCount; vertexIndex++)
-        {
-            discVertices[vertexIndex] = spoke;
-
-            // rotate spoke
-            f64 x = spoke.x;
-            f64 y = spoke.y;
-            spoke.x = c * x - s * y;
-            spoke.y = s * x + c * y;
-        }
-
-
-
-        int discTriangleCount = discVertexCount - 2;
-        int totalVertexCount = 3 * discTriangleCount * simulation->particleCount;
-
+        int totalVertexCount = 3 * discTriangleCount * loopData->frameParticleCount;
         int bufferByteCount = totalVertexCount * sizeof(VertexColor);
-        VertexColor* bufferData = (VertexColor*) malloc(bufferByteCount);
-
-        VertexColor* bufferCursor = bufferData;
-
-        for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex) {
-
-            Particle* particle = simulation->particles + particleIndex;
-
-            V2 firstVertex = particle->position + particle->radius * discVertices[0];
-            V2 secondVertex = particle->position + particle->radius * discVertices[1];
-
-            for (int triangleIndex = 0; triangleIndex < discTriangleCount; ++triangleIndex) {
-                bufferCursor->vertex = firstVertex;
-                bufferCursor->color = particle->color;
-                ++bufferCursor;
-
-                bufferCursor->vertex = secondVertex;
-                bufferCursor->color = particle->color;
-                ++bufferCursor;
-
-                V2 thirdVertex = particle->position + particle->radius * discVertices[triangleIndex + 2];
-
-                bufferCursor->vertex = thirdVertex;
-                bufferCursor->color = particle->color;
-                ++bufferCursor;
 
-                secondVertex = thirdVertex;
-            }
-        }
-
-        glBufferData(GL_ARRAY_BUFFER, bufferByteCount, bufferData, GL_STATIC_DRAW);
-
-            
+        glBufferData(GL_ARRAY_BUFFER, bufferByteCount, loopData->particleVertices, GL_STATIC_DRAW);
         glDrawArrays(GL_TRIANGLES, 0, totalVertexCount);
-
-        free(bufferData);
-        free(discVertices);
-
     }
 
     
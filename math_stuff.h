@@ -219,6 +219,31 @@ periodize(V2 a, f32 width, f32 height)
     return a;
 }
 
+// NOTE: adding and taking away 1.5 * 2^52 (or 2^23) pushes the fraction out of the mantissa, which rounds
+// to nearest without a branch or a call. Good while |a| < 2^51 (or 2^22), and halves go to even.
+inline f64
+roundToNearest(f64 a)
+{
+    f64 magic = 6755399441055744.0;
+    return (a + magic) - magic;
+}
+
+inline f32
+roundToNearest(f32 a)
+{
+    f32 magic = 12582912.0f;
+    return (a + magic) - magic;
+}
+
+// NOTE: periodize for one coordinate, in whatever precision it comes in, with the reciprocal of the width
+// worked out beforehand, since this runs for every pair
+template <typename Real>
+inline Real
+minimalImage(Real a, Real width, Real invWidth)
+{
+    return a - width * roundToNearest(a * invWidth);
+}
+
 void printV2(V2 v)
 {
     printf("%.2f, %.2f\n", v.x, v.y);
@@ -284,6 +309,73 @@ randomGaussian()
     return (y * factor);
 }
 
+// NOTE: a random number generator with its own state (PCG32), so simulations running side by side
+// each get their own stream and don't share (or race on) rand()'s
+struct RandomSeries {
+    u64 state;
+    u64 increment;
+
+    bool isGaussianPrepared;
+    f32 preparedGaussian;
+};
+
+u32
+randomU32(RandomSeries* series)
+{
+    u64 oldState = series->state;
+    series->state = oldState * 6364136223846793005ULL + series->increment;
+    u32 xorShifted = (u32) (((oldState >> 18) ^ oldState) >> 27);
+    u32 rotation = (u32) (oldState >> 59);
+    return (xorShifted >> rotation) | (xorShifted << ((-rotation) & 31));
+}
+
+// NOTE: series with the same seed but different streams don't overlap
+RandomSeries
+randomSeries(u64 seed, u64 stream)
+{
+    RandomSeries series = {};
+    series.increment = (stream << 1) | 1;
+    randomU32(&series);
+    series.state += seed;
+    randomU32(&series);
+    return series;
+}
+
+f32
+randomF32(RandomSeries* series)
+{
+    return (randomU32(series) >> 8) * (1.0f / (1 << 24));
+}
+
+f32
+randomBetween(RandomSeries* series, f32 a, f32 b)
+{
+    return lerp(a, randomF32(series), b);
+}
+
+f32
+randomGaussian(RandomSeries* series)
+{
+    if (series->isGaussianPrepared)
+    {
+        series->isGaussianPrepared = false;
+        return series->preparedGaussian;
+    }
+
+    f32 x, y, w;
+    do
+    {
+        x = 2 * randomF32(series) - 1;
+        y = 2 * randomF32(series) - 1;
+        w = x * x + y * y;
+    } while ((w >= 1) || (w == 0));
+
+    f32 factor = sqrt( (-2.0 * log(w)) / w);
+    series->preparedGaussian = x * factor;
+    series->isGaussianPrepared = true;
+    return (y * factor);
+}
+
 
 
 
@@ -0,0 +1,517 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "particle_simulation.h"
+#include "threading.h"
+#include "baseline_file.h"
+
+// NOTE: times the small pieces the step is built from, each on its own, over a few thousand inputs that stay
+// in cache. Every piece runs once to warm up, and then in batches long enough to time, keeping the fastest of
+// several batches, since anything else running on the machine only ever makes a batch slower. The inputs
+// come from fixed seeds, so every run does the same work.
+//
+//     microbenchmark [baseline file] [threshold percent] [write]
+//
+// With a baseline file, every time is compared to the one stored for it, and anything slower by more than
+// the threshold (10% unless given) is a regression, which makes the exit status 1. With write, the file
+// is written from this run instead. A baseline only means something on the machine and build it came from.
+
+#define microItemCount 4096
+#define microBatchSeconds 0.01
+#define microBatchCount 31
+
+f64
+getTime()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+struct MicroInputs {
+    V2* points;
+    V2* otherPoints;
+    f32* scalars;
+    f32* quadrances;
+    f64* doubleQuadrances;
+    V2* lineStarts;
+    V2* lineEnds;
+
+    // NOTE: a stencil row of the default grid is 9 cells, about a third of them taken
+    Particle** cells;
+    int stencilWidth;
+
+    Interaction interaction;
+    PotentialTable table;
+
+    // for the kernels
+    Simulation simulation;
+    Simulation chainSimulation;
+};
+
+// NOTE: every piece processes microItemCount items and returns something that depends on all of them,
+// which goes into microSink, so the compiler can't leave the work out
+typedef f64 MicroBenchmark(MicroInputs* inputs);
+
+global_variable volatile f64 microSink;
+
+//
+// Vectors
+//
+
+f64
+microV2MultiplyAdd(MicroInputs* inputs)
+{
+    V2 sum = v2(0, 0);
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        sum += inputs->points[index] + inputs->scalars[index] * inputs->otherPoints[index];
+    }
+    return sum.x + sum.y;
+}
+
+f64
+microV2Inner(MicroInputs* inputs)
+{
+    f32 sum = 0;
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        sum += inner(inputs->points[index], inputs->otherPoints[index]);
+    }
+    return sum;
+}
+
+f64
+microV2Normalize(MicroInputs* inputs)
+{
+    V2 sum = v2(0, 0);
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        sum += normalize(inputs->points[index]);
+    }
+    return sum.x + sum.y;
+}
+
+f64
+microPeriodize(MicroInputs* inputs)
+{
+    V2 sum = v2(0, 0);
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        sum += periodize(inputs->points[index], 100, 100);
+    }
+    return sum.x + sum.y;
+}
+
+f64
+microMinimalImageF32(MicroInputs* inputs)
+{
+    f32 width = 100;
+    f32 invWidth = 1 / width;
+    f32 sum = 0;
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        sum += minimalImage(inputs->points[index].x - inputs->otherPoints[index].x, width, invWidth);
+    }
+    return sum;
+}
+
+f64
+microMinimalImageF64(MicroInputs* inputs)
+{
+    f64 width = 100;
+    f64 invWidth = 1 / width;
+    f64 sum = 0;
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        sum += minimalImage((f64) inputs->points[index].x - (f64) inputs->otherPoints[index].x, width, invWidth);
+    }
+    return sum;
+}
+
+f64
+microShortestVectorFromLine(MicroInputs* inputs)
+{
+    V2 sum = v2(0, 0);
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        sum += shortestVectorFromLine(inputs->points[index], inputs->lineStarts[index], inputs->lineEnds[index]);
+    }
+    return sum.x + sum.y;
+}
+
+f64
+microHexagonLatticePosition(MicroInputs* inputs)
+{
+    V2 sum = v2(0, 0);
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        sum += hexagonLatticePosition(index);
+    }
+    return sum.x + sum.y;
+}
+
+//
+// Random numbers
+//
+
+f64
+microRandomU32(MicroInputs* inputs)
+{
+    RandomSeries random = randomSeries(1, 0);
+    u32 sum = 0;
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        sum += randomU32(&random);
+    }
+    return sum;
+}
+
+f64
+microRandomGaussian(MicroInputs* inputs)
+{
+    RandomSeries random = randomSeries(1, 0);
+    f32 sum = 0;
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        sum += randomGaussian(&random);
+    }
+    return sum;
+}
+
+//
+// Pair potential
+//
+
+f64
+microLennardJonesF32(MicroInputs* inputs)
+{
+    f32 sum = 0;
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        PairForceOf<f32> pairForce = LennardJones().evaluate(&inputs->interaction, inputs->quadrances[index]);
+        sum += pairForce.potentialEnergy + pairForce.forceFactor;
+    }
+    return sum;
+}
+
+f64
+microLennardJonesF64(MicroInputs* inputs)
+{
+    f64 sum = 0;
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        PairForceOf<f64> pairForce = LennardJones().evaluate(&inputs->interaction, inputs->doubleQuadrances[index]);
+        sum += pairForce.potentialEnergy + pairForce.forceFactor;
+    }
+    return sum;
+}
+
+f64
+microLennardJonesTable(MicroInputs* inputs)
+{
+    f64 sum = 0;
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        PairForce pairForce = lookUpPotentialTable(&inputs->table, inputs->doubleQuadrances[index]);
+        sum += pairForce.potentialEnergy + pairForce.forceFactor;
+    }
+    return sum;
+}
+
+//
+// Stencil rows
+//
+
+// NOTE: what the interior of the force loop does with a stencil row, walking the taken cells by their bits
+f64
+microStencilRowMask(MicroInputs* inputs)
+{
+    int sum = 0;
+    int stencilWidth = inputs->stencilWidth;
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        Particle** row = inputs->cells + index * stencilWidth;
+        u32 occupied = nonNullMask(row, stencilWidth);
+        while (occupied)
+        {
+            sum += lowestSetBit(occupied);
+            occupied &= occupied - 1;
+        }
+    }
+    return sum;
+}
+
+// NOTE: the same with a branch per cell, like the wrapping part of the force loop
+f64
+microStencilRowBranches(MicroInputs* inputs)
+{
+    int sum = 0;
+    int stencilWidth = inputs->stencilWidth;
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        Particle** row = inputs->cells + index * stencilWidth;
+        for (int x = 0; x < stencilWidth; ++x)
+        {
+            if (row[x]) sum += x;
+        }
+    }
+    return sum;
+}
+
+//
+// Kernels
+//
+
+// NOTE: the whole pair force pass over the default scene, per particle rather than per item,
+// see microKernelScale
+f64
+microPairForces(Simulation* simulation, Precision precision)
+{
+    simulation->precision = precision;
+    PairLoop loop = {PairRange_All, 0, simulation->particleCount, true};
+    calculatePairForces(simulation, loop);
+    return simulation->particles[0].acceleration.x;
+}
+
+f64 microPairForcesMixed(MicroInputs* inputs)  { return microPairForces(&inputs->simulation, Precision_Mixed); }
+f64 microPairForcesSingle(MicroInputs* inputs) { return microPairForces(&inputs->simulation, Precision_Single); }
+f64 microPairForcesDouble(MicroInputs* inputs) { return microPairForces(&inputs->simulation, Precision_Double); }
+
+f64
+microPairForcesHalfStencil(MicroInputs* inputs)
+{
+    Simulation* simulation = &inputs->simulation;
+    simulation->precision = Precision_Mixed;
+    PairLoop loop = {PairRange_All, 0, simulation->particleCount, false};
+    calculatePairForces(simulation, loop);
+    return simulation->particles[0].acceleration.x;
+}
+
+// NOTE: the half stencil the way it runs on four threads, with the gathering, all on this one
+f64
+microPairForcesSlices(MicroInputs* inputs)
+{
+    Simulation* simulation = &inputs->simulation;
+    simulation->precision = Precision_Mixed;
+    prepareSlices(simulation, 4);
+    for (int sliceIndex = 0; sliceIndex < simulation->sliceCount; ++sliceIndex)
+    {
+        calculateSlicePairForces(simulation, PairRange_All, sliceIndex);
+    }
+    gatherSliceForces(simulation, PairRange_All, 0, simulation->particleCount);
+    return simulation->particles[0].acceleration.x;
+}
+
+f64
+microBondedForces(MicroInputs* inputs)
+{
+    Simulation* simulation = &inputs->chainSimulation;
+    calculateBondedForces(simulation, 0, simulation->particleCount);
+    return simulation->particles[0].acceleration.x;
+}
+
+//
+// Running
+//
+
+// NOTE: what counts as an item, for the kernels that go over a whole scene
+enum MicroItems {
+    MicroItems_Inputs,
+    MicroItems_Particles,
+    MicroItems_ChainParticles,
+};
+
+struct MicroCase {
+    const char* name;
+    MicroBenchmark* benchmark;
+    MicroItems items;
+};
+
+void
+initMicroInputs(MicroInputs* inputs)
+{
+    RandomSeries random = randomSeries(12345, 0);
+
+    inputs->points = allocArray(V2, microItemCount);
+    inputs->otherPoints = allocArray(V2, microItemCount);
+    inputs->scalars = allocArray(f32, microItemCount);
+    inputs->quadrances = allocArray(f32, microItemCount);
+    inputs->doubleQuadrances = allocArray(f64, microItemCount);
+    inputs->lineStarts = allocArray(V2, microItemCount);
+    inputs->lineEnds = allocArray(V2, microItemCount);
+
+    // NOTE: points a little past the box, so periodize and the minimal image wrap some of them
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        inputs->points[index] = v2(randomBetween(&random, -60, 60), randomBetween(&random, -60, 60));
+        inputs->otherPoints[index] = v2(randomBetween(&random, -60, 60), randomBetween(&random, -60, 60));
+        inputs->scalars[index] = randomBetween(&random, -1, 1);
+        inputs->lineStarts[index] = v2(randomBetween(&random, -10, 10), randomBetween(&random, -10, 10));
+        inputs->lineEnds[index] = v2(randomBetween(&random, -10, 10), randomBetween(&random, -10, 10));
+    }
+
+    // NOTE: the pairs within the cutoff of the default scene, from a bit inside the separation out
+    srand(1);
+    initSimulation(&inputs->simulation);
+    updateInteractions(&inputs->simulation);
+    inputs->interaction = inputs->simulation.interactions[0];
+    f64 innerQuadrance = square(0.85 * inputs->simulation.separation);
+    for (int index = 0; index < microItemCount; ++index)
+    {
+        f64 quadrance = innerQuadrance + randomF32(&random) * (inputs->interaction.squaredCutoff - innerQuadrance);
+        inputs->doubleQuadrances[index] = quadrance;
+        inputs->quadrances[index] = (f32) quadrance;
+    }
+    inputs->table = {};
+    buildPotentialTable(&inputs->table, PotentialType_LennardJones, &inputs->interaction);
+
+    inputs->stencilWidth = 9;
+    inputs->cells = allocArray(Particle*, microItemCount * inputs->stencilWidth);
+    Particle* someParticle = (Particle*) inputs->points;
+    for (int cellIndex = 0; cellIndex < microItemCount * inputs->stencilWidth; ++cellIndex)
+    {
+        inputs->cells[cellIndex] = (randomF32(&random) < 0.3f) ? someParticle : 0;
+    }
+
+    // NOTE: the scene a little way in, so the particles aren't on their lattice anymore
+    Simulation* simulation = &inputs->simulation;
+    defaultParticles(simulation);
+    defaultWalls(simulation);
+    simulation->temperature = 1;
+    simulation->viscosity = 0.05;
+    advanceSimulation(simulation, 1);
+    clearGrid(simulation);
+    for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+    {
+        putParticleInGrid(simulation, simulation->particles + particleIndex);
+    }
+
+    Simulation* chainSimulation = &inputs->chainSimulation;
+    srand(1);
+    initSimulation(chainSimulation);
+    defaultParticles(chainSimulation);
+    polymerChainsSetup(chainSimulation, 20);
+    updateBondRows(&chainSimulation->topology, chainSimulation->particleCount);
+}
+
+// NOTE: nanoseconds per item, the fastest of the batches
+f64
+timeMicroCase(MicroCase* microCase, MicroInputs* inputs)
+{
+    int itemsPerCall = microItemCount;
+    if (microCase->items == MicroItems_Particles) itemsPerCall = inputs->simulation.particleCount;
+    if (microCase->items == MicroItems_ChainParticles) itemsPerCall = inputs->chainSimulation.particleCount;
+    microSink = microSink + microCase->benchmark(inputs);
+
+    // NOTE: enough calls per batch that the clock's resolution doesn't matter
+    int callsPerBatch = 1;
+    while (true)
+    {
+        f64 startTime = getTime();
+        for (int callIndex = 0; callIndex < callsPerBatch; ++callIndex)
+        {
+            microSink = microSink + microCase->benchmark(inputs);
+        }
+        if (getTime() - startTime >= microBatchSeconds) break;
+        callsPerBatch *= 2;
+    }
+
+    f64 bestSeconds = 1e30;
+    for (int batchIndex = 0; batchIndex < microBatchCount; ++batchIndex)
+    {
+        f64 startTime = getTime();
+        for (int callIndex = 0; callIndex < callsPerBatch; ++callIndex)
+        {
+            microSink = microSink + microCase->benchmark(inputs);
+        }
+        bestSeconds = min(bestSeconds, getTime() - startTime);
+    }
+    return 1e9 * bestSeconds / ((f64) callsPerBatch * itemsPerCall);
+}
+
+int
+main(int argumentCount, char** arguments)
+{
+    const char* baselinePath = (argumentCount > 1) ? arguments[1] : 0;
+    f64 threshold = (argumentCount > 2) ? atof(arguments[2]) : 10;
+    bool isWritingBaseline = (argumentCount > 3) && !strcmp(arguments[3], "write");
+
+    MicroCase cases[] = {
+        {"V2 multiply-add", microV2MultiplyAdd},
+        {"V2 inner", microV2Inner},
+        {"V2 normalize", microV2Normalize},
+        {"periodize", microPeriodize},
+        {"minimalImage f32", microMinimalImageF32},
+        {"minimalImage f64", microMinimalImageF64},
+        {"shortestVectorFromLine", microShortestVectorFromLine},
+        {"hexagonLatticePosition", microHexagonLatticePosition},
+        {"randomU32", microRandomU32},
+        {"randomGaussian", microRandomGaussian},
+        {"Lennard-Jones f32", microLennardJonesF32},
+        {"Lennard-Jones f64", microLennardJonesF64},
+        {"Lennard-Jones table", microLennardJonesTable},
+        {"stencil row " simdName, microStencilRowMask},
+        {"stencil row branches", microStencilRowBranches},
+        {"pair forces mixed", microPairForcesMixed, MicroItems_Particles},
+        {"pair forces single", microPairForcesSingle, MicroItems_Particles},
+        {"pair forces double", microPairForcesDouble, MicroItems_Particles},
+        {"pair forces half stencil", microPairForcesHalfStencil, MicroItems_Particles},
+        {"pair forces 4 slices", microPairForcesSlices, MicroItems_Particles},
+        {"bonded forces", microBondedForces, MicroItems_ChainParticles},
+    };
+
+    MicroInputs inputs = {};
+    initMicroInputs(&inputs);
+
+    BaselineFile baseline = {};
+    bool hasBaseline = baselinePath && !isWritingBaseline && readBaselineFile(&baseline, baselinePath);
+    if (baselinePath && !isWritingBaseline && !hasBaseline)
+    {
+        printf("Could not read the baseline %s.\n", baselinePath);
+    }
+
+    printf("%s vectors, items are particles for the kernels\n", simdName);
+    printf("\n%-28s %10s %12s %10s %9s\n", "", "ns", "Mitems/s", "baseline", "change");
+
+    const char* names[arrayCount(cases)];
+    f64 times[arrayCount(cases)];
+    int regressionCount = 0;
+    for (int caseIndex = 0; caseIndex < (int) arrayCount(cases); ++caseIndex)
+    {
+        MicroCase* microCase = cases + caseIndex;
+        f64 time = timeMicroCase(microCase, &inputs);
+        names[caseIndex] = microCase->name;
+        times[caseIndex] = time;
+
+        printf("%-28s %10.3f %12.1f", microCase->name, time, 1e3 / time);
+        f64 baselineTime = hasBaseline ? findBaselineTime(&baseline, microCase->name) : 0;
+        if (baselineTime > 0)
+        {
+            f64 change = changeFromBaseline(time, baselineTime);
+            bool isRegression = change > threshold;
+            regressionCount += isRegression;
+            printf(" %10.3f %8.1f%%%s", baselineTime, change, isRegression ? "  slower" : "");
+        }
+        printf("\n");
+    }
+
+    if (isWritingBaseline)
+    {
+        if (!writeBaselineFile(baselinePath, "nanoseconds per item, from microbenchmark with " simdName " vectors", names, times, arrayCount(cases)))
+        {
+            printf("Could not write the baseline %s.\n", baselinePath);
+            return 1;
+        }
+        printf("\nWrote the baseline %s.\n", baselinePath);
+    }
+    else if (hasBaseline)
+    {
+        printf("\n%d of %d slower than the baseline by more than %.0f%%\n", regressionCount, (int) arrayCount(cases), threshold);
+    }
+
+    return (regressionCount > 0) ? 1 : 0;
+}
@@ -0,0 +1,244 @@
+#ifndef pair_potentials_h
+#define pair_potentials_h
+
+#include "types.h"
+#include "math_stuff.h"
+
+// NOTE: what the force loop reads for one pair of species, derived from the species pairs.
+// Separation is where the potential has its minimum (or where repulsion ends, for the purely repulsive ones).
+struct Interaction {
+	f64 squaredSeparation;
+	f64 bondEnergy;
+	f64 squaredCutoff;
+	f64 cutoff;
+
+	// the potential and its slope at the cutoff, for shifting
+	f64 cutoffEnergy;
+	f64 cutoffSlope;
+
+	// where the short range part hands over to the long range part, for multiple time stepping
+	f64 squaredInnerStart;
+	f64 squaredInnerEnd;
+};
+
+// NOTE: forceFactor is (dU/dr) / r, so that the force on the first particle is
+// forceFactor * (otherPosition - position)
+template <typename Real>
+struct PairForceOf {
+	Real potentialEnergy;
+	Real forceFactor;
+};
+
+typedef PairForceOf<f64> PairForce;
+
+// NOTE: how the potential is made to go to zero at the cutoff.
+// Shifting the energy keeps it continuous, shifting the force keeps the force continuous too.
+enum CutoffShift {
+	CutoffShift_None,
+	CutoffShift_Energy,
+	CutoffShift_Force,
+
+	CutoffShift_Count,
+};
+
+const char* cutoffShiftNames[] = {
+	"no shift",
+	"energy shift",
+	"force shift",
+};
+
+// NOTE: for multiple time stepping, the potential is split smoothly into a short range part
+// that goes to zero between the inner start and end, and the long range rest
+enum PairRange {
+	PairRange_All,
+	PairRange_Short,
+	PairRange_Long,
+};
+
+// NOTE: what the force loop computes in. Single is all f32 and double is all f64, for reference runs.
+// Mixed does the geometry in f32 like the positions are stored, but the potential and the sums per particle in f64.
+// The loop is scalar and spends most of its time walking the stencil rather than on the potential,
+// so single is no faster than mixed, only less accurate.
+enum Precision {
+	Precision_Mixed,
+	Precision_Single,
+	Precision_Double,
+
+	Precision_Count,
+};
+
+const char* precisionNames[] = {
+	"mixed",
+	"single",
+	"double",
+};
+
+struct MixedPrecisionTypes {
+	typedef f32 Geometry;
+	typedef f64 Real;
+	typedef f64 Accumulator;
+};
+
+struct SinglePrecisionTypes {
+	typedef f32 Geometry;
+	typedef f32 Real;
+	typedef f32 Accumulator;
+};
+
+struct DoublePrecisionTypes {
+	typedef f64 Geometry;
+	typedef f64 Real;
+	typedef f64 Accumulator;
+};
+
+enum PotentialType {
+	PotentialType_LennardJones,
+	PotentialType_TruncatedShiftedLennardJones,
+	PotentialType_WeeksChandlerAndersen,
+	PotentialType_Morse,
+	PotentialType_HarmonicDisks,
+	PotentialType_Yukawa,
+
+	PotentialType_Count,
+};
+
+const char* potentialNames[] = {
+	"Lennard-Jones",
+	"truncated and shifted Lennard-Jones",
+	"Weeks-Chandler-Andersen",
+	"Morse",
+	"harmonic disks",
+	"Yukawa",
+};
+
+//
+// Potentials
+//
+
+// NOTE: each potential is a type, so the force loop can be instantiated once per potential
+// with everything inlined, instead of branching per pair. They evaluate in whatever precision
+// they are handed the quadrance in.
+
+struct LennardJones {
+	template <typename Real>
+	static inline PairForceOf<Real>
+	evaluate(Interaction* interaction, Real quadrance)
+	{
+		Real bondEnergy = (Real) interaction->bondEnergy;
+		Real invQuadrance = 1 / quadrance;
+		Real rInv2 = (Real) interaction->squaredSeparation * invQuadrance;
+		Real rInv6 = rInv2 * rInv2 * rInv2;
+		Real rInv12 = square(rInv6);
+		Real virial = bondEnergy * 12 * (rInv6 - rInv12);
+
+		PairForceOf<Real> result;
+		result.potentialEnergy = bondEnergy * (rInv12 - 2 * rInv6);
+		result.forceFactor = virial * invQuadrance;
+		return result;
+	}
+};
+
+// NOTE: truncated and shifted Lennard-Jones is plain Lennard-Jones with at least an energy shift,
+// since the force loop does the truncating and shifting for every potential
+
+// NOTE: only the repulsive part of Lennard-Jones, cut at the minimum and lifted to zero
+struct WeeksChandlerAndersen {
+	template <typename Real>
+	static inline PairForceOf<Real>
+	evaluate(Interaction* interaction, Real quadrance)
+	{
+		PairForceOf<Real> result = LennardJones::evaluate(interaction, quadrance);
+		result.potentialEnergy += (Real) interaction->bondEnergy;
+		if (quadrance >= (Real) interaction->squaredSeparation)
+		{
+			result.potentialEnergy = 0;
+			result.forceFactor = 0;
+		}
+		return result;
+	}
+};
+
+// NOTE: the width is chosen so the curvature at the minimum matches Lennard-Jones
+struct Morse {
+	template <typename Real>
+	static inline PairForceOf<Real>
+	evaluate(Interaction* interaction, Real quadrance)
+	{
+		Real bondEnergy = (Real) interaction->bondEnergy;
+		Real distance = sqrt(quadrance);
+		Real separation = sqrt((Real) interaction->squaredSeparation);
+		Real width = 6 / separation;
+		Real e = exp(-width * (distance - separation));
+
+		PairForceOf<Real> result;
+		result.potentialEnergy = bondEnergy * (square(1 - e) - 1);
+		result.forceFactor = bondEnergy * 2 * width * (1 - e) * e / distance;
+		return result;
+	}
+};
+
+// NOTE: soft disks that only push while they overlap
+struct HarmonicDisks {
+	template <typename Real>
+	static inline PairForceOf<Real>
+	evaluate(Interaction* interaction, Real quadrance)
+	{
+		Real bondEnergy = (Real) interaction->bondEnergy;
+		Real distance = sqrt(quadrance);
+		Real separation = sqrt((Real) interaction->squaredSeparation);
+		Real overlap = atLeast(0, 1 - distance / separation);
+
+		PairForceOf<Real> result;
+		result.potentialEnergy = bondEnergy * square(overlap);
+		result.forceFactor = -2 * bondEnergy * overlap / (separation * distance);
+		return result;
+	}
+};
+
+// NOTE: screened repulsion, with the screening length equal to the separation
+struct Yukawa {
+	template <typename Real>
+	static inline PairForceOf<Real>
+	evaluate(Interaction* interaction, Real quadrance)
+	{
+		Real distance = sqrt(quadrance);
+		Real separation = sqrt((Real) interaction->squaredSeparation);
+		Real screening = 1 / separation;
+		Real potentialEnergy = (Real) interaction->bondEnergy * separation / distance * exp(-screening * (distance - separation));
+
+		PairForceOf<Real> result;
+		result.potentialEnergy = potentialEnergy;
+		result.forceFactor = -potentialEnergy * (1 / distance + screening) / distance;
+		return result;
+	}
+};
+
+// NOTE: branches on the potential, so only for setup work and the rare pair a table doesn't cover
+PairForce
+evaluatePotential(PotentialType potentialType, Interaction* interaction, f64 quadrance)
+{
+	switch (potentialType)
+	{
+		case PotentialType_LennardJones:                 return LennardJones::evaluate(interaction, quadrance);
+		case PotentialType_TruncatedShiftedLennardJones: return LennardJones::evaluate(interaction, quadrance);
+		case PotentialType_WeeksChandlerAndersen:        return WeeksChandlerAndersen::evaluate(interaction, quadrance);
+		case PotentialType_Morse:                        return Morse::evaluate(interaction, quadrance);
+		case PotentialType_HarmonicDisks:                return HarmonicDisks::evaluate(interaction, quadrance);
+		case PotentialType_Yukawa:                       return Yukawa::evaluate(interaction, quadrance);
+		default: invalidCodePath;
+	}
+	PairForce zero = {};
+	return zero;
+}
+
+CutoffShift
+cutoffShiftForPotential(PotentialType potentialType, CutoffShift cutoffShift)
+{
+	if ((potentialType == PotentialType_TruncatedShiftedLennardJones) && (cutoffShift == CutoffShift_None))
+	{
+		return CutoffShift_Energy;
+	}
+	return cutoffShift;
+}
+
+#endif
@@ -0,0 +1,513 @@
+#ifndef particle_mesh_h
+#define particle_mesh_h
+
+#include "types.h"
+#include "math_stuff.h"
+#include "pair_potentials.h"
+#include "potential_table.h"
+#include "threading.h"
+
+// NOTE: long range forces in a periodic box (2D Coulomb or gravity, both logarithmic in 2D).
+// The 1/r force is split with a Gaussian of width splitting: the smooth far part is solved on a mesh with FFTs,
+// and the sharp near part is a short range pair force that the particle grid takes care of.
+//
+// Charges are spread to the mesh with cloud-in-cell weights, the Poisson equation is solved in Fourier space,
+// and the potential and field are interpolated back with the same weights.
+//
+// The potential a particle reads back includes the far part of its own charge, which the near part doesn't
+// take back out since a particle is no pair with itself, so selfPotential is subtracted per particle.
+
+struct Complex {
+	f64 re, im;
+};
+
+struct ParticleMesh {
+	f64 boxWidth;
+	f64 boxHeight;
+
+	// NOTE: powers of two, for the FFT
+	int colCount;
+	int rowCount;
+	f64 cellWidth;
+	f64 cellHeight;
+
+	f64 splitting;
+	f64 nearFieldCutoff;
+	// NOTE: the far potential of a unit charge at its own position, (eulerGamma - ln(2 splitting^2)) / 2
+	f64 selfPotential;
+
+	// per node
+	Complex* charge;
+	Complex* potential;
+	// NOTE: x in the real part and y in the imaginary part, both fields are real so one FFT does both
+	Complex* field;
+	f64* greensFunction;
+
+	// NOTE: exp(-i tau k / max(colCount, rowCount)) for the first half of k
+	Complex* twiddles;
+	// NOTE: a block of columns per thread
+	Complex* scratch;
+	int scratchThreadCount;
+
+	// NOTE: the particles are spread in slices, each into its own copy of the charge,
+	// which are added up in slice order so the charge doesn't depend on the threads
+	f64* sliceCharges;
+	int sliceCount;
+
+	f64 nearFieldMinQuadrance;
+	f64 nearFieldInvStep;
+	PotentialTableEntry* nearFieldTable;
+};
+
+//
+// FFT
+//
+
+// NOTE: in place radix-2, the inverse is not normalized. twiddles are for a transform of twiddleCount,
+// which is a multiple of count.
+void
+fft(Complex* data, int count, Complex* twiddles, int twiddleCount, bool isInverse)
+{
+	for (int index = 1, reversed = 0; index < count; ++index)
+	{
+		int bit = count >> 1;
+		for (; reversed & bit; bit >>= 1)
+		{
+			reversed ^= bit;
+		}
+		reversed ^= bit;
+		if (index < reversed)
+		{
+			Complex temp = data[index];
+			data[index] = data[reversed];
+			data[reversed] = temp;
+		}
+	}
+
+	f64 sign = isInverse ? -1 : 1;
+	for (int length = 2; length <= count; length <<= 1)
+	{
+		int twiddleStride = twiddleCount / length;
+		for (int start = 0; start < count; start += length)
+		{
+			for (int offset = 0; offset < length / 2; ++offset)
+			{
+				Complex twiddle = twiddles[offset * twiddleStride];
+				twiddle.im *= sign;
+
+				Complex* a = data + start + offset;
+				Complex* b = a + length / 2;
+				Complex t = {b->re * twiddle.re - b->im * twiddle.im, b->re * twiddle.im + b->im * twiddle.re};
+				b->re = a->re - t.re;
+				b->im = a->im - t.im;
+				a->re += t.re;
+				a->im += t.im;
+			}
+		}
+	}
+}
+
+struct MeshFFTJob {
+	ParticleMesh* mesh;
+	Complex* data;
+	bool isInverse;
+};
+
+void
+fftRowsChunk(void* data, int startRow, int endRow)
+{
+	MeshFFTJob* job = (MeshFFTJob*)data;
+	ParticleMesh* mesh = job->mesh;
+	int twiddleCount = max(mesh->colCount, mesh->rowCount);
+	for (int row = startRow; row < endRow; ++row)
+	{
+		fft(job->data + row * mesh->colCount, mesh->colCount, mesh->twiddles, twiddleCount, job->isInverse);
+	}
+}
+
+// NOTE: the columns are copied out a few at a time, so every row of the mesh is read a cache line at a time
+#define fftColumnBlockSize 8
+
+void
+fftColumnsChunk(void* data, int startCol, int endCol)
+{
+	MeshFFTJob* job = (MeshFFTJob*)data;
+	ParticleMesh* mesh = job->mesh;
+	int twiddleCount = max(mesh->colCount, mesh->rowCount);
+	int rowCount = mesh->rowCount;
+	assert(currentThreadIndex < mesh->scratchThreadCount);
+	Complex* columns = mesh->scratch + currentThreadIndex * fftColumnBlockSize * rowCount;
+	for (int firstCol = startCol; firstCol < endCol; firstCol += fftColumnBlockSize)
+	{
+		int blockSize = atMost(fftColumnBlockSize, endCol - firstCol);
+		for (int row = 0; row < rowCount; ++row)
+		{
+			Complex* source = job->data + row * mesh->colCount + firstCol;
+			for (int col = 0; col < blockSize; ++col)
+			{
+				columns[col * rowCount + row] = source[col];
+			}
+		}
+		for (int col = 0; col < blockSize; ++col)
+		{
+			fft(columns + col * rowCount, rowCount, mesh->twiddles, twiddleCount, job->isInverse);
+		}
+		for (int row = 0; row < rowCount; ++row)
+		{
+			Complex* destination = job->data + row * mesh->colCount + firstCol;
+			for (int col = 0; col < blockSize; ++col)
+			{
+				destination[col] = columns[col * rowCount + row];
+			}
+		}
+	}
+}
+
+// NOTE: the rows are independent, and so are the columns once the rows are done
+void
+fft2D(ParticleMesh* mesh, Complex* data, bool isInverse)
+{
+	MeshFFTJob job = {mesh, data, isInverse};
+	parallelFor(mesh->rowCount, 16, fftRowsChunk, &job);
+	parallelFor(mesh->colCount, 16, fftColumnsChunk, &job);
+}
+
+//
+// Mesh
+//
+
+int
+nextPowerOfTwo(int n)
+{
+	int result = 1;
+	while (result < n)
+	{
+		result <<= 1;
+	}
+	return result;
+}
+
+f64
+sinc(f64 x)
+{
+	return (fabs(x) < 1e-8) ? 1 : sin(x) / x;
+}
+
+void buildNearFieldTable(ParticleMesh* mesh);
+
+// NOTE: cells are at most maxCellSide wide, and the split is one and a half cells wide
+void
+initParticleMesh(ParticleMesh* mesh, f64 boxWidth, f64 boxHeight, f64 maxCellSide)
+{
+	mesh->boxWidth = boxWidth;
+	mesh->boxHeight = boxHeight;
+	mesh->colCount = nextPowerOfTwo(ceil(boxWidth / maxCellSide));
+	mesh->rowCount = nextPowerOfTwo(ceil(boxHeight / maxCellSide));
+	mesh->cellWidth = boxWidth / mesh->colCount;
+	mesh->cellHeight = boxHeight / mesh->rowCount;
+
+	mesh->splitting = 1.5 * max(mesh->cellWidth, mesh->cellHeight);
+	// NOTE: exp(-r^2 / (2 splitting^2)) is below 1e-3 here
+	mesh->nearFieldCutoff = 4 * mesh->splitting;
+	f64 eulerGamma = 0.5772156649015329;
+	mesh->selfPotential = 0.5 * (eulerGamma - log(2 * square(mesh->splitting)));
+
+	int nodeCount = mesh->colCount * mesh->rowCount;
+	int twiddleCount = max(mesh->colCount, mesh->rowCount);
+	mesh->charge = (Complex*) realloc(mesh->charge, nodeCount * sizeof(Complex));
+	mesh->potential = (Complex*) realloc(mesh->potential, nodeCount * sizeof(Complex));
+	mesh->field = (Complex*) realloc(mesh->field, nodeCount * sizeof(Complex));
+	mesh->greensFunction = (f64*) realloc(mesh->greensFunction, nodeCount * sizeof(f64));
+	mesh->twiddles = (Complex*) realloc(mesh->twiddles, atLeast(1, twiddleCount / 2) * sizeof(Complex));
+	mesh->scratchThreadCount = getThreadCount();
+	mesh->scratch = (Complex*) realloc(mesh->scratch, mesh->scratchThreadCount * fftColumnBlockSize * mesh->rowCount * sizeof(Complex));
+	// NOTE: sized on the next spread
+	mesh->sliceCount = 0;
+
+	for (int k = 0; k < twiddleCount / 2; ++k)
+	{
+		f64 angle = -tau * k / twiddleCount;
+		mesh->twiddles[k] = {cos(angle), sin(angle)};
+	}
+
+	buildNearFieldTable(mesh);
+
+	// NOTE: the Fourier transform of -ln(r) is 2 pi / k^2, times the Gaussian that makes it smooth,
+	// divided by the cloud-in-cell window twice, once for spreading and once for interpolating
+	for (int row = 0; row < mesh->rowCount; ++row)
+	{
+		int m = (row <= mesh->rowCount / 2) ? row : row - mesh->rowCount;
+		f64 ky = tau * m / boxHeight;
+		for (int col = 0; col < mesh->colCount; ++col)
+		{
+			int n = (col <= mesh->colCount / 2) ? col : col - mesh->colCount;
+			f64 kx = tau * n / boxWidth;
+			f64 squaredK = kx * kx + ky * ky;
+
+			f64 greensFunction = 0;
+			if (squaredK > 0)
+			{
+				f64 window = square(sinc(0.5 * kx * mesh->cellWidth) * sinc(0.5 * ky * mesh->cellHeight));
+				greensFunction = tau / squaredK * exp(-0.5 * squaredK * square(mesh->splitting)) / square(window);
+			}
+			mesh->greensFunction[row * mesh->colCount + col] = greensFunction;
+		}
+	}
+}
+
+struct MeshWeights {
+	int cols[2];
+	int rows[2];
+	f64 weights[2][2];
+};
+
+MeshWeights
+cloudInCellWeights(ParticleMesh* mesh, V2 position)
+{
+	f64 u = (position.x + 0.5 * mesh->boxWidth) / mesh->cellWidth;
+	f64 v = (position.y + 0.5 * mesh->boxHeight) / mesh->cellHeight;
+	int col = floor(u);
+	int row = floor(v);
+	f64 fx = u - col;
+	f64 fy = v - row;
+
+	MeshWeights result;
+	result.cols[0] = mod(col, mesh->colCount);
+	result.cols[1] = mod(col + 1, mesh->colCount);
+	result.rows[0] = mod(row, mesh->rowCount);
+	result.rows[1] = mod(row + 1, mesh->rowCount);
+	result.weights[0][0] = (1 - fx) * (1 - fy);
+	result.weights[0][1] = fx * (1 - fy);
+	result.weights[1][0] = (1 - fx) * fy;
+	result.weights[1][1] = fx * fy;
+	return result;
+}
+
+// NOTE: returns the slice's copy of the charge, cleared
+f64*
+beginMeshSlice(ParticleMesh* mesh, int sliceIndex)
+{
+	int nodeCount = mesh->colCount * mesh->rowCount;
+	f64* sliceCharge = mesh->sliceCharges + sliceIndex * nodeCount;
+	memset(sliceCharge, 0, nodeCount * sizeof(f64));
+	return sliceCharge;
+}
+
+void
+prepareMeshSlices(ParticleMesh* mesh, int sliceCount)
+{
+	if (mesh->sliceCount != sliceCount)
+	{
+		mesh->sliceCount = sliceCount;
+		mesh->sliceCharges = (f64*) realloc(mesh->sliceCharges, sliceCount * mesh->colCount * mesh->rowCount * sizeof(f64));
+	}
+}
+
+void
+spreadCharge(ParticleMesh* mesh, f64* sliceCharge, V2 position, f64 charge)
+{
+	MeshWeights w = cloudInCellWeights(mesh, position);
+	for (int y = 0; y < 2; ++y)
+	{
+		for (int x = 0; x < 2; ++x)
+		{
+			sliceCharge[w.rows[y] * mesh->colCount + w.cols[x]] += charge * w.weights[y][x];
+		}
+	}
+}
+
+// NOTE: adds the slices up into the charge the solver transforms
+void
+gatherMeshChargeChunk(void* data, int startRow, int endRow)
+{
+	ParticleMesh* mesh = (ParticleMesh*)data;
+	int nodeCount = mesh->colCount * mesh->rowCount;
+	for (int nodeIndex = startRow * mesh->colCount; nodeIndex < endRow * mesh->colCount; ++nodeIndex)
+	{
+		f64 charge = 0;
+		for (int sliceIndex = 0; sliceIndex < mesh->sliceCount; ++sliceIndex)
+		{
+			charge += mesh->sliceCharges[sliceIndex * nodeCount + nodeIndex];
+		}
+		mesh->charge[nodeIndex] = {charge, 0};
+	}
+}
+
+void
+solveParticleMeshChunk(void* data, int startRow, int endRow)
+{
+	ParticleMesh* mesh = (ParticleMesh*)data;
+	f64 normalization = 1 / (mesh->boxWidth * mesh->boxHeight);
+	for (int row = startRow; row < endRow; ++row)
+	{
+		int m = (row <= mesh->rowCount / 2) ? row : row - mesh->rowCount;
+		// NOTE: the Nyquist frequency has no sensible derivative
+		f64 ky = (2 * m == mesh->rowCount) ? 0 : tau * m / mesh->boxHeight;
+		for (int col = 0; col < mesh->colCount; ++col)
+		{
+			int n = (col <= mesh->colCount / 2) ? col : col - mesh->colCount;
+			f64 kx = (2 * n == mesh->colCount) ? 0 : tau * n / mesh->boxWidth;
+
+			int nodeIndex = row * mesh->colCount + col;
+			Complex charge = mesh->charge[nodeIndex];
+			f64 g = normalization * mesh->greensFunction[nodeIndex];
+			Complex potential = {g * charge.re, g * charge.im};
+			mesh->potential[nodeIndex] = potential;
+
+			// field = -i k potential, and fieldX + i fieldY = (ky - i kx) potential
+			Complex field = {ky * potential.re + kx * potential.im, ky * potential.im - kx * potential.re};
+			mesh->field[nodeIndex] = field;
+		}
+	}
+}
+
+// NOTE: potential and field of the far part, per unit charge and unit coupling, from the gathered charge
+void
+solveParticleMesh(ParticleMesh* mesh)
+{
+	fft2D(mesh, mesh->charge, false);
+	parallelFor(mesh->rowCount, 16, solveParticleMeshChunk, mesh);
+	fft2D(mesh, mesh->potential, true);
+	fft2D(mesh, mesh->field, true);
+}
+
+void
+interpolateMesh(ParticleMesh* mesh, V2 position, f64* potential, V2* field)
+{
+	MeshWeights w = cloudInCellWeights(mesh, position);
+	f64 resultPotential = 0;
+	f64 fieldX = 0;
+	f64 fieldY = 0;
+	for (int y = 0; y < 2; ++y)
+	{
+		for (int x = 0; x < 2; ++x)
+		{
+			int nodeIndex = w.rows[y] * mesh->colCount + w.cols[x];
+			resultPotential += w.weights[y][x] * mesh->potential[nodeIndex].re;
+			fieldX += w.weights[y][x] * mesh->field[nodeIndex].re;
+			fieldY += w.weights[y][x] * mesh->field[nodeIndex].im;
+		}
+	}
+	*potential = resultPotential;
+	*field = v2(fieldX, fieldY);
+}
+
+//
+// Near field
+//
+
+// NOTE: exponential integral E1, series below 1 and continued fraction above
+f64
+exponentialIntegral(f64 x)
+{
+	if (x < 1)
+	{
+		f64 eulerGamma = 0.5772156649015329;
+		f64 sum = 0;
+		f64 term = 1;
+		for (int k = 1; k < 30; ++k)
+		{
+			term *= -x / k;
+			sum -= term / k;
+		}
+		return -eulerGamma - log(x) + sum;
+	}
+
+	// modified Lentz
+	f64 b = x + 1;
+	f64 c = 1e300;
+	f64 d = 1 / b;
+	f64 h = d;
+	for (int i = 1; i < 100; ++i)
+	{
+		f64 a = -i * i;
+		b += 2;
+		d = 1 / (a * d + b);
+		c = b + a / c;
+		f64 delta = c * d;
+		h *= delta;
+		if (fabs(delta - 1) < 1e-12) break;
+	}
+	return h * exp(-x);
+}
+
+// NOTE: what the mesh misses of -ln(r) between two unit charges, which is E1(r^2 / (2 splitting^2)) / 2
+PairForce
+exactNearFieldPairForce(ParticleMesh* mesh, f64 quadrance)
+{
+	f64 x = quadrance / (2 * square(mesh->splitting));
+
+	PairForce result;
+	result.potentialEnergy = 0.5 * exponentialIntegral(x);
+	result.forceFactor = -exp(-x) / quadrance;
+	return result;
+}
+
+// NOTE: E1 takes about 200 ns, so the near field is tabulated like the pair potentials, from half the
+// splitting out to the cutoff, with the exact slopes since both have them in closed form. Closer than
+// that the energy goes like -ln(r), so the rare pair in there gets the exact one.
+void
+buildNearFieldTable(ParticleMesh* mesh)
+{
+	f64 squaredCutoff = square(mesh->nearFieldCutoff);
+	f64 doubleSquaredSplitting = 2 * square(mesh->splitting);
+	mesh->nearFieldMinQuadrance = square(0.5 * mesh->splitting);
+	f64 step = (squaredCutoff - mesh->nearFieldMinQuadrance) / potentialTableIntervalCount;
+	mesh->nearFieldInvStep = 1 / step;
+	mesh->nearFieldTable = (PotentialTableEntry*) realloc(mesh->nearFieldTable, (potentialTableIntervalCount + 1) * sizeof(PotentialTableEntry));
+
+	for (int intervalIndex = 0; intervalIndex < potentialTableIntervalCount; ++intervalIndex)
+	{
+		f64 q0 = mesh->nearFieldMinQuadrance + intervalIndex * step;
+		f64 q1 = q0 + step;
+		PairForce start = exactNearFieldPairForce(mesh, q0);
+		PairForce end = exactNearFieldPairForce(mesh, q1);
+		// NOTE: d/dq of -exp(-q / 2s^2) / q
+		f64 forceSlope0 = -start.forceFactor * (1 / q0 + 1 / doubleSquaredSplitting);
+		f64 forceSlope1 = -end.forceFactor * (1 / q1 + 1 / doubleSquaredSplitting);
+
+		PotentialTableEntry* entry = mesh->nearFieldTable + intervalIndex;
+		hermiteCoefficients(entry->energy, start.potentialEnergy, end.potentialEnergy, 0.5 * start.forceFactor * step, 0.5 * end.forceFactor * step);
+		hermiteCoefficients(entry->forceFactor, start.forceFactor, end.forceFactor, forceSlope0 * step, forceSlope1 * step);
+	}
+	memset(mesh->nearFieldTable + potentialTableIntervalCount, 0, sizeof(PotentialTableEntry));
+}
+
+inline PairForce
+nearFieldPairForce(ParticleMesh* mesh, f64 quadrance)
+{
+	if (quadrance < mesh->nearFieldMinQuadrance)
+	{
+		return exactNearFieldPairForce(mesh, quadrance);
+	}
+
+	f64 t = (quadrance - mesh->nearFieldMinQuadrance) * mesh->nearFieldInvStep;
+	t = atMost(potentialTableIntervalCount, t);
+	int intervalIndex = (int) t;
+	f64 u = t - intervalIndex;
+
+	PotentialTableEntry* entry = mesh->nearFieldTable + intervalIndex;
+	f64* e = entry->energy;
+	f64* f = entry->forceFactor;
+
+	PairForce result;
+	result.potentialEnergy = e[0] + u * (e[1] + u * (e[2] + u * e[3]));
+	result.forceFactor = f[0] + u * (f[1] + u * (f[2] + u * f[3]));
+	return result;
+}
+
+void
+freeParticleMesh(ParticleMesh* mesh)
+{
+	free(mesh->charge);
+	free(mesh->potential);
+	free(mesh->field);
+	free(mesh->greensFunction);
+	free(mesh->twiddles);
+	free(mesh->scratch);
+	free(mesh->sliceCharges);
+	free(mesh->nearFieldTable);
+	*mesh = {};
+}
+
+#endif
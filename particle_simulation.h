@@ -7,16 +7,27 @@
 #include <string.h>
 #include "math_stuff.h"
 #include "types.h"
+#include "simd.h"
+#include "pair_potentials.h"
+#include "potential_table.h"
+#include "particle_mesh.h"
+#include "barnes_hut.h"
+#include "bond_topology.h"
  
 
+#define maxSpeciesCount 4
+
 struct Particle {
 	V2 position;
 	V2 velocity;
 	V2 acceleration;
+	V2 slowAcceleration;
 
 	f64 mass;
 	f64 radius;
+	f64 charge;
 	Color4 color;
+	int species;
 
 	int gridCol;
 	int gridRow;
@@ -27,14 +38,89 @@ struct Particle {
 
 };
 
+// NOTE: what one slice of the half stencil adds to a particle outside of it, see sliceForces
+struct SliceForce {
+	V2 acceleration;
+	f64 potentialEnergy;
+};
+
 struct Wall {
 	V2 start;
 	V2 end;
 };
 
+struct Species {
+	f64 mass;
+	f64 radius;
+	f64 charge;
+	Color4 color;
+};
+
+enum LongRangeType {
+	LongRangeType_None,
+	LongRangeType_Coulomb,
+	LongRangeType_Gravity,
+};
+
+// NOTE: the mesh is for the periodic box, the tree ignores the box and is for open systems
+enum LongRangeSolver {
+	LongRangeSolver_ParticleMesh,
+	LongRangeSolver_BarnesHut,
+};
+
+// NOTE: separation and bond energy are relative to the simulation's,
+// so that mixtures can be written down in reduced units
+struct SpeciesPair {
+	f64 separationFactor;
+	f64 energyFactor;
+	f64 cutoffFactor;
+};
+
+// NOTE: the parts of advanceSimulation, for profiling
+enum StepPhase {
+	StepPhase_Updates,
+	StepPhase_FirstHalf,
+	StepPhase_Binning,
+	StepPhase_ExternalForces,
+	StepPhase_PairForces,
+	StepPhase_BondedForces,
+	StepPhase_LongRangeForces,
+	StepPhase_SecondHalf,
+	StepPhase_MultipleTimeStep,
+	StepPhase_AdaptTimeStep,
+
+	StepPhase_Count,
+};
+
+const char* stepPhaseNames[] = {
+	"updates",
+	"first half",
+	"binning",
+	"external forces",
+	"pair forces",
+	"bonded forces",
+	"long range forces",
+	"second half",
+	"multiple time step",
+	"adapt time step",
+};
+
+// NOTE: called around every chunk of every phase, on the thread that runs the chunk, with how many
+// particles the chunk had
+typedef void StepPhaseCallback(void* data, StepPhase phase, int particleCount);
+
+struct StepProfiler {
+	StepPhaseCallback* beginPhase;
+	StepPhaseCallback* endPhase;
+	void* data;
+};
+
 struct Simulation {
 	Particle* particles;
 	int particleCount;
+	// NOTE: counts the times the particles were replaced, added or removed, so whatever keeps its own
+	// copy of them knows to start over even when the count came out the same
+	u32 particleGeneration;
 
 	// box
 	f64 boxWidth;
@@ -45,18 +131,47 @@ struct Simulation {
 	int gridColCount;
 	f64 gridCellWidth;
 	f64 gridCellHeight;
+	f64 invGridCellWidth;
+	f64 invGridCellHeight;
 
 	// walls
 	Wall* walls;
 	int wallCount;
+	// NOTE: counts the times the walls were replaced, like particleGeneration
+	u32 wallGeneration;
 	// TODO: implement wallstrength
 	f64 wallStrength;
 
 	// time
 	f64 dt;
 	f64 timeLeftToSimulate;
-
-	// TODO: have different particle types and corresponding interactions
+	u64 stepCount;
+
+	// multiple time stepping
+	// NOTE: dt is the outer step, for the slow forces
+	bool isUsingMultipleTimeSteps;
+	bool hasSplitForces;
+	int innerStepCount;
+	f64 innerCutoffFactor;
+
+	// adaptive time step
+	bool isUsingAdaptiveTimeStep;
+	// NOTE: in separations, the derived lengths are set in updateInteractions
+	f64 maxStepDisplacementFactor;
+	f64 stepErrorFactor;
+	f64 maxStepDisplacement;
+	f64 stepErrorTolerance;
+	f64 minDt;
+	f64 maxDt;
+	// NOTE: the accelerations after the last step, for how fast the forces change
+	V2* previousAccelerations;
+	int previousAccelerationCount;
+	u32 previousAccelerationGeneration;
+
+	// species
+	Species species[maxSpeciesCount];
+	int speciesCount;
+	SpeciesPair speciesPairs[maxSpeciesCount][maxSpeciesCount];
 
 	// interactions
 	f64 separation;
@@ -64,17 +179,70 @@ struct Simulation {
 	f64 cutoffFactor;
     f64 gravityStrength;
 
+	PotentialType potentialType;
+	CutoffShift cutoffShift;
+	Precision precision;
+	Interaction interactions[maxSpeciesCount * maxSpeciesCount];
+	f64 interactionRange;
+	f64 innerInteractionRange;
+
+	bool isUsingPotentialTables;
+	PotentialTable* potentialTables;
+
+	// NOTE: the pair forces are always summed per particle in stencil order, the same as in a domain
+	// decomposed run and on any number of threads, at twice the pairs
+	bool isUsingFullStencil;
+
+	// NOTE: with more than one thread the half stencil runs as one slice of particles per thread. A slice
+	// adds its own particles' pairs to them, and what it owes the other particle of a pair to its row of
+	// sliceForces, which are added up in slice order afterwards, so the result doesn't depend on which
+	// thread ran which slice.
+	SliceForce* sliceForces;
+	int sliceCount;
+	int sliceForceCapacity;
+
+	// long range, charges for Coulomb and masses for gravity
+	LongRangeType longRangeType;
+	LongRangeSolver longRangeSolver;
+	f64 longRangeStrength;
+	ParticleMesh* particleMesh;
+	BarnesHutTree* barnesHutTree;
+	f64 openingAngle;
+
+	// bonds and angles
+	BondTopology topology;
+	// NOTE: bonded particles don't feel each other's pair potential, for bonds that stand in for it
+	bool isExcludingBondedPairs;
+
 	// thermostat
 	f32 temperature;
 	f32 viscosity;
+	RandomSeries random;
 
 	// user interaction
 	bool isDragging;
 	V2 mousePosition;
 	int draggedParticleIndex;
 	f64 draggingStrength;
+
+	// NOTE: 0 unless something measures the phases of the step
+	StepProfiler* profiler;
 };
 
+inline void
+beginStepPhase(Simulation* simulation, StepPhase phase, int particleCount)
+{
+	StepProfiler* profiler = simulation->profiler;
+	if (profiler) profiler->beginPhase(profiler->data, phase, particleCount);
+}
+
+inline void
+endStepPhase(Simulation* simulation, StepPhase phase, int particleCount)
+{
+	StepProfiler* profiler = simulation->profiler;
+	if (profiler) profiler->endPhase(profiler->data, phase, particleCount);
+}
+
 int
 pickParticle(Simulation* simulation, V2 pickPosition)
 {
@@ -110,6 +278,58 @@ hexagonLatticePosition(int particleIndex)
     return (x * latticeX + y * latticeY);
 }
 
+// NOTE: the same positions as hexagonLatticePosition for the indices from firstIndex on, with the square root
+// only for the first one, and the layer and side stepped from there
+void
+hexagonLatticePositions(int firstIndex, int count, V2* positions)
+{
+    V2 latticeX[6];
+    V2 latticeY[6];
+    for (u64 triangleIndex = 0; triangleIndex < 6; ++triangleIndex)
+    {
+        f64 angle = triangleIndex * tau / 6;
+        latticeX[triangleIndex] = v2FromAngle(angle);
+        latticeY[triangleIndex] = v2FromAngle(angle + tau / 3);
+    }
+
+    int positionIndex = 0;
+    if ((firstIndex == 0) && (count > 0))
+    {
+        positions[positionIndex++] = v2(0, 0);
+    }
+
+    f64 k = atLeast(0, firstIndex - 1);
+    u64 layer = floor((sqrt(8 * (k / 6) + 1) - 1) / 2) + 1;
+    u64 rest = k - 6 * layer * (layer - 1) / 2;
+    for (; positionIndex < count; ++positionIndex)
+    {
+        u64 triangleIndex = rest / layer;
+        f64 x = layer;
+        f64 y = rest % layer;
+        positions[positionIndex] = x * latticeX[triangleIndex] + y * latticeY[triangleIndex];
+
+        rest++;
+        if (rest == 6 * layer)
+        {
+            layer++;
+            rest = 0;
+        }
+    }
+}
+
+void
+setParticleSpecies(Simulation* simulation, Particle* particle, int speciesIndex)
+{
+	assert((speciesIndex >= 0) && (speciesIndex < simulation->speciesCount));
+
+	Species* species = simulation->species + speciesIndex;
+	particle->species = speciesIndex;
+	particle->mass = species->mass;
+	particle->radius = species->radius;
+	particle->charge = species->charge;
+	particle->color = species->color;
+}
+
 void
 setParticleCount(Simulation* simulation, int particleCount)
 {
@@ -127,30 +347,136 @@ setParticleCount(Simulation* simulation, int particleCount)
 	{
 		// set defaults
 		Particle* particle = simulation->particles + particleIndex;
-		particle->mass = 1;
-		particle->radius = 1;
-		particle->color = c4(0, 0, 0, 1);
+		setParticleSpecies(simulation, particle, 0);
+	}
+	if (particleCount < simulation->particleCount)
+	{
+		trimBondTopology(&simulation->topology, particleCount);
 	}
 	simulation->particleCount = particleCount;
+	simulation->particleGeneration++;
 }
 
 void
 updateGrid(Simulation* simulation)
 {
-	// TODO: figure out grid size from interaction
+	// NOTE: the grid holds one particle per cell, so cells can't be wider than the smallest particle
 
-	f64 radius = 1;
+	f64 radius = simulation->species[0].radius;
+	for (int speciesIndex = 1; speciesIndex < simulation->speciesCount; ++speciesIndex)
+	{
+		radius = min(radius, simulation->species[speciesIndex].radius);
+	}
 	f64 maxCellSide = radius;
 	simulation->gridColCount = atLeast(1, ceil(simulation->boxWidth / maxCellSide));
 	simulation->gridRowCount = atLeast(1, ceil(simulation->boxHeight / maxCellSide));
 	simulation->gridCellWidth = simulation->boxWidth / simulation->gridColCount;
 	simulation->gridCellHeight = simulation->boxHeight / simulation->gridRowCount;
+	simulation->invGridCellWidth = simulation->gridColCount / simulation->boxWidth;
+	simulation->invGridCellHeight = simulation->gridRowCount / simulation->boxHeight;
 	u64 cellCount = simulation->gridColCount * simulation->gridRowCount;
 	simulation->particleGrid = (Particle**) realloc(simulation->particleGrid, cellCount * sizeof(Particle*));
 
 	assert(simulation->particleCount < (simulation->gridColCount * simulation->gridRowCount));
 }
 
+void
+updateInteractions(Simulation* simulation)
+{
+	f64 maxSquaredCutoff = 0;
+	f64 maxSquaredInnerEnd = 0;
+	for (int speciesA = 0; speciesA < simulation->speciesCount; ++speciesA)
+	{
+		for (int speciesB = 0; speciesB < simulation->speciesCount; ++speciesB)
+		{
+			SpeciesPair* pair = &simulation->speciesPairs[speciesA][speciesB];
+			Interaction* interaction = simulation->interactions + speciesA * maxSpeciesCount + speciesB;
+
+			f64 separation = pair->separationFactor * simulation->separation;
+			f64 cutoffFactor = (pair->cutoffFactor > 0) ? pair->cutoffFactor : simulation->cutoffFactor;
+			interaction->squaredSeparation = square(separation);
+			interaction->bondEnergy = pair->energyFactor * simulation->bondEnergy;
+			interaction->cutoff = cutoffFactor * separation;
+			interaction->squaredCutoff = square(interaction->cutoff);
+
+			f64 innerEnd = atMost(interaction->cutoff, simulation->innerCutoffFactor * separation);
+			interaction->squaredInnerEnd = square(innerEnd);
+			interaction->squaredInnerStart = square(0.8 * innerEnd);
+			maxSquaredInnerEnd = max(maxSquaredInnerEnd, interaction->squaredInnerEnd);
+
+			PairForce atCutoff = evaluatePotential(simulation->potentialType, interaction, interaction->squaredCutoff);
+			interaction->cutoffEnergy = atCutoff.potentialEnergy;
+			interaction->cutoffSlope = atCutoff.forceFactor * interaction->cutoff;
+			maxSquaredCutoff = max(maxSquaredCutoff, interaction->squaredCutoff);
+		}
+	}
+	simulation->interactionRange = sqrt(maxSquaredCutoff);
+	simulation->innerInteractionRange = sqrt(maxSquaredInnerEnd);
+
+	simulation->maxStepDisplacement = simulation->maxStepDisplacementFactor * simulation->separation;
+	simulation->stepErrorTolerance = simulation->stepErrorFactor * simulation->separation;
+}
+
+// NOTE: only rebuilds the tables whose parameters changed since last time
+void
+updatePotentialTables(Simulation* simulation)
+{
+	if (!simulation->potentialTables)
+	{
+		int tableCount = maxSpeciesCount * maxSpeciesCount;
+		simulation->potentialTables = allocArray(PotentialTable, tableCount);
+		memset(simulation->potentialTables, 0, tableCount * sizeof(PotentialTable));
+	}
+
+	for (int speciesA = 0; speciesA < simulation->speciesCount; ++speciesA)
+	{
+		for (int speciesB = 0; speciesB < simulation->speciesCount; ++speciesB)
+		{
+			int pairIndex = speciesA * maxSpeciesCount + speciesB;
+			Interaction* interaction = simulation->interactions + pairIndex;
+			PotentialTable* table = simulation->potentialTables + pairIndex;
+
+			bool isUpToDate = table->isBuilt
+				&& (table->potentialType == simulation->potentialType)
+				&& (memcmp(&table->interaction, interaction, sizeof(Interaction)) == 0);
+			if (!isUpToDate)
+			{
+				buildPotentialTable(table, simulation->potentialType, interaction);
+			}
+		}
+	}
+}
+
+void
+setSpeciesPair(Simulation* simulation, int speciesA, int speciesB, f64 separationFactor, f64 energyFactor, f64 cutoffFactor = 0)
+{
+	SpeciesPair pair = {separationFactor, energyFactor, cutoffFactor};
+	simulation->speciesPairs[speciesA][speciesB] = pair;
+	simulation->speciesPairs[speciesB][speciesA] = pair;
+	updateInteractions(simulation);
+}
+
+int
+addSpecies(Simulation* simulation, f64 mass, f64 radius, Color4 color)
+{
+	assert(simulation->speciesCount < maxSpeciesCount);
+
+	int speciesIndex = simulation->speciesCount++;
+	Species* species = simulation->species + speciesIndex;
+	species->mass = mass;
+	species->radius = radius;
+	species->charge = 0;
+	species->color = color;
+
+	// NOTE: interacts like everything else until told otherwise
+	for (int otherIndex = 0; otherIndex <= speciesIndex; ++otherIndex)
+	{
+		setSpeciesPair(simulation, speciesIndex, otherIndex, 1, 1);
+	}
+	updateGrid(simulation);
+	return speciesIndex;
+}
+
 void
 initSimulation(Simulation* simulation)
 {
@@ -163,6 +489,23 @@ initSimulation(Simulation* simulation)
 	simulation->draggingStrength = 10;
 	simulation->cutoffFactor = 2;
 
+	// multiple time stepping
+
+	simulation->innerStepCount = 4;
+	simulation->innerCutoffFactor = 1.5;
+
+	// adaptive time step
+
+	simulation->maxStepDisplacementFactor = 0.1;
+	simulation->stepErrorFactor = 1e-4;
+	simulation->minDt = 0.0005;
+	simulation->maxDt = 0.05;
+
+	// long range
+
+	simulation->longRangeStrength = 20;
+	simulation->openingAngle = 0.5;
+
 	// thermostat
 
 	simulation->temperature = 10;
@@ -174,9 +517,13 @@ initSimulation(Simulation* simulation)
 	simulation->boxWidth = boxSide;
 	simulation->boxHeight = boxSide;
 
+	// NOTE: seeded from rand(), so srand still decides what a lone simulation does
+	simulation->random = randomSeries(rand(), 0);
+
 	// init
 
-	updateGrid(simulation);
+	simulation->speciesCount = 0;
+	addSpecies(simulation, 1, 1, c4(0, 0, 0, 1));
 }
 
 
@@ -190,7 +537,7 @@ defaultParticles(Simulation* simulation)
     for (int i = 0; i < simulation->particleCount; ++i) {
         Particle* particle = simulation->particles + i;
         particle->position = simulation->separation * hexagonLatticePosition(i);
-        particle->position += 0.05 * v2(randomGaussian(), randomGaussian());
+        particle->position += 0.05 * v2(randomGaussian(&simulation->random), randomGaussian(&simulation->random));
         particle->velocity = v2(0, 0);
         particle->acceleration = v2(0, 0);
         Color4 orange = c4(0.8, 0.3, 0, 1);
@@ -198,7 +545,7 @@ defaultParticles(Simulation* simulation)
     }
     
     
-    printf("Initialized simulation with %d particles.", simulation->particleCount);
+    printf("Initialized simulation with %d particles.\n", simulation->particleCount);
 }
 
 void defaultWalls(Simulation* simulation)
@@ -212,8 +559,10 @@ void defaultWalls(Simulation* simulation)
         v2(-halfWidth, halfHeight),
     };
     
+    free(simulation->walls);
     simulation->wallCount = 4;
     simulation->walls = allocArray(Wall, simulation->wallCount);
+    simulation->wallGeneration++;
     for (int wallIndex = 0; wallIndex < simulation->wallCount; ++wallIndex)
     {
         Wall* wall = simulation->walls + wallIndex;
@@ -234,8 +583,10 @@ evaporationSetup(Simulation* simulation)
         v2(halfWidth, 0),
     };
     
+    free(simulation->walls);
     simulation->wallCount = 3;
     simulation->walls = allocArray(Wall, simulation->wallCount);
+    simulation->wallGeneration++;
     for (int wallIndex = 0; wallIndex < simulation->wallCount; ++wallIndex)
     {
         Wall* wall = simulation->walls + wallIndex;
@@ -247,6 +598,93 @@ evaporationSetup(Simulation* simulation)
     simulation->temperature = 20;
 }
 
+// NOTE: Kob-Andersen style 80:20 mixture, the minority species is smaller and
+// binds strongly to the majority, which keeps the mixture from crystallizing
+void
+binaryMixtureSetup(Simulation* simulation)
+{
+    simulation->species[0].color = c4(0.8, 0.3, 0, 1);
+    int smallSpecies = addSpecies(simulation, 1, 0.88, c4(0.1, 0.3, 0.8, 1));
+    setSpeciesPair(simulation, 0, smallSpecies, 0.8, 1.5, 2.5);
+    setSpeciesPair(simulation, smallSpecies, smallSpecies, 0.88, 0.5, 2.5);
+    setSpeciesPair(simulation, 0, 0, 1, 1, 2.5);
+
+    for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        int species = ((particleIndex % 5) == 0) ? smallSpecies : 0;
+        setParticleSpecies(simulation, particle, species);
+    }
+}
+
+// NOTE: alternating positive and negative ions, any leftover charge is neutralized by the mesh
+void
+electrolyteSetup(Simulation* simulation)
+{
+    simulation->species[0].color = c4(0.8, 0.1, 0.1, 1);
+    simulation->species[0].charge = 1;
+    int anionSpecies = addSpecies(simulation, 1, 1, c4(0.1, 0.1, 0.8, 1));
+    simulation->species[anionSpecies].charge = -1;
+    simulation->longRangeType = LongRangeType_Coulomb;
+
+    for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        setParticleSpecies(simulation, particle, particleIndex % 2);
+    }
+}
+
+// NOTE: the particles pull each other together, with the tree, so the box is open and only the walls
+// hold the clump in, see hasOpenBoundaries
+void
+selfGravitySetup(Simulation* simulation)
+{
+    simulation->longRangeType = LongRangeType_Gravity;
+    simulation->longRangeSolver = LongRangeSolver_BarnesHut;
+    simulation->longRangeStrength = 0.05;
+}
+
+// NOTE: strings the particles into chains in the order they are in, with a harmonic bond between
+// neighbors in a chain and a soft angle that keeps the chains from folding back on themselves.
+// A chain ends early where the next particle isn't close enough to bond to.
+void
+polymerChainsSetup(Simulation* simulation, int chainLength)
+{
+    BondTopology* topology = &simulation->topology;
+    f64 bondLength = simulation->separation;
+    int bondStyle = addBondStyle(topology, BondType_Harmonic, 20 * simulation->bondEnergy / square(bondLength), bondLength);
+    int angleStyle = addAngleStyle(topology, 0.5 * simulation->bondEnergy, 0.5 * tau);
+    simulation->isExcludingBondedPairs = true;
+
+    Color4 chainColors[] = {c4(0.8, 0.3, 0, 1), c4(0.1, 0.3, 0.8, 1), c4(0.2, 0.6, 0.2, 1)};
+    int chainIndex = 0;
+    int chainStart = 0;
+    for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        if (particleIndex > chainStart)
+        {
+            Particle* previous = particle - 1;
+            bool isFull = (particleIndex - chainStart == chainLength);
+            bool isTooFar = square(particle->position - previous->position) > square(1.5 * bondLength);
+            if (isFull || isTooFar)
+            {
+                chainStart = particleIndex;
+                chainIndex++;
+            }
+            else
+            {
+                addBond(topology, particleIndex - 1, particleIndex, bondStyle);
+                if (particleIndex - chainStart >= 2)
+                {
+                    addAngle(topology, particleIndex - 2, particleIndex - 1, particleIndex, angleStyle);
+                }
+            }
+        }
+        particle->color = chainColors[chainIndex % arrayCount(chainColors)];
+    }
+}
+
 Particle*
 addParticle(Simulation* simulation)
 {
@@ -255,15 +693,68 @@ addParticle(Simulation* simulation)
     return particle;
 }
 
+// NOTE: the particles after it move down one, and the bonds and the dragged particle follow them
 void
 removeParticle(Simulation* simulation, int particleIndex)
 {
     Particle* particle = simulation->particles + particleIndex;
     int movedParticlesCount = simulation->particleCount - particleIndex - 1;
-    memmove(particle, particle + 1, movedParticlesCount * sizeof(Particle*));
+    memmove(particle, particle + 1, movedParticlesCount * sizeof(Particle));
+
+    BondTopology* topology = &simulation->topology;
+    if (hasBondedTerms(topology))
+    {
+        int* newFromOld = allocArray(int, simulation->particleCount);
+        for (int oldIndex = 0; oldIndex < simulation->particleCount; ++oldIndex)
+        {
+            newFromOld[oldIndex] = (oldIndex < particleIndex) ? oldIndex : oldIndex - 1;
+        }
+        newFromOld[particleIndex] = -1;
+        remapBondTopology(topology, newFromOld);
+        free(newFromOld);
+    }
+
+    if (simulation->draggedParticleIndex == particleIndex)
+    {
+        simulation->isDragging = false;
+    }
+    else if (simulation->draggedParticleIndex > particleIndex)
+    {
+        simulation->draggedParticleIndex--;
+    }
+
     setParticleCount(simulation, simulation->particleCount - 1);
 }
 
+// NOTE: puts the particle that was at oldFromNew[i] at i, for any order that keeps all of them,
+// like one that sorts them by cell so neighbors sit close in memory
+void
+reorderParticles(Simulation* simulation, const int* oldFromNew)
+{
+    int particleCount = simulation->particleCount;
+    Particle* reordered = allocArray(Particle, particleCount);
+    int* newFromOld = allocArray(int, particleCount);
+    for (int newIndex = 0; newIndex < particleCount; ++newIndex)
+    {
+        reordered[newIndex] = simulation->particles[oldFromNew[newIndex]];
+        newFromOld[oldFromNew[newIndex]] = newIndex;
+    }
+    free(simulation->particles);
+    simulation->particles = reordered;
+
+    if (hasBondedTerms(&simulation->topology))
+    {
+        remapBondTopology(&simulation->topology, newFromOld);
+    }
+    if (simulation->draggedParticleIndex < particleCount)
+    {
+        simulation->draggedParticleIndex = newFromOld[simulation->draggedParticleIndex];
+    }
+    // NOTE: the grid points into the old array, and is only binned again by the next step
+    memset(simulation->particleGrid, 0, simulation->gridRowCount * simulation->gridColCount * sizeof(Particle*));
+    free(newFromOld);
+}
+
 V2
 shortestVectorFromLine(V2 point, V2 lineStart, V2 lineEnd)
 {
@@ -315,161 +806,1641 @@ isOverlapping(Simulation* simulation, Particle* particle)
 }
 
 void
-applyLangevinNoise(Particle* particle, f32 temperature, f32 viscosityFactor, f32 gaussianFactor)
+diluteGasSetup(Simulation* simulation, int particleCount)
+{
+    setParticleCount(simulation, 0);
+    for (int particleIndex = 0; particleIndex < particleCount; ++particleIndex)
+    {
+        Particle* particle = addParticle(simulation);
+        do
+        {
+            particle->position = v2(randomBetween(&simulation->random, -0.5, 0.5) * simulation->boxWidth,
+                randomBetween(&simulation->random, -0.5, 0.5) * simulation->boxHeight);
+        } while (isOverlapping(simulation, particle));
+
+        f32 thermalVelocity = sqrt(simulation->temperature / particle->mass);
+        particle->velocity = thermalVelocity * v2(randomGaussian(&simulation->random), randomGaussian(&simulation->random));
+        particle->acceleration = v2(0, 0);
+        particle->color = c4(0.2, 0.4, 0.8, 1);
+    }
+    simulation->gravityStrength = 0;
+}
+
+void
+applyLangevinNoise(RandomSeries* random, Particle* particle, f32 temperature, f32 viscosityFactor, f32 gaussianFactor)
 {
 	f32 thermalVelocity = sqrt(temperature / particle->mass);
 
-	V2 gaussianVector = v2(randomGaussian(), randomGaussian());
+	V2 gaussianVector = v2(randomGaussian(random), randomGaussian(random));
 	particle->velocity *= viscosityFactor;
 	particle->velocity += thermalVelocity * gaussianFactor * gaussianVector;
 }
 
-void
-advanceSimulation(Simulation* simulation, f64 timeToSimulate)
+V2
+draggingAcceleration(Simulation* simulation, Particle* particle)
 {
-	simulation->timeLeftToSimulate += timeToSimulate;
-
-    f64 dt = simulation->dt;
+	V2 relativePosition = simulation->mousePosition - particle->position;
+	V2 acceleration = simulation->draggingStrength / particle->mass * relativePosition;
+	acceleration -= particle->velocity / particle->mass; // some friction
+	return acceleration;
+}
 
-    f32 viscosityFactor = exp(-0.5 * simulation->viscosity * dt);
-    f32 gaussianFactor = sqrt(1 - square(viscosityFactor));
+void
+applyWallCollisions(Simulation* simulation)
+{
+    for (int particleIndex = 0;
+         particleIndex < simulation->particleCount;
+         ++particleIndex)
+    {
+    	Particle* particle = simulation->particles + particleIndex;
 
-    while (simulation->timeLeftToSimulate > dt) {
-        simulation->timeLeftToSimulate -= dt;
+		for (int wallIndex = 0; wallIndex < simulation->wallCount; wallIndex++)
+		{
+			Wall* wall = simulation->walls + wallIndex;
+			
+            // TODO: check minus sign
+            V2 particleFromWall = shortestVectorFromLine(particle->position, wall->start, wall->end);
+			f32 squaredDistance = square(particleFromWall);
 
-        // reset particleGrid
-        int cellCount = simulation->gridRowCount * simulation->gridColCount;
-        memset(simulation->particleGrid, 0, cellCount * sizeof(Particle*));
+			if (squaredDistance < square(particle->radius))
+			{
+				f32 distance = sqrtf(squaredDistance);
+				V2 normal = particleFromWall / distance;
+				f32 overlap = particle->radius - distance;
 
-        Particle* particles = simulation->particles;
+				particle->position += overlap * normal;
 
-        for (int particleIndex = 0;
-             particleIndex < simulation->particleCount;
-             ++particleIndex)
-        {
-        	Particle* particle = particles + particleIndex;
+				particle->velocity -= 2 * inner(particle->velocity, normal) * normal;
+			}
+		}
+    }
+}
 
-        	applyLangevinNoise(particle, simulation->temperature, viscosityFactor, gaussianFactor);
-        	particle->velocity += 0.5 * dt * particle->acceleration;
-        	particle->position += particle->velocity * dt;
-            particle->position = periodize(particle->position, simulation->boxWidth, simulation->boxHeight);
+void
+applyExternalForces(Simulation* simulation)
+{
+	// ! user interaction
 
-            particle->acceleration = v2(0, -simulation->gravityStrength);
+	if (simulation->isDragging && (simulation->draggedParticleIndex < simulation->particleCount))
+	{
+		Particle* particle = simulation->particles + simulation->draggedParticleIndex;
+		particle->acceleration += draggingAcceleration(simulation, particle);
+	}
 
-            // ! Put particles in grid
-            
-            
-            V2 normalizedPosition = v2(particle->position.x / simulation->boxWidth, particle->position.y / simulation->boxHeight) + v2(0.5, 0.5);
-            int col = floor(normalizedPosition.x * simulation->gridColCount);
-            int row = floor(normalizedPosition.y * simulation->gridRowCount);
-            // TODO: v-- these might be redundant
-            col = mod(col, simulation->gridColCount);
-            row = mod(row, simulation->gridRowCount);
-            int cellIndex = row * simulation->gridColCount + col;
-            assert(cellIndex < cellCount);
+	// ! particle-wall interactions	
 
-            particle->gridCol = col;
-            particle->gridRow = row;
+	applyWallCollisions(simulation);
+}
 
-            simulation->particleGrid[cellIndex] = particle;
-        }
+void
+clearGrid(Simulation* simulation)
+{
+    int cellCount = simulation->gridRowCount * simulation->gridColCount;
+    memset(simulation->particleGrid, 0, cellCount * sizeof(Particle*));
+}
 
+// NOTE: the tree sums the long range forces over open space rather than over the periodic images of the
+// box, so with it nothing wraps around: the pairs don't take the minimal image, and the stencils stop at
+// the edges of the grid. The grid holds one particle per cell, so it can't follow particles out of the box,
+// and instead of periodizing the steps bounce them off its edges.
+inline bool
+hasOpenBoundaries(Simulation* simulation)
+{
+    return (simulation->longRangeType != LongRangeType_None) && (simulation->longRangeSolver == LongRangeSolver_BarnesHut);
+}
 
-        // ! calculate forces
+inline void
+reflectOffBox(Particle* particle, f64 boxWidth, f64 boxHeight)
+{
+    f32 halfWidth = 0.5 * boxWidth;
+    f32 halfHeight = 0.5 * boxHeight;
+    if (particle->position.x > halfWidth)
+    {
+        particle->position.x = 2 * halfWidth - particle->position.x;
+        particle->velocity.x = -fabsf(particle->velocity.x);
+    }
+    else if (particle->position.x < -halfWidth)
+    {
+        particle->position.x = -2 * halfWidth - particle->position.x;
+        particle->velocity.x = fabsf(particle->velocity.x);
+    }
+    if (particle->position.y > halfHeight)
+    {
+        particle->position.y = 2 * halfHeight - particle->position.y;
+        particle->velocity.y = -fabsf(particle->velocity.y);
+    }
+    else if (particle->position.y < -halfHeight)
+    {
+        particle->position.y = -2 * halfHeight - particle->position.y;
+        particle->velocity.y = fabsf(particle->velocity.y);
+    }
+}
 
-        for (int particleIndex = 0;
-             particleIndex < simulation->particleCount;
-             ++particleIndex)
+// NOTE: the steps periodize the positions, so the cell is almost always inside the grid already,
+// and only particles that were put outside the box (or land exactly on its far edge) take the slow way.
+// The tests are written so that positions that blew up (to NaN or past what an int holds) take it too.
+// With open boundaries those go in the nearest edge cell instead, since nothing may wrap.
+void
+putParticleInGrid(Simulation* simulation, Particle* particle)
+{
+    f64 u = (particle->position.x + 0.5 * simulation->boxWidth) * simulation->invGridCellWidth;
+    f64 v = (particle->position.y + 0.5 * simulation->boxHeight) * simulation->invGridCellHeight;
+    int col = (int) u;
+    int row = (int) v;
+    if (!(u >= 0) || ((u32) col >= (u32) simulation->gridColCount))
+    {
+        if (hasOpenBoundaries(simulation))
+        {
+            col = (u >= simulation->gridColCount) ? simulation->gridColCount - 1 : 0;
+        }
+        else
+        {
+            col = mod((int) floor(u), simulation->gridColCount);
+        }
+    }
+    if (!(v >= 0) || ((u32) row >= (u32) simulation->gridRowCount))
+    {
+        if (hasOpenBoundaries(simulation))
+        {
+            row = (v >= simulation->gridRowCount) ? simulation->gridRowCount - 1 : 0;
+        }
+        else
         {
-        	Particle* particle = particles + particleIndex;
+            row = mod((int) floor(v), simulation->gridRowCount);
+        }
+    }
+    int cellIndex = row * simulation->gridColCount + col;
+    assert(cellIndex < simulation->gridColCount * simulation->gridRowCount);
 
-        	// ! user interaction
+    particle->gridCol = col;
+    particle->gridRow = row;
 
-        	if (simulation->isDragging && (particleIndex == simulation->draggedParticleIndex))
-        	{
-        		V2 relativePosition = simulation->mousePosition - particle->position;
-        		particle->acceleration += simulation->draggingStrength / particle->mass * relativePosition;
-        		particle->acceleration -= particle->velocity / particle->mass; // some friction
-        	}
+    simulation->particleGrid[cellIndex] = particle;
+}
 
-			// ! particle-wall interactions	
-			for (int wallIndex = 0; wallIndex < simulation->wallCount; wallIndex++)
-			{
-				Wall* wall = simulation->walls + wallIndex;
-				
-                // TODO: check minus sign
-                V2 particleFromWall = shortestVectorFromLine(particle->position, wall->start, wall->end);
-				f32 squaredDistance = square(particleFromWall);
-
-				if (squaredDistance < square(particle->radius))
-				{
-					f32 distance = sqrtf(squaredDistance);
-					V2 normal = particleFromWall / distance;
-					f32 overlap = particle->radius - distance;
-
-					particle->position += overlap * normal;
-
-					particle->velocity -= 2 * inner(particle->velocity, normal) * normal;
-				}
-			}
+// NOTE: what one particle's pairs add up to
+template <typename Types>
+struct PairSums {
+    typename Types::Accumulator forceX;
+    typename Types::Accumulator forceY;
+    typename Types::Accumulator potentialEnergy;
+};
 
-        	// ! particle-particle interactions
-        	
-        	f64 range = simulation->cutoffFactor * simulation->separation;
-        	// TODO: maybe optimize this to be a circle? (probably not worth it)
-        	int gridRadius = range / min(simulation->gridCellWidth, simulation->gridCellHeight);
+template <typename Potential, typename Types, CutoffShift cutoffShift, PairRange pairRange, bool isFullStencil>
+inline void
+addPairForce(Potential potential, Interaction* interaction, Particle* otherParticle,
+             typename Types::Geometry relativeX, typename Types::Geometry relativeY, PairSums<Types>* sums,
+             SliceForce* otherSliceForce)
+{
+    typedef typename Types::Real Real;
 
-        	for (int y = -gridRadius; y <= gridRadius; ++y)
-        	{
-        		int row = mod(particle->gridRow + y, simulation->gridRowCount);
-        		int rowIndex = row * simulation->gridColCount;
-        		for (int x = -gridRadius; x <= gridRadius; ++x)
-        		{
-        			int col = mod(particle->gridCol + x, simulation->gridColCount);
-        			int cellIndex = rowIndex + col;
-        			Particle* otherParticle = simulation->particleGrid[cellIndex];
-        			if (otherParticle && (otherParticle < particle))
-        			{
-						f64 separation = simulation->separation;
+    Real quadrance = (Real) (relativeX * relativeX + relativeY * relativeY);
 
-						V2 relativePosition = otherParticle->position - particle->position;
-				        relativePosition = periodize(relativePosition, simulation->boxWidth, simulation->boxHeight);
-						f64 quadrance = square(relativePosition);
+    // NOTE: the stencil is a square, so a good part of it is beyond the cutoff
+    if (quadrance >= (Real) interaction->squaredCutoff) return;
+    if ((pairRange == PairRange_Short) && (quadrance >= (Real) interaction->squaredInnerEnd)) return;
+    if ((pairRange == PairRange_Long) && (quadrance < (Real) interaction->squaredInnerStart)) return;
 
-						f64 invQuadrance = 1 / quadrance;
-				        f64 rInv2 = square(separation) * invQuadrance;
-						f64 rInv6 = rInv2 * rInv2 * rInv2;
-						f64 rInv12 = square(rInv6);
-						f64 potentialEnergy = simulation->bondEnergy * (rInv12 - 2 * rInv6);
-						f64 virial = simulation->bondEnergy * 12 * (rInv6 - rInv12);
-						f64 forceFactor = virial * invQuadrance;
-							
-						particle->acceleration += forceFactor / particle->mass * relativePosition;
-						otherParticle->acceleration -= forceFactor / otherParticle->mass * relativePosition;
+    PairForceOf<Real> pairForce = potential.evaluate(interaction, quadrance);
+    if (cutoffShift == CutoffShift_Energy)
+    {
+        pairForce.potentialEnergy -= (Real) interaction->cutoffEnergy;
+    }
+    else if (cutoffShift == CutoffShift_Force)
+    {
+        Real distance = sqrt(quadrance);
+        Real cutoffSlope = (Real) interaction->cutoffSlope;
+        pairForce.potentialEnergy -= (Real) interaction->cutoffEnergy + (distance - (Real) interaction->cutoff) * cutoffSlope;
+        pairForce.forceFactor -= cutoffSlope / distance;
+    }
 
-						f64 halfPotentialEnergy = potentialEnergy / 2;
-						particle->potentialEnergy = halfPotentialEnergy;
-						otherParticle->potentialEnergy = halfPotentialEnergy;
-        			}
-        		}
-        	}
+    if (pairRange != PairRange_All)
+    {
+        // NOTE: the short part is smoothstep(r^2) times the potential, and its force is the exact
+        // derivative of that, so both parts stay conservative
+        Real innerStart = (Real) interaction->squaredInnerStart;
+        Real innerWidth = (Real) interaction->squaredInnerEnd - innerStart;
+        Real t = atLeast((Real) 0, atMost((Real) 1, (quadrance - innerStart) / innerWidth));
+        Real weight = 1 - t * t * (3 - 2 * t);
+        Real weightSlope = -6 * t * (1 - t) / innerWidth;
+
+        PairForceOf<Real> shortForce;
+        shortForce.potentialEnergy = weight * pairForce.potentialEnergy;
+        shortForce.forceFactor = weight * pairForce.forceFactor + 2 * weightSlope * pairForce.potentialEnergy;
+        if (pairRange == PairRange_Short)
+        {
+            pairForce = shortForce;
+        }
+        else
+        {
+            pairForce.potentialEnergy -= shortForce.potentialEnergy;
+            pairForce.forceFactor -= shortForce.forceFactor;
+        }
+    }
 
+    Real pairForceX = pairForce.forceFactor * (Real) relativeX;
+    Real pairForceY = pairForce.forceFactor * (Real) relativeY;
+    sums->forceX += pairForceX;
+    sums->forceY += pairForceY;
+    sums->potentialEnergy += pairForce.potentialEnergy;
 
+    if (!isFullStencil)
+    {
+        Real invMass = 1 / (Real) otherParticle->mass;
+        V2 acceleration = v2(-invMass * pairForceX, -invMass * pairForceY);
+        if (otherSliceForce)
+        {
+            otherSliceForce->acceleration += acceleration;
+            otherSliceForce->potentialEnergy += 0.5 * pairForce.potentialEnergy;
+            return;
         }
 
-        for (int particleIndex = 0;
-             particleIndex < simulation->particleCount;
-             ++particleIndex)
+        if (pairRange == PairRange_Long)
         {
-        	Particle* particle = particles + particleIndex;
-        	particle->velocity += 0.5 * dt * particle->acceleration;
-        	applyLangevinNoise(particle, simulation->temperature, viscosityFactor, gaussianFactor);
-
-			particle->kineticEnergy = 0.5 * particle->mass * square(particle->velocity);
+            otherParticle->slowAcceleration += acceleration;
+        }
+        else
+        {
+            otherParticle->acceleration += acceleration;
         }
+        otherParticle->potentialEnergy += 0.5 * pairForce.potentialEnergy;
+    }
+}
+
+// NOTE: with the full stencil every pair is visited from both sides and each visit only writes the particle
+// it is about, which costs twice the pairs but lets chunks of particles run on different threads.
+// The pairs of a particle are summed in Types::Accumulator and added to it once at the end.
+//
+// Particles whose stencil stays inside the grid skip the wrapping: their cells are plain offsets, and their
+// neighbors are less than half a box away, so the minimal image would change nothing. Their stencil rows
+// are contiguous too, so the empty cells are skipped with a mask rather than one branch per cell.
+template <typename Potential, typename Types, CutoffShift cutoffShift, PairRange pairRange, bool isFullStencil>
+void
+calculatePairForces(Simulation* simulation, Potential potential, int startIndex, int endIndex, SliceForce* sliceForces)
+{
+    typedef typename Types::Geometry Geometry;
+
+    f64 range = (pairRange == PairRange_Short) ? simulation->innerInteractionRange : simulation->interactionRange;
+    // TODO: maybe optimize this to be a circle? (probably not worth it)
+    int gridRadius = ceil(range / min(simulation->gridCellWidth, simulation->gridCellHeight));
+    int gridColCount = simulation->gridColCount;
+    int gridRowCount = simulation->gridRowCount;
+    Particle** particleGrid = simulation->particleGrid;
+
+    Geometry boxWidth = (Geometry) simulation->boxWidth;
+    Geometry boxHeight = (Geometry) simulation->boxHeight;
+    Geometry invBoxWidth = 1 / boxWidth;
+    Geometry invBoxHeight = 1 / boxHeight;
+
+    // NOTE: a stencil one cell narrower than the grid could still reach more than half way round
+    int stencilWidth = 2 * gridRadius + 1;
+    bool hasInterior = (gridColCount > stencilWidth) && (gridRowCount > stencilWidth);
+    bool isOpen = hasOpenBoundaries(simulation);
+
+    // NOTE: a particle's bond partners are its row of the topology, a handful at most, so checking the pairs
+    // against it is cheaper than taking them back out afterwards, and without bonds the row is just empty
+    Particle* particles = simulation->particles;
+    BondTopology* topology = &simulation->topology;
+    bool isExcludingBondedPairs = simulation->isExcludingBondedPairs && (topology->bondCount > 0);
+
+    for (int particleIndex = startIndex;
+         particleIndex < endIndex;
+         ++particleIndex)
+    {
+    	Particle* particle = simulation->particles + particleIndex;
+    	Interaction* speciesInteractions = simulation->interactions + particle->species * maxSpeciesCount;
+    	Geometry positionX = (Geometry) particle->position.x;
+    	Geometry positionY = (Geometry) particle->position.y;
+
+    	PairSums<Types> sums = {};
+
+    	int* excludedBegin = 0;
+    	int* excludedEnd = 0;
+    	if (isExcludingBondedPairs)
+    	{
+    		excludedBegin = topology->bondPartners + topology->bondStarts[particleIndex];
+    		excludedEnd = topology->bondPartners + topology->bondStarts[particleIndex + 1];
+    	}
+
+    	bool isInterior = hasInterior &&
+    		(particle->gridCol >= gridRadius) && (particle->gridCol < gridColCount - gridRadius) &&
+    		(particle->gridRow >= gridRadius) && (particle->gridRow < gridRowCount - gridRadius);
+
+    	if (isInterior)
+    	{
+    		for (int y = -gridRadius; y <= gridRadius; ++y)
+    		{
+    			Particle** gridRow = particleGrid + (particle->gridRow + y) * gridColCount + particle->gridCol - gridRadius;
+    			for (int firstX = 0; firstX < stencilWidth; firstX += 32)
+    			{
+    				u32 occupied = nonNullMask(gridRow + firstX, atMost(32, stencilWidth - firstX));
+    				while (occupied)
+    				{
+    					Particle* otherParticle = gridRow[firstX + lowestSetBit(occupied)];
+    					occupied &= occupied - 1;
+    					bool isVisited = isFullStencil ? (otherParticle != particle) : (otherParticle < particle);
+    					if (isVisited && ((excludedBegin == excludedEnd) || !isInBondRow(excludedBegin, excludedEnd, (int) (otherParticle - particles))))
+    					{
+    						Geometry relativeX = (Geometry) otherParticle->position.x - positionX;
+    						Geometry relativeY = (Geometry) otherParticle->position.y - positionY;
+    						SliceForce* otherSliceForce = sliceForces ? sliceForces + (otherParticle - particles) : 0;
+    						addPairForce<Potential, Types, cutoffShift, pairRange, isFullStencil>(
+    							potential, speciesInteractions + otherParticle->species, otherParticle, relativeX, relativeY, &sums, otherSliceForce);
+    					}
+    				}
+    			}
+    		}
+    	}
+    	else
+    	{
+    		// NOTE: open boundaries cut the stencil off at the edges instead
+    		int startY = isOpen ? atLeast(-gridRadius, -particle->gridRow) : -gridRadius;
+    		int endY = isOpen ? atMost(gridRadius, gridRowCount - 1 - particle->gridRow) : gridRadius;
+    		int startX = isOpen ? atLeast(-gridRadius, -particle->gridCol) : -gridRadius;
+    		int endX = isOpen ? atMost(gridRadius, gridColCount - 1 - particle->gridCol) : gridRadius;
+    		for (int y = startY; y <= endY; ++y)
+    		{
+    			Particle** gridRow = particleGrid + mod(particle->gridRow + y, gridRowCount) * gridColCount;
+    			for (int x = startX; x <= endX; ++x)
+    			{
+    				Particle* otherParticle = gridRow[mod(particle->gridCol + x, gridColCount)];
+    				bool isVisited = isFullStencil ? (otherParticle != particle) : (otherParticle < particle);
+    				if (otherParticle && isVisited &&
+    					((excludedBegin == excludedEnd) || !isInBondRow(excludedBegin, excludedEnd, (int) (otherParticle - particles))))
+    				{
+    					Geometry relativeX = (Geometry) otherParticle->position.x - positionX;
+    					Geometry relativeY = (Geometry) otherParticle->position.y - positionY;
+    					if (!isOpen)
+    					{
+    						relativeX = minimalImage(relativeX, boxWidth, invBoxWidth);
+    						relativeY = minimalImage(relativeY, boxHeight, invBoxHeight);
+    					}
+    					SliceForce* otherSliceForce = sliceForces ? sliceForces + (otherParticle - particles) : 0;
+    					addPairForce<Potential, Types, cutoffShift, pairRange, isFullStencil>(
+    						potential, speciesInteractions + otherParticle->species, otherParticle, relativeX, relativeY, &sums, otherSliceForce);
+    				}
+    			}
+    		}
+    	}
+
+    	typename Types::Accumulator invMass = 1 / (typename Types::Accumulator) particle->mass;
+    	V2 acceleration = v2(invMass * sums.forceX, invMass * sums.forceY);
+    	if (pairRange == PairRange_Long)
+    	{
+    		particle->slowAcceleration += acceleration;
+    	}
+    	else
+    	{
+    		particle->acceleration += acceleration;
+    	}
+    	particle->potentialEnergy += 0.5 * sums.potentialEnergy;
+    }
+}
+
+// NOTE: which particles the force loop goes over, and how
+struct PairLoop {
+    PairRange pairRange;
+    int startIndex;
+    int endIndex;
+    // only for PairRange_All
+    bool isFullStencil;
+    // NOTE: the row of the slice this loop is, or 0 to write the other particles directly
+    SliceForce* sliceForces;
+};
+
+// NOTE: picks the compile-time precision, shift and range once, so the force loop doesn't branch on them per pair
+template <typename Potential, typename Types, CutoffShift cutoffShift>
+void
+calculatePairForces(Simulation* simulation, Potential potential, PairLoop loop)
+{
+    if (loop.isFullStencil)
+    {
+        assert(loop.pairRange == PairRange_All);
+        calculatePairForces<Potential, Types, cutoffShift, PairRange_All, true>(simulation, potential, loop.startIndex, loop.endIndex, loop.sliceForces);
+        return;
+    }
+
+    switch (loop.pairRange)
+    {
+        case PairRange_All:   calculatePairForces<Potential, Types, cutoffShift, PairRange_All, false>(simulation, potential, loop.startIndex, loop.endIndex, loop.sliceForces); break;
+        case PairRange_Short: calculatePairForces<Potential, Types, cutoffShift, PairRange_Short, false>(simulation, potential, loop.startIndex, loop.endIndex, loop.sliceForces); break;
+        case PairRange_Long:  calculatePairForces<Potential, Types, cutoffShift, PairRange_Long, false>(simulation, potential, loop.startIndex, loop.endIndex, loop.sliceForces); break;
+        default: invalidCodePath;
+    }
+}
 
+template <typename Potential, typename Types>
+void
+calculatePairForces(Simulation* simulation, Potential potential, PairLoop loop)
+{
+    switch (cutoffShiftForPotential(simulation->potentialType, simulation->cutoffShift))
+    {
+        case CutoffShift_None:   calculatePairForces<Potential, Types, CutoffShift_None>(simulation, potential, loop); break;
+        case CutoffShift_Energy: calculatePairForces<Potential, Types, CutoffShift_Energy>(simulation, potential, loop); break;
+        case CutoffShift_Force:  calculatePairForces<Potential, Types, CutoffShift_Force>(simulation, potential, loop); break;
+        default: invalidCodePath;
     }
 }
 
+template <typename Potential>
+void
+calculatePairForces(Simulation* simulation, Potential potential, PairLoop loop)
+{
+    switch (simulation->precision)
+    {
+        case Precision_Mixed:  calculatePairForces<Potential, MixedPrecisionTypes>(simulation, potential, loop); break;
+        case Precision_Single: calculatePairForces<Potential, SinglePrecisionTypes>(simulation, potential, loop); break;
+        case Precision_Double: calculatePairForces<Potential, DoublePrecisionTypes>(simulation, potential, loop); break;
+        default: invalidCodePath;
+    }
+}
+
+void
+calculatePairForces(Simulation* simulation, PairLoop loop)
+{
+    if (simulation->isUsingPotentialTables)
+    {
+        TabulatedPotential tabulatedPotential = {simulation->interactions, simulation->potentialTables};
+        calculatePairForces(simulation, tabulatedPotential, loop);
+    }
+    else switch (simulation->potentialType)
+    {
+        case PotentialType_LennardJones:                 calculatePairForces(simulation, LennardJones(), loop); break;
+        case PotentialType_TruncatedShiftedLennardJones: calculatePairForces(simulation, LennardJones(), loop); break;
+        case PotentialType_WeeksChandlerAndersen:        calculatePairForces(simulation, WeeksChandlerAndersen(), loop); break;
+        case PotentialType_Morse:                        calculatePairForces(simulation, Morse(), loop); break;
+        case PotentialType_HarmonicDisks:                calculatePairForces(simulation, HarmonicDisks(), loop); break;
+        case PotentialType_Yukawa:                       calculatePairForces(simulation, Yukawa(), loop); break;
+        default: invalidCodePath;
+    }
+}
+
+void
+calculatePairForces(Simulation* simulation, PairRange pairRange)
+{
+    PairLoop loop = {pairRange, 0, simulation->particleCount, false, 0};
+    calculatePairForces(simulation, loop);
+}
+
+// NOTE: a slice is every sliceCount-th chunk of particles rather than one run of them, since with the half
+// stencil a particle only visits the neighbors before it, and the particles of a lattice or of a blob that
+// was added all at once sit next to their neighbors in the array too, so either way the slices get about
+// the same number of pairs
+#define sliceChunkSize 128
+
+// NOTE: one slice per thread, and a single slice writes the particles directly
+void
+prepareSlices(Simulation* simulation, int sliceCount)
+{
+    simulation->sliceCount = sliceCount;
+    if (simulation->sliceCount == 1) return;
+
+    int capacity = simulation->sliceCount * simulation->particleCount;
+    if (capacity > simulation->sliceForceCapacity)
+    {
+        simulation->sliceForces = (SliceForce*) realloc(simulation->sliceForces, capacity * sizeof(SliceForce));
+        simulation->sliceForceCapacity = capacity;
+    }
+}
+
+void
+calculateSlicePairForces(Simulation* simulation, PairRange pairRange, int sliceIndex)
+{
+    int particleCount = simulation->particleCount;
+    int sliceCount = simulation->sliceCount;
+    SliceForce* sliceForces = 0;
+    if (sliceCount > 1)
+    {
+        sliceForces = simulation->sliceForces + sliceIndex * particleCount;
+        memset(sliceForces, 0, particleCount * sizeof(SliceForce));
+    }
+
+    for (int startIndex = sliceIndex * sliceChunkSize;
+         startIndex < particleCount;
+         startIndex += sliceCount * sliceChunkSize)
+    {
+        PairLoop loop = {pairRange, startIndex, atMost(particleCount, startIndex + sliceChunkSize), false, sliceForces};
+        calculatePairForces(simulation, loop);
+    }
+}
+
+void
+gatherSliceForces(Simulation* simulation, PairRange pairRange, int startIndex, int endIndex)
+{
+    int particleCount = simulation->particleCount;
+    for (int particleIndex = startIndex;
+         particleIndex < endIndex;
+         ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        V2 acceleration = v2(0, 0);
+        f64 potentialEnergy = 0;
+        for (int sliceIndex = 0; sliceIndex < simulation->sliceCount; ++sliceIndex)
+        {
+            SliceForce* sliceForce = simulation->sliceForces + sliceIndex * particleCount + particleIndex;
+            acceleration += sliceForce->acceleration;
+            potentialEnergy += sliceForce->potentialEnergy;
+        }
+
+        if (pairRange == PairRange_Long)
+        {
+            particle->slowAcceleration += acceleration;
+        }
+        else
+        {
+            particle->acceleration += acceleration;
+        }
+        particle->potentialEnergy += potentialEnergy;
+    }
+}
+
+// NOTE: made on first use, and again whenever the box changes size
+void
+updateParticleMesh(Simulation* simulation)
+{
+    ParticleMesh* mesh = simulation->particleMesh;
+    if (!mesh)
+    {
+        mesh = allocArray(ParticleMesh, 1);
+        *mesh = {};
+        simulation->particleMesh = mesh;
+    }
+    if ((mesh->boxWidth != simulation->boxWidth) || (mesh->boxHeight != simulation->boxHeight))
+    {
+        initParticleMesh(mesh, simulation->boxWidth, simulation->boxHeight, 0.5 * simulation->separation);
+    }
+}
+
+inline f64
+longRangeSource(Simulation* simulation, Particle* particle)
+{
+    return (simulation->longRangeType == LongRangeType_Gravity) ? particle->mass : particle->charge;
+}
+
+void
+addLongRangeField(Particle* particle, f64 coupling, f64 source, f64 potential, V2 field, PairRange pairRange)
+{
+    V2 acceleration = (coupling * source / particle->mass) * field;
+    if (pairRange == PairRange_Long)
+    {
+        particle->slowAcceleration += acceleration;
+    }
+    else
+    {
+        particle->acceleration += acceleration;
+    }
+    particle->potentialEnergy += 0.5 * coupling * source * potential;
+}
+
+struct MeshForcesJob {
+    Simulation* simulation;
+    f64 coupling;
+    PairRange pairRange;
+};
+
+// NOTE: a slice is a run of particles here, since spreading costs the same for every particle
+void
+spreadMeshSliceChunk(void* data, int startSlice, int endSlice)
+{
+    MeshForcesJob* job = (MeshForcesJob*)data;
+    Simulation* simulation = job->simulation;
+    ParticleMesh* mesh = simulation->particleMesh;
+
+    for (int sliceIndex = startSlice; sliceIndex < endSlice; ++sliceIndex)
+    {
+        f64* sliceCharge = beginMeshSlice(mesh, sliceIndex);
+        int startIndex = (int) ((s64) simulation->particleCount * sliceIndex / mesh->sliceCount);
+        int endIndex = (int) ((s64) simulation->particleCount * (sliceIndex + 1) / mesh->sliceCount);
+        for (int particleIndex = startIndex; particleIndex < endIndex; ++particleIndex)
+        {
+            Particle* particle = simulation->particles + particleIndex;
+            spreadCharge(mesh, sliceCharge, particle->position, longRangeSource(simulation, particle));
+        }
+    }
+}
+
+void
+solveMeshTask(void* data)
+{
+    MeshForcesJob* job = (MeshForcesJob*)data;
+    solveParticleMesh(job->simulation->particleMesh);
+}
+
+void
+interpolateMeshChunk(void* data, int startIndex, int endIndex)
+{
+    MeshForcesJob* job = (MeshForcesJob*)data;
+    Simulation* simulation = job->simulation;
+    ParticleMesh* mesh = simulation->particleMesh;
+
+    for (int particleIndex = startIndex; particleIndex < endIndex; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        f64 source = longRangeSource(simulation, particle);
+        f64 potential;
+        V2 field;
+        interpolateMesh(mesh, particle->position, &potential, &field);
+        potential -= source * mesh->selfPotential;
+        addLongRangeField(particle, job->coupling, source, potential, field, job->pairRange);
+    }
+}
+
+// NOTE: the near part as a half stencil over one slice, like calculateSlicePairForces. The stencil is
+// wider than the pair potential's, so the wrapped rows and columns are stepped along rather than each
+// taken mod the grid, and particles whose stencil stays inside the grid don't wrap at all.
+void
+calculateNearFieldForces(Simulation* simulation, f64 coupling, PairRange pairRange, int sliceIndex)
+{
+    ParticleMesh* mesh = simulation->particleMesh;
+    int particleCount = simulation->particleCount;
+    SliceForce* sliceForces = 0;
+    if (simulation->sliceCount > 1)
+    {
+        sliceForces = simulation->sliceForces + sliceIndex * particleCount;
+        memset(sliceForces, 0, particleCount * sizeof(SliceForce));
+    }
+
+    int gridRadius = ceil(mesh->nearFieldCutoff / min(simulation->gridCellWidth, simulation->gridCellHeight));
+    int gridColCount = simulation->gridColCount;
+    int gridRowCount = simulation->gridRowCount;
+    int stencilWidth = 2 * gridRadius + 1;
+    bool hasInterior = (gridColCount > stencilWidth) && (gridRowCount > stencilWidth);
+    f64 squaredCutoff = square(mesh->nearFieldCutoff);
+    f64 boxWidth = simulation->boxWidth;
+    f64 boxHeight = simulation->boxHeight;
+    f64 invBoxWidth = 1 / boxWidth;
+    f64 invBoxHeight = 1 / boxHeight;
+    Particle* particles = simulation->particles;
+
+    for (int startIndex = sliceIndex * sliceChunkSize;
+         startIndex < particleCount;
+         startIndex += simulation->sliceCount * sliceChunkSize)
+    {
+        int endIndex = atMost(particleCount, startIndex + sliceChunkSize);
+        for (int particleIndex = startIndex; particleIndex < endIndex; ++particleIndex)
+        {
+            Particle* particle = particles + particleIndex;
+            f64 source = longRangeSource(simulation, particle);
+            if (source == 0) continue;
+
+            bool isInterior = hasInterior &&
+                (particle->gridCol >= gridRadius) && (particle->gridCol < gridColCount - gridRadius) &&
+                (particle->gridRow >= gridRadius) && (particle->gridRow < gridRowCount - gridRadius);
+            int firstCol = isInterior ? particle->gridCol - gridRadius : mod(particle->gridCol - gridRadius, gridColCount);
+            int row = isInterior ? particle->gridRow - gridRadius : mod(particle->gridRow - gridRadius, gridRowCount);
+
+            f64 forceX = 0;
+            f64 forceY = 0;
+            f64 potentialEnergy = 0;
+            for (int y = 0; y < stencilWidth; ++y)
+            {
+                Particle** gridRow = simulation->particleGrid + row * gridColCount;
+                int col = firstCol;
+                for (int x = 0; x < stencilWidth; ++x)
+                {
+                    Particle* otherParticle = gridRow[col];
+                    if (++col == gridColCount) col = 0;
+                    if (!otherParticle || (otherParticle >= particle)) continue;
+
+                    f64 relativeX = (f64) otherParticle->position.x - (f64) particle->position.x;
+                    f64 relativeY = (f64) otherParticle->position.y - (f64) particle->position.y;
+                    if (!isInterior)
+                    {
+                        relativeX = minimalImage(relativeX, boxWidth, invBoxWidth);
+                        relativeY = minimalImage(relativeY, boxHeight, invBoxHeight);
+                    }
+                    f64 quadrance = square(relativeX) + square(relativeY);
+                    if (quadrance >= squaredCutoff) continue;
+
+                    f64 product = coupling * source * longRangeSource(simulation, otherParticle);
+                    PairForce pairForce = nearFieldPairForce(mesh, quadrance);
+                    f64 forceFactor = product * pairForce.forceFactor;
+                    f64 halfPotentialEnergy = 0.5 * product * pairForce.potentialEnergy;
+                    forceX += forceFactor * relativeX;
+                    forceY += forceFactor * relativeY;
+                    potentialEnergy += halfPotentialEnergy;
+
+                    f64 invMass = 1 / otherParticle->mass;
+                    V2 acceleration = v2(-invMass * forceFactor * relativeX, -invMass * forceFactor * relativeY);
+                    if (sliceForces)
+                    {
+                        SliceForce* otherSliceForce = sliceForces + (otherParticle - particles);
+                        otherSliceForce->acceleration += acceleration;
+                        otherSliceForce->potentialEnergy += halfPotentialEnergy;
+                    }
+                    else
+                    {
+                        if (pairRange == PairRange_Long)
+                        {
+                            otherParticle->slowAcceleration += acceleration;
+                        }
+                        else
+                        {
+                            otherParticle->acceleration += acceleration;
+                        }
+                        otherParticle->potentialEnergy += halfPotentialEnergy;
+                    }
+                }
+                if (++row == gridRowCount) row = 0;
+            }
+
+            V2 acceleration = v2(forceX / particle->mass, forceY / particle->mass);
+            if (pairRange == PairRange_Long)
+            {
+                particle->slowAcceleration += acceleration;
+            }
+            else
+            {
+                particle->acceleration += acceleration;
+            }
+            particle->potentialEnergy += potentialEnergy;
+        }
+    }
+}
+
+void
+nearFieldSliceChunk(void* data, int startSlice, int endSlice)
+{
+    MeshForcesJob* job = (MeshForcesJob*)data;
+    for (int sliceIndex = startSlice; sliceIndex < endSlice; ++sliceIndex)
+    {
+        calculateNearFieldForces(job->simulation, job->coupling, job->pairRange, sliceIndex);
+    }
+}
+
+void
+gatherNearFieldChunk(void* data, int startIndex, int endIndex)
+{
+    MeshForcesJob* job = (MeshForcesJob*)data;
+    gatherSliceForces(job->simulation, job->pairRange, startIndex, endIndex);
+}
+
+// NOTE: the far part on the mesh and the near part on the particle grid. The near part doesn't need the mesh,
+// so it runs alongside spreading and solving, and both add to the particles once the other is done with them.
+void
+calculateMeshForces(Simulation* simulation, f64 coupling, PairRange pairRange)
+{
+    updateParticleMesh(simulation);
+    ParticleMesh* mesh = simulation->particleMesh;
+    int threadCount = getThreadCount();
+    prepareMeshSlices(mesh, threadCount);
+    prepareSlices(simulation, threadCount);
+
+    MeshForcesJob job = {simulation, coupling, pairRange};
+    int particleCount = simulation->particleCount;
+
+    TaskGraph graph;
+    graph.nodeCount = 0;
+    graph.group = {};
+    TaskNode* spread = addParallelTask(&graph, mesh->sliceCount, 1, spreadMeshSliceChunk, &job);
+    TaskNode* gatherCharge = addParallelTask(&graph, mesh->rowCount, 16, gatherMeshChargeChunk, mesh);
+    TaskNode* solve = addTask(&graph, solveMeshTask, &job);
+    TaskNode* nearField = addParallelTask(&graph, simulation->sliceCount, 1, nearFieldSliceChunk, &job);
+    TaskNode* interpolate = addParallelTask(&graph, particleCount, sliceChunkSize, interpolateMeshChunk, &job);
+
+    addDependency(spread, gatherCharge);
+    addDependency(gatherCharge, solve);
+    addDependency(solve, interpolate);
+    if (simulation->sliceCount > 1)
+    {
+        TaskNode* gatherNearField = addParallelTask(&graph, particleCount, sliceChunkSize, gatherNearFieldChunk, &job);
+        addDependency(nearField, gatherNearField);
+        addDependency(gatherNearField, interpolate);
+    }
+    else
+    {
+        addDependency(nearField, interpolate);
+    }
+
+    runTaskGraph(&graph);
+}
+
+// NOTE: every particle against every other, in open space, see hasOpenBoundaries
+void
+calculateTreeForces(Simulation* simulation, f64 coupling, PairRange pairRange)
+{
+    BarnesHutTree* tree = simulation->barnesHutTree;
+    if (!tree)
+    {
+        tree = allocArray(BarnesHutTree, 1);
+        *tree = {};
+        simulation->barnesHutTree = tree;
+    }
+    tree->openingAngle = simulation->openingAngle;
+    // NOTE: the short range potential keeps particles apart, this only keeps the sum finite if they don't
+    tree->softening = 0.25 * simulation->separation;
+    tree->isComputingPotentials = true;
+
+    setBarnesHutBodyCount(tree, simulation->particleCount);
+    for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        tree->positions[particleIndex] = particle->position;
+        tree->sources[particleIndex] = longRangeSource(simulation, particle);
+    }
+
+    buildBarnesHutTree(tree);
+    walkBarnesHutTree(tree);
+
+    for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        V2 field = v2(tree->fieldX[particleIndex], tree->fieldY[particleIndex]);
+        addLongRangeField(particle, coupling, tree->sources[particleIndex], tree->potentials[particleIndex], field, pairRange);
+    }
+}
+
+// NOTE: in 2D, two unit charges (or masses) at distance r have energy -strength * ln(r) (or +strength * ln(r) for gravity)
+void
+calculateLongRangeForces(Simulation* simulation, PairRange pairRange)
+{
+    if (simulation->longRangeType == LongRangeType_None) return;
+
+    f64 coupling = simulation->longRangeStrength;
+    if (simulation->longRangeType == LongRangeType_Gravity)
+    {
+        coupling = -coupling;
+    }
+
+    switch (simulation->longRangeSolver)
+    {
+        case LongRangeSolver_ParticleMesh: calculateMeshForces(simulation, coupling, pairRange); break;
+        case LongRangeSolver_BarnesHut:    calculateTreeForces(simulation, coupling, pairRange); break;
+        default: invalidCodePath;
+    }
+}
+
+//
+// Bonded forces
+//
+
+// NOTE: gathers each particle's bonds and angles from its rows, and only writes that particle, so chunks
+// of particles can run on different threads. Both ends of a bond (and all three particles of an angle) work
+// the geometry out the same way, from the same positions, so their forces cancel.
+// The bonds are short, so their minimal image is always the right one.
+void
+calculateBondedForces(Simulation* simulation, int startIndex, int endIndex)
+{
+    BondTopology* topology = &simulation->topology;
+    if (!hasBondedTerms(topology)) return;
+
+    Particle* particles = simulation->particles;
+    f64 boxWidth = simulation->boxWidth;
+    f64 boxHeight = simulation->boxHeight;
+    f64 invBoxWidth = 1 / boxWidth;
+    f64 invBoxHeight = 1 / boxHeight;
+    int overStretchedBondCount = 0;
+
+    for (int particleIndex = startIndex;
+         particleIndex < endIndex;
+         ++particleIndex)
+    {
+    	Particle* particle = particles + particleIndex;
+    	f64 forceX = 0;
+    	f64 forceY = 0;
+    	f64 potentialEnergy = 0;
+
+    	for (int entry = topology->bondStarts[particleIndex]; entry < topology->bondStarts[particleIndex + 1]; ++entry)
+    	{
+    		Particle* otherParticle = particles + topology->bondPartners[entry];
+    		f64 relativeX = minimalImage((f64) otherParticle->position.x - (f64) particle->position.x, boxWidth, invBoxWidth);
+    		f64 relativeY = minimalImage((f64) otherParticle->position.y - (f64) particle->position.y, boxHeight, invBoxHeight);
+
+    		BondForce bondForce = evaluateBond(topology->bondStyles + topology->bondRowStyles[entry], square(relativeX) + square(relativeY));
+    		forceX += bondForce.forceFactor * relativeX;
+    		forceY += bondForce.forceFactor * relativeY;
+    		potentialEnergy += 0.5 * bondForce.energy;
+    		if (bondForce.isOverStretched && (particleIndex < topology->bondPartners[entry])) overStretchedBondCount++;
+    	}
+
+    	for (int entry = topology->angleStarts[particleIndex]; entry < topology->angleStarts[particleIndex + 1]; ++entry)
+    	{
+    		Angle* angle = topology->angles + topology->angleRows[entry];
+    		Particle* vertex = particles + angle->vertex;
+    		Particle* particleA = particles + angle->a;
+    		Particle* particleC = particles + angle->c;
+
+    		f64 fromVertexAX = minimalImage((f64) particleA->position.x - (f64) vertex->position.x, boxWidth, invBoxWidth);
+    		f64 fromVertexAY = minimalImage((f64) particleA->position.y - (f64) vertex->position.y, boxHeight, invBoxHeight);
+    		f64 fromVertexCX = minimalImage((f64) particleC->position.x - (f64) vertex->position.x, boxWidth, invBoxWidth);
+    		f64 fromVertexCY = minimalImage((f64) particleC->position.y - (f64) vertex->position.y, boxHeight, invBoxHeight);
+    		AngleForce angleForce = evaluateAngle(topology->angleStyles + angle->style, fromVertexAX, fromVertexAY, fromVertexCX, fromVertexCY);
+
+    		if (particleIndex == angle->a)
+    		{
+    			forceX += angleForce.forceAX;
+    			forceY += angleForce.forceAY;
+    		}
+    		else if (particleIndex == angle->c)
+    		{
+    			forceX += angleForce.forceCX;
+    			forceY += angleForce.forceCY;
+    		}
+    		else
+    		{
+    			forceX -= angleForce.forceAX + angleForce.forceCX;
+    			forceY -= angleForce.forceAY + angleForce.forceCY;
+    		}
+    		potentialEnergy += angleForce.energy / 3;
+    	}
+
+    	f64 invMass = 1 / particle->mass;
+    	particle->acceleration += v2(invMass * forceX, invMass * forceY);
+    	particle->potentialEnergy += potentialEnergy;
+    }
+
+    if (overStretchedBondCount) atomicAdd(&topology->overStretchedBondCount, overStretchedBondCount);
+}
+
+// NOTE: the slow forces are everything that changes slowly or is expensive: gravity, dragging,
+// and the long range part of the pair forces
+void
+calculateSlowForces(Simulation* simulation)
+{
+    for (int particleIndex = 0;
+         particleIndex < simulation->particleCount;
+         ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        particle->slowAcceleration = v2(0, -simulation->gravityStrength);
+    }
+
+    if (simulation->isDragging && (simulation->draggedParticleIndex < simulation->particleCount))
+    {
+        Particle* particle = simulation->particles + simulation->draggedParticleIndex;
+        particle->slowAcceleration += draggingAcceleration(simulation, particle);
+    }
+
+    calculatePairForces(simulation, PairRange_Long);
+    calculateLongRangeForces(simulation, PairRange_Long);
+}
+
+void
+splitForces(Simulation* simulation)
+{
+    clearGrid(simulation);
+    for (int particleIndex = 0;
+         particleIndex < simulation->particleCount;
+         ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        particle->acceleration = v2(0, 0);
+        particle->potentialEnergy = 0;
+        putParticleInGrid(simulation, particle);
+    }
+    calculatePairForces(simulation, PairRange_Short);
+    calculateBondedForces(simulation, 0, simulation->particleCount);
+    calculateSlowForces(simulation);
+    simulation->hasSplitForces = true;
+}
+
+//
+// Step graph
+//
+
+// NOTE: a single step as a chain of task graph nodes, with the per particle stages cut into chunks that
+// the threads steal from each other. The noise of each particle comes from its own random stream, seeded
+// once per step, so the result doesn't depend on which thread (or process) moved which particle.
+
+#define stepChunkSize 128
+
+// NOTE: every step draws one seed from the simulation's series, so anything that steps the same
+// particles with the same seeds gets the same noise
+u64
+nextNoiseSeed(Simulation* simulation)
+{
+    u64 high = randomU32(&simulation->random);
+    u64 low = randomU32(&simulation->random);
+    return (high << 32) | low;
+}
+
+struct StepTaskData {
+    Simulation* simulation;
+    f32 viscosityFactor;
+    f32 gaussianFactor;
+    u64 noiseSeed;
+    bool isFullStencil;
+};
+
+void
+firstHalfStepChunk(void* data, int startIndex, int endIndex)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    Simulation* simulation = step->simulation;
+    f64 dt = simulation->dt;
+    bool isOpen = hasOpenBoundaries(simulation);
+    beginStepPhase(simulation, StepPhase_FirstHalf, endIndex - startIndex);
+
+    for (int particleIndex = startIndex;
+         particleIndex < endIndex;
+         ++particleIndex)
+    {
+    	Particle* particle = simulation->particles + particleIndex;
+
+    	RandomSeries random = randomSeries(step->noiseSeed, 2 * particleIndex);
+    	applyLangevinNoise(&random, particle, simulation->temperature, step->viscosityFactor, step->gaussianFactor);
+    	particle->velocity += 0.5 * dt * particle->acceleration;
+    	particle->position += particle->velocity * dt;
+        if (isOpen)
+        {
+            reflectOffBox(particle, simulation->boxWidth, simulation->boxHeight);
+        }
+        else
+        {
+            particle->position = periodize(particle->position, simulation->boxWidth, simulation->boxHeight);
+        }
+
+        particle->acceleration = v2(0, -simulation->gravityStrength);
+        particle->potentialEnergy = 0;
+    }
+    endStepPhase(simulation, StepPhase_FirstHalf, endIndex - startIndex);
+}
+
+// NOTE: serial, since two particles can land in the same cell and the later one has to win
+void
+binParticles(Simulation* simulation)
+{
+    clearGrid(simulation);
+    for (int particleIndex = 0;
+         particleIndex < simulation->particleCount;
+         ++particleIndex)
+    {
+        putParticleInGrid(simulation, simulation->particles + particleIndex);
+    }
+}
+
+void
+binningStepTask(void* data)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    Simulation* simulation = step->simulation;
+    beginStepPhase(simulation, StepPhase_Binning, simulation->particleCount);
+    binParticles(simulation);
+    endStepPhase(simulation, StepPhase_Binning, simulation->particleCount);
+}
+
+void
+externalForcesStepTask(void* data)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    Simulation* simulation = step->simulation;
+    beginStepPhase(simulation, StepPhase_ExternalForces, simulation->particleCount);
+    applyExternalForces(simulation);
+    endStepPhase(simulation, StepPhase_ExternalForces, simulation->particleCount);
+}
+
+void
+pairForcesStepChunk(void* data, int startIndex, int endIndex)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    beginStepPhase(step->simulation, StepPhase_PairForces, endIndex - startIndex);
+    PairLoop loop = {PairRange_All, startIndex, endIndex, true, 0};
+    calculatePairForces(step->simulation, loop);
+    endStepPhase(step->simulation, StepPhase_PairForces, endIndex - startIndex);
+}
+
+int
+sliceParticleCount(Simulation* simulation, int sliceIndex)
+{
+    int result = 0;
+    for (int startIndex = sliceIndex * sliceChunkSize;
+         startIndex < simulation->particleCount;
+         startIndex += simulation->sliceCount * sliceChunkSize)
+    {
+        result += atMost(sliceChunkSize, simulation->particleCount - startIndex);
+    }
+    return result;
+}
+
+void
+pairForcesSliceStepChunk(void* data, int startSlice, int endSlice)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    for (int sliceIndex = startSlice; sliceIndex < endSlice; ++sliceIndex)
+    {
+        int particleCount = sliceParticleCount(step->simulation, sliceIndex);
+        beginStepPhase(step->simulation, StepPhase_PairForces, particleCount);
+        calculateSlicePairForces(step->simulation, PairRange_All, sliceIndex);
+        endStepPhase(step->simulation, StepPhase_PairForces, particleCount);
+    }
+}
+
+// NOTE: counts no particles, the slices already did
+void
+gatherPairForcesStepChunk(void* data, int startIndex, int endIndex)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    beginStepPhase(step->simulation, StepPhase_PairForces, 0);
+    gatherSliceForces(step->simulation, PairRange_All, startIndex, endIndex);
+    endStepPhase(step->simulation, StepPhase_PairForces, 0);
+}
+
+void
+bondedForcesStepChunk(void* data, int startIndex, int endIndex)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    beginStepPhase(step->simulation, StepPhase_BondedForces, endIndex - startIndex);
+    calculateBondedForces(step->simulation, startIndex, endIndex);
+    endStepPhase(step->simulation, StepPhase_BondedForces, endIndex - startIndex);
+}
+
+// NOTE: the solvers use parallelFor, which turns into tasks from in here
+void
+longRangeForcesStepTask(void* data)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    Simulation* simulation = step->simulation;
+    beginStepPhase(simulation, StepPhase_LongRangeForces, simulation->particleCount);
+    calculateLongRangeForces(simulation, PairRange_All);
+    endStepPhase(simulation, StepPhase_LongRangeForces, simulation->particleCount);
+}
+
+void
+secondHalfStepChunk(void* data, int startIndex, int endIndex)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    Simulation* simulation = step->simulation;
+    f64 dt = simulation->dt;
+    beginStepPhase(simulation, StepPhase_SecondHalf, endIndex - startIndex);
+
+    for (int particleIndex = startIndex;
+         particleIndex < endIndex;
+         ++particleIndex)
+    {
+    	Particle* particle = simulation->particles + particleIndex;
+    	particle->velocity += 0.5 * dt * particle->acceleration;
+    	RandomSeries random = randomSeries(step->noiseSeed, 2 * particleIndex + 1);
+    	applyLangevinNoise(&random, particle, simulation->temperature, step->viscosityFactor, step->gaussianFactor);
+
+		particle->kineticEnergy = 0.5 * particle->mass * square(particle->velocity);
+    }
+    endStepPhase(simulation, StepPhase_SecondHalf, endIndex - startIndex);
+}
+
+void
+singleTimeStep(Simulation* simulation, f32 viscosityFactor, f32 gaussianFactor)
+{
+    StepTaskData step = {};
+    step.simulation = simulation;
+    step.viscosityFactor = viscosityFactor;
+    step.gaussianFactor = gaussianFactor;
+    step.noiseSeed = nextNoiseSeed(simulation);
+    // NOTE: the half stencil writes both particles of a pair, so with more than one thread it runs as
+    // slices whose forces on each other are gathered after, which is still half the pairs of the full stencil
+    step.isFullStencil = simulation->isUsingFullStencil;
+    prepareSlices(simulation, getThreadCount());
+
+    int particleCount = simulation->particleCount;
+
+    TaskGraph graph;
+    graph.nodeCount = 0;
+    graph.group = {};
+    TaskNode* firstHalf = addParallelTask(&graph, particleCount, stepChunkSize, firstHalfStepChunk, &step);
+    TaskNode* binning = addTask(&graph, binningStepTask, &step);
+    TaskNode* externalForces = addTask(&graph, externalForcesStepTask, &step);
+    TaskNode* pairForces;
+    if (step.isFullStencil)
+    {
+        pairForces = addParallelTask(&graph, particleCount, stepChunkSize, pairForcesStepChunk, &step);
+    }
+    else
+    {
+        pairForces = addParallelTask(&graph, simulation->sliceCount, 1, pairForcesSliceStepChunk, &step);
+    }
+    TaskNode* longRangeForces = addTask(&graph, longRangeForcesStepTask, &step);
+    TaskNode* secondHalf = addParallelTask(&graph, particleCount, stepChunkSize, secondHalfStepChunk, &step);
+
+    // NOTE: the force stages all add to the same accelerations, so they stay in a chain
+    addDependency(firstHalf, binning);
+    addDependency(binning, externalForces);
+    addDependency(externalForces, pairForces);
+    if (!step.isFullStencil && (simulation->sliceCount > 1))
+    {
+        TaskNode* gatherPairForces = addParallelTask(&graph, particleCount, stepChunkSize, gatherPairForcesStepChunk, &step);
+        addDependency(pairForces, gatherPairForces);
+        pairForces = gatherPairForces;
+    }
+    if (hasBondedTerms(&simulation->topology))
+    {
+        TaskNode* bondedForces = addParallelTask(&graph, particleCount, stepChunkSize, bondedForcesStepChunk, &step);
+        addDependency(pairForces, bondedForces);
+        addDependency(bondedForces, longRangeForces);
+    }
+    else
+    {
+        addDependency(pairForces, longRangeForces);
+    }
+    addDependency(longRangeForces, secondHalf);
+
+    runTaskGraph(&graph);
+}
+
+// NOTE: reversible multiple time stepping (RESPA): the slow forces kick at the ends of the outer step,
+// and the short range pair forces drive velocity Verlet steps of dt / innerStepCount in between.
+// Every inner step is a task graph like a single step, the first one starting with the outer kick
+// and the last one ending with the slow forces and the other outer kick. Nothing in here is profiled
+// on its own, the whole step is StepPhase_MultipleTimeStep.
+
+void
+outerFirstKickChunk(void* data, int startIndex, int endIndex)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    Simulation* simulation = step->simulation;
+    f64 dt = simulation->dt;
+
+    for (int particleIndex = startIndex;
+         particleIndex < endIndex;
+         ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        RandomSeries random = randomSeries(step->noiseSeed, 2 * particleIndex);
+        applyLangevinNoise(&random, particle, simulation->temperature, step->viscosityFactor, step->gaussianFactor);
+        particle->velocity += 0.5 * dt * particle->slowAcceleration;
+    }
+}
+
+void
+innerFirstHalfChunk(void* data, int startIndex, int endIndex)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    Simulation* simulation = step->simulation;
+    f64 innerDt = simulation->dt / simulation->innerStepCount;
+    bool isOpen = hasOpenBoundaries(simulation);
+
+    for (int particleIndex = startIndex;
+         particleIndex < endIndex;
+         ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        particle->velocity += 0.5 * innerDt * particle->acceleration;
+        particle->position += particle->velocity * innerDt;
+        if (isOpen)
+        {
+            reflectOffBox(particle, simulation->boxWidth, simulation->boxHeight);
+        }
+        else
+        {
+            particle->position = periodize(particle->position, simulation->boxWidth, simulation->boxHeight);
+        }
+
+        particle->acceleration = v2(0, 0);
+        particle->potentialEnergy = 0;
+    }
+}
+
+void
+innerBinningTask(void* data)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    binParticles(step->simulation);
+}
+
+void
+innerWallsTask(void* data)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    applyWallCollisions(step->simulation);
+}
+
+void
+shortPairForcesSliceChunk(void* data, int startSlice, int endSlice)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    for (int sliceIndex = startSlice; sliceIndex < endSlice; ++sliceIndex)
+    {
+        calculateSlicePairForces(step->simulation, PairRange_Short, sliceIndex);
+    }
+}
+
+void
+gatherShortPairForcesChunk(void* data, int startIndex, int endIndex)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    gatherSliceForces(step->simulation, PairRange_Short, startIndex, endIndex);
+}
+
+// NOTE: bonds are as stiff as the closest pairs, so they go with the inner steps
+void
+innerBondedForcesChunk(void* data, int startIndex, int endIndex)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    calculateBondedForces(step->simulation, startIndex, endIndex);
+}
+
+void
+innerSecondHalfChunk(void* data, int startIndex, int endIndex)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    Simulation* simulation = step->simulation;
+    f64 innerDt = simulation->dt / simulation->innerStepCount;
+
+    for (int particleIndex = startIndex;
+         particleIndex < endIndex;
+         ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        particle->velocity += 0.5 * innerDt * particle->acceleration;
+    }
+}
+
+// NOTE: the parts of calculateSlowForces that are per particle
+void
+clearSlowForcesChunk(void* data, int startIndex, int endIndex)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    Simulation* simulation = step->simulation;
+
+    for (int particleIndex = startIndex;
+         particleIndex < endIndex;
+         ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        particle->slowAcceleration = v2(0, -simulation->gravityStrength);
+        if (simulation->isDragging && (particleIndex == simulation->draggedParticleIndex))
+        {
+            particle->slowAcceleration += draggingAcceleration(simulation, particle);
+        }
+    }
+}
+
+void
+longPairForcesSliceChunk(void* data, int startSlice, int endSlice)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    for (int sliceIndex = startSlice; sliceIndex < endSlice; ++sliceIndex)
+    {
+        calculateSlicePairForces(step->simulation, PairRange_Long, sliceIndex);
+    }
+}
+
+void
+gatherLongPairForcesChunk(void* data, int startIndex, int endIndex)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    gatherSliceForces(step->simulation, PairRange_Long, startIndex, endIndex);
+}
+
+// NOTE: the solvers use parallelFor, which turns into tasks from in here
+void
+slowLongRangeForcesTask(void* data)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    calculateLongRangeForces(step->simulation, PairRange_Long);
+}
+
+void
+outerSecondKickChunk(void* data, int startIndex, int endIndex)
+{
+    StepTaskData* step = (StepTaskData*)data;
+    Simulation* simulation = step->simulation;
+    f64 dt = simulation->dt;
+
+    for (int particleIndex = startIndex;
+         particleIndex < endIndex;
+         ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        particle->velocity += 0.5 * dt * particle->slowAcceleration;
+        RandomSeries random = randomSeries(step->noiseSeed, 2 * particleIndex + 1);
+        applyLangevinNoise(&random, particle, simulation->temperature, step->viscosityFactor, step->gaussianFactor);
+
+        particle->kineticEnergy = 0.5 * particle->mass * square(particle->velocity);
+    }
+}
+
+// NOTE: every stage moves the particles or adds to their forces, so each one waits for the one before
+inline TaskNode*
+addStage(TaskNode* previous, TaskNode* node)
+{
+    if (previous)
+    {
+        addDependency(previous, node);
+    }
+    return node;
+}
+
+void
+multipleTimeStep(Simulation* simulation, f32 viscosityFactor, f32 gaussianFactor)
+{
+    StepTaskData step = {};
+    step.simulation = simulation;
+    step.viscosityFactor = viscosityFactor;
+    step.gaussianFactor = gaussianFactor;
+    step.noiseSeed = nextNoiseSeed(simulation);
+    prepareSlices(simulation, getThreadCount());
+
+    int particleCount = simulation->particleCount;
+    bool isGathering = (simulation->sliceCount > 1);
+    bool hasBonds = hasBondedTerms(&simulation->topology);
+
+    for (int innerStepIndex = 0; innerStepIndex < simulation->innerStepCount; ++innerStepIndex)
+    {
+        TaskGraph graph;
+        graph.nodeCount = 0;
+        graph.group = {};
+        TaskNode* last = 0;
+
+        if (innerStepIndex == 0)
+        {
+            last = addStage(last, addParallelTask(&graph, particleCount, stepChunkSize, outerFirstKickChunk, &step));
+        }
+
+        last = addStage(last, addParallelTask(&graph, particleCount, stepChunkSize, innerFirstHalfChunk, &step));
+        last = addStage(last, addTask(&graph, innerBinningTask, &step));
+        last = addStage(last, addTask(&graph, innerWallsTask, &step));
+        last = addStage(last, addParallelTask(&graph, simulation->sliceCount, 1, shortPairForcesSliceChunk, &step));
+        if (isGathering)
+        {
+            last = addStage(last, addParallelTask(&graph, particleCount, stepChunkSize, gatherShortPairForcesChunk, &step));
+        }
+        if (hasBonds)
+        {
+            last = addStage(last, addParallelTask(&graph, particleCount, stepChunkSize, innerBondedForcesChunk, &step));
+        }
+        last = addStage(last, addParallelTask(&graph, particleCount, stepChunkSize, innerSecondHalfChunk, &step));
+
+        if (innerStepIndex == simulation->innerStepCount - 1)
+        {
+            last = addStage(last, addParallelTask(&graph, particleCount, stepChunkSize, clearSlowForcesChunk, &step));
+            last = addStage(last, addParallelTask(&graph, simulation->sliceCount, 1, longPairForcesSliceChunk, &step));
+            if (isGathering)
+            {
+                last = addStage(last, addParallelTask(&graph, particleCount, stepChunkSize, gatherLongPairForcesChunk, &step));
+            }
+            last = addStage(last, addTask(&graph, slowLongRangeForcesTask, &step));
+            last = addStage(last, addParallelTask(&graph, particleCount, stepChunkSize, outerSecondKickChunk, &step));
+        }
+
+        runTaskGraph(&graph);
+    }
+}
+
+// NOTE: picks the largest dt that keeps the step accurate, judged by how fast the forces change.
+// Velocity Verlet is off by about jerk dt^3 / 6 per step, and the jerk is the change of acceleration over
+// the last step divided by its dt, so the forces of a calm crystal or a dilute gas allow a far longer step
+// than the collisions of a liquid. On top of that no particle may move further than maxStepDisplacement,
+// so nothing steps deep into another particle before its force shows up.
+// Shrinks right away when things get violent, but only grows a little per step, so dt changes smoothly.
+void
+adaptTimeStep(Simulation* simulation)
+{
+    int particleCount = simulation->particleCount;
+    bool hasPreviousAccelerations = (simulation->previousAccelerationCount == particleCount)
+        && (simulation->previousAccelerationGeneration == simulation->particleGeneration);
+    if (!hasPreviousAccelerations)
+    {
+        simulation->previousAccelerations = (V2*) realloc(simulation->previousAccelerations, atLeast(1, particleCount) * sizeof(V2));
+        simulation->previousAccelerationCount = particleCount;
+        simulation->previousAccelerationGeneration = simulation->particleGeneration;
+    }
+
+    f64 maxSquaredSpeed = 0;
+    f64 maxSquaredChange = 0;
+    for (int particleIndex = 0; particleIndex < particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        V2 acceleration = particle->acceleration;
+        if (simulation->hasSplitForces)
+        {
+            acceleration += particle->slowAcceleration;
+        }
+        V2* previousAcceleration = simulation->previousAccelerations + particleIndex;
+        maxSquaredSpeed = max(maxSquaredSpeed, square(particle->velocity));
+        maxSquaredChange = max(maxSquaredChange, square(acceleration - *previousAcceleration));
+        *previousAcceleration = acceleration;
+    }
+
+    f64 targetDt = simulation->maxDt;
+    if (maxSquaredSpeed > 0)
+    {
+        targetDt = min(targetDt, simulation->maxStepDisplacement / sqrt(maxSquaredSpeed));
+    }
+    if (hasPreviousAccelerations && (maxSquaredChange > 0))
+    {
+        f64 maxJerk = sqrt(maxSquaredChange) / simulation->dt;
+        targetDt = min(targetDt, cbrt(6 * simulation->stepErrorTolerance / maxJerk));
+    }
+
+    f64 maxGrowth = 1.05;
+    f64 dt = min(targetDt, maxGrowth * simulation->dt);
+    simulation->dt = atLeast(simulation->minDt, atMost(simulation->maxDt, dt));
+}
+
+void
+advanceSimulation(Simulation* simulation, f64 timeToSimulate)
+{
+	simulation->timeLeftToSimulate += timeToSimulate;
+    beginStepPhase(simulation, StepPhase_Updates, simulation->particleCount);
+
+    // NOTE: cheap, and picks up any changes to the interaction parameters
+    updateInteractions(simulation);
+    if (hasBondedTerms(&simulation->topology))
+    {
+        updateBondRows(&simulation->topology, simulation->particleCount);
+    }
+    if (simulation->isUsingPotentialTables)
+    {
+        updatePotentialTables(simulation);
+    }
+
+    if (simulation->isUsingMultipleTimeSteps && !simulation->hasSplitForces)
+    {
+        splitForces(simulation);
+    }
+    else if (!simulation->isUsingMultipleTimeSteps && simulation->hasSplitForces)
+    {
+        // NOTE: coming back from multiple time stepping, so put the forces back together
+        for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+        {
+            Particle* particle = simulation->particles + particleIndex;
+            particle->acceleration += particle->slowAcceleration;
+        }
+        simulation->hasSplitForces = false;
+    }
+    endStepPhase(simulation, StepPhase_Updates, simulation->particleCount);
+
+    while (simulation->timeLeftToSimulate > simulation->dt) {
+        f64 dt = simulation->dt;
+        simulation->timeLeftToSimulate -= dt;
+        simulation->stepCount++;
+
+        f32 viscosityFactor = exp(-0.5 * simulation->viscosity * dt);
+        f32 gaussianFactor = sqrt(1 - square(viscosityFactor));
+
+        if (simulation->isUsingMultipleTimeSteps)
+        {
+            beginStepPhase(simulation, StepPhase_MultipleTimeStep, simulation->particleCount);
+            multipleTimeStep(simulation, viscosityFactor, gaussianFactor);
+            endStepPhase(simulation, StepPhase_MultipleTimeStep, simulation->particleCount);
+        }
+        else
+        {
+            singleTimeStep(simulation, viscosityFactor, gaussianFactor);
+        }
+
+        if (simulation->isUsingAdaptiveTimeStep)
+        {
+            beginStepPhase(simulation, StepPhase_AdaptTimeStep, simulation->particleCount);
+            adaptTimeStep(simulation);
+            endStepPhase(simulation, StepPhase_AdaptTimeStep, simulation->particleCount);
+        }
+    }
+}
+
+//
+// Observables
+//
+
+// NOTE: per particle, for whatever reports on a running simulation
+struct SimulationObservables {
+	f64 kineticEnergy;
+	f64 potentialEnergy;
+	f64 measuredTemperature;
+	V2 momentum;
+};
+
+SimulationObservables
+measureObservables(Simulation* simulation)
+{
+	SimulationObservables observables = {};
+	for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+	{
+		Particle* particle = simulation->particles + particleIndex;
+		// NOTE: from the velocity, since the particle's own is only there once it has taken a step
+		observables.kineticEnergy += 0.5 * particle->mass * square(particle->velocity);
+		observables.potentialEnergy += particle->potentialEnergy;
+		observables.momentum += particle->mass * particle->velocity;
+	}
+
+	int particleCount = atLeast(1, simulation->particleCount);
+	observables.kineticEnergy /= particleCount;
+	observables.potentialEnergy /= particleCount;
+	// NOTE: two degrees of freedom per particle, each with half of kT
+	observables.measuredTemperature = observables.kineticEnergy;
+	return observables;
+}
+
+void
+freeSimulation(Simulation* simulation)
+{
+    free(simulation->particles);
+    free(simulation->particleGrid);
+    free(simulation->walls);
+    free(simulation->potentialTables);
+    free(simulation->previousAccelerations);
+    free(simulation->sliceForces);
+    freeBondTopology(&simulation->topology);
+    if (simulation->particleMesh)
+    {
+        freeParticleMesh(simulation->particleMesh);
+        free(simulation->particleMesh);
+    }
+    if (simulation->barnesHutTree)
+    {
+        freeBarnesHutTree(simulation->barnesHutTree);
+        free(simulation->barnesHutTree);
+    }
+    *simulation = {};
+}
 
 #endif
@@ -0,0 +1,350 @@
+#ifndef perf_counters_h
+#define perf_counters_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "types.h"
+#include "math_stuff.h"
+#include "threading.h"
+#include "baseline_file.h"
+
+// NOTE: the processor's own counts of what a piece of code did, from Linux's perf_event_open, read around
+// the phases of whatever is being profiled. Every thread opens its own counters the first time it reads them,
+// as one group, so a read is a single system call and all the counters cover the same stretch of time.
+// Only user space is counted, which perf_event_paranoid allows up to 2.
+//
+// Whatever the machine doesn't have (virtual machines often have no hardware counters at all) reads as 0
+// and is reported as missing. The task clock is counted by the kernel itself, so there is always a time.
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+#define HAS_PERF_COUNTERS 1
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#else
+#define HAS_PERF_COUNTERS 0
+#endif
+
+enum PerfCounter {
+	PerfCounter_TaskClock,
+	PerfCounter_Cycles,
+	PerfCounter_Instructions,
+	PerfCounter_L1DataMisses,
+	PerfCounter_LastLevelMisses,
+	PerfCounter_BranchMisses,
+
+	PerfCounter_Count,
+};
+
+const char* perfCounterNames[] = {
+	"ns",
+	"cycles",
+	"instructions",
+	"L1d misses",
+	"LLC misses",
+	"branch misses",
+};
+
+struct PerfCounterGroup {
+	bool isOpened;
+	int leader;
+	int counterCount;
+	// NOTE: which counter each of the group's values is, in the order they joined
+	PerfCounter counters[PerfCounter_Count];
+};
+
+#if HAS_PERF_COUNTERS
+
+global_variable __thread PerfCounterGroup threadPerfCounters;
+
+// NOTE: what at least one thread could open, for the report
+global_variable volatile s32 openedPerfCounterMask;
+
+int
+openPerfCounter(PerfCounter counter, int leader)
+{
+	perf_event_attr attributes = {};
+	attributes.size = sizeof(attributes);
+	attributes.type = PERF_TYPE_HARDWARE;
+	attributes.disabled = (leader < 0);
+	attributes.exclude_kernel = 1;
+	attributes.exclude_hv = 1;
+	attributes.read_format = PERF_FORMAT_GROUP;
+
+	u64 cacheMiss = ((u64) PERF_COUNT_HW_CACHE_OP_READ << 8) | ((u64) PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	switch (counter)
+	{
+		case PerfCounter_TaskClock:
+			attributes.type = PERF_TYPE_SOFTWARE;
+			attributes.config = PERF_COUNT_SW_TASK_CLOCK;
+			break;
+		case PerfCounter_Cycles:          attributes.config = PERF_COUNT_HW_CPU_CYCLES; break;
+		case PerfCounter_Instructions:    attributes.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+		case PerfCounter_BranchMisses:    attributes.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+		case PerfCounter_L1DataMisses:
+			attributes.type = PERF_TYPE_HW_CACHE;
+			attributes.config = PERF_COUNT_HW_CACHE_L1D | cacheMiss;
+			break;
+		case PerfCounter_LastLevelMisses:
+			attributes.type = PERF_TYPE_HW_CACHE;
+			attributes.config = PERF_COUNT_HW_CACHE_LL | cacheMiss;
+			break;
+		default: invalidCodePath;
+	}
+
+	// NOTE: the calling thread, on whatever CPU it runs
+	return (int) syscall(SYS_perf_event_open, &attributes, 0, -1, leader, 0);
+}
+
+void
+openPerfCounterGroup(PerfCounterGroup* group)
+{
+	group->isOpened = true;
+	group->leader = -1;
+	group->counterCount = 0;
+	for (int counterIndex = 0; counterIndex < PerfCounter_Count; ++counterIndex)
+	{
+		PerfCounter counter = (PerfCounter) counterIndex;
+		int file = openPerfCounter(counter, group->leader);
+		if (file < 0) continue;
+
+		if (group->leader < 0) group->leader = file;
+		group->counters[group->counterCount++] = counter;
+		__sync_fetch_and_or(&openedPerfCounterMask, 1 << counterIndex);
+	}
+	if (group->leader >= 0)
+	{
+		ioctl(group->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+}
+
+// NOTE: the running totals of the calling thread, 0 for the counters it doesn't have
+void
+readPerfCounters(u64* values)
+{
+	memset(values, 0, PerfCounter_Count * sizeof(u64));
+	PerfCounterGroup* group = &threadPerfCounters;
+	if (!group->isOpened) openPerfCounterGroup(group);
+	if (group->leader < 0) return;
+
+	u64 buffer[1 + PerfCounter_Count];
+	if (read(group->leader, buffer, sizeof(buffer)) <= 0) return;
+	int valueCount = atMost((int) buffer[0], group->counterCount);
+	for (int valueIndex = 0; valueIndex < valueCount; ++valueIndex)
+	{
+		values[group->counters[valueIndex]] = buffer[1 + valueIndex];
+	}
+}
+
+bool
+hasPerfCounter(PerfCounter counter)
+{
+	return (openedPerfCounterMask >> counter) & 1;
+}
+
+#else
+
+void readPerfCounters(u64* values) { memset(values, 0, PerfCounter_Count * sizeof(u64)); }
+bool hasPerfCounter(PerfCounter counter) { return false; }
+
+#endif
+
+//
+// Phases
+//
+
+// NOTE: the counters summed per phase, each thread into its own row so nothing is shared while counting.
+// A phase that starts while another is running on the same thread (a thread that steals work while it waits)
+// is counted in both.
+
+#define maxPerfPhaseCount 16
+#define maxPerfPhaseDepth 8
+
+struct PerfPhaseThread {
+	u64 totals[maxPerfPhaseCount][PerfCounter_Count];
+	u64 itemCounts[maxPerfPhaseCount];
+
+	u64 starts[maxPerfPhaseDepth][PerfCounter_Count];
+	int depth;
+};
+
+struct PerfPhaseProfile {
+	int phaseCount;
+	const char** phaseNames;
+	PerfPhaseThread threads[maxThreadCount];
+};
+
+void
+initPerfPhaseProfile(PerfPhaseProfile* profile, int phaseCount, const char** phaseNames)
+{
+	memset(profile, 0, sizeof(*profile));
+	profile->phaseCount = atMost(maxPerfPhaseCount, phaseCount);
+	profile->phaseNames = phaseNames;
+}
+
+void
+beginPerfPhase(PerfPhaseProfile* profile, int phase)
+{
+	PerfPhaseThread* thread = profile->threads + currentThreadIndex;
+	assert(thread->depth < maxPerfPhaseDepth);
+	readPerfCounters(thread->starts[thread->depth++]);
+}
+
+void
+endPerfPhase(PerfPhaseProfile* profile, int phase, int itemCount)
+{
+	u64 values[PerfCounter_Count];
+	readPerfCounters(values);
+
+	PerfPhaseThread* thread = profile->threads + currentThreadIndex;
+	assert(thread->depth > 0);
+	u64* starts = thread->starts[--thread->depth];
+	for (int counterIndex = 0; counterIndex < PerfCounter_Count; ++counterIndex)
+	{
+		thread->totals[phase][counterIndex] += values[counterIndex] - starts[counterIndex];
+	}
+	thread->itemCounts[phase] += itemCount;
+}
+
+// NOTE: the phase's counts summed over the threads
+void
+sumPerfPhase(PerfPhaseProfile* profile, int phase, u64* totals, u64* itemCount)
+{
+	memset(totals, 0, PerfCounter_Count * sizeof(u64));
+	*itemCount = 0;
+	for (int threadIndex = 0; threadIndex < maxThreadCount; ++threadIndex)
+	{
+		PerfPhaseThread* thread = profile->threads + threadIndex;
+		for (int counterIndex = 0; counterIndex < PerfCounter_Count; ++counterIndex)
+		{
+			totals[counterIndex] += thread->totals[phase][counterIndex];
+		}
+		*itemCount += thread->itemCounts[phase];
+	}
+}
+
+//
+// Report
+//
+
+// NOTE: every phase's counts per item (a particle step, say), with the cycles per instruction and the phase's
+// share of the time. With a baseline from an earlier run, the change of every count follows, so whichever
+// counter a change of layout or kernel moved stands out. The baseline names are "phase: counter".
+
+#define perfReportChangeThreshold 5
+
+void
+namePerfCount(char* name, int nameSize, PerfPhaseProfile* profile, int phase, int counter)
+{
+	snprintf(name, nameSize, "%s: %s", profile->phaseNames[phase], perfCounterNames[counter]);
+}
+
+void
+printPerfPhaseReport(PerfPhaseProfile* profile, u64 itemCount, const char* itemName, BaselineFile* baseline)
+{
+	f64 perItem = 1.0 / atLeast(1, itemCount);
+	f64 perItemCounts[maxPerfPhaseCount][PerfCounter_Count];
+	f64 totalTime = 0;
+	for (int phase = 0; phase < profile->phaseCount; ++phase)
+	{
+		u64 totals[PerfCounter_Count];
+		u64 phaseItemCount;
+		sumPerfPhase(profile, phase, totals, &phaseItemCount);
+		for (int counterIndex = 0; counterIndex < PerfCounter_Count; ++counterIndex)
+		{
+			perItemCounts[phase][counterIndex] = perItem * totals[counterIndex];
+		}
+		totalTime += perItemCounts[phase][PerfCounter_TaskClock];
+	}
+
+	printf("\nper %-22s", itemName);
+	for (int counterIndex = 0; counterIndex < PerfCounter_Count; ++counterIndex)
+	{
+		printf(" %14s", perfCounterNames[counterIndex]);
+	}
+	printf(" %8s %8s\n", "IPC", "time");
+
+	for (int phase = 0; phase < profile->phaseCount; ++phase)
+	{
+		f64* counts = perItemCounts[phase];
+		if (counts[PerfCounter_TaskClock] == 0) continue;
+
+		printf("%-26s", profile->phaseNames[phase]);
+		for (int counterIndex = 0; counterIndex < PerfCounter_Count; ++counterIndex)
+		{
+			if (hasPerfCounter((PerfCounter) counterIndex)) printf(" %14.2f", counts[counterIndex]);
+			else printf(" %14s", "-");
+		}
+		if (counts[PerfCounter_Cycles] > 0) printf(" %8.2f", counts[PerfCounter_Instructions] / counts[PerfCounter_Cycles]);
+		else printf(" %8s", "-");
+		printf(" %7.1f%%\n", 100 * counts[PerfCounter_TaskClock] / atLeast(1e-30, totalTime));
+	}
+	for (int counterIndex = 0; counterIndex < PerfCounter_Count; ++counterIndex)
+	{
+		if (!hasPerfCounter((PerfCounter) counterIndex)) printf("(no %s on this machine)\n", perfCounterNames[counterIndex]);
+	}
+
+	if (!baseline || !baseline->count) return;
+
+	// NOTE: the change of every count against the baseline, with the ones that moved marked
+	printf("\nchange from the baseline, * when more than %d%%\n", perfReportChangeThreshold);
+	printf("%-26s", "");
+	for (int counterIndex = 0; counterIndex < PerfCounter_Count; ++counterIndex)
+	{
+		printf(" %14s", perfCounterNames[counterIndex]);
+	}
+	printf("\n");
+	for (int phase = 0; phase < profile->phaseCount; ++phase)
+	{
+		f64* counts = perItemCounts[phase];
+		if (counts[PerfCounter_TaskClock] == 0) continue;
+
+		printf("%-26s", profile->phaseNames[phase]);
+		for (int counterIndex = 0; counterIndex < PerfCounter_Count; ++counterIndex)
+		{
+			char name[256];
+			namePerfCount(name, sizeof(name), profile, phase, counterIndex);
+			f64 baselineCount = findBaselineTime(baseline, name);
+			if (!hasPerfCounter((PerfCounter) counterIndex) || (baselineCount <= 0))
+			{
+				printf(" %14s", "-");
+				continue;
+			}
+			f64 change = changeFromBaseline(counts[counterIndex], baselineCount);
+			printf(" %+12.1f%%%s", change, (fabs(change) > perfReportChangeThreshold) ? "*" : " ");
+		}
+		printf("\n");
+	}
+}
+
+bool
+writePerfPhaseBaseline(PerfPhaseProfile* profile, u64 itemCount, const char* path, const char* comment)
+{
+	char names[maxPerfPhaseCount * PerfCounter_Count][256];
+	const char* namePointers[maxPerfPhaseCount * PerfCounter_Count];
+	f64 counts[maxPerfPhaseCount * PerfCounter_Count];
+	int count = 0;
+	for (int phase = 0; phase < profile->phaseCount; ++phase)
+	{
+		u64 totals[PerfCounter_Count];
+		u64 phaseItemCount;
+		sumPerfPhase(profile, phase, totals, &phaseItemCount);
+		if (totals[PerfCounter_TaskClock] == 0) continue;
+
+		for (int counterIndex = 0; counterIndex < PerfCounter_Count; ++counterIndex)
+		{
+			if (!hasPerfCounter((PerfCounter) counterIndex)) continue;
+			namePerfCount(names[count], sizeof(names[count]), profile, phase, counterIndex);
+			namePointers[count] = names[count];
+			counts[count] = (f64) totals[counterIndex] / atLeast(1, itemCount);
+			count++;
+		}
+	}
+	return writeBaselineFile(path, comment, namePointers, counts, count);
+}
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef potential_table_h
+#define potential_table_h
+
+#include "types.h"
+#include "math_stuff.h"
+#include "pair_potentials.h"
+
+// NOTE: energy and force factor sampled uniformly in r^2 between the inner radius and the cutoff,
+// and interpolated with cubic Hermite splines, with the exact potential inside the inner radius. Looking
+// up by r^2 means the force loop needs no divide, square root or powers.
+//
+// That only pays for potentials that cost more than the lookup. A lookup is a dependent load and two cubics,
+// about 5.5 ns in microbenchmark against 1.5 ns for Lennard-Jones in f64, and the pair loop spends most of
+// its time finding the pairs anyway. In benchmark the built-in potentials step within 3% of their exact
+// versions with tables, and only Morse, with its exponential, is about 10% faster.
+
+#define potentialTableIntervalCount 512
+#define potentialTableInnerFactor 0.6
+
+// NOTE: one cache line per interval
+struct PotentialTableEntry {
+	f64 energy[4];
+	f64 forceFactor[4];
+};
+
+struct PotentialTable {
+	// what the table was built from, so we know when to rebuild
+	Interaction interaction;
+	PotentialType potentialType;
+	bool isBuilt;
+
+	f64 minQuadrance;
+	f64 invStep;
+	// NOTE: one extra zero entry, which everything beyond the cutoff lands in
+	PotentialTableEntry entries[potentialTableIntervalCount + 1];
+};
+
+void
+hermiteCoefficients(f64* coefficients, f64 p0, f64 p1, f64 m0, f64 m1)
+{
+	coefficients[0] = p0;
+	coefficients[1] = m0;
+	coefficients[2] = 3 * (p1 - p0) - 2 * m0 - m1;
+	coefficients[3] = 2 * (p0 - p1) + m0 + m1;
+}
+
+// NOTE: samples from the inside at the cutoff, where truncated potentials jump
+PairForce
+samplePotential(PotentialType potentialType, Interaction* interaction, f64 quadrance)
+{
+	f64 lastInsideQuadrance = interaction->squaredCutoff * (1 - 1e-12);
+	return evaluatePotential(potentialType, interaction, atMost(lastInsideQuadrance, quadrance));
+}
+
+f64
+sampleForceSlope(PotentialType potentialType, Interaction* interaction, f64 quadrance, f64 h)
+{
+	f64 lowQuadrance = quadrance - h;
+	f64 highQuadrance = quadrance + h;
+	if (highQuadrance >= interaction->squaredCutoff)
+	{
+		// one-sided at the cutoff
+		lowQuadrance = quadrance - 2 * h;
+		highQuadrance = quadrance;
+	}
+	f64 low = samplePotential(potentialType, interaction, lowQuadrance).forceFactor;
+	f64 high = samplePotential(potentialType, interaction, highQuadrance).forceFactor;
+	return (high - low) / (highQuadrance - lowQuadrance);
+}
+
+void
+buildPotentialTable(PotentialTable* table, PotentialType potentialType, Interaction* interaction)
+{
+	table->interaction = *interaction;
+	table->potentialType = potentialType;
+	table->isBuilt = true;
+
+	table->minQuadrance = square(potentialTableInnerFactor) * interaction->squaredSeparation;
+	f64 step = (interaction->squaredCutoff - table->minQuadrance) / potentialTableIntervalCount;
+	table->invStep = 1 / step;
+
+	// NOTE: dU/d(r^2) is half the force factor, but the force factor's own slope we take numerically
+	f64 h = 1e-4 * step;
+	for (int intervalIndex = 0; intervalIndex < potentialTableIntervalCount; ++intervalIndex)
+	{
+		f64 q0 = table->minQuadrance + intervalIndex * step;
+		f64 q1 = q0 + step;
+		PairForce start = samplePotential(potentialType, interaction, q0);
+		PairForce end = samplePotential(potentialType, interaction, q1);
+		f64 forceSlope0 = sampleForceSlope(potentialType, interaction, q0, h);
+		f64 forceSlope1 = sampleForceSlope(potentialType, interaction, q1, h);
+
+		PotentialTableEntry* entry = table->entries + intervalIndex;
+		hermiteCoefficients(entry->energy, start.potentialEnergy, end.potentialEnergy, 0.5 * start.forceFactor * step, 0.5 * end.forceFactor * step);
+		hermiteCoefficients(entry->forceFactor, start.forceFactor, end.forceFactor, forceSlope0 * step, forceSlope1 * step);
+	}
+	memset(table->entries + potentialTableIntervalCount, 0, sizeof(PotentialTableEntry));
+}
+
+inline PairForce
+lookUpPotentialTable(PotentialTable* table, f64 quadrance)
+{
+	// NOTE: inside the inner radius the repulsion has to keep growing, or overlapping particles would pass
+	// through each other, so those rare pairs get the exact potential
+	if (quadrance < table->minQuadrance)
+	{
+		return evaluatePotential(table->potentialType, &table->interaction, quadrance);
+	}
+
+	// NOTE: clamped to the zero entry beyond the cutoff
+	f64 t = (quadrance - table->minQuadrance) * table->invStep;
+	t = atMost(potentialTableIntervalCount, t);
+	int intervalIndex = (int) t;
+	f64 u = t - intervalIndex;
+
+	PotentialTableEntry* entry = table->entries + intervalIndex;
+	f64* e = entry->energy;
+	f64* f = entry->forceFactor;
+
+	PairForce result;
+	result.potentialEnergy = e[0] + u * (e[1] + u * (e[2] + u * e[3]));
+	result.forceFactor = f[0] + u * (f[1] + u * (f[2] + u * f[3]));
+	return result;
+}
+
+// NOTE: the tables are indexed like the interactions, so the force loop can use the same pair lookup
+struct TabulatedPotential {
+	Interaction* interactions;
+	PotentialTable* tables;
+
+	// NOTE: the tables are f64, so other precisions only convert on the way in and out
+	template <typename Real>
+	inline PairForceOf<Real>
+	evaluate(Interaction* interaction, Real quadrance)
+	{
+		PotentialTable* table = tables + (interaction - interactions);
+		PairForce pairForce = lookUpPotentialTable(table, quadrance);
+		PairForceOf<Real> result = {(Real) pairForce.potentialEnergy, (Real) pairForce.forceFactor};
+		return result;
+	}
+};
+
+#endif
@@ -0,0 +1,309 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "particle_simulation.h"
+#include "threading.h"
+#include "baseline_file.h"
+
+// NOTE: runs the scenes the app starts from, with fixed seeds, and checks that they are still as fast as
+// they were and that the physics still comes out right:
+//
+//   - without a thermostat, the total energy and the momentum stay where they started
+//   - with the Langevin thermostat, every velocity component has m v^2 = kT on average
+//
+//     regression [baseline file] [threshold percent] [write]
+//
+// The physics has fixed tolerances, with room for the noise of a run of this length but not for a broken
+// integrator or force. The times are nanoseconds per particle per step, compared to the baseline file like
+// microbenchmark does, slower by more than the threshold (25% unless given) is a regression. Either kind
+// of failure makes the exit status 1.
+
+f64
+getTime()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+global_variable int failureCount;
+
+// NOTE: fails when the value is further than the tolerance from where it should be
+void
+checkPhysics(const char* name, f64 value, f64 expected, f64 tolerance)
+{
+    bool isPassing = fabs(value - expected) <= tolerance;
+    failureCount += !isPassing;
+    printf("    %-32s %12.4e %12.4e %12.4e  %s\n", name, value, expected, tolerance, isPassing ? "ok" : "FAILED");
+}
+
+//
+// Measurements
+//
+
+f64
+totalEnergy(Simulation* simulation)
+{
+    f64 energy = 0;
+    for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        energy += particle->kineticEnergy + particle->potentialEnergy;
+    }
+    return energy;
+}
+
+// NOTE: summed in f64, since the velocities of a few hundred particles cancel to a lot less than f32 resolves
+struct Momentum {
+    f64 x;
+    f64 y;
+};
+
+Momentum
+totalMomentum(Simulation* simulation)
+{
+    Momentum momentum = {};
+    for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        momentum.x += particle->mass * particle->velocity.x;
+        momentum.y += particle->mass * particle->velocity.y;
+    }
+    return momentum;
+}
+
+bool
+areParticlesFinite(Simulation* simulation)
+{
+    for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        if (!isfinite(particle->position.x) || !isfinite(particle->position.y)) return false;
+        if (!isfinite(particle->velocity.x) || !isfinite(particle->velocity.y)) return false;
+    }
+    return true;
+}
+
+// NOTE: m v^2 per velocity component, summed over time, for the particles inside a region
+struct Equipartition {
+    f64 squaredMomentumX;
+    f64 squaredMomentumY;
+    u64 sampleCount;
+};
+
+void
+sampleEquipartition(Equipartition* equipartition, Simulation* simulation, V2 regionMin, V2 regionMax)
+{
+    for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+    {
+        Particle* particle = simulation->particles + particleIndex;
+        V2 position = particle->position;
+        if ((position.x < regionMin.x) || (position.x > regionMax.x) || (position.y < regionMin.y) || (position.y > regionMax.y)) continue;
+
+        equipartition->squaredMomentumX += particle->mass * square((f64) particle->velocity.x);
+        equipartition->squaredMomentumY += particle->mass * square((f64) particle->velocity.y);
+        equipartition->sampleCount++;
+    }
+}
+
+//
+// Scenarios
+//
+
+struct RegressionTiming {
+    f64 steppedSeconds;
+    u64 particleSteps;
+};
+
+// NOTE: the timing covers the stepping only, not the measuring in between
+void
+timedAdvance(Simulation* simulation, f64 timeToSimulate, RegressionTiming* timing)
+{
+    u64 firstStep = simulation->stepCount;
+    f64 startTime = getTime();
+    advanceSimulation(simulation, timeToSimulate);
+    timing->steppedSeconds += getTime() - startTime;
+    timing->particleSteps += (simulation->stepCount - firstStep) * simulation->particleCount;
+}
+
+void
+regressionSetup(Simulation* simulation)
+{
+    *simulation = {};
+    srand(1);
+    initSimulation(simulation);
+    defaultParticles(simulation);
+}
+
+// NOTE: the default scene melted with the thermostat and left to itself in the periodic box
+f64
+regressionNve()
+{
+    printf("\nLennard-Jones NVE\n");
+    Simulation simulation;
+    regressionSetup(&simulation);
+    simulation.temperature = 30;
+    advanceSimulation(&simulation, 20);
+
+    simulation.viscosity = 0;
+    advanceSimulation(&simulation, 1.5 * simulation.dt);
+    f64 startEnergy = totalEnergy(&simulation);
+    Momentum startMomentum = totalMomentum(&simulation);
+
+    // NOTE: in units of kT per particle, and of the thermal momentum per particle
+    int particleCount = simulation.particleCount;
+    f64 energyScale = simulation.temperature * particleCount;
+    f64 momentumScale = sqrt(simulation.temperature) * particleCount;
+
+    RegressionTiming timing = {};
+    f64 maxEnergyError = 0;
+    int sampleCount = 100;
+    for (int sampleIndex = 0; sampleIndex < sampleCount; ++sampleIndex)
+    {
+        timedAdvance(&simulation, 0.5, &timing);
+        maxEnergyError = max(maxEnergyError, fabs(totalEnergy(&simulation) - startEnergy) / energyScale);
+    }
+    f64 drift = (totalEnergy(&simulation) - startEnergy) / energyScale;
+    Momentum endMomentum = totalMomentum(&simulation);
+    f64 momentumChange = sqrt(square(endMomentum.x - startMomentum.x) + square(endMomentum.y - startMomentum.y)) / momentumScale;
+
+    // NOTE: a few thousandths of kT from velocity Verlet at this dt, a broken force or step is off by far more.
+    // Pair forces that aren't equal and opposite show up in the momentum right away.
+    checkPhysics("energy drift (kT)", drift, 0, 0.05);
+    checkPhysics("largest energy error (kT)", maxEnergyError, 0, 0.05);
+    checkPhysics("momentum change", momentumChange, 0, 1e-4);
+
+    freeSimulation(&simulation);
+    return 1e9 * timing.steppedSeconds / timing.particleSteps;
+}
+
+// NOTE: the averages are over a few thousand independent samples, good to a couple of percent
+void
+checkEquipartition(Equipartition* equipartition, f64 temperature)
+{
+    f64 tolerance = 0.05;
+    f64 temperatureX = equipartition->squaredMomentumX / equipartition->sampleCount;
+    f64 temperatureY = equipartition->squaredMomentumY / equipartition->sampleCount;
+    checkPhysics("m vx^2 / kT", temperatureX / temperature, 1, tolerance);
+    checkPhysics("m vy^2 / kT", temperatureY / temperature, 1, tolerance);
+}
+
+// NOTE: the default scene in its walls, at the thermostat's default temperature
+f64
+regressionLangevin()
+{
+    printf("\nLangevin\n");
+    Simulation simulation;
+    regressionSetup(&simulation);
+    defaultWalls(&simulation);
+    advanceSimulation(&simulation, 30);
+
+    RegressionTiming timing = {};
+    Equipartition equipartition = {};
+    V2 boxMax = 0.5 * v2(simulation.boxWidth, simulation.boxHeight);
+    for (int sampleIndex = 0; sampleIndex < 2000; ++sampleIndex)
+    {
+        timedAdvance(&simulation, 0.05, &timing);
+        sampleEquipartition(&equipartition, &simulation, -boxMax, boxMax);
+    }
+
+    checkEquipartition(&equipartition, simulation.temperature);
+    checkPhysics("finite", areParticlesFinite(&simulation), 1, 0);
+
+    freeSimulation(&simulation);
+    return 1e9 * timing.steppedSeconds / timing.particleSteps;
+}
+
+// NOTE: the particles that are still in the cup are the ones in equilibrium with the liquid,
+// whatever falls out of it outside keeps falling through the periodic box
+f64
+regressionEvaporation()
+{
+    printf("\nevaporation\n");
+    Simulation simulation;
+    regressionSetup(&simulation);
+    evaporationSetup(&simulation);
+    advanceSimulation(&simulation, 30);
+
+    RegressionTiming timing = {};
+    Equipartition equipartition = {};
+    Wall* cupBottom = simulation.walls + 1;
+    V2 cupMin = cupBottom->start;
+    V2 cupMax = v2(cupBottom->end.x, 0);
+    for (int sampleIndex = 0; sampleIndex < 2000; ++sampleIndex)
+    {
+        timedAdvance(&simulation, 0.05, &timing);
+        sampleEquipartition(&equipartition, &simulation, cupMin, cupMax);
+    }
+
+    checkEquipartition(&equipartition, simulation.temperature);
+    checkPhysics("finite", areParticlesFinite(&simulation), 1, 0);
+
+    freeSimulation(&simulation);
+    return 1e9 * timing.steppedSeconds / timing.particleSteps;
+}
+
+int
+main(int argumentCount, char** arguments)
+{
+    const char* baselinePath = (argumentCount > 1) ? arguments[1] : 0;
+    f64 threshold = (argumentCount > 2) ? atof(arguments[2]) : 25;
+    bool isWritingBaseline = (argumentCount > 3) && !strcmp(arguments[3], "write");
+
+    printf("%s vectors, %d threads\n", simdName, getThreadCount());
+    printf("\n    %-32s %12s %12s %12s\n", "", "measured", "expected", "tolerance");
+
+    const char* names[] = {
+        "Lennard-Jones NVE",
+        "Langevin",
+        "evaporation",
+    };
+    f64 times[arrayCount(names)];
+    times[0] = regressionNve();
+    times[1] = regressionLangevin();
+    times[2] = regressionEvaporation();
+
+    BaselineFile baseline = {};
+    bool hasBaseline = baselinePath && !isWritingBaseline && readBaselineFile(&baseline, baselinePath);
+    if (baselinePath && !isWritingBaseline && !hasBaseline)
+    {
+        printf("Could not read the baseline %s.\n", baselinePath);
+    }
+
+    printf("\n%-28s %10s %10s %9s\n", "", "ns", "baseline", "change");
+    int regressionCount = 0;
+    for (int caseIndex = 0; caseIndex < (int) arrayCount(names); ++caseIndex)
+    {
+        printf("%-28s %10.2f", names[caseIndex], times[caseIndex]);
+        f64 baselineTime = hasBaseline ? findBaselineTime(&baseline, names[caseIndex]) : 0;
+        if (baselineTime > 0)
+        {
+            f64 change = changeFromBaseline(times[caseIndex], baselineTime);
+            bool isRegression = change > threshold;
+            regressionCount += isRegression;
+            printf(" %10.2f %8.1f%%%s", baselineTime, change, isRegression ? "  SLOWER" : "");
+        }
+        printf("\n");
+    }
+
+    if (isWritingBaseline)
+    {
+        if (!writeBaselineFile(baselinePath, "nanoseconds per particle per step, from regression with " simdName " vectors", names, times, arrayCount(names)))
+        {
+            printf("Could not write the baseline %s.\n", baselinePath);
+            return 1;
+        }
+        printf("\nWrote the baseline %s.\n", baselinePath);
+    }
+
+    printf("\n%d physics checks failed, %d scenarios slower than the baseline by more than %.0f%%\n", failureCount, regressionCount, threshold);
+    if (failureCount || regressionCount)
+    {
+        printf("REGRESSION\n");
+        return 1;
+    }
+    return 0;
+}
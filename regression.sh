@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+warnings="-Wall -Wno-unused-function"
+flags="-O3"
+c++ regression.cpp -o regression $warnings $flags -lpthread
@@ -0,0 +1,798 @@
+#ifndef scenario_h
+#define scenario_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "particle_simulation.h"
+#include "threading.h"
+
+// NOTE: a scene written down as a text file, instead of as a setup function. A line per setting, and # starts a comment:
+//
+//     box 400 200                          the periodic box, centered on the origin
+//     temperature 1                        also viscosity, gravity, separation, bond_energy, cutoff_factor and dt
+//     seed 7                               for everything random in the file, otherwise it comes from rand()
+//     species 1 1  0.8 0.3 0               mass, radius and color, the first one replaces the default species
+//     pair 0 1  0.8 1.5 2.5                separation, energy and cutoff factor, like setSpeciesPair
+//     box_walls                            the four walls along the edges of the box
+//     wall -25 0  -25 -25  25 -25  25 0    a wall along every segment of the polyline
+//     hexagon 0  0 0  13                   species, center and layer count, the default scene's hexagon
+//     lattice 0  -50 -20  50 20            species, and the corners of a rectangle filled with a hexagonal lattice
+//     random 1  -50 20  50 50  1000        species, rectangle and how many particles, at random without overlaps
+//     poisson 1  -50 20  50 50  3          species, rectangle and the distance, as many as fit that far apart
+//
+// The regions take options after their numbers: spacing= for the lattices (the separation unless given),
+// jitter= to shake the lattices by a gaussian of that width, and thermal for velocities at the temperature
+// instead of at rest.
+//
+// The regions are filled in order, each one straight into the particles, in parallel. Random and poisson
+// keep clear of the walls and of everything placed before them, with a grid; the lattices go where they are
+// told. Everything random comes from streams per chunk, or per cell, so the scene doesn't depend on how
+// many threads built it.
+
+#define maxScenarioRegionCount 64
+#define maxScenarioWallCount 1024
+#define maxScenarioWordCount 256
+
+enum ScenarioFill {
+	ScenarioFill_Hexagon,
+	ScenarioFill_Lattice,
+	ScenarioFill_Random,
+	ScenarioFill_Poisson,
+
+	ScenarioFill_Count,
+};
+
+const char* scenarioFillNames[] = {
+	"hexagon",
+	"lattice",
+	"random",
+	"poisson",
+};
+
+struct ScenarioRegion {
+	ScenarioFill fill;
+	int species;
+	// NOTE: the hexagon's center is min
+	V2 min;
+	V2 max;
+
+	int layerCount;
+	int count;
+	f64 distance;
+
+	f64 spacing;
+	f64 jitter;
+	bool isThermal;
+};
+
+struct Scenario {
+	ScenarioRegion regions[maxScenarioRegionCount];
+	int regionCount;
+
+	Wall walls[maxScenarioWallCount];
+	int wallCount;
+	bool hasBoxWalls;
+
+	bool hasSeed;
+	u64 seed;
+};
+
+//
+// Reading
+//
+
+// NOTE: splits the line into words in place, up to a #
+int
+splitScenarioLine(char* line, char** words, int maxWordCount)
+{
+	int wordCount = 0;
+	char* at = line;
+	while (*at && (*at != '#') && (wordCount < maxWordCount))
+	{
+		while ((*at == ' ') || (*at == '\t') || (*at == '\r') || (*at == '\n')) *at++ = 0;
+		if (!*at || (*at == '#')) break;
+
+		words[wordCount++] = at;
+		while (*at && (*at != ' ') && (*at != '\t') && (*at != '\r') && (*at != '\n') && (*at != '#')) at++;
+	}
+	*at = 0;
+	return wordCount;
+}
+
+bool
+parseScenarioNumber(const char* word, f64* number)
+{
+	char* end;
+	*number = strtod(word, &end);
+	return (end != word) && !*end;
+}
+
+// NOTE: the words after a region's numbers
+const char*
+parseScenarioRegionOptions(ScenarioRegion* region, char** words, int wordCount)
+{
+	for (int wordIndex = 0; wordIndex < wordCount; ++wordIndex)
+	{
+		char* word = words[wordIndex];
+		char* value = strchr(word, '=');
+		if (value) *value++ = 0;
+
+		if (!strcmp(word, "thermal") && !value)
+		{
+			region->isThermal = true;
+		}
+		else if (!strcmp(word, "spacing") && value && parseScenarioNumber(value, &region->spacing) && (region->spacing > 0))
+		{
+		}
+		else if (!strcmp(word, "jitter") && value && parseScenarioNumber(value, &region->jitter) && (region->jitter >= 0))
+		{
+		}
+		else
+		{
+			return "unknown region option";
+		}
+	}
+	return 0;
+}
+
+// NOTE: the settings go into the simulation right away, the walls and regions wait for buildScenario.
+// Returns what is wrong with the line, or 0.
+const char*
+parseScenarioLine(Scenario* scenario, Simulation* simulation, char** words, int wordCount, int* speciesLineCount)
+{
+	const char* command = words[0];
+	f64 numbers[maxScenarioWordCount];
+	int numberCount = 0;
+	while ((numberCount + 1 < wordCount) && parseScenarioNumber(words[numberCount + 1], numbers + numberCount))
+	{
+		numberCount++;
+	}
+	char** options = words + 1 + numberCount;
+	int optionCount = wordCount - 1 - numberCount;
+
+	ScenarioFill fill = ScenarioFill_Count;
+	for (int fillIndex = 0; fillIndex < ScenarioFill_Count; ++fillIndex)
+	{
+		if (!strcmp(command, scenarioFillNames[fillIndex])) fill = (ScenarioFill) fillIndex;
+	}
+
+	if (fill != ScenarioFill_Count)
+	{
+		int expectedNumberCounts[] = {4, 5, 6, 6};
+		if (numberCount != expectedNumberCounts[fill]) return "wrong number of numbers for the region";
+		if (scenario->regionCount == maxScenarioRegionCount) return "too many regions";
+
+		ScenarioRegion* region = scenario->regions + scenario->regionCount;
+		*region = {};
+		region->fill = fill;
+		region->species = (int) numbers[0];
+		if ((region->species != numbers[0]) || (region->species < 0) || (region->species >= simulation->speciesCount))
+		{
+			return "no such species";
+		}
+		region->min = v2(numbers[1], numbers[2]);
+		if (fill == ScenarioFill_Hexagon)
+		{
+			region->layerCount = (int) numbers[3];
+			if (region->layerCount < 1) return "a hexagon needs at least one layer";
+		}
+		else
+		{
+			region->max = v2(numbers[3], numbers[4]);
+			if ((region->max.x < region->min.x) || (region->max.y < region->min.y)) return "the rectangle is inside out";
+		}
+		if (fill == ScenarioFill_Random)
+		{
+			region->count = (int) numbers[5];
+			if (region->count < 1) return "no particles to place";
+		}
+		if (fill == ScenarioFill_Poisson)
+		{
+			region->distance = numbers[5];
+			if (region->distance <= 0) return "the distance has to be positive";
+		}
+
+		const char* error = parseScenarioRegionOptions(region, options, optionCount);
+		if (error) return error;
+		scenario->regionCount++;
+		return 0;
+	}
+
+	if (optionCount > 0) return "unexpected words";
+
+	if (!strcmp(command, "box"))
+	{
+		if ((numberCount != 2) || (numbers[0] <= 0) || (numbers[1] <= 0)) return "box takes a width and a height";
+		simulation->boxWidth = numbers[0];
+		simulation->boxHeight = numbers[1];
+	}
+	else if (!strcmp(command, "seed"))
+	{
+		if (numberCount != 1) return "seed takes a number";
+		scenario->hasSeed = true;
+		scenario->seed = (u64) numbers[0];
+	}
+	else if (!strcmp(command, "species"))
+	{
+		if ((numberCount != 5) || (numbers[0] <= 0) || (numbers[1] <= 0)) return "species takes a mass, a radius and a color";
+		Color4 color = c4(numbers[2], numbers[3], numbers[4], 1);
+		if (*speciesLineCount == 0)
+		{
+			Species* species = simulation->species;
+			species->mass = numbers[0];
+			species->radius = numbers[1];
+			species->color = color;
+		}
+		else
+		{
+			if (simulation->speciesCount == maxSpeciesCount) return "too many species";
+			addSpecies(simulation, numbers[0], numbers[1], color);
+		}
+		(*speciesLineCount)++;
+	}
+	else if (!strcmp(command, "pair"))
+	{
+		if ((numberCount != 4) && (numberCount != 5)) return "pair takes two species and two or three factors";
+		int speciesA = (int) numbers[0];
+		int speciesB = (int) numbers[1];
+		if ((speciesA < 0) || (speciesA >= simulation->speciesCount) || (speciesB < 0) || (speciesB >= simulation->speciesCount))
+		{
+			return "no such species";
+		}
+		setSpeciesPair(simulation, speciesA, speciesB, numbers[2], numbers[3], (numberCount == 5) ? numbers[4] : 0);
+	}
+	else if (!strcmp(command, "box_walls"))
+	{
+		if (numberCount != 0) return "box_walls takes no numbers";
+		scenario->hasBoxWalls = true;
+	}
+	else if (!strcmp(command, "wall"))
+	{
+		if ((numberCount < 4) || (numberCount % 2)) return "a wall takes at least two points";
+		int segmentCount = numberCount / 2 - 1;
+		if (scenario->wallCount + segmentCount > maxScenarioWallCount) return "too many walls";
+		for (int segmentIndex = 0; segmentIndex < segmentCount; ++segmentIndex)
+		{
+			Wall* wall = scenario->walls + scenario->wallCount++;
+			f64* point = numbers + 2 * segmentIndex;
+			wall->start = v2(point[0], point[1]);
+			wall->end = v2(point[2], point[3]);
+		}
+	}
+	else
+	{
+		if (numberCount != 1) return "unknown setting";
+		f64 value = numbers[0];
+		if (!strcmp(command, "temperature")) simulation->temperature = value;
+		else if (!strcmp(command, "viscosity")) simulation->viscosity = value;
+		else if (!strcmp(command, "gravity")) simulation->gravityStrength = value;
+		else if (!strcmp(command, "separation")) simulation->separation = value;
+		else if (!strcmp(command, "bond_energy")) simulation->bondEnergy = value;
+		else if (!strcmp(command, "cutoff_factor")) simulation->cutoffFactor = value;
+		else if (!strcmp(command, "dt") && (value > 0)) simulation->dt = value;
+		else return "unknown setting";
+	}
+	return 0;
+}
+
+// NOTE: the simulation should be fresh from initSimulation, the file's settings go on top of the defaults
+bool
+readScenarioFile(Scenario* scenario, Simulation* simulation, const char* path)
+{
+	*scenario = {};
+	FILE* file = fopen(path, "r");
+	if (!file)
+	{
+		printf("Could not open the scenario %s.\n", path);
+		return false;
+	}
+
+	char line[4096];
+	int lineNumber = 0;
+	int speciesLineCount = 0;
+	const char* error = 0;
+	while (!error && fgets(line, sizeof(line), file))
+	{
+		lineNumber++;
+		char* words[maxScenarioWordCount];
+		int wordCount = splitScenarioLine(line, words, maxScenarioWordCount);
+		if (wordCount == 0) continue;
+		error = parseScenarioLine(scenario, simulation, words, wordCount, &speciesLineCount);
+	}
+	fclose(file);
+
+	if (error)
+	{
+		printf("%s:%d: %s\n", path, lineNumber, error);
+		return false;
+	}
+	return true;
+}
+
+//
+// Filling
+//
+
+#define scenarioChunkSize 4096
+
+struct ScenarioFillJob {
+	Simulation* simulation;
+	ScenarioRegion* region;
+	Particle* particles;
+	u64 seed;
+
+	// lattice
+	int latticeColCount;
+	f64 spacing;
+};
+
+// NOTE: everything but the position, which is already there
+void
+initScenarioParticle(Simulation* simulation, ScenarioRegion* region, Particle* particle, RandomSeries* random)
+{
+	V2 position = particle->position;
+	*particle = {};
+	setParticleSpecies(simulation, particle, region->species);
+
+	if (region->jitter > 0)
+	{
+		position += region->jitter * v2(randomGaussian(random), randomGaussian(random));
+	}
+	particle->position = periodize(position, simulation->boxWidth, simulation->boxHeight);
+
+	if (region->isThermal)
+	{
+		f32 thermalVelocity = sqrt(simulation->temperature / particle->mass);
+		particle->velocity = thermalVelocity * v2(randomGaussian(random), randomGaussian(random));
+	}
+}
+
+// NOTE: the chunks start at fixed indices, so their streams don't depend on the threads
+void
+fillScenarioLatticeChunk(void* data, int startIndex, int endIndex)
+{
+	ScenarioFillJob* job = (ScenarioFillJob*)data;
+	ScenarioRegion* region = job->region;
+	RandomSeries random = randomSeries(job->seed, startIndex);
+
+	if (region->fill == ScenarioFill_Hexagon)
+	{
+		V2 positions[scenarioChunkSize];
+		hexagonLatticePositions(startIndex, endIndex - startIndex, positions);
+		for (int particleIndex = startIndex; particleIndex < endIndex; ++particleIndex)
+		{
+			Particle* particle = job->particles + particleIndex;
+			particle->position = region->min + job->spacing * positions[particleIndex - startIndex];
+			initScenarioParticle(job->simulation, region, particle, &random);
+		}
+	}
+	else
+	{
+		f64 rowSpacing = 0.5 * sqrt(3) * job->spacing;
+		for (int particleIndex = startIndex; particleIndex < endIndex; ++particleIndex)
+		{
+			int row = particleIndex / job->latticeColCount;
+			int col = particleIndex % job->latticeColCount;
+			Particle* particle = job->particles + particleIndex;
+			particle->position = region->min + v2((col + 0.5 * (row & 1)) * job->spacing, row * rowSpacing);
+			initScenarioParticle(job->simulation, region, particle, &random);
+		}
+	}
+}
+
+// NOTE: cells of side distance / sqrt(2), so each holds at most one sample, and all the samples a candidate
+// has to keep away from are within two cells of it. Cells three apart in both directions can take samples
+// at the same time without seeing each other's, so the cells go in nine phases, and in parallel within a phase.
+struct PlacementGrid {
+	Simulation* simulation;
+	ScenarioRegion* region;
+	u64 seed;
+
+	V2 min;
+	f64 cellSide;
+	f64 invCellSide;
+	int colCount;
+	int rowCount;
+	f64 radius;
+	f64 squaredDistance;
+
+	V2* samples;
+	u8* isTaken;
+
+	// NOTE: the particles of the regions before, in the same cells, with a margin of two cells all around
+	int* existingStarts;
+	int* existingIndices;
+	int existingColCount;
+
+	int round;
+	f32 acceptance;
+	int phaseCol;
+	int phaseRow;
+	int phaseColCount;
+	volatile s32 placedCount;
+	volatile s32 triedCount;
+};
+
+bool
+isPlacementClear(PlacementGrid* grid, V2 candidate, int col, int row)
+{
+	for (int y = atLeast(0, row - 2); y <= atMost(grid->rowCount - 1, row + 2); ++y)
+	{
+		for (int x = atLeast(0, col - 2); x <= atMost(grid->colCount - 1, col + 2); ++x)
+		{
+			int cellIndex = y * grid->colCount + x;
+			if (grid->isTaken[cellIndex] && (square(grid->samples[cellIndex] - candidate) < grid->squaredDistance))
+			{
+				return false;
+			}
+		}
+	}
+
+	if (grid->existingStarts)
+	{
+		Particle* particles = grid->simulation->particles;
+		for (int y = row; y <= row + 4; ++y)
+		{
+			int rowStart = y * grid->existingColCount;
+			int start = grid->existingStarts[rowStart + col];
+			int end = grid->existingStarts[rowStart + col + 5];
+			for (int entry = start; entry < end; ++entry)
+			{
+				if (square(particles[grid->existingIndices[entry]].position - candidate) < grid->squaredDistance) return false;
+			}
+		}
+	}
+
+	Simulation* simulation = grid->simulation;
+	f64 squaredRadius = square(grid->radius);
+	for (int wallIndex = 0; wallIndex < simulation->wallCount; ++wallIndex)
+	{
+		Wall* wall = simulation->walls + wallIndex;
+		if (square(shortestVectorFromLine(candidate, wall->start, wall->end)) < squaredRadius) return false;
+	}
+	return true;
+}
+
+void
+placementPhaseChunk(void* data, int startIndex, int endIndex)
+{
+	PlacementGrid* grid = (PlacementGrid*)data;
+	ScenarioRegion* region = grid->region;
+	int cellCount = grid->colCount * grid->rowCount;
+	int placedCount = 0;
+	int triedCount = 0;
+
+	for (int phaseIndex = startIndex; phaseIndex < endIndex; ++phaseIndex)
+	{
+		int col = grid->phaseCol + 3 * (phaseIndex % grid->phaseColCount);
+		int row = grid->phaseRow + 3 * (phaseIndex / grid->phaseColCount);
+		int cellIndex = row * grid->colCount + col;
+		if (grid->isTaken[cellIndex]) continue;
+
+		RandomSeries random = randomSeries(grid->seed, (u64) grid->round * cellCount + cellIndex);
+		if ((grid->acceptance < 1) && (randomF32(&random) >= grid->acceptance)) continue;
+
+		V2 candidate = grid->min + grid->cellSide * v2(col + randomF32(&random), row + randomF32(&random));
+		if ((candidate.x > region->max.x) || (candidate.y > region->max.y)) continue;
+
+		triedCount++;
+		if (isPlacementClear(grid, candidate, col, row))
+		{
+			grid->samples[cellIndex] = candidate;
+			grid->isTaken[cellIndex] = 1;
+			placedCount++;
+		}
+	}
+	atomicAdd(&grid->placedCount, placedCount);
+	atomicAdd(&grid->triedCount, triedCount);
+}
+
+// NOTE: counting sort of the particles placed so far into the cells around the region
+void
+bucketExistingParticles(PlacementGrid* grid)
+{
+	Simulation* simulation = grid->simulation;
+	int colCount = grid->colCount + 4;
+	int rowCount = grid->rowCount + 4;
+	int cellCount = colCount * rowCount;
+	grid->existingColCount = colCount;
+	grid->existingStarts = allocArray(int, cellCount + 1);
+	memset(grid->existingStarts, 0, (cellCount + 1) * sizeof(int));
+
+	int* cellOfParticle = allocArray(int, simulation->particleCount);
+	for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+	{
+		V2 cellPosition = grid->invCellSide * (simulation->particles[particleIndex].position - grid->min);
+		int col = (int) floor(cellPosition.x) + 2;
+		int row = (int) floor(cellPosition.y) + 2;
+		bool isInside = (col >= 0) && (col < colCount) && (row >= 0) && (row < rowCount);
+		cellOfParticle[particleIndex] = isInside ? (row * colCount + col) : -1;
+		if (isInside) grid->existingStarts[cellOfParticle[particleIndex] + 1]++;
+	}
+	for (int cellIndex = 0; cellIndex < cellCount; ++cellIndex)
+	{
+		grid->existingStarts[cellIndex + 1] += grid->existingStarts[cellIndex];
+	}
+
+	grid->existingIndices = allocArray(int, atLeast(1, grid->existingStarts[cellCount]));
+	int* fill = allocArray(int, cellCount);
+	memcpy(fill, grid->existingStarts, cellCount * sizeof(int));
+	for (int particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex)
+	{
+		int cellIndex = cellOfParticle[particleIndex];
+		if (cellIndex >= 0) grid->existingIndices[fill[cellIndex]++] = particleIndex;
+	}
+	free(fill);
+	free(cellOfParticle);
+}
+
+struct PlacementCopyJob {
+	PlacementGrid* grid;
+	Particle* particles;
+	int* rowStarts;
+};
+
+void
+countPlacementRowsChunk(void* data, int startIndex, int endIndex)
+{
+	PlacementCopyJob* job = (PlacementCopyJob*)data;
+	PlacementGrid* grid = job->grid;
+	for (int row = startIndex; row < endIndex; ++row)
+	{
+		u8* isTaken = grid->isTaken + row * grid->colCount;
+		int count = 0;
+		for (int col = 0; col < grid->colCount; ++col) count += isTaken[col];
+		job->rowStarts[row + 1] = count;
+	}
+}
+
+void
+copyPlacementRowsChunk(void* data, int startIndex, int endIndex)
+{
+	PlacementCopyJob* job = (PlacementCopyJob*)data;
+	PlacementGrid* grid = job->grid;
+	Simulation* simulation = grid->simulation;
+	for (int row = startIndex; row < endIndex; ++row)
+	{
+		RandomSeries random = randomSeries(grid->seed + 1, row);
+		int particleIndex = job->rowStarts[row];
+		for (int col = 0; col < grid->colCount; ++col)
+		{
+			int cellIndex = row * grid->colCount + col;
+			if (!grid->isTaken[cellIndex]) continue;
+
+			Particle* particle = job->particles + particleIndex++;
+			particle->position = grid->samples[cellIndex];
+			initScenarioParticle(simulation, grid->region, particle, &random);
+		}
+	}
+}
+
+// NOTE: the room for more particles at the end, which the caller fills in
+Particle*
+appendScenarioParticles(Simulation* simulation, int count)
+{
+	int particleCount = simulation->particleCount + count;
+	if (particleCount >= simulation->gridColCount * simulation->gridRowCount)
+	{
+		printf("The box is too small for %d particles.\n", particleCount);
+		return 0;
+	}
+
+	Particle* newPointer = (Particle*)realloc(simulation->particles, particleCount * sizeof(Particle));
+	if (!newPointer) return 0;
+	simulation->particles = newPointer;
+	Particle* appended = simulation->particles + simulation->particleCount;
+	simulation->particleCount = particleCount;
+	simulation->particleGeneration++;
+	return appended;
+}
+
+// NOTE: random takes as many rounds as it needs for its count, poisson goes on until the region is about full
+#define maxPlacementRoundCount 64
+#define poissonRoundCount 32
+
+bool
+placeScenarioRegion(Simulation* simulation, ScenarioRegion* region, u64 seed)
+{
+	PlacementGrid grid = {};
+	grid.simulation = simulation;
+	grid.region = region;
+	grid.seed = seed;
+
+	// NOTE: far enough from every species already placed, so one distance does for all of them
+	f64 radius = simulation->species[region->species].radius;
+	f64 maxRadius = 0;
+	for (int speciesIndex = 0; speciesIndex < simulation->speciesCount; ++speciesIndex)
+	{
+		maxRadius = max(maxRadius, simulation->species[speciesIndex].radius);
+	}
+	f64 distance = max(region->distance, radius + maxRadius);
+	grid.radius = radius;
+	grid.squaredDistance = square(distance);
+	grid.cellSide = distance / sqrt(2);
+	grid.invCellSide = 1 / grid.cellSide;
+	grid.min = region->min;
+	grid.colCount = atLeast(1, ceil((region->max.x - region->min.x) * grid.invCellSide));
+	grid.rowCount = atLeast(1, ceil((region->max.y - region->min.y) * grid.invCellSide));
+	int cellCount = grid.colCount * grid.rowCount;
+	grid.samples = allocArray(V2, cellCount);
+	grid.isTaken = allocArray(u8, cellCount);
+	memset(grid.isTaken, 0, cellCount);
+	if (simulation->particleCount > 0)
+	{
+		bucketExistingParticles(&grid);
+	}
+
+	bool isRandom = (region->fill == ScenarioFill_Random);
+	int targetCount = isRandom ? region->count : cellCount;
+	int roundCount = isRandom ? maxPlacementRoundCount : poissonRoundCount;
+	f64 successRate = 1;
+	for (grid.round = 0; (grid.round < roundCount) && (grid.placedCount < targetCount); ++grid.round)
+	{
+		// NOTE: random only tries about as many of the free cells as it still needs, judging by how many
+		// tries worked out last round, so it doesn't fill up one end of the region first
+		int freeCellCount = cellCount - grid.placedCount;
+		grid.acceptance = isRandom ? atMost(1, (targetCount - grid.placedCount) / (successRate * freeCellCount)) : 1;
+		int placedBefore = grid.placedCount;
+		grid.triedCount = 0;
+
+		for (int phase = 0; phase < 9; ++phase)
+		{
+			grid.phaseCol = phase % 3;
+			grid.phaseRow = phase / 3;
+			grid.phaseColCount = (grid.colCount - grid.phaseCol + 2) / 3;
+			int phaseRowCount = (grid.rowCount - grid.phaseRow + 2) / 3;
+			parallelFor(grid.phaseColCount * phaseRowCount, scenarioChunkSize, placementPhaseChunk, &grid);
+		}
+		int roundPlacedCount = grid.placedCount - placedBefore;
+		successRate = atLeast(0.01, (f64) roundPlacedCount / atLeast(1, grid.triedCount));
+
+		// NOTE: poisson stops once hardly any more fit
+		if (!isRandom && (roundPlacedCount < grid.placedCount / 200)) break;
+	}
+
+	// NOTE: the last round can overshoot a little, so some of them go again, picked at random
+	RandomSeries random = randomSeries(seed + 2, 0);
+	while (grid.placedCount > targetCount)
+	{
+		int cellIndex = randomU32(&random) % cellCount;
+		if (grid.isTaken[cellIndex])
+		{
+			grid.isTaken[cellIndex] = 0;
+			grid.placedCount--;
+		}
+	}
+	if (isRandom && (grid.placedCount < targetCount))
+	{
+		printf("Only %d of %d random particles fit.\n", grid.placedCount, targetCount);
+	}
+
+	PlacementCopyJob job = {};
+	job.grid = &grid;
+	job.rowStarts = allocArray(int, grid.rowCount + 1);
+	job.rowStarts[0] = 0;
+	parallelFor(grid.rowCount, 64, countPlacementRowsChunk, &job);
+	for (int row = 0; row < grid.rowCount; ++row)
+	{
+		job.rowStarts[row + 1] += job.rowStarts[row];
+	}
+
+	job.particles = appendScenarioParticles(simulation, grid.placedCount);
+	if (job.particles)
+	{
+		parallelFor(grid.rowCount, 64, copyPlacementRowsChunk, &job);
+	}
+
+	free(job.rowStarts);
+	free(grid.samples);
+	free(grid.isTaken);
+	free(grid.existingStarts);
+	free(grid.existingIndices);
+	return job.particles != 0;
+}
+
+bool
+fillScenarioLattice(Simulation* simulation, ScenarioRegion* region, u64 seed)
+{
+	ScenarioFillJob job = {};
+	job.simulation = simulation;
+	job.region = region;
+	job.seed = seed;
+	job.spacing = (region->spacing > 0) ? region->spacing : simulation->separation;
+
+	int count;
+	if (region->fill == ScenarioFill_Hexagon)
+	{
+		count = hexagonNumber(region->layerCount);
+	}
+	else
+	{
+		// NOTE: the odd rows are shifted by half a spacing, and every row has as many as fit then
+		f64 rowSpacing = 0.5 * sqrt(3) * job.spacing;
+		int rowCount = 1 + (int) floor((region->max.y - region->min.y) / rowSpacing);
+		f64 width = region->max.x - region->min.x;
+		job.latticeColCount = 1 + (int) atLeast(0, floor((width - ((rowCount > 1) ? 0.5 * job.spacing : 0)) / job.spacing));
+		count = rowCount * job.latticeColCount;
+	}
+
+	job.particles = appendScenarioParticles(simulation, count);
+	if (!job.particles) return false;
+	parallelFor(count, scenarioChunkSize, fillScenarioLatticeChunk, &job);
+	return true;
+}
+
+//
+// Building
+//
+
+// NOTE: replaces the simulation's walls and particles with the scenario's
+bool
+buildScenario(Simulation* simulation, Scenario* scenario)
+{
+	// NOTE: the box and the species may have changed
+	updateGrid(simulation);
+	updateInteractions(simulation);
+
+	u64 seed;
+	if (scenario->hasSeed)
+	{
+		seed = scenario->seed;
+		simulation->random = randomSeries(seed, 0);
+	}
+	else
+	{
+		seed = ((u64) randomU32(&simulation->random) << 32) | randomU32(&simulation->random);
+	}
+
+	if (scenario->hasBoxWalls)
+	{
+		defaultWalls(simulation);
+	}
+	else
+	{
+		free(simulation->walls);
+		simulation->walls = 0;
+		simulation->wallCount = 0;
+	}
+	int boxWallCount = simulation->wallCount;
+	simulation->wallCount += scenario->wallCount;
+	simulation->walls = (Wall*)realloc(simulation->walls, atLeast(1, simulation->wallCount) * sizeof(Wall));
+	memcpy(simulation->walls + boxWallCount, scenario->walls, scenario->wallCount * sizeof(Wall));
+	simulation->wallGeneration++;
+
+	setParticleCount(simulation, 0);
+	for (int regionIndex = 0; regionIndex < scenario->regionCount; ++regionIndex)
+	{
+		ScenarioRegion* region = scenario->regions + regionIndex;
+		// NOTE: a few seeds apart, since the placement uses up to three
+		u64 regionSeed = seed + 4 * regionIndex;
+		bool isFilled;
+		if ((region->fill == ScenarioFill_Random) || (region->fill == ScenarioFill_Poisson))
+		{
+			isFilled = placeScenarioRegion(simulation, region, regionSeed);
+		}
+		else
+		{
+			isFilled = fillScenarioLattice(simulation, region, regionSeed);
+		}
+		if (!isFilled) return false;
+	}
+
+	printf("Initialized simulation with %d particles.\n", simulation->particleCount);
+	return true;
+}
+
+bool
+loadScenario(Simulation* simulation, const char* path)
+{
+	Scenario* scenario = allocArray(Scenario, 1);
+	bool isLoaded = readScenarioFile(scenario, simulation, path) && buildScenario(simulation, scenario);
+	free(scenario);
+	return isLoaded;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef simd_h
+#define simd_h
+
+#include "types.h"
+
+// NOTE: the few vector operations the step uses, on SSE2 in the native build and on wasm SIMD128 in the
+// browser build (em++ -msimd128), with a plain loop everywhere else. All of them give the same answers,
+// so turning the vectors on or off never changes a trajectory.
+#if defined(__wasm_simd128__)
+#define SIMD_WASM 1
+#define simdName "wasm simd128"
+#include <wasm_simd128.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#define SIMD_SSE2 1
+#define simdName "sse2"
+#include <emmintrin.h>
+#else
+#define simdName "scalar"
+#endif
+
+inline int
+lowestSetBit(u32 mask)
+{
+	assert(mask);
+	return __builtin_ctz(mask);
+}
+
+// NOTE: bit i is set when pointers[i] isn't null, for at most 32 pointers.
+// The grid has at most one particle per cell and most of the stencil is empty, so the force loop
+// walks the set bits instead of testing (and mispredicting) every cell.
+template <typename T>
+inline u32
+nonNullMask(T** pointers, int count)
+{
+	assert(count <= 32);
+	u32 mask = 0;
+	int index = 0;
+
+#if SIMD_WASM
+	v128_t zero = wasm_i32x4_splat(0);
+	if (sizeof(T*) == 4)
+	{
+		for (; index + 4 <= count; index += 4)
+		{
+			v128_t lanes = wasm_v128_load(pointers + index);
+			u32 isNull = wasm_i32x4_bitmask(wasm_i32x4_eq(lanes, zero));
+			mask |= (~isNull & 0xF) << index;
+		}
+	}
+	else
+	{
+		for (; index + 2 <= count; index += 2)
+		{
+			v128_t lanes = wasm_v128_load(pointers + index);
+			u32 isNull = wasm_i64x2_bitmask(wasm_i64x2_eq(lanes, zero));
+			mask |= (~isNull & 0x3) << index;
+		}
+	}
+#elif SIMD_SSE2
+	__m128i zero = _mm_setzero_si128();
+	if (sizeof(T*) == 4)
+	{
+		for (; index + 4 <= count; index += 4)
+		{
+			__m128i lanes = _mm_loadu_si128((__m128i*) (pointers + index));
+			u32 isNull = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(lanes, zero)));
+			mask |= (~isNull & 0xF) << index;
+		}
+	}
+	else
+	{
+		// NOTE: SSE2 can only compare 32 bit halves, a pointer is null when both of its halves are
+		for (; index + 2 <= count; index += 2)
+		{
+			__m128i lanes = _mm_loadu_si128((__m128i*) (pointers + index));
+			u32 isZero = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(lanes, zero)));
+			u32 isNull = isZero & (isZero >> 1);
+			u32 isSet = ~isNull & 0x5;
+			mask |= ((isSet & 0x1) | ((isSet >> 1) & 0x2)) << index;
+		}
+	}
+#endif
+
+	for (; index < count; ++index)
+	{
+		if (pointers[index]) mask |= 1u << index;
+	}
+	return mask;
+}
+
+#endif
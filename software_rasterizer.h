@@ -0,0 +1,445 @@
+#ifndef software_rasterizer_h
+#define software_rasterizer_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "math_stuff.h"
+#include "threading.h"
+#include "density_field.h"
+
+// NOTE: draws what loop draws (anti-aliased discs, then the walls and the drag line) into memory,
+// for machines without a GPU. The frame is cut into tiles, the discs are sorted into the tiles they touch,
+// and then every tile is drawn on its own, so the tiles run in parallel without sharing any pixels,
+// and each of them stays in cache. Within a tile things are drawn in the same order as loop draws them.
+
+#define rasterTileSide 64
+
+struct RasterLine {
+	V2 start;
+	V2 end;
+	// in pixels
+	f32 width;
+	Color4 color;
+};
+
+struct SoftwareRasterizer {
+	// NOTE: RGB, top row first, like the image files want it
+	int width;
+	int height;
+	u8* pixels;
+
+	int tileColCount;
+	int tileRowCount;
+
+	// ! frame
+
+	V2 viewCenter;
+	f32 pixelsPerUnit;
+	Color4 background;
+
+	FrameParticle* particles;
+	int particleCount;
+
+	RasterLine* lines;
+	int lineCount;
+	int lineCapacity;
+
+	// NOTE: the discs of tile t are tileDiscs[tileStarts[t]] up to tileDiscs[tileStarts[t + 1]]
+	int* tileStarts;
+	int* tileDiscs;
+	int tileDiscCapacity;
+};
+
+void
+initRasterizer(SoftwareRasterizer* rasterizer, int width, int height)
+{
+	*rasterizer = {};
+	rasterizer->width = width;
+	rasterizer->height = height;
+	rasterizer->pixels = allocArray(u8, 3 * width * height);
+	rasterizer->tileColCount = (width + rasterTileSide - 1) / rasterTileSide;
+	rasterizer->tileRowCount = (height + rasterTileSide - 1) / rasterTileSide;
+	rasterizer->tileStarts = allocArray(int, rasterizer->tileColCount * rasterizer->tileRowCount + 1);
+}
+
+// NOTE: pixelsPerUnit scales world units to pixels, and the view center ends up in the middle of the frame
+void
+beginRasterFrame(SoftwareRasterizer* rasterizer, V2 viewCenter, f32 pixelsPerUnit, Color4 background)
+{
+	rasterizer->viewCenter = viewCenter;
+	rasterizer->pixelsPerUnit = pixelsPerUnit;
+	rasterizer->background = background;
+	rasterizer->particles = 0;
+	rasterizer->particleCount = 0;
+	rasterizer->lineCount = 0;
+}
+
+inline V2
+pixelFromWorld(SoftwareRasterizer* rasterizer, V2 position)
+{
+	V2 result;
+	result.x = 0.5f * rasterizer->width + (position.x - rasterizer->viewCenter.x) * rasterizer->pixelsPerUnit;
+	result.y = 0.5f * rasterizer->height - (position.y - rasterizer->viewCenter.y) * rasterizer->pixelsPerUnit;
+	return result;
+}
+
+// NOTE: start and end are in world units, the width in pixels
+void
+addRasterLine(SoftwareRasterizer* rasterizer, V2 start, V2 end, f32 width, Color4 color)
+{
+	if (rasterizer->lineCount == rasterizer->lineCapacity)
+	{
+		rasterizer->lineCapacity = atLeast(16, 2 * rasterizer->lineCapacity);
+		rasterizer->lines = (RasterLine*) realloc(rasterizer->lines, rasterizer->lineCapacity * sizeof(RasterLine));
+	}
+	RasterLine* line = rasterizer->lines + rasterizer->lineCount++;
+	line->start = pixelFromWorld(rasterizer, start);
+	line->end = pixelFromWorld(rasterizer, end);
+	line->width = width;
+	line->color = color;
+}
+
+struct TileRange {
+	int firstCol;
+	int lastCol;
+	int firstRow;
+	int lastRow;
+};
+
+// NOTE: the tiles a disc (or its anti-aliased edge) touches, empty when it is outside the frame
+TileRange
+tileRangeOfDisc(SoftwareRasterizer* rasterizer, FrameParticle* particle)
+{
+	V2 center = pixelFromWorld(rasterizer, particle->position);
+	f32 radius = particle->radius * rasterizer->pixelsPerUnit + 1;
+
+	TileRange range;
+	range.firstCol = atLeast(0, (int) floorf((center.x - radius) / rasterTileSide));
+	range.lastCol = atMost(rasterizer->tileColCount - 1, (int) floorf((center.x + radius) / rasterTileSide));
+	range.firstRow = atLeast(0, (int) floorf((center.y - radius) / rasterTileSide));
+	range.lastRow = atMost(rasterizer->tileRowCount - 1, (int) floorf((center.y + radius) / rasterTileSide));
+	return range;
+}
+
+// NOTE: how much of the pixel a shape covers, from the distance of its center to the shape's edge
+inline f32
+edgeCoverage(f32 distanceInside)
+{
+	return atLeast(0.0f, atMost(1.0f, distanceInside + 0.5f));
+}
+
+inline void
+blendPixel(f32* pixel, Color4 color, f32 coverage)
+{
+	f32 alpha = coverage * color.a;
+	pixel[0] += alpha * (color.r - pixel[0]);
+	pixel[1] += alpha * (color.g - pixel[1]);
+	pixel[2] += alpha * (color.b - pixel[2]);
+}
+
+// NOTE: a ParallelForCallback over the tiles
+void
+rasterTileChunk(void* data, int startTile, int endTile)
+{
+	SoftwareRasterizer* rasterizer = (SoftwareRasterizer*)data;
+	f32* tilePixels = allocArray(f32, 3 * rasterTileSide * rasterTileSide);
+
+	for (int tileIndex = startTile; tileIndex < endTile; ++tileIndex)
+	{
+		int left = (tileIndex % rasterizer->tileColCount) * rasterTileSide;
+		int top = (tileIndex / rasterizer->tileColCount) * rasterTileSide;
+		int right = atMost(rasterizer->width, left + rasterTileSide);
+		int bottom = atMost(rasterizer->height, top + rasterTileSide);
+		int tileWidth = right - left;
+
+		Color4 background = rasterizer->background;
+		for (int pixelIndex = 0; pixelIndex < rasterTileSide * rasterTileSide; ++pixelIndex)
+		{
+			tilePixels[3 * pixelIndex + 0] = background.r;
+			tilePixels[3 * pixelIndex + 1] = background.g;
+			tilePixels[3 * pixelIndex + 2] = background.b;
+		}
+
+		// ! discs
+
+		for (int orderIndex = rasterizer->tileStarts[tileIndex]; orderIndex < rasterizer->tileStarts[tileIndex + 1]; ++orderIndex)
+		{
+			FrameParticle* particle = rasterizer->particles + rasterizer->tileDiscs[orderIndex];
+			V2 center = pixelFromWorld(rasterizer, particle->position);
+			f32 radius = particle->radius * rasterizer->pixelsPerUnit;
+
+			int firstX = atLeast(left, (int) floorf(center.x - radius - 0.5f));
+			int lastX = atMost(right - 1, (int) ceilf(center.x + radius + 0.5f));
+			int firstY = atLeast(top, (int) floorf(center.y - radius - 0.5f));
+			int lastY = atMost(bottom - 1, (int) ceilf(center.y + radius + 0.5f));
+
+			for (int y = firstY; y <= lastY; ++y)
+			{
+				f32 offsetY = y + 0.5f - center.y;
+				f32* pixel = tilePixels + 3 * ((y - top) * tileWidth + (firstX - left));
+				for (int x = firstX; x <= lastX; ++x, pixel += 3)
+				{
+					f32 offsetX = x + 0.5f - center.x;
+					f32 coverage = edgeCoverage(radius - sqrtf(offsetX * offsetX + offsetY * offsetY));
+					if (coverage > 0) blendPixel(pixel, particle->color, coverage);
+				}
+			}
+		}
+
+		// ! lines, there are few of them, so every tile looks at all of them
+
+		for (int lineIndex = 0; lineIndex < rasterizer->lineCount; ++lineIndex)
+		{
+			RasterLine* line = rasterizer->lines + lineIndex;
+			f32 reach = 0.5f * line->width + 1;
+			int firstX = atLeast(left, (int) floorf(min(line->start.x, line->end.x) - reach));
+			int lastX = atMost(right - 1, (int) ceilf(max(line->start.x, line->end.x) + reach));
+			int firstY = atLeast(top, (int) floorf(min(line->start.y, line->end.y) - reach));
+			int lastY = atMost(bottom - 1, (int) ceilf(max(line->start.y, line->end.y) + reach));
+
+			V2 direction = line->end - line->start;
+			f32 squaredLength = square(direction);
+			f32 invSquaredLength = (squaredLength > 0) ? 1 / squaredLength : 0;
+
+			for (int y = firstY; y <= lastY; ++y)
+			{
+				f32* pixel = tilePixels + 3 * ((y - top) * tileWidth + (firstX - left));
+				for (int x = firstX; x <= lastX; ++x, pixel += 3)
+				{
+					V2 fromStart = v2(x + 0.5f, y + 0.5f) - line->start;
+					f32 t = atLeast(0.0f, atMost(1.0f, inner(fromStart, direction) * invSquaredLength));
+					f32 distance = sqrtf(square(fromStart - t * direction));
+					f32 coverage = edgeCoverage(0.5f * line->width - distance);
+					if (coverage > 0) blendPixel(pixel, line->color, coverage);
+				}
+			}
+		}
+
+		for (int y = top; y < bottom; ++y)
+		{
+			f32* source = tilePixels + 3 * (y - top) * tileWidth;
+			u8* destination = rasterizer->pixels + 3 * (y * rasterizer->width + left);
+			for (int channelIndex = 0; channelIndex < 3 * tileWidth; ++channelIndex)
+			{
+				destination[channelIndex] = (u8) (255 * source[channelIndex] + 0.5f);
+			}
+		}
+	}
+
+	free(tilePixels);
+}
+
+// NOTE: draws the discs, then the lines added since beginRasterFrame
+void
+rasterizeFrame(SoftwareRasterizer* rasterizer, FrameParticle* particles, int particleCount)
+{
+	rasterizer->particles = particles;
+	rasterizer->particleCount = particleCount;
+
+	int tileCount = rasterizer->tileColCount * rasterizer->tileRowCount;
+	int* tileStarts = rasterizer->tileStarts;
+	memset(tileStarts, 0, (tileCount + 1) * sizeof(int));
+
+	// NOTE: counting sort into the tiles, a disc on a tile edge goes into each tile it touches
+	for (int particleIndex = 0; particleIndex < particleCount; ++particleIndex)
+	{
+		TileRange range = tileRangeOfDisc(rasterizer, particles + particleIndex);
+		for (int row = range.firstRow; row <= range.lastRow; ++row)
+		{
+			for (int col = range.firstCol; col <= range.lastCol; ++col)
+			{
+				tileStarts[row * rasterizer->tileColCount + col + 1]++;
+			}
+		}
+	}
+	for (int tileIndex = 0; tileIndex < tileCount; ++tileIndex)
+	{
+		tileStarts[tileIndex + 1] += tileStarts[tileIndex];
+	}
+
+	int tileDiscCount = tileStarts[tileCount];
+	if (tileDiscCount > rasterizer->tileDiscCapacity)
+	{
+		rasterizer->tileDiscCapacity = 2 * tileDiscCount;
+		rasterizer->tileDiscs = (int*) realloc(rasterizer->tileDiscs, rasterizer->tileDiscCapacity * sizeof(int));
+	}
+
+	// NOTE: fills each tile from its start, which leaves tileStarts shifted by one tile, so shift it back
+	for (int particleIndex = 0; particleIndex < particleCount; ++particleIndex)
+	{
+		TileRange range = tileRangeOfDisc(rasterizer, particles + particleIndex);
+		for (int row = range.firstRow; row <= range.lastRow; ++row)
+		{
+			for (int col = range.firstCol; col <= range.lastCol; ++col)
+			{
+				rasterizer->tileDiscs[tileStarts[row * rasterizer->tileColCount + col]++] = particleIndex;
+			}
+		}
+	}
+	for (int tileIndex = tileCount; tileIndex > 0; --tileIndex)
+	{
+		tileStarts[tileIndex] = tileStarts[tileIndex - 1];
+	}
+	tileStarts[0] = 0;
+
+	parallelFor(tileCount, 1, rasterTileChunk, rasterizer);
+}
+
+void
+freeRasterizer(SoftwareRasterizer* rasterizer)
+{
+	free(rasterizer->pixels);
+	free(rasterizer->lines);
+	free(rasterizer->tileStarts);
+	free(rasterizer->tileDiscs);
+	*rasterizer = {};
+}
+
+//
+// Image files
+//
+
+bool
+writePpm(SoftwareRasterizer* rasterizer, const char* path)
+{
+	FILE* file = fopen(path, "wb");
+	if (!file) return false;
+	fprintf(file, "P6\n%d %d\n255\n", rasterizer->width, rasterizer->height);
+	size_t byteCount = 3 * rasterizer->width * rasterizer->height;
+	bool isWritten = fwrite(rasterizer->pixels, 1, byteCount, file) == byteCount;
+	fclose(file);
+	return isWritten;
+}
+
+global_variable u32 crcTable[256];
+
+u32
+updateCrc(u32 crc, u8* bytes, size_t byteCount)
+{
+	if (!crcTable[1])
+	{
+		for (u32 index = 0; index < 256; ++index)
+		{
+			u32 value = index;
+			for (int bit = 0; bit < 8; ++bit)
+			{
+				value = (value & 1) ? (0xEDB88320 ^ (value >> 1)) : (value >> 1);
+			}
+			crcTable[index] = value;
+		}
+	}
+
+	crc = ~crc;
+	for (size_t index = 0; index < byteCount; ++index)
+	{
+		crc = crcTable[(crc ^ bytes[index]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+void
+putBigEndian(u8* bytes, u32 value)
+{
+	bytes[0] = (u8) (value >> 24);
+	bytes[1] = (u8) (value >> 16);
+	bytes[2] = (u8) (value >> 8);
+	bytes[3] = (u8) value;
+}
+
+void
+writePngChunk(FILE* file, const char* type, u8* data, u32 byteCount)
+{
+	u8 header[8];
+	putBigEndian(header, byteCount);
+	memcpy(header + 4, type, 4);
+	u32 crc = updateCrc(0, header + 4, 4);
+	crc = updateCrc(crc, data, byteCount);
+	u8 footer[4];
+	putBigEndian(footer, crc);
+
+	fwrite(header, 1, 8, file);
+	fwrite(data, 1, byteCount, file);
+	fwrite(footer, 1, 4, file);
+}
+
+// NOTE: the image data is stored without compression, in deflate blocks of at most 65535 bytes,
+// so this is only about as big as the PPM, but anything opens it
+bool
+writePng(SoftwareRasterizer* rasterizer, const char* path)
+{
+	FILE* file = fopen(path, "wb");
+	if (!file) return false;
+
+	u8 signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	fwrite(signature, 1, sizeof(signature), file);
+
+	u8 header[13];
+	putBigEndian(header + 0, rasterizer->width);
+	putBigEndian(header + 4, rasterizer->height);
+	header[8] = 8;  // bits per channel
+	header[9] = 2;  // RGB
+	header[10] = 0; // deflate
+	header[11] = 0; // filters
+	header[12] = 0; // not interlaced
+	writePngChunk(file, "IHDR", header, sizeof(header));
+
+	// NOTE: every row starts with its filter, which is none
+	u32 rowByteCount = 3 * rasterizer->width + 1;
+	u32 rawByteCount = rowByteCount * rasterizer->height;
+	u8* raw = allocArray(u8, rawByteCount);
+	for (int row = 0; row < rasterizer->height; ++row)
+	{
+		raw[row * rowByteCount] = 0;
+		memcpy(raw + row * rowByteCount + 1, rasterizer->pixels + 3 * rasterizer->width * row, rowByteCount - 1);
+	}
+
+	u32 blockCount = atLeast(1u, (rawByteCount + 65534) / 65535);
+	u32 dataByteCount = 2 + 5 * blockCount + rawByteCount + 4;
+	u8* data = allocArray(u8, dataByteCount);
+
+	u8* cursor = data;
+	*cursor++ = 0x78; // deflate with a 32K window
+	*cursor++ = 0x01; // no preset dictionary, and the check bits
+	for (u32 blockIndex = 0; blockIndex < blockCount; ++blockIndex)
+	{
+		u32 blockStart = 65535 * blockIndex;
+		u32 blockByteCount = atMost(65535u, rawByteCount - blockStart);
+		*cursor++ = (blockIndex == blockCount - 1) ? 1 : 0;
+		*cursor++ = (u8) blockByteCount;
+		*cursor++ = (u8) (blockByteCount >> 8);
+		*cursor++ = (u8) ~blockByteCount;
+		*cursor++ = (u8) (~blockByteCount >> 8);
+		memcpy(cursor, raw + blockStart, blockByteCount);
+		cursor += blockByteCount;
+	}
+
+	// NOTE: Adler-32, the sums can go 5552 bytes before they have to be reduced
+	u32 adlerA = 1;
+	u32 adlerB = 0;
+	for (u32 runStart = 0; runStart < rawByteCount; runStart += 5552)
+	{
+		u32 runEnd = atMost(rawByteCount, runStart + 5552);
+		for (u32 byteIndex = runStart; byteIndex < runEnd; ++byteIndex)
+		{
+			adlerA += raw[byteIndex];
+			adlerB += adlerA;
+		}
+		adlerA %= 65521;
+		adlerB %= 65521;
+	}
+	putBigEndian(cursor, (adlerB << 16) | adlerA);
+	free(raw);
+
+	writePngChunk(file, "IDAT", data, dataByteCount);
+	writePngChunk(file, "IEND", 0, 0);
+	free(data);
+
+	bool isWritten = !ferror(file);
+	fclose(file);
+	return isWritten;
+}
+
+#endif
@@ -0,0 +1,656 @@
+#ifndef threading_h
+#define threading_h
+
+#include "types.h"
+#include "math_stuff.h"
+
+// NOTE: threads are only available where we have pthreads,
+// everywhere else the parallel helpers run serially on the calling thread
+#if defined(_WIN32) || (defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__))
+#define SINGLE_THREADED 1
+#else
+#define SINGLE_THREADED 0
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#define maxThreadCount 64
+
+//
+// Atomics
+//
+
+// NOTE: returns the value that was in destination before the exchange
+inline s32
+atomicCompareExchange(volatile s32* destination, s32 expected, s32 desired)
+{
+	return __sync_val_compare_and_swap(destination, expected, desired);
+}
+
+// NOTE: returns the value that was in destination before the addition
+inline s32
+atomicAdd(volatile s32* destination, s32 addend)
+{
+	return __sync_fetch_and_add(destination, addend);
+}
+
+inline s32
+atomicLoad(volatile s32* source)
+{
+	return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+}
+
+inline void
+atomicStore(volatile s32* destination, s32 value)
+{
+	__atomic_store_n(destination, value, __ATOMIC_RELEASE);
+}
+
+// NOTE: the loads and stores before the fence are done before any store after it
+inline void
+releaseFence()
+{
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// NOTE: the loads before the fence are done before any load or store after it
+inline void
+acquireFence()
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+// NOTE: the body of a spin loop. On x64 this tells the core it is spinning, so it doesn't flood the
+// pipeline with speculative loads of the lock (and pay for them when the lock is let go), and leaves more
+// of the core to its hyperthread. WebAssembly has no such hint, so there it is just the loop.
+inline void
+spinPause()
+{
+#if defined(__SSE2__) || defined(_M_X64)
+	_mm_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+//
+// Parallel for
+//
+
+typedef void ParallelForCallback(void* data, int startIndex, int endIndex);
+
+struct ParallelJob {
+	ParallelForCallback* callback;
+	void* data;
+	int count;
+	int chunkSize;
+
+	volatile s32 nextStartIndex;
+	volatile s32 finishedCount;
+};
+
+struct ThreadPool {
+	bool isInitialized;
+	bool isBusy;
+	// NOTE: every thread is busy running tasks, see waitForTasks
+	bool isRunningTasks;
+	int threadCount;
+
+#if !SINGLE_THREADED
+	pthread_t threads[maxThreadCount];
+	pthread_mutex_t mutex;
+	pthread_cond_t jobStarted;
+	pthread_cond_t jobFinished;
+#endif
+
+	ParallelJob* job;
+	u64 jobGeneration;
+	int workersInJob;
+	volatile s32 startedWorkerCount;
+};
+
+global_variable ThreadPool globalThreadPool;
+
+// NOTE: 0 on the thread that started the pool, the workers number themselves from 1
+#if SINGLE_THREADED
+global_variable int currentThreadIndex;
+#else
+global_variable __thread int currentThreadIndex;
+#endif
+
+void
+runParallelJob(ParallelJob* job)
+{
+	while (true)
+	{
+		int startIndex = atomicAdd(&job->nextStartIndex, job->chunkSize);
+		if (startIndex >= job->count) break;
+
+		int endIndex = atMost(job->count, startIndex + job->chunkSize);
+		job->callback(job->data, startIndex, endIndex);
+		atomicAdd(&job->finishedCount, endIndex - startIndex);
+	}
+}
+
+#if !SINGLE_THREADED
+void*
+threadPoolWorker(void* argument)
+{
+	ThreadPool* pool = (ThreadPool*)argument;
+	u64 seenGeneration = 0;
+	currentThreadIndex = atomicAdd(&pool->startedWorkerCount, 1) + 1;
+
+	while (true)
+	{
+		pthread_mutex_lock(&pool->mutex);
+		while (pool->jobGeneration == seenGeneration)
+		{
+			pthread_cond_wait(&pool->jobStarted, &pool->mutex);
+		}
+		seenGeneration = pool->jobGeneration;
+		ParallelJob* job = pool->job;
+		if (!job)
+		{
+			// NOTE: woke up after the job was already done
+			pthread_mutex_unlock(&pool->mutex);
+			continue;
+		}
+		pool->workersInJob++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		runParallelJob(job);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->workersInJob--;
+		pthread_cond_signal(&pool->jobFinished);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+	return 0;
+}
+#endif
+
+void
+initThreadPool(ThreadPool* pool, int threadCount)
+{
+	pool->isInitialized = true;
+	pool->threadCount = 1;
+
+#if !SINGLE_THREADED
+	if (threadCount <= 0)
+	{
+		// NOTE: in the browser build this is navigator.hardwareConcurrency, which is also how many
+		// workers emscripten starts ahead of time (see emscripten.sh), since a worker started later
+		// only runs once the main thread returns to the browser
+		threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	threadCount = atLeast(1, atMost(maxThreadCount, threadCount));
+
+	pthread_mutex_init(&pool->mutex, 0);
+	pthread_cond_init(&pool->jobStarted, 0);
+	pthread_cond_init(&pool->jobFinished, 0);
+
+	// NOTE: the calling thread is the first worker, so only start the rest
+	for (int threadIndex = 1; threadIndex < threadCount; ++threadIndex)
+	{
+		if (pthread_create(pool->threads + threadIndex, 0, threadPoolWorker, pool) != 0) break;
+		pool->threadCount++;
+	}
+#endif
+}
+
+int
+getThreadCount()
+{
+	ThreadPool* pool = &globalThreadPool;
+	if (!pool->isInitialized)
+	{
+		initThreadPool(pool, 0);
+	}
+	return pool->threadCount;
+}
+
+void
+parallelForOnPool(ThreadPool* pool, int count, int chunkSize, ParallelForCallback* callback, void* data)
+{
+	chunkSize = atLeast(1, chunkSize);
+	if ((pool->threadCount == 1) || pool->isBusy || (count <= chunkSize))
+	{
+		callback(data, 0, count);
+		return;
+	}
+
+#if !SINGLE_THREADED
+	ParallelJob job = {};
+	job.callback = callback;
+	job.data = data;
+	job.count = count;
+	job.chunkSize = chunkSize;
+
+	pool->isBusy = true;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->job = &job;
+	pool->jobGeneration++;
+	pthread_cond_broadcast(&pool->jobStarted);
+	pthread_mutex_unlock(&pool->mutex);
+
+	runParallelJob(&job);
+
+	// NOTE: wait for the workers to let go of the job too, since it lives on our stack
+	pthread_mutex_lock(&pool->mutex);
+	while ((atomicLoad(&job.finishedCount) < count) || (pool->workersInJob > 0))
+	{
+		pthread_cond_wait(&pool->jobFinished, &pool->mutex);
+	}
+	pool->job = 0;
+	pthread_mutex_unlock(&pool->mutex);
+
+	pool->isBusy = false;
+#endif
+}
+
+void parallelForAsTasks(int count, int chunkSize, ParallelForCallback* callback, void* data);
+
+// NOTE: calls callback on chunks of [0, count) on all threads and returns when every chunk is done.
+// Nested calls (from inside a callback) run serially, unless they come from inside a task.
+void
+parallelFor(int count, int chunkSize, ParallelForCallback* callback, void* data)
+{
+	if (count <= 0) return;
+
+	ThreadPool* pool = &globalThreadPool;
+	if (!pool->isInitialized)
+	{
+		initThreadPool(pool, 0);
+	}
+
+	if (pool->isRunningTasks)
+	{
+		parallelForAsTasks(count, chunkSize, callback, data);
+		return;
+	}
+
+	parallelForOnPool(pool, count, chunkSize, callback, data);
+}
+
+//
+// Work stealing
+//
+
+// NOTE: for work that comes in pieces of different sizes, or that makes more work as it goes.
+// Every thread pushes and pops tasks at the back of its own queue, and when that runs dry
+// it steals from the front of the others, where the oldest tasks are.
+
+typedef void TaskCallback(void* data);
+
+// NOTE: counts the tasks spawned into it that haven't finished yet
+struct TaskGroup {
+	volatile s32 pendingCount;
+};
+
+struct Task {
+	TaskCallback* callback;
+	void* data;
+	TaskGroup* group;
+};
+
+#define taskQueueCapacity 1024
+
+struct TaskQueue {
+	volatile s32 lock;
+	// NOTE: only ever go up, the tasks are at [head, tail) modulo the capacity
+	int head;
+	int tail;
+	Task tasks[taskQueueCapacity];
+};
+
+global_variable TaskQueue globalTaskQueues[maxThreadCount];
+
+void
+lockTaskQueue(TaskQueue* queue)
+{
+	while (atomicCompareExchange(&queue->lock, 0, 1) != 0)
+	{
+		while (atomicLoad(&queue->lock) != 0)
+		{
+			spinPause();
+		}
+	}
+}
+
+void
+unlockTaskQueue(TaskQueue* queue)
+{
+	atomicStore(&queue->lock, 0);
+}
+
+void
+runTask(Task task)
+{
+	task.callback(task.data);
+	atomicAdd(&task.group->pendingCount, -1);
+}
+
+// NOTE: can be called from inside a task, and a full queue just runs the task right away
+void
+spawnTask(TaskGroup* group, TaskCallback* callback, void* data)
+{
+	Task task = {callback, data, group};
+	atomicAdd(&group->pendingCount, 1);
+
+	TaskQueue* queue = globalTaskQueues + currentThreadIndex;
+	lockTaskQueue(queue);
+	bool isFull = (queue->tail - queue->head == taskQueueCapacity);
+	if (!isFull)
+	{
+		queue->tasks[queue->tail % taskQueueCapacity] = task;
+		queue->tail++;
+	}
+	unlockTaskQueue(queue);
+
+	if (isFull)
+	{
+		runTask(task);
+	}
+}
+
+// NOTE: takes from the back of our own queue, or the front of someone else's.
+// With a group it only takes that group's tasks, moving the task at the end it takes from into the gap.
+bool
+takeTask(TaskQueue* queue, bool isStealing, TaskGroup* group, Task* task)
+{
+	bool isTaken = false;
+	lockTaskQueue(queue);
+	int queuedCount = queue->tail - queue->head;
+	for (int offset = 0; offset < queuedCount; ++offset)
+	{
+		int index = isStealing ? (queue->head + offset) : (queue->tail - 1 - offset);
+		Task* candidate = queue->tasks + (index % taskQueueCapacity);
+		if (group && (candidate->group != group)) continue;
+
+		*task = *candidate;
+		if (isStealing)
+		{
+			*candidate = queue->tasks[queue->head % taskQueueCapacity];
+			queue->head++;
+		}
+		else
+		{
+			queue->tail--;
+			*candidate = queue->tasks[queue->tail % taskQueueCapacity];
+		}
+		isTaken = true;
+		break;
+	}
+	unlockTaskQueue(queue);
+	return isTaken;
+}
+
+bool
+runOneTask(TaskGroup* group, int threadCount)
+{
+	Task task;
+	if (takeTask(globalTaskQueues + currentThreadIndex, false, group, &task))
+	{
+		runTask(task);
+		return true;
+	}
+	for (int offset = 1; offset < threadCount; ++offset)
+	{
+		int victimIndex = (currentThreadIndex + offset) % threadCount;
+		if (takeTask(globalTaskQueues + victimIndex, true, group, &task))
+		{
+			runTask(task);
+			return true;
+		}
+	}
+	return false;
+}
+
+// NOTE: lets another thread have the core while we have nothing to do, which matters with more threads than cores
+inline void
+yieldThread()
+{
+#if !SINGLE_THREADED
+	sched_yield();
+#endif
+}
+
+// NOTE: runs anyone's tasks until the group is done
+void
+runTasksUntilDone(void* data, int startIndex, int endIndex)
+{
+	TaskGroup* group = (TaskGroup*)data;
+	int threadCount = getThreadCount();
+	while (atomicLoad(&group->pendingCount) > 0)
+	{
+		if (!runOneTask(0, threadCount))
+		{
+			yieldThread();
+		}
+	}
+}
+
+// NOTE: runs tasks on all threads until every task in the group is done, including the ones they spawned.
+// Called from inside a task, the other threads are already running tasks, so this one only helps with
+// the group's own tasks, which keeps it from getting buried under unrelated work.
+void
+waitForTasks(TaskGroup* group)
+{
+	ThreadPool* pool = &globalThreadPool;
+	if (!pool->isInitialized)
+	{
+		initThreadPool(pool, 0);
+	}
+
+	if (pool->isRunningTasks)
+	{
+		while (atomicLoad(&group->pendingCount) > 0)
+		{
+			if (!runOneTask(group, pool->threadCount))
+			{
+				yieldThread();
+			}
+		}
+		return;
+	}
+
+	pool->isRunningTasks = true;
+	parallelForOnPool(pool, pool->threadCount, 1, runTasksUntilDone, group);
+	pool->isRunningTasks = false;
+}
+
+void
+runParallelJobChunk(void* data)
+{
+	ParallelJob* job = (ParallelJob*)data;
+	int startIndex = atomicAdd(&job->nextStartIndex, job->chunkSize);
+	int endIndex = atMost(job->count, startIndex + job->chunkSize);
+	job->callback(job->data, startIndex, endIndex);
+}
+
+// NOTE: a parallel for from inside a task, with one task per chunk for the other threads to steal
+void
+parallelForAsTasks(int count, int chunkSize, ParallelForCallback* callback, void* data)
+{
+	chunkSize = atLeast(1, chunkSize);
+
+	ParallelJob job = {};
+	job.callback = callback;
+	job.data = data;
+	job.count = count;
+	job.chunkSize = chunkSize;
+
+	TaskGroup group = {};
+	for (int startIndex = 0; startIndex < count; startIndex += chunkSize)
+	{
+		spawnTask(&group, runParallelJobChunk, &job);
+	}
+	waitForTasks(&group);
+}
+
+//
+// Task graphs
+//
+
+// NOTE: the stages of a step or a frame as nodes, each started as soon as the ones it depends on are done,
+// so stages that don't depend on each other overlap. A node is either one task, or count items cut
+// into chunks that are spread over the threads like a parallel for.
+
+#define maxTaskNodeCount 32
+#define maxTaskDependentCount 8
+
+struct TaskGraph;
+
+struct TaskNode {
+	TaskGraph* graph;
+	TaskCallback* callback;
+	ParallelForCallback* parallelCallback;
+	void* data;
+	int count;
+	int chunkSize;
+
+	int dependencyCount;
+	int dependentCount;
+	TaskNode* dependents[maxTaskDependentCount];
+
+	volatile s32 unfinishedDependencyCount;
+	volatile s32 nextStartIndex;
+	volatile s32 finishedCount;
+};
+
+struct TaskGraph {
+	TaskNode nodes[maxTaskNodeCount];
+	int nodeCount;
+	TaskGroup group;
+};
+
+TaskNode*
+addTaskNode(TaskGraph* graph)
+{
+	assert(graph->nodeCount < maxTaskNodeCount);
+	TaskNode* node = graph->nodes + graph->nodeCount++;
+	*node = {};
+	node->graph = graph;
+	return node;
+}
+
+TaskNode*
+addTask(TaskGraph* graph, TaskCallback* callback, void* data)
+{
+	TaskNode* node = addTaskNode(graph);
+	node->callback = callback;
+	node->data = data;
+	return node;
+}
+
+TaskNode*
+addParallelTask(TaskGraph* graph, int count, int chunkSize, ParallelForCallback* callback, void* data)
+{
+	TaskNode* node = addTaskNode(graph);
+	node->parallelCallback = callback;
+	node->data = data;
+	node->count = count;
+	node->chunkSize = atLeast(1, chunkSize);
+	return node;
+}
+
+// NOTE: after only starts once before is done
+void
+addDependency(TaskNode* before, TaskNode* after)
+{
+	assert(before->dependentCount < maxTaskDependentCount);
+	before->dependents[before->dependentCount++] = after;
+	after->dependencyCount++;
+}
+
+void startTaskNode(TaskNode* node);
+
+void
+finishTaskNode(TaskNode* node)
+{
+	for (int dependentIndex = 0; dependentIndex < node->dependentCount; ++dependentIndex)
+	{
+		TaskNode* dependent = node->dependents[dependentIndex];
+		if (atomicAdd(&dependent->unfinishedDependencyCount, -1) == 1)
+		{
+			startTaskNode(dependent);
+		}
+	}
+}
+
+void
+runTaskNode(void* data)
+{
+	TaskNode* node = (TaskNode*)data;
+	node->callback(node->data);
+	finishTaskNode(node);
+}
+
+// NOTE: one task per chunk, but each takes whichever chunk is next, and the last one to finish finishes the node
+void
+runTaskNodeChunk(void* data)
+{
+	TaskNode* node = (TaskNode*)data;
+	int startIndex = atomicAdd(&node->nextStartIndex, node->chunkSize);
+	int endIndex = atMost(node->count, startIndex + node->chunkSize);
+	node->parallelCallback(node->data, startIndex, endIndex);
+
+	int chunkCount = endIndex - startIndex;
+	if (atomicAdd(&node->finishedCount, chunkCount) + chunkCount == node->count)
+	{
+		finishTaskNode(node);
+	}
+}
+
+void
+startTaskNode(TaskNode* node)
+{
+	TaskGroup* group = &node->graph->group;
+	if (!node->parallelCallback)
+	{
+		spawnTask(group, runTaskNode, node);
+	}
+	else if (node->count <= 0)
+	{
+		finishTaskNode(node);
+	}
+	else
+	{
+		for (int startIndex = 0; startIndex < node->count; startIndex += node->chunkSize)
+		{
+			spawnTask(group, runTaskNodeChunk, node);
+		}
+	}
+}
+
+// NOTE: runs every node and returns when they are all done, the graph can be run again
+void
+runTaskGraph(TaskGraph* graph)
+{
+	for (int nodeIndex = 0; nodeIndex < graph->nodeCount; ++nodeIndex)
+	{
+		TaskNode* node = graph->nodes + nodeIndex;
+		node->unfinishedDependencyCount = node->dependencyCount;
+		node->nextStartIndex = 0;
+		node->finishedCount = 0;
+	}
+
+	for (int nodeIndex = 0; nodeIndex < graph->nodeCount; ++nodeIndex)
+	{
+		TaskNode* node = graph->nodes + nodeIndex;
+		if (node->dependencyCount == 0)
+		{
+			startTaskNode(node);
+		}
+	}
+
+	waitForTasks(&graph->group);
+}
+
+#endif